@@ -3,10 +3,16 @@
 
 #include "common.h"
 #include "buffer.h"
+#include "control.h"
 #include "display.h"
 #include "encoder.h"
+#include "hls.h"
 #include "list_common.h"
 #include "network.h"
+#include "ratectl.h"
+#include "rudp.h"
+#include "source.h"
+#include "udp.h"
 #include "websock.h"
 
 typedef struct
@@ -15,39 +21,107 @@ typedef struct
 	List_t		link;
 }NetConWrapper_t;
 
+//WebSocket broadcast channels, picked per connection from the request path
+typedef enum
+{
+	CAP_WS_CHANNEL_NONE = 0,		//Not set up yet, gets nothing
+	CAP_WS_CHANNEL_TS,				//One TS message per access unit
+	CAP_WS_CHANNEL_RAW_WAIT,		//Raw protocol, waiting for the next key frame
+	CAP_WS_CHANNEL_RAW,				//Raw protocol
+	CAP_WS_CHANNEL_FMP4_WAIT,		//Fragmented MP4, waiting for the next key frame
+	CAP_WS_CHANNEL_FMP4,			//Fragmented MP4
+}CapWsChannel_t;
+
+/**
+ * Raw access unit protocol for WebCodecs players, requested with the CAP_WS_RAW_PATH path.
+ * Every binary message is a 16 byte big endian header followed by Annex-B data:
+ *   0      CAP_RAW_CONFIG (parameter sets) or CAP_RAW_FRAME (one access unit)
+ *   1      CAP_RAW_FLAG_* flags
+ *   2..3   codec config version, bumped whenever the parameter sets change
+ *   4..7   frame sequence
+ *   8..15  pts, CLOCK_MONOTONIC microseconds
+ * The parameter sets are sent on connect and before the first frame using a new version,
+ * frames start at a key frame. A player that had to drop frames sends a message starting
+ * with CAP_RAW_KEY_REQUEST, an intra refresh stream then gets an IDR frame to resume from.
+ */
+#define CAP_WS_RAW_PATH			"/raw"		//Also NET_HTTP_WS_PATH CAP_WS_RAW_PATH on the HTTP port
+#define CAP_RAW_HEADER_SIZE		16
+#define CAP_RAW_CONFIG			0
+#define CAP_RAW_FRAME			1
+#define CAP_RAW_KEY_REQUEST		2			//Player to server
+#define CAP_RAW_FLAG_KEY		0x01
+#define CAP_RAW_FLAG_H265		0x02
+
+/**
+ * Fragmented MP4 for Media Source Extensions, requested with the CAP_WS_FMP4_PATH path.
+ * Every binary message is a complete box sequence that can go to SourceBuffer.appendBuffer
+ * as is: the init segment (ftyp + moov) first, then one moof + mdat per frame starting at
+ * a key frame. A new init segment is sent whenever the parameter sets change.
+ */
+#define CAP_WS_FMP4_PATH		"/fmp4"		//Also NET_HTTP_WS_PATH CAP_WS_FMP4_PATH on the HTTP port
+
+#define CAP_METRICS_PATH		"/metrics"	//Encoder telemetry in the Prometheus text format on the HTTP port
+#define CAP_HLS_SEGMENTS		6			//Complete segments in the playlist
+#define CAP_MAX_HELD_PARTS		32			//Parts of one access unit held by reference, the rest are copied
+
 typedef struct
 {
-	NetCon_t	*sock;
-	List_t		link;
+	WebsockConn_t	*conn;
+	CapWsChannel_t	channel;
+	uint16_t		configVersion;	//Parameter sets the client has, raw protocol only
+	List_t			link;
 }SockConWrapper_t;
 
 typedef struct
 {
-	int v4l2fd;
-	enum v4l2_buf_type 		bufType;
-	enum v4l2_memory 		memType;
-
-	struct
-	{
-		uint32_t 				pixfmt;
-		int 					numPlanes;
-		enum v4l2_colorspace 	clrspc;
-		uint32_t 				width;
-		uint32_t 				height;
-		int						bytesPerLine[NUM_PLANES];
-		int						numBufs;
-	}src;
+	SourceConfig_t			source;
+	EncoderConfig_t			encoder;	//Size and format are taken from the source
+	uint16_t				tcpPort;	//Raw TS over TCP, 0 to disable
+	uint16_t				wsPort;		//WebSocket server, 0 to disable
+	uint16_t				httpPort;	//HTTP stream, player and WebSocket upgrades, 0 to disable
+	const char				*docRoot;	//Player files served on httpPort
+	int						hlsSegmentMs;	//HLS under HLS_PATH on httpPort, 0 to disable
+	int						hlsPartMs;	//LL-HLS partial segments, 0 to disable
+	UdpConfig_t				udp;		//TS over UDP/RTP, NULL dest to disable
+	RudpConfig_t			rudp;		//TS over reliable UDP, 0 port to disable
+	PacingConfig_t			pacing;		//Kernel pacing of the TCP, HTTP stream and UDP sinks, peak 0 disables
+	RateCtlConfig_t			rateCtl;	//Encoder bitrate from viewer backlog, minBps 0 to disable
+	ControlConfig_t			control;	//Unix control socket, NULL path to disable
+	bool					display;	//Open the X11 preview window
+	bool					verbose;	//Print per second frame rate
+}CaptureConfig_t;
+
+typedef struct
+{
+	CaptureConfig_t			config;
+	volatile bool			quit;
+
+	//Capture source
+	Source_t				*source;
 
 	Display_t				*viewer;
-    Buffer_t 				buffers[DMA_BUFF_COUNT];
 	
 	//Frame stats
 	int						frameCount;
 	struct timespec			tsLastTick;
 
+	//Running totals, read by capture_bench and /metrics from other threads with relaxed atomics
+	uint64_t				framesTotal;
+	uint64_t				ausTotal;
+	uint64_t				tsBytesTotal;
+
 	//Encoder
 	Encoder_t 				*enc;
 
+	//Closed loop bitrate, sampled on the capture loop
+	RateCtl_t				*rateCtl;
+	RateCtlSample_t			*rcSamples;
+	int						rcSamplesCap;
+	int64_t					rcLastMs;
+
+	//Local control socket, served on the capture loop
+	Control_t				*control;
+
 	//Muxer
 	void					*ts;
 	int						tsStreamId;
@@ -59,14 +133,68 @@ typedef struct
 	List_t					qSend;
 	List_t					qFree;
 
+	//Access unit gathered from the parts of a sliced encoder, see EncoderPacket_t.partial.
+	//Parts that follow each other in the encoder's buffer are held there, others copied
+	const uint8_t			*auData;	//Held parts, NULL once copied into auBuf
+	void					*auHeld[CAP_MAX_HELD_PARTS];
+	int						auHeldCount;
+	uint8_t					*auBuf;
+	size_t					auLen;
+	size_t					auCap;
+	bool					auBroken;	//A part failed to mux, the rest of the unit is dropped
+
+	//Guards lConnections and lSocks, the encoder thread walks them
+	pthread_mutex_t			lock;
+
 	//Websock
 	Websock_t				*sockServer;
 	List_t					lSocks;
+	uint8_t					*wsBuf;		//One access unit, gathered for a single message
+	size_t					wsBufCap;
+
+	//HLS segments, fed the same access units as the TS WebSocket clients
+	Hls_t					*hls;
+
+	//UDP/RTP sink, fed the same access units
+	Udp_t					*udp;
+
+	//Reliable UDP sink, fed the same access units
+	Rudp_t					*rudp;
 
-	//Network
+	//Fragmented MP4 muxer, fed only while CAP_WS_CHANNEL_FMP4* clients are connected
+	void					*fmp4;
+	bool					fmp4Key;	//Access unit being muxed is a key frame
+
+	//Parameter sets of the last key frame, raw WebSocket protocol
+	uint8_t					*paramSets;
+	int						paramSetsLen;
+	uint16_t				paramSetsVersion;
+
+	//Network, raw TCP and HTTP /live.ts viewers share lConnections
 	Net_t					*net;
+	Net_t					*http;
 	List_t					lConnections;
 	
 }App_t;
 
+/**
+ * Open the source, encoder, muxer and network sinks
+ */
+CStatus_t capAppInit(App_t *app, CaptureConfig_t *config);
+
+/**
+ * Run the capture loop on the calling thread until capAppStop
+ */
+CStatus_t capAppRun(App_t *app);
+
+/**
+ * Ask capAppRun to return, safe from any thread or a signal handler
+ */
+void capAppStop(App_t *app);
+
+/**
+ * Release everything capAppInit created, also after a failed init
+ */
+void capAppDeinit(App_t *app);
+
 #endif
\ No newline at end of file
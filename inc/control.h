@@ -0,0 +1,56 @@
+#ifndef __CONTROL_H__
+#define __CONTROL_H__
+
+#include "common.h"
+
+/*
+ * Local control socket. A client connects to the unix stream socket, writes one
+ * command per line and reads the replies until the server closes, e.g.
+ *
+ *   echo "set bitrate=4000 rc=cbr" | socat - UNIX-CONNECT:/tmp/capture.sock
+ *
+ * Every line is split on blanks and handed to ControlInterface_t.Command, which
+ * writes its reply with controlReply. The server answers "ok" or "error: <why>"
+ * after it. Commands run on the thread that calls controlDispatch, which serves one
+ * client for at most CONTROL_TIMEOUT_MS, so a client has to shut down its write
+ * side once it has sent its commands. The socket is only open to its owner.
+ */
+
+#define CONTROL_MAX_LINE        512
+#define CONTROL_MAX_ARGS        16
+#define CONTROL_TIMEOUT_MS      200     //From connect, a client that has not finished its commands by then is dropped
+
+struct Control;
+typedef struct Control              Control_t;
+
+typedef struct
+{
+    const char          *path;      //Socket path, NULL to disable
+}ControlConfig_t;
+
+typedef struct
+{
+    //argv[0] is the command, CSTATUS_BAD_PARAM for unknown commands or arguments
+    CStatus_t (*Command)(int fd, int argc, char *argv[], void *udata);
+}ControlInterface_t;
+
+/**
+ * Listen on config->path, a stale socket file there is replaced
+ */
+Control_t *controlCreate(ControlConfig_t *config, ControlInterface_t *itf, void *udata);
+
+void controlDestroy(Control_t *ctl);
+
+int controlGetFd(Control_t *ctl);
+
+/**
+ * Serve the pending client, call when the fd is readable
+ */
+void controlDispatch(Control_t *ctl);
+
+/**
+ * printf to the client of a Command
+ */
+void controlReply(int fd, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
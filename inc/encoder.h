@@ -1,11 +1,64 @@
 #ifndef __ENCODER_CAPTURE_H__
 #define __ENCODER_CAPTURE_H__
 
-#include <rockchip/rk_mpi.h>
 #include "buffer.h"
 #include "common.h"
 #include <pthread.h>
 
+struct Encoder;
+struct EncoderOps;
+
+typedef struct Encoder              Encoder_t;
+typedef struct EncoderOps           EncoderOps_t;
+
+typedef enum
+{
+    ENCODER_BACKEND_MPP = 0,        //Rockchip MPP hardware encoder
+    ENCODER_BACKEND_MOCK,           //Replays recorded access units, no hardware needed
+}EncoderBackend_t;
+
+typedef enum
+{
+    ENCODER_CODEC_H264 = 0,
+    ENCODER_CODEC_H265,
+}EncoderCodec_t;
+
+typedef enum
+{
+    ENCODER_RC_VBR = 0,
+    ENCODER_RC_CBR,
+    ENCODER_RC_AVBR,
+    ENCODER_RC_FIXQP,               //Every frame at qpMin
+}EncoderRcMode_t;
+
+typedef enum
+{
+    ENCODER_SPLIT_NONE = 0,         //One packet per access unit
+    ENCODER_SPLIT_BYTES,            //A slice every splitArg bytes
+    ENCODER_SPLIT_SLICES,           //splitArg slices per frame
+}EncoderSplit_t;
+
+/**
+ * Fields of encoderUpdateConfig, ENCODER_CFG_HEADERS change the parameter sets
+ */
+typedef enum
+{
+    ENCODER_CFG_BITRATE     = 1 << 0,
+    ENCODER_CFG_FPS         = 1 << 1,
+    ENCODER_CFG_GOP         = 1 << 2,
+    ENCODER_CFG_RC_MODE     = 1 << 3,
+    ENCODER_CFG_QP          = 1 << 4,
+    ENCODER_CFG_PROFILE     = 1 << 5,
+    ENCODER_CFG_LEVEL       = 1 << 6,
+    ENCODER_CFG_CODEC       = 1 << 7,
+    ENCODER_CFG_TIER        = 1 << 8,
+    ENCODER_CFG_CTU         = 1 << 9,
+    ENCODER_CFG_SPLIT       = 1 << 10,  //Only at create
+    ENCODER_CFG_REFRESH     = 1 << 11,  //Only at create
+
+    ENCODER_CFG_HEADERS     = ENCODER_CFG_PROFILE | ENCODER_CFG_LEVEL | ENCODER_CFG_CODEC | ENCODER_CFG_TIER | ENCODER_CFG_CTU,
+}EncoderCfgField_t;
+
 typedef struct
 {
     //Encoder Config
@@ -13,44 +66,171 @@ typedef struct
     int                 height;
     int                 verStride;  //Represents the distance between two adjacent rows in vertical direction, in units of bytes.
     int                 horStride;  //Represents the number of row spacing between image components, in units of 1.
+    uint32_t            pixfmt;     //V4L2 fourcc of the input frames, 0 means NV24
 
     int                 birate;
     int                 fps;
     int                 gop;
+
+    EncoderRcMode_t     rcMode;
+    int                 qpMin;      //0 for the codec default
+    int                 qpMax;      //0 for the codec default
+    int                 profile;    //profile_idc, 0 for High (H.264) or Main (H.265)
+    int                 level;      //level_idc, 0 for 4.0 (H.264) or 4.1 (H.265)
+    int                 tier;       //H.265 general_tier_flag, 1 for the High tier
+    int                 ctu;        //H.265 CTU size 16/32/64, 0 for the hardware default
+    EncoderSplit_t      split;      //Hand out slices as they are encoded instead of whole frames
+    int                 splitArg;   //Bytes or slice count, see EncoderSplit_t
+    int                 refresh;    //Intra refresh cycle in frames instead of gop IDR frames, 0 disables
+    bool                refreshCols;//Refresh columns instead of rows
+
+    EncoderBackend_t    backend;
+    EncoderCodec_t      codec;      //A replayed mock stream brings its own
+    const char          *mockPath;  //Annex-B elementary stream for the mock backend, NULL to synthesize
 }EncoderConfig_t;
 
+/**
+ * One encoded access unit, valid only for the duration of the NewPacket callback.
+ * With config.split an access unit comes in parts, each holding whole slices, that
+ * share pts, keyFrame and seq. Only the last part has partial false.
+ */
 typedef struct
 {
-    void (*NewPacket)(unsigned char * data, int len, void *udata);
+    uint8_t             *data;
+    int                 len;
+    int64_t             pts;        //Input frame time, CLOCK_MONOTONIC microseconds
+    bool                keyFrame;
+    bool                newHeaders; //First key frame after encoderUpdateConfig changed the parameter sets
+    bool                recoveryPoint;  //Starts an intra refresh cycle, led by the parameter sets and a recovery point SEI
+    bool                partial;    //More parts of this access unit follow
+    int                 part;       //Index within the access unit, 0 for the first
+    int                 qp;         //Average QP of the frame, -1 if the backend does not report it
+    uint32_t            seq;
+
+    void                *handle;    //Backend packet, released after the callback unless held
+}EncoderPacket_t;
+
+typedef struct
+{
+    void (*NewPacket)(EncoderPacket_t *pkt, void *udata);
 }EncoderInterface_t;
 
+#define ENCODER_STATS_WINDOW    64      //Frames in the rolling aggregates of EncoderStats_t
+
+//One access unit as it left the encoder
 typedef struct
 {
-    //Handles
-    MppCtx              ctx;
-    MppApi              *api;
-    MppEncCfg           cfg;
+    int64_t             pts;
+    int64_t             latencyUs;  //Input frame to the last part out of the backend
+    int                 bytes;
+    int                 qp;
+    bool                keyFrame;
+}EncoderFrameStat_t;
+
+/**
+ * Telemetry of encoderGetStats. The rate control fullness is modelled here rather
+ * than read from the backend: a buffer of one second at the target bitrate that every
+ * frame fills and the target bitrate drains, above 100 percent the encoder overshoots.
+ */
+typedef struct
+{
+    //Since create
+    uint64_t            frames;
+    uint64_t            keyFrames;
+    uint64_t            recoveryPoints;
+    uint64_t            bytes;
+
+    //Latest frame
+    EncoderFrameStat_t  last;
+
+    //Over the last window frames, at most ENCODER_STATS_WINDOW
+    int                 window;
+    int                 avgBytes;
+    int                 maxBytes;
+    int                 avgKeyBytes;    //0 without a key frame in the window
+    int64_t             avgLatencyUs;
+    int64_t             maxLatencyUs;
+    double              avgQp;          //-1 if unknown
+    int                 outBps;         //Encoded bitrate over the window
+
+    int                 targetBps;
+    int                 targetFps;
+    int                 rcFullness;     //Percent
+}EncoderStats_t;
+
+/**
+ * Backend operations. GetPacket runs on the encoder thread and may block for a
+ * bounded time, CSTATUS_AGAIN tells the thread to check isRunning and retry.
+ */
+struct EncoderOps
+{
+    const char  *name;
+    CStatus_t   (*Init)(Encoder_t *enc);
+    void        (*Deinit)(Encoder_t *enc);
+    CStatus_t   (*PutFrame)(Encoder_t *enc, Buffer_t *buff, int64_t pts);
+    CStatus_t   (*GetPacket)(Encoder_t *enc, EncoderPacket_t *pkt);
+    void        (*ReleasePacket)(Encoder_t *enc, EncoderPacket_t *pkt);
+
+    //Target bitrate and frame rate while running, NULL if the backend cannot change them
+    CStatus_t   (*SetRate)(Encoder_t *enc, int bps, int fps);
+
+    //Apply the ENCODER_CFG_* fields of config, already checked, while running. config.fps
+    //is the output rate. A change of ENCODER_CFG_HEADERS must start over at a key frame
+    //with the new parameter sets
+    CStatus_t   (*UpdateConfig)(Encoder_t *enc, const EncoderConfig_t *config, uint32_t fields);
+
+    //Make the next frame an IDR frame, NULL if the backend cannot
+    CStatus_t   (*RequestKeyFrame)(Encoder_t *enc);
+
+    //Keep pkt->data valid past ReleasePacket until ReleaseHold, NULL if it can not be kept.
+    //Runs on the encoder thread inside NewPacket, ReleaseHold on any thread
+    void        *(*HoldPacket)(Encoder_t *enc, EncoderPacket_t *pkt);
+    void        (*ReleaseHold)(Encoder_t *enc, void *ref);
+};
+
+struct Encoder
+{
+    //Backend
+    const EncoderOps_t  *ops;
+    void                *priv;
     pthread_t           threadEnc;
 
     //Callbacks and udata
     EncoderInterface_t  *itf;
     void                *udata;
 
-    //Library Settings
-    int                 frameSize;
-    int                 headerSize;
-    MppCodingType       codecType;
-    MppFrameFormat      frameFormat;
-    MppEncRcMode        rcMode;
-    MppEncHeaderMode    headerMode;
-    MppEncSeiMode       seiMode;
-
     //Configs
     EncoderConfig_t     config;
 
     //State Varibles
     bool                isRunning;
-}Encoder_t;
+    uint32_t            seq;
+
+    //Runtime rate, see encoderSetBitrate. Set on the capture loop under statsLock for the
+    //encoder thread and encoderGetStats
+    int                 bps;
+    int                 fps;
+    int                 fpsAcc;     //Frames are let through while it reaches config.fps
+
+    //Set by encoderUpdateConfig, the next key frame is flagged newHeaders
+    volatile bool       headersPending;
+
+    //Intra refresh, frames since the last key frame and its parameter sets
+    int                 refreshFrames;
+    uint8_t             *paramSets;
+    size_t              paramSetsLen;
+    uint8_t             *recoveryBuf;   //Parameter sets, SEI and the first part of a recovery point
+    size_t              recoveryCap;
+
+    //Telemetry of the encoder thread, see encoderGetStats
+    pthread_mutex_t     statsLock;
+    EncoderStats_t      stats;          //Counters and the last frame, aggregates are filled on read
+    EncoderFrameStat_t  statsRing[ENCODER_STATS_WINDOW];
+    int                 statsHead;
+    int                 statsAuBytes;   //Parts of the current access unit so far
+    double              rcLevel;        //Bits in the modelled rate control buffer
+    int64_t             rcLastPts;
+};
 
 Encoder_t * encoderCreate(EncoderConfig_t *config, EncoderInterface_t *itf, void *udata);
 
@@ -58,5 +238,69 @@ void encoderDestroy(Encoder_t *enc);
 
 CStatus_t encoderPutFrame(Encoder_t *enc, Buffer_t *buff);
 
+/**
+ * Change the target bitrate while running. fps below config.fps drops input frames
+ * evenly before the encoder, 0 keeps the current frame rate
+ */
+CStatus_t encoderSetBitrate(Encoder_t *enc, int bps, int fps);
+
+/**
+ * Keep the data of pkt past the NewPacket callback, e.g. to gather the parts of an
+ * access unit by reference. Packets live in a fixed pool of backend buffers and an
+ * encoder whose buffers are all held drops input frames, so hold them briefly.
+ * @return reference for encoderReleaseHold, NULL if the data has to be copied instead
+ */
+void *encoderHoldPacket(Encoder_t *enc, EncoderPacket_t *pkt);
+
+void encoderReleaseHold(Encoder_t *enc, void *ref);
+
+/**
+ * Counters, the latest frame and the aggregates over the last ENCODER_STATS_WINDOW
+ * frames, safe from any thread
+ */
+void encoderGetStats(Encoder_t *enc, EncoderStats_t *stats);
+
+/**
+ * Ask for an IDR frame, e.g. for a viewer that joins an intra refresh stream
+ */
+CStatus_t encoderRequestKeyFrame(Encoder_t *enc);
+
+/**
+ * Change the ENCODER_CFG_* fields of config on the running encoder, the rest of
+ * config is ignored. fps is the output rate, at most the capture rate given at
+ * create. Size, format, backend and codec are fixed for the encoder's lifetime.
+ * Nothing is applied if any field is out of range.
+ */
+CStatus_t encoderUpdateConfig(Encoder_t *enc, const EncoderConfig_t *config, uint32_t fields);
+
+/**
+ * Parse one "<key>=<value>" into config and add its ENCODER_CFG_* to fields. Keys are
+ * bitrate (kbps), fps, gop, rc, qpmin, qpmax, profile (name or idc), level (x.y or
+ * idc), tier, ctu, codec, slices, slicebytes and refresh (frames[:cols]). Names and
+ * levels follow config->codec.
+ */
+CStatus_t encoderParseSetting(EncoderConfig_t *config, uint32_t *fields, char *setting);
+
+/**
+ * Map "h264"/"h265"/"hevc" to EncoderCodec_t, -1 if unknown
+ */
+int encoderCodecFromString(const char *name);
+
+/**
+ * Map "vbr"/"cbr"/"avbr"/"fixqp" to EncoderRcMode_t, -1 if unknown
+ */
+int encoderRcModeFromString(const char *name);
+
+const char *encoderRcModeToString(EncoderRcMode_t mode);
+
+/**
+ * Map "mpp"/"mock" to EncoderBackend_t, -1 if unknown
+ */
+int encoderBackendFromString(const char *name);
+
+/**
+ * CLOCK_MONOTONIC in microseconds, the time base of EncoderPacket_t.pts
+ */
+int64_t encoderTimeUs(void);
 
-#endif
\ No newline at end of file
+#endif
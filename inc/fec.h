@@ -0,0 +1,129 @@
+#ifndef __FEC_H__
+#define __FEC_H__
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * SMPTE 2022-1 row/column XOR forward error correction for RTP carried TS.
+ *
+ * The media packets are laid out row by row in an L (columns) x D (rows) matrix.
+ * Every column of D packets is protected by one column FEC packet, sent on the media
+ * port + 2, and optionally every row of L packets by one row FEC packet on port + 4.
+ * Any single loss per column or row is rebuilt, column and row FEC together also
+ * repair most bursts up to L packets long. The overhead is 1/D for columns plus 1/L
+ * for rows.
+ *
+ * FEC packet: RTP header (PT 96), 16 byte FEC header, XOR of the media payloads
+ *   0..1   SN base low bits
+ *   2..3   length recovery
+ *   4      E=1, PT recovery
+ *   5..7   mask, 0
+ *   8..11  TS recovery
+ *   12     N=0, D (0 column, 1 row), type 0 (XOR), index 0
+ *   13     offset, L for columns, 1 for rows
+ *   14     NA, D for columns, L for rows
+ *   15     SN base extension, 0
+ */
+
+#define FEC_RTP_HEADER          12
+#define FEC_HEADER              16
+#define FEC_RTP_PT              96
+#define FEC_MAX_PAYLOAD         1316        //7 TS packets
+#define FEC_PACKET_MAX          (FEC_RTP_HEADER + FEC_HEADER + FEC_MAX_PAYLOAD)
+#define FEC_MAX_COLS            20
+#define FEC_MAX_ROWS            20
+#define FEC_MAX_CELLS           100         //L x D limit of SMPTE 2022-1
+#define FEC_COLUMN_PORT_OFFSET  2
+#define FEC_ROW_PORT_OFFSET     4
+
+typedef enum
+{
+    FEC_COLUMN = 0,
+    FEC_ROW = 1,
+}FecDirection_t;
+
+typedef struct
+{
+    int                 cols;       //L, 1..FEC_MAX_COLS
+    int                 rows;       //D, 1..FEC_MAX_ROWS, L x D <= FEC_MAX_CELLS
+    bool                rowFec;     //Also send row FEC, 2D
+}FecConfig_t;
+
+typedef struct
+{
+    FecDirection_t      dir;
+    size_t              len;
+    uint8_t             data[FEC_PACKET_MAX];
+}FecPacket_t;
+
+struct FecEnc;
+struct FecDec;
+typedef struct FecEnc FecEnc_t;
+typedef struct FecDec FecDec_t;
+
+typedef struct
+{
+    uint64_t            media;      //Packets received or rebuilt
+    uint64_t            fec;        //FEC packets received
+    uint64_t            recovered;
+    uint64_t            lost;       //Given up on
+    uint64_t            late;       //Duplicate media and media after its deadline
+}FecDecStats_t;
+
+/**
+ * dst ^= src, vectorized
+ */
+void fecXor(uint8_t *dst, const uint8_t *src, size_t len);
+
+/**
+ * Parse "LxD" or "LxD,row" into config
+ */
+CStatus_t fecParseConfig(FecConfig_t *config, const char *str);
+
+/**
+ * Create the sender side
+ */
+FecEnc_t *fecEncCreate(FecConfig_t *config);
+
+/**
+ * Destroy the sender side
+ */
+void fecEncDestroy(FecEnc_t *fec);
+
+/**
+ * Add the next RTP media packet, in sequence order. The FEC packets it completes,
+ * at most one column and one row, are written to out
+ * @return number of packets written to out
+ */
+int fecEncode(FecEnc_t *fec, const uint8_t *rtp, size_t len, FecPacket_t out[2]);
+
+/**
+ * Receiver side, hands the TS payloads to Deliver in sequence order. A missing packet
+ * is waited for until the FEC covering it can no longer arrive, then skipped
+ */
+FecDec_t *fecDecCreate(void (*Deliver)(const uint8_t *ts, size_t len, void *udata), void *udata);
+
+/**
+ * Destroy the receiver side
+ */
+void fecDecDestroy(FecDec_t *fec);
+
+/**
+ * Add an RTP media datagram as received
+ */
+void fecDecMedia(FecDec_t *fec, const uint8_t *rtp, size_t len);
+
+/**
+ * Add a column or row FEC datagram as received
+ */
+void fecDecFec(FecDec_t *fec, const uint8_t *pkt, size_t len);
+
+/**
+ * Deliver what is still held back, e.g. at the end of the stream
+ */
+void fecDecFlush(FecDec_t *fec);
+
+void fecDecGetStats(FecDec_t *fec, FecDecStats_t *stats);
+
+#endif
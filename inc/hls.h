@@ -0,0 +1,54 @@
+#ifndef __HLS_H__
+#define __HLS_H__
+
+#include <stdint.h>
+#include "common.h"
+#include "network.h"
+
+/*
+ * HLS sink: cuts the muxed TS at random access points into a ring of in memory
+ * segments and serves them with their playlist from the HTTP Net_t. A random
+ * access point is an IDR frame or an intra refresh recovery point, both carry the
+ * TS random_access_indicator.
+ *
+ *   HLS_PATH "live.m3u8"        playlist, LL-HLS blocking reload with _HLS_msn/_HLS_part
+ *   HLS_PATH "<msn>.ts"         complete segment
+ *   HLS_PATH "<msn>.<part>.ts"  LL-HLS partial segment, waits for the preload hint
+ *
+ * Parts are immutable once closed, every viewer is sent the same buffers.
+ */
+
+#define HLS_PATH                "/hls/"
+#define HLS_MAX_PARTS           64          //Per segment, later frames join the last one
+
+struct Hls;
+typedef struct Hls Hls_t;
+
+typedef struct
+{
+    int                 segmentMs;          //Target duration, cut at the first random access point after it
+    int                 segments;           //Complete segments in the playlist
+    int                 partMs;             //LL-HLS part target, 0 disables partial segments
+}HlsConfig_t;
+
+/**
+ * Create the segmenter, nothing is served until the first random access point
+ */
+Hls_t *hlsCreate(HlsConfig_t *config);
+
+/**
+ * Destroy the segmenter, parts still being sent are freed by their last viewer
+ */
+void hlsDestroy(Hls_t *hls);
+
+/**
+ * Append one access unit of 188 byte TS packets, as produced by mpeg_ts_write
+ */
+CStatus_t hlsWrite(Hls_t *hls, const uint8_t *data, size_t len);
+
+/**
+ * NetInterface_t.Request handler body, CSTATUS_AGAIN if the path is not under HLS_PATH
+ */
+CStatus_t hlsServe(Hls_t *hls, int fd, const NetHttpRequest_t *req);
+
+#endif
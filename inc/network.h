@@ -7,6 +7,7 @@
 #include <list_common.h>
 #include "common.h"
 #include "buffer.h"
+#include "pacing.h"
 
 struct Net;
 struct NetCon;
@@ -22,9 +23,29 @@ typedef struct NetCon               NetCon_t;
 typedef struct NetInterface         NetInterface_t;
 typedef struct NetConInterface      NetConInterface_t;
 
+#define NET_HTTP_MAX_PATH       1024
+#define NET_HTTP_MAX_QUERY      256
+
+typedef struct
+{
+    char                method[8];
+    char                path[NET_HTTP_MAX_PATH];    //Percent decoded
+    char                query[NET_HTTP_MAX_QUERY];  //As sent, without the '?'
+    int                 headLen;
+    bool                head;       //HEAD, no body
+    bool                upgrade;    //Upgrade: websocket
+    bool                close;      //Connection: close or HTTP/1.0
+}NetHttpRequest_t;
+
 struct NetInterface
 {
     void (*NewClient)(NetCon_t *con, void *udata);
+
+    //HTTP only, takes over fd with the upgrade request still unread, NULL answers 404
+    CStatus_t (*Upgrade)(int fd, void *udata);
+
+    //HTTP only, may block. CSTATUS_AGAIN falls through to the static files, other failures close fd
+    CStatus_t (*Request)(int fd, const NetHttpRequest_t *req, void *udata);
 };
 
 
@@ -46,12 +67,17 @@ struct NetCon
     pthread_mutex_t     lock;
     bool                running;
     bool                destroyed;
+    Pacer_t             pacer;      //SO_MAX_PACING_RATE, fed by netConSend
+    size_t              sendBytes;  //Queued on lSend and not written yet
     List_t              link;
 };
 
 struct NetConfig
 {
     uint16_t port;
+    bool http;              //Serve HTTP/1.1 instead of raw TS, see netDispatch
+    const char *docRoot;    //HTTP static files, NULL serves none
+    PacingConfig_t pacing;  //Kernel pacing of the TS streams, peak 0 disables
 };
 
 struct Net
@@ -63,6 +89,9 @@ struct Net
 };
 
 
+#define NET_HTTP_STREAM_PATH    "/live.ts"
+#define NET_HTTP_WS_PATH        "/ws"
+
 struct NetConConfig
 {
     int bufferCount;
@@ -92,10 +121,32 @@ int netGetFd(Net_t *n);
 
 /**
  * Dispatch for incomming connection
+ *
+ * With config.http the request is read on a short lived thread:
+ *   GET NET_HTTP_STREAM_PATH  close delimited TS stream, handed to NewClient
+ *   NET_HTTP_WS_PATH[/...]    WebSocket upgrade, handed to Upgrade unread
+ *   GET/HEAD anything else    Request, then static file under config.docRoot
  */
 void netDispatch(Net_t *n);
 
 
+/**
+ * HTTP response head, length < 0 leaves out Content-Length. extra holds whole header lines
+ */
+CStatus_t netHttpRespond(int fd, int code, const char *reason, const char *type, int64_t length, bool close,
+                         const char *extra);
+
+/**
+ * HTTP response with a one line text body
+ */
+CStatus_t netHttpError(int fd, int code, const char *reason, bool close, const char *extra);
+
+/**
+ * Blocking send of the whole buffer
+ */
+CStatus_t netHttpSend(int fd, const void *data, size_t len);
+
+
 /****************************************************************************** */
 /**************************** Network Connection APIs ************************* */
 /****************************************************************************** */
@@ -114,6 +165,12 @@ void netConClose(NetCon_t *con);
 int netConSend(NetCon_t *n, NetBuffer_t *buf);
 
 
+/**
+ * Bytes queued for the connection and not yet handed to the socket
+ */
+size_t netConBacklog(NetCon_t *con);
+
+
 /**
  * Get Network Fd to add into poll
  */
@@ -0,0 +1,85 @@
+#ifndef __PACING_H__
+#define __PACING_H__
+
+#include <stdint.h>
+#include <time.h>
+#include "common.h"
+
+/*
+ * Kernel paced transmission for the TCP and UDP sinks. An IDR frame is many times
+ * the average frame, sent as one burst it overflows shallow switch and Wi-Fi
+ * buffers. Every sink measures its own average output rate and lets the kernel
+ * hold it to peak x that average:
+ *   - SO_MAX_PACING_RATE on every socket, enforced by the fq qdisc and, without
+ *     it, by TCP's internal pacing
+ *   - for the UDP sink also SO_TXTIME departure times on every datagram, on
+ *     CLOCK_MONOTONIC for fq or CLOCK_TAI for the ETF qdisc
+ *
+ *   tc qdisc replace dev eth0 root fq
+ *   tc qdisc replace dev eth0 parent 100:1 etf clockid CLOCK_TAI delta 200000
+ *
+ * ETF drops a datagram whose departure is already past when it reaches the qdisc,
+ * or by the time the qdisc hands it to the device delta ahead of it. Every
+ * CLOCK_TAI departure is therefore at least leadUs ahead of now, which has to cover
+ * the qdisc's delta plus the time through the stack: PACING_ETF_LEAD_US by default,
+ * "<peak>,etf=<us>" for a larger delta.
+ *
+ * A burst the rate cannot drain within PACING_MAX_DELAY_MS goes out at that
+ * horizon, late frames are worth less than a short burst.
+ */
+
+#define PACING_AVERAGE_MS       2000        //Time constant of the average rate
+#define PACING_WINDOW_MS        250         //Rate sample period
+#define PACING_MAX_DELAY_MS     250         //Departure horizon
+#define PACING_RATE_SLACK       10          //Percent change before the socket rate is updated
+#define PACING_ETF_LEAD_US      500         //Default lead of ETF departures, above the delta of the example
+
+typedef struct
+{
+    double              peak;       //Peak to average rate ratio, >= 1, 0 disables pacing
+    bool                etf;        //Departure times on CLOCK_TAI for ETF instead of CLOCK_MONOTONIC for fq
+    int                 leadUs;     //ETF only, no departure is closer to now than this
+}PacingConfig_t;
+
+typedef struct
+{
+    PacingConfig_t      config;
+    clockid_t           clock;
+    int64_t             windowStartNs;
+    uint64_t            windowBytes;
+    double              avgRate;        //Bytes per second
+    uint64_t            rate;           //Pacing rate in bytes per second, 0 until the first sample
+    uint64_t            appliedRate;    //Last SO_MAX_PACING_RATE
+    int64_t             nextNs;         //Departure of the next byte on clock
+}Pacer_t;
+
+/**
+ * Parse "peak", "peak,etf" or "peak,etf=<lead us>" into config
+ */
+CStatus_t pacingParseConfig(PacingConfig_t *config, const char *str);
+
+void pacerInit(Pacer_t *pacer, const PacingConfig_t *config);
+
+/**
+ * Account bytes handed to the sink
+ * @return true when the rate moved PACING_RATE_SLACK percent from the one applied
+ */
+bool pacerAccount(Pacer_t *pacer, size_t bytes);
+
+/**
+ * Set SO_MAX_PACING_RATE on fd to the current rate
+ */
+CStatus_t pacerApplyRate(Pacer_t *pacer, int fd);
+
+/**
+ * Turn on SO_TXTIME for fd on the pacer's clock
+ */
+CStatus_t pacerEnableTxtime(Pacer_t *pacer, int fd);
+
+/**
+ * Departure time in nanoseconds on the pacer's clock of the next bytes, never
+ * before now plus the ETF lead
+ */
+int64_t pacerDepart(Pacer_t *pacer, size_t bytes);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef __RATECTL_H__
+#define __RATECTL_H__
+
+#include <stdint.h>
+#include "common.h"
+
+/*
+ * Closed loop encoder bitrate control. Every RATECTL_PERIOD_MS the capture app
+ * samples each TCP and WebSocket viewer: bytes queued in the app, bytes the socket
+ * has not sent (TCP_INFO notsent), RTT and delivery rate. The backlog of the worst
+ * viewer, in milliseconds to drain it at its delivery rate, or at the bitrate it was
+ * encoded at when the rate is unknown, steers the encoder:
+ *   - above highMs for RATECTL_CONGESTED_SAMPLES samples in a row the bitrate drops
+ *     by a quarter, or to RATECTL_DELIVERY_SHARE of that viewer's delivery rate if it
+ *     is lower, and once at minBps the frame rate halves down to minFps. Within holdMs
+ *     of a cut only a backlog grown past the one that triggered it cuts again
+ *   - below lowMs for holdMs since the last change the frame rate is restored
+ *     first, then the bitrate grows by RATECTL_STEP_UP percent up to maxBps
+ * The gap between the thresholds and the hold time keep it from oscillating, so the
+ * queue, and with it glass to glass latency, stays bounded under congestion.
+ */
+
+#define RATECTL_PERIOD_MS           250
+#define RATECTL_CONGESTED_SAMPLES   2
+#define RATECTL_DELIVERY_SHARE      85      //Percent of the delivery rate a congested viewer gets
+#define RATECTL_STEP_UP             10      //Percent
+#define RATECTL_DEFAULT_HIGH_MS     200
+#define RATECTL_DEFAULT_LOW_MS      50
+#define RATECTL_DEFAULT_HOLD_MS     4000
+
+typedef struct
+{
+    int                 minBps;     //0 disables the controller
+    int                 maxBps;
+    int                 minFps;     //0 never lowers the frame rate
+    int                 highMs;     //Backlog that backs off, 0 for RATECTL_DEFAULT_HIGH_MS
+    int                 lowMs;      //Backlog that allows probing up, 0 for RATECTL_DEFAULT_LOW_MS
+    int                 holdMs;     //Time after a change before probing up or cutting again, 0 for RATECTL_DEFAULT_HOLD_MS
+}RateCtlConfig_t;
+
+typedef struct
+{
+    size_t              backlog;        //App queue plus socket notsent bytes
+    uint32_t            rttUs;          //0 unknown
+    uint64_t            deliveryRate;   //Bytes per second, 0 unknown
+}RateCtlSample_t;
+
+struct RateCtl;
+typedef struct RateCtl RateCtl_t;
+
+/**
+ * Parse "<min kbps>:<max kbps>[:<min fps>]" into config
+ */
+CStatus_t rateCtlParseConfig(RateCtlConfig_t *config, const char *str);
+
+/**
+ * Start at bps and fps, clamped to the configured bounds
+ */
+RateCtl_t *rateCtlCreate(RateCtlConfig_t *config, int bps, int fps);
+
+void rateCtlDestroy(RateCtl_t *rc);
+
+/**
+ * Start over from a target set by hand
+ * @return bps clamped to the configured bounds
+ */
+int rateCtlReset(RateCtl_t *rc, int bps, int fps);
+
+/**
+ * Add the socket's TCP_INFO to a sample, queued is what the app still holds
+ */
+void rateCtlSampleSocket(RateCtlSample_t *sample, int fd, size_t queued);
+
+/**
+ * One period of samples, one per viewer
+ * @return true when the target in bps and fps changed
+ */
+bool rateCtlUpdate(RateCtl_t *rc, const RateCtlSample_t *samples, int count, int *bps, int *fps);
+
+#endif
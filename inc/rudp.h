@@ -0,0 +1,96 @@
+#ifndef __RUDP_H__
+#define __RUDP_H__
+
+#include <stdint.h>
+#include "common.h"
+#include "pacing.h"
+
+/*
+ * Reliable UDP sink for viewers across the internet: sequence numbered datagrams of
+ * up to RUDP_TS_PER_DGRAM TS packets, repaired by NACK driven retransmission within
+ * a latency budget instead of TCP's in order delivery.
+ *
+ * Receivers register with RUDP_HELLO to the sink port and keep repeating it. The sink
+ * answers an unknown address with a PING no larger than the HELLO, carrying a cookie
+ * keyed to the address, and only starts sending once the PONG echoes it, so a forged
+ * source address never turns the sink into an amplifier. Peers whose PONGs stop are
+ * dropped after RUDP_PEER_TIMEOUT_MS. Every RUDP_PING_MS the sink measures the round
+ * trip time of each peer and tells it the result, so that:
+ *   - a receiver NACKs a gap at once and again every RTO (srtt + 4 rttvar) while it
+ *     is missing, and gives up once the gap is older than the latency budget
+ *   - the sink only retransmits a packet if it can still arrive within the budget and
+ *     at most once per RTT to the same peer, the ring holds the budget and no more
+ *
+ * With pacing.peak set the socket is held to peak x its average rate with
+ * SO_MAX_PACING_RATE and GSO messages are cut to a millisecond at that rate. Control
+ * datagrams and retransmissions queue behind the data, so the RTT measured includes
+ * the pacing delay the data sees.
+ *
+ * Datagram, big endian:
+ *   0      RUDP_* type
+ *   1      RUDP_FLAG_* flags
+ *   2..3   payload specific
+ *   4..7   sequence (DATA), number of ranges (NACK), cookie (PING, echoed by PONG)
+ *   8..15  sender clock in microseconds (DATA first send, PING), echoed by PONG
+ *   16..   DATA: TS packets, NACK: first/last sequence pairs, PING: srtt and rttvar in us
+ */
+
+#define RUDP_TS_PACKET          188
+#define RUDP_TS_PER_DGRAM       7
+#define RUDP_HEADER             16
+#define RUDP_MAX_PAYLOAD        (RUDP_TS_PER_DGRAM * RUDP_TS_PACKET)
+#define RUDP_MAX_DGRAM          (RUDP_HEADER + RUDP_MAX_PAYLOAD)
+#define RUDP_MAX_NACK_RANGES    64
+#define RUDP_MAX_PEERS          16
+#define RUDP_PING_MS            100
+#define RUDP_PEER_TIMEOUT_MS    3000
+#define RUDP_DEFAULT_LATENCY_MS 120
+
+#define RUDP_DATA               1
+#define RUDP_NACK               2
+#define RUDP_HELLO              3
+#define RUDP_PING               4
+#define RUDP_PONG               5
+#define RUDP_BYE                6
+
+#define RUDP_FLAG_REXMIT        0x01
+
+struct Rudp;
+typedef struct Rudp Rudp_t;
+
+typedef struct
+{
+    uint16_t            port;       //Receivers say hello here
+    int                 latencyMs;  //Retransmission budget, 0 for RUDP_DEFAULT_LATENCY_MS
+    PacingConfig_t      pacing;     //Kernel pacing, peak 0 disables
+}RudpConfig_t;
+
+typedef struct
+{
+    int                 peers;
+    uint64_t            datagrams;  //First sends, summed over the peers
+    uint64_t            rexmits;
+    uint64_t            nacked;     //Sequences asked for
+    uint64_t            late;       //Asked for but past the budget, not sent
+    uint64_t            dropped;    //Refused by the socket
+    int64_t             maxRttUs;   //Slowest peer
+}RudpStats_t;
+
+/**
+ * Bind the port and start the control thread
+ */
+Rudp_t *rudpCreate(RudpConfig_t *config);
+
+/**
+ * Stop the control thread, peers are told RUDP_BYE
+ */
+void rudpDestroy(Rudp_t *rudp);
+
+/**
+ * Send one access unit of 188 byte TS packets to every peer
+ */
+CStatus_t rudpSend(Rudp_t *rudp, const uint8_t *data, size_t len);
+
+void rudpGetStats(Rudp_t *rudp, RudpStats_t *stats);
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef __SOURCE_H__
+#define __SOURCE_H__
+
+#include "common.h"
+#include "buffer.h"
+
+struct Source;
+struct SourceOps;
+
+typedef struct Source               Source_t;
+typedef struct SourceOps            SourceOps_t;
+
+typedef enum
+{
+    SOURCE_V4L2 = 0,        //HDMI RX device through V4L2 ioctls
+    SOURCE_SYNTHETIC,       //Generated moving test pattern, paced at config fps
+    SOURCE_FILE,            //mmap replay of raw frame dumps, paced at config fps
+}SourceType_t;
+
+typedef struct
+{
+    SourceType_t    type;
+    const char      *path;      //V4L2 node, raw dump file or "frame-%d.raw" style pattern
+    uint32_t        pixfmt;     //V4L2_PIX_FMT_NV24 or V4L2_PIX_FMT_NV12
+    uint32_t        width;
+    uint32_t        height;
+    int             fps;        //Ignored by V4L2, the device decides the rate
+    int             numBufs;
+}SourceConfig_t;
+
+/**
+ * Backend operations, every capture backend fills the same Buffer_t pool
+ */
+struct SourceOps
+{
+    const char  *name;
+    CStatus_t   (*Open)(Source_t *src);
+    CStatus_t   (*AllocateBuffers)(Source_t *src);
+    CStatus_t   (*Queue)(Source_t *src, int index);
+    CStatus_t   (*Dequeue)(Source_t *src, Buffer_t **buff);
+    CStatus_t   (*Start)(Source_t *src);
+    CStatus_t   (*Stop)(Source_t *src);
+    void        (*Close)(Source_t *src);
+};
+
+struct Source
+{
+    const SourceOps_t       *ops;
+    void                    *priv;
+    SourceConfig_t          config;
+
+    //Readable whenever a frame can be dequeued
+    int                     fd;
+
+    //Negotiated format
+    struct
+    {
+        uint32_t                pixfmt;
+        int                     numPlanes;
+        uint32_t                width;
+        uint32_t                height;
+        int                     bytesPerLine[NUM_PLANES];
+        int                     frameSize;
+        int                     numBufs;
+    }fmt;
+
+    Buffer_t                buffers[DMA_BUFF_COUNT];
+
+    //Buffer ownership for the software backends, true while owned by the source
+    bool                    queued[DMA_BUFF_COUNT];
+};
+
+/**
+ * Open the backend selected by config->type and allocate its buffers
+ */
+Source_t *sourceCreate(SourceConfig_t *config);
+
+/**
+ * Stop (if needed) and release the source
+ */
+void sourceDestroy(Source_t *src);
+
+/**
+ * Get source fd to add into poll
+ */
+int sourceGetFd(Source_t *src);
+
+/**
+ * Queue all buffers and start streaming
+ */
+CStatus_t sourceStart(Source_t *src);
+
+CStatus_t sourceStop(Source_t *src);
+
+/**
+ * Dequeue a filled buffer, CSTATUS_AGAIN if none is ready yet
+ */
+CStatus_t sourceDequeue(Source_t *src, Buffer_t **buff);
+
+/**
+ * Give a buffer back to the source
+ */
+CStatus_t sourceQueueByIndex(Source_t *src, int index);
+
+/**
+ * Parse "v4l2", "synth" or "file", returns -1 when unknown
+ */
+int sourceTypeFromString(const char *name);
+
+#endif
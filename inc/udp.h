@@ -0,0 +1,74 @@
+#ifndef __UDP_H__
+#define __UDP_H__
+
+#include <stdint.h>
+#include "common.h"
+#include "fec.h"
+#include "pacing.h"
+
+/*
+ * UDP sink: sends the muxed TS to unicast or multicast destinations, UDP_TS_PER_DGRAM
+ * packets per datagram, optionally behind an RFC 2250 RTP header (payload type 33).
+ *
+ * Every access unit goes out right away, its last datagram may be short. The datagrams
+ * of all destinations are batched into sendmmsg() calls and, when the kernel supports
+ * UDP_SEGMENT, every run of UDP_GSO_MAX_SEGS datagrams is a single GSO message.
+ *
+ * With fec.cols set the RTP stream is protected by SMPTE 2022-1 column FEC on each
+ * destination port + 2 and, with fec.rowFec, row FEC on port + 4, see fec.h.
+ *
+ * With pacing.peak set every datagram carries a departure time, the datagrams of
+ * all destinations interleaved, and GSO messages are cut to a millisecond at the
+ * pacing rate, see pacing.h.
+ */
+
+#define UDP_TS_PACKET           188
+#define UDP_TS_PER_DGRAM        7
+#define UDP_RTP_HEADER          12
+#define UDP_RTP_PT_MP2T         33
+#define UDP_MAX_DESTS           8
+
+struct Udp;
+typedef struct Udp Udp_t;
+
+typedef struct
+{
+    const char          *dest;      //"host:port[,host:port...]", unicast or multicast
+    const char          *iface;     //Egress interface name, NULL for the routing table's
+    int                 ttl;        //Unicast and multicast TTL, 0 keeps the defaults
+    bool                rtp;        //RFC 2250 RTP header on every datagram
+    FecConfig_t         fec;        //Row/column FEC, needs rtp, cols 0 disables
+    PacingConfig_t      pacing;     //Kernel pacing, peak 0 disables
+}UdpConfig_t;
+
+typedef struct
+{
+    uint64_t            datagrams;  //Summed over the destinations, as are the others
+    uint64_t            bytes;      //UDP payload
+    uint64_t            syscalls;
+    uint64_t            dropped;    //Datagrams the socket refused
+    uint64_t            fecDatagrams;   //Column and row
+    uint64_t            fecBytes;   //UDP payload, over bytes is the FEC overhead
+}UdpStats_t;
+
+/**
+ * Resolve the destinations and open the socket
+ */
+Udp_t *udpCreate(UdpConfig_t *config);
+
+/**
+ * Close the socket
+ */
+void udpDestroy(Udp_t *udp);
+
+/**
+ * Send one access unit of 188 byte TS packets, pts is the 90kHz RTP timestamp
+ */
+CStatus_t udpSend(Udp_t *udp, const uint8_t *data, size_t len, int64_t pts);
+
+/**
+ * Running totals, only the sending thread updates them
+ */
+void udpGetStats(Udp_t *udp, UdpStats_t *stats);
+
+#endif
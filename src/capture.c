@@ -1,11 +1,27 @@
 #include "common.h"
 #include "capture.h"
+#include "fmp4-writer.h"
 #include "mpeg-ts.h"
 #include "mpeg-ts-proto.h"
 #include "list_common.h"
 #include "network.h"
 #include "websock.h"
 
+//Named encoder settings for the control socket "preset" command
+typedef struct
+{
+	const char				*name;
+	EncoderRcMode_t			rcMode;
+	int						gopMs;
+	int						qpMin;
+	int						qpMax;
+}CapPreset_t;
+
+static const CapPreset_t capPresets[] = {
+	{ "lowlatency",	ENCODER_RC_CBR,		1000,	0,	0 },	//Even frame sizes and a short gop keep queues shallow
+	{ "quality",	ENCODER_RC_AVBR,	4000,	0,	0 },	//Bits go where the picture needs them
+};
+
 //Packetiser
 static void* tsAlloc(void* param, size_t bytes)
 {
@@ -14,7 +30,7 @@ static void* tsAlloc(void* param, size_t bytes)
     if(bytes > TS_PACKET_SIZE || bytes <=0)
     {
         printf("TS h264 packetizer asked for buffer of size more than\
-                    that can be given, ask - %d, possible - %d\n", bytes, TS_PACKET_SIZE);
+                    that can be given, ask - %zu, possible - %d\n", bytes, TS_PACKET_SIZE);
         return NULL;
     }
 
@@ -26,7 +42,8 @@ static void* tsAlloc(void* param, size_t bytes)
 		return NULL;
 	}
 
-	listInsert(&app->qSend, &buf->link);
+	//Keep the muxer order, the fan-out walks qSend front to back
+	listInsertBack(&app->qSend, &buf->link);
 	app->qSendCount++;
 
 	buf->size = bytes;
@@ -57,267 +74,408 @@ static struct mpeg_ts_func_t mpegHandler = {
 
 CStatus_t capCreateViewer(App_t *app)
 {
-	app->viewer = displayCreate(app->src.width, app->src.height);
+	app->viewer = displayCreate(app->source->fmt.width, app->source->fmt.height);
 	OKAY_RETURN(NULL == app->viewer, CSTATUS_FAIL, "failed to create the viewer\n");
 	return CSTATUS_SUCCESS;
 }
 
 CStatus_t capDrawFrameFromBufferIndex(App_t *app, int index)
 {
-	Buffer_t *buf = &app->buffers[index];
+	Buffer_t *buf = &app->source->buffers[index];
 	return displayDraw(app->viewer, buf);
 }
 
-
-CStatus_t capOpenAndConfigure(App_t *app)
+static CStatus_t capReserveWsBuf(App_t *app, size_t len)
 {
-	CStatus_t status = CSTATUS_FAIL;
-	do
+	if(len > app->wsBufCap)
 	{
-		int ret = -1;
+		uint8_t *wsBuf = realloc(app->wsBuf, len);
+		OKAY_RETURN(wsBuf == NULL, CSTATUS_MEMORY, "failed to allocate %zu bytes for websocket message\n", len);
+		app->wsBuf = wsBuf;
+		app->wsBufCap = len;
+	}
+	return CSTATUS_SUCCESS;
+}
+
+//Gathers the TS packets of the last access unit into wsBuf, returns the length
+static size_t capGatherAccessUnit(App_t *app)
+{
+	size_t len = (size_t)app->qSendCount * TS_PACKET_SIZE;
+	if(capReserveWsBuf(app, len) != CSTATUS_SUCCESS)
+	{ return 0; }
 
-		//Open Device		
-		app->v4l2fd = open(V4L2_DEVICE, O_RDWR, 0);
-		OKAY_STOP(app->v4l2fd < 0, "failed to open : %s (%s)\n", V4L2_DEVICE, ERRSTR);
+	size_t offset = 0;
+	NetBuffer_t *buf = NULL;
+	LIST_FOR_EACH(buf, &app->qSend, link)
+	{
+		memcpy(app->wsBuf + offset, buf->buffer, TS_PACKET_SIZE);
+		offset += TS_PACKET_SIZE;
+	}
+	return offset;
+}
 
-		//Query Capabilities
-		struct v4l2_capability caps = {0};
-		ret = ioctl(app->v4l2fd, VIDIOC_QUERYCAP, &caps);
-		OKAY_STOP(ret, "failed to query cap\n");
-		OKAY_STOP(!(caps.capabilities & (V4L2_CAP_VIDEO_CAPTURE_MPLANE | V4L2_CAP_STREAMING)),
-					"device doesn't support capturing\n");
+static void capRawHeader(App_t *app, uint8_t *hdr, uint8_t type, bool keyFrame, uint32_t seq, int64_t pts)
+{
+	hdr[0] = type;
+	hdr[1] = (keyFrame ? CAP_RAW_FLAG_KEY : 0) |
+			 (app->enc->config.codec == ENCODER_CODEC_H265 ? CAP_RAW_FLAG_H265 : 0);
+	hdr[2] = app->paramSetsVersion >> 8;
+	hdr[3] = app->paramSetsVersion;
+	for(int i = 0; i < 4; i++)
+	{ hdr[4 + i] = seq >> (24 - 8 * i); }
+	for(int i = 0; i < 8; i++)
+	{ hdr[8 + i] = (uint64_t)pts >> (56 - 8 * i); }
+}
 
+//Caller holds app->lock
+static void capSendParamSets(App_t *app, SockConWrapper_t *w)
+{
+	uint8_t msg[CAP_RAW_HEADER_SIZE + app->paramSetsLen];
+	capRawHeader(app, msg, CAP_RAW_CONFIG, false, 0, 0);
+	memcpy(msg + CAP_RAW_HEADER_SIZE, app->paramSets, app->paramSetsLen);
+	websockConnSend(w->conn, msg, sizeof(msg));
+	w->configVersion = app->paramSetsVersion;
+}
 
-		//Get and Set Supported Image format
-		struct v4l2_format fmt = {0};
-		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-		ret = ioctl(app->v4l2fd, VIDIOC_G_FMT, &fmt);
-		OKAY_STOP(ret < 0, "VIDIOC_G_FMT failed: %s\n", ERRSTR);
+//Collects the SPS/PPS (and VPS) ahead of the first slice of a key frame, true if they changed
+static bool capUpdateParamSets(App_t *app, const uint8_t *data, size_t len)
+{
+	bool h265 = app->enc->config.codec == ENCODER_CODEC_H265;
+	uint8_t sets[1024];
+	size_t setsLen = 0, leading;
 
-		fmt.fmt.pix_mp.width = IMG_WIDTH;
-		fmt.fmt.pix_mp.height = IMG_HEIGHT;
-		fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
-		fmt.fmt.pix_mp.num_planes = 1;
+	int pos = mpeg_h264_find_nalu(data, len, &leading);
+	while(pos >= 0)
+	{
+		size_t start = pos;
+		int next = mpeg_h264_find_nalu(data + start, len - start, &leading);
+		size_t end = next < 0 ? len : start + next - leading;
 
+		int type = h265 ? (data[start] >> 1) & 0x3f : data[start] & 0x1f;
+		bool paramSet = h265 ? (type >= 32 && type <= 34) : (type == 7 || type == 8);
+		bool vcl = h265 ? type < 32 : (type >= 1 && type <= 5);
+		if(vcl)
+		{ break; }
 
-		ret = ioctl(app->v4l2fd, VIDIOC_S_FMT, &fmt);
-		OKAY_STOP(ret < 0, "VIDIOC_S_FMT failed: %s\n", ERRSTR);
+		if(paramSet && setsLen + 4 + (end - start) <= sizeof(sets))
+		{
+			static const uint8_t startCode[4] = {0, 0, 0, 1};
+			memcpy(sets + setsLen, startCode, 4);
+			memcpy(sets + setsLen + 4, data + start, end - start);
+			setsLen += 4 + (end - start);
+		}
 
-		//Store src value
-		app->src.pixfmt = fmt.fmt.pix_mp.pixelformat;
-		app->src.width = fmt.fmt.pix_mp.width;
-		app->src.height = fmt.fmt.pix_mp.height;
-		app->src.numPlanes = fmt.fmt.pix_mp.num_planes;
-		app->src.bytesPerLine[0] =  fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+		if(next < 0)
+		{ break; }
+		pos = start + next;
+	}
 
-		status = CSTATUS_SUCCESS;
-	} while (0);
+	if(setsLen == 0 || (setsLen == (size_t)app->paramSetsLen && memcmp(sets, app->paramSets, setsLen) == 0))
+	{ return false; }
 
-	return status;
+	uint8_t *paramSets = realloc(app->paramSets, setsLen);
+	OKAY_RETURN(paramSets == NULL, false, "failed to allocate parameter sets\n");
+	memcpy(paramSets, sets, setsLen);
+	app->paramSets = paramSets;
+	app->paramSetsLen = setsLen;
+	app->paramSetsVersion++;
+	return true;
 }
 
-
-CStatus_t capAllocateBuffers(App_t *app, int nums)
+//WebCodecs clients get the access unit as is, no TS. Caller holds app->lock
+static void capRawAccessUnit(App_t *app, EncoderPacket_t *pkt)
 {
-	int ret = 0;
-
-	//Request DMA Buffer
-	struct v4l2_requestbuffers rqbufs = {0};
-	rqbufs.count = app->src.numBufs;
-	rqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	rqbufs.memory = app->memType;
-	ret = ioctl(app->v4l2fd, VIDIOC_REQBUFS, &rqbufs);
-	OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_REQBUFS failed: %s\n", ERRSTR);
-	OKAY_RETURN(rqbufs.count < DMA_BUFF_COUNT, CSTATUS_FAIL, "video node allocated only "
-				"%u of %u buffers\n", rqbufs.count, DMA_BUFF_COUNT);
-
-	for(int i = 0; i < app->src.numBufs; i++)
+	if(pkt->keyFrame && capUpdateParamSets(app, pkt->data, pkt->len) && app->paramSetsLen > 0)
 	{
-		struct v4l2_buffer buf = {0};
-		buf.type    = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        buf.memory  = app->memType;
-        buf.index   = i;
-        struct v4l2_plane planes[NUM_PLANES];		//We are only going to use 1
-        buf.m.planes = planes;
-        buf.length = NUM_PLANES;
-
-		ret = ioctl(app->v4l2fd, VIDIOC_QUERYBUF, &buf);
-		OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_QUERYBUF failed : index %d, %s\n", i, ERRSTR);
+		uint8_t msg[CAP_RAW_HEADER_SIZE + app->paramSetsLen];
+		capRawHeader(app, msg, CAP_RAW_CONFIG, false, pkt->seq, pkt->pts);
+		memcpy(msg + CAP_RAW_HEADER_SIZE, app->paramSets, app->paramSetsLen);
+		websockBroadcast(app->sockServer, CAP_WS_CHANNEL_RAW, msg, sizeof(msg));
+	}
 
-		for(int j = 0; j < NUM_PLANES; j++)
+	//Decoders start at a key frame, hold new clients until one arrives
+	if(pkt->keyFrame)
+	{
+		SockConWrapper_t *w = NULL;
+		LIST_FOR_EACH(w, &app->lSocks, link)
 		{
-			app->buffers[i].size[j] = buf.m.planes[j].length;
-			app->buffers[i].ptr[j] = mmap(NULL,
-										buf.m.planes[j].length,
-										PROT_READ | PROT_WRITE,	//Required
-										MAP_SHARED, 			//Recommended
-										app->v4l2fd, buf.m.planes[0].m.mem_offset);
-			OKAY_STOP(app->buffers[i].ptr == NULL, "failed to mmap : %i, %s\n", i, ERRSTR);
+			if(w->channel != CAP_WS_CHANNEL_RAW_WAIT)
+			{ continue; }
 
-			struct v4l2_exportbuffer expbuf = (struct v4l2_exportbuffer) {0} ;
-			expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-			expbuf.index = i;
-			expbuf.flags = O_CLOEXEC;
-			ret = ioctl(app->v4l2fd, VIDIOC_EXPBUF, &expbuf);
-			OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_EXPBUF failed : index %d, %s\n", i, ERRSTR);
-			
-			app->buffers[i].dmafd[j] = expbuf.fd;
-			app->buffers[i].offset[j] = buf.m.planes[j].data_offset;
+			if(w->configVersion != app->paramSetsVersion && app->paramSetsLen > 0)
+			{ capSendParamSets(app, w); }
+			w->channel = CAP_WS_CHANNEL_RAW;
+			websockConnSetChannel(w->conn, w->channel);
 		}
+	}
 
-		// ret = displayInitBuffer(app->viewer, &app->buffers[i]);
-		// OKAY_RETURN(CSTATUS_SUCCESS != ret, CSTATUS_FAIL, "failed to create gl texture\n");
+	size_t len = CAP_RAW_HEADER_SIZE + pkt->len;
+	if(capReserveWsBuf(app, len) != CSTATUS_SUCCESS)
+	{ return; }
 
-		// MppBufferInfo info;
-		// memset(&info, 0, sizeof(MppBufferInfo));
-		// info.type = MPP_BUFFER_TYPE_EXT_DMA;
-		// info.fd =  expbuf.fd;
-		// info.size = buf_len & 0x07ffffff;
-		// info.index = (buf_len & 0xf8000000) >> 27;
-		// mpp_buffer_import(&ctx->fbuf[i].buffer, &info);
+	capRawHeader(app, app->wsBuf, CAP_RAW_FRAME, pkt->keyFrame, pkt->seq, pkt->pts);
+	memcpy(app->wsBuf + CAP_RAW_HEADER_SIZE, pkt->data, pkt->len);
+	websockBroadcast(app->sockServer, CAP_WS_CHANNEL_RAW, app->wsBuf, (int)len);
+}
 
-		
-		app->buffers[i].index = i;
-	}
+//The muxer copies each box sequence into wsBuf, it is sent before the next one is built
+static void* fmp4Alloc(void* param, size_t bytes)
+{
+	App_t *app = (App_t *) param;
+	return (capReserveWsBuf(app, bytes) == CSTATUS_SUCCESS) ? app->wsBuf : NULL;
+}
 
-	return CSTATUS_SUCCESS;
+static void fmp4FreePacket(void* param, void *packet)
+{
+	UNUSED_PARAMETER(param);
+	UNUSED_PARAMETER(packet);
 }
 
-//Queue All the buffers
-CStatus_t capQueueAllBuffers(App_t *app)
+//Called from fmp4_writer_write on the encoder thread, app->lock is already held
+static int fmp4Write(void* param, const void* packet, size_t bytes, int init)
 {
-	struct v4l2_buffer	buffer;
-	struct v4l2_plane	buf_planes[1];
-	int					i = 0;
-	int					ret = -1;
+	App_t *app = (App_t *) param;
 
-	for (i=0; i<app->src.numBufs; i++)
+	//Clients that wait start with the key frame fragment, after the current init segment
+	if(!init && app->fmp4Key)
 	{
-		memset(&buffer, 0, sizeof(buffer));
-		buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-		buffer.memory = app->memType;
-		buffer.index = i;
-		buffer.m.planes	= buf_planes;
-		buffer.length	= app->src.numPlanes;
-
-		ret = ioctl (app->v4l2fd, VIDIOC_QBUF, &buffer);
-		OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_QBUF failed : index %d, %s\n", i, ERRSTR);
+		SockConWrapper_t *w = NULL;
+		LIST_FOR_EACH(w, &app->lSocks, link)
+		{
+			if(w->channel != CAP_WS_CHANNEL_FMP4_WAIT)
+			{ continue; }
+
+			size_t initLen = 0;
+			const void *initSeg = fmp4_writer_get_init(app->fmp4, &initLen);
+			if(initSeg != NULL)
+			{ websockConnSend(w->conn, (uint8_t *)initSeg, (int)initLen); }
+			w->channel = CAP_WS_CHANNEL_FMP4;
+			websockConnSetChannel(w->conn, w->channel);
+		}
 	}
-	return CSTATUS_SUCCESS;
+
+	websockBroadcast(app->sockServer, CAP_WS_CHANNEL_FMP4, (uint8_t *)packet, (int)bytes);
+	return 0;
 }
 
-//Enqueue Buffer
-CStatus_t capQueueByIndex(App_t *app, int index)
-{
-	struct v4l2_buffer	buffer;
-	struct v4l2_plane	buf_planes[NUM_PLANES] = {0};
-	int					ret = -1;
+static struct fmp4_writer_func_t fmp4Handler = {
+	.alloc = fmp4Alloc,
+	.free = fmp4FreePacket,
+	.write = fmp4Write,
+};
 
+static void capFreeSendQueue(App_t *app)
+{
+	while (1)
+	{
+		NetBuffer_t * buf = NULL;
+		LIST_POP_FRONT(buf, &app->qSend, link);
 
-	memset(&buffer, 0, sizeof(buffer));
-	buffer.type	= V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	buffer.memory	= app->memType;
-	buffer.index	= index;
-	buffer.m.planes	= buf_planes;
-	buffer.length	= app->src.numPlanes;
+		//If NULL then there are no more packet left in queue
+		if(NULL == buf)
+		{
+			break;
+		}	
 
-	ret = ioctl (app->v4l2fd, VIDIOC_QBUF, &buffer);
-	OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_QBUF failed : index %d, %s\n", index, ERRSTR);
-	return CSTATUS_SUCCESS;
+		listInsertBack(&app->qFree, &buf->link);
+	}
 }
 
-//Deuque Buffer
-CStatus_t capDequeue(App_t *app, Buffer_t ** buff)
+static void capReleaseParts(App_t *app)
 {
-	struct v4l2_buffer	buf;
-	struct v4l2_plane	buf_planes[NUM_PLANES] = {0};
-	int			ret = -1;
-
-	memset(&buf, 0, sizeof(buf));
-	memset(&buf_planes[0], 0, sizeof(struct v4l2_plane));
-
-	buf.type		= V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	buf.memory		= app->memType;
-	buf.m.planes	= buf_planes;
-	buf.length		= app->src.numPlanes;
-	
-	ret = ioctl (app->v4l2fd, VIDIOC_DQBUF, &buf);
-	if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	for(int i = 0; i < app->auHeldCount; i++)
 	{
-		*buff = NULL;
-		return CSTATUS_AGAIN;
+		encoderReleaseHold(app->enc, app->auHeld[i]);
 	}
-	
-	OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_DBUF failed : %s\n", ERRSTR);
-
-	Buffer_t *b = &app->buffers[buf.index];
-	b->len[0] = buf.m.planes[0].bytesused;
-	*buff = b;
-
-	return CSTATUS_SUCCESS;
+	app->auHeldCount = 0;
 }
 
-//Start capturing
-CStatus_t capStreamStart(App_t *app)
+//Keeps the parts of a sliced access unit for the sinks that take whole units. While each
+//part follows the last one in the encoder's buffer they are held there, else copied
+static CStatus_t capAppendPart(App_t *app, EncoderPacket_t *pkt)
 {
-	int	ret = -1;
-	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	ret = ioctl (app->v4l2fd, VIDIOC_STREAMON, &type);
-	OKAY_RETURN(ret < 0, CSTATUS_FAIL , "VIDIOC_STREAMON failed : %s\n", ERRSTR);
-	return CSTATUS_SUCCESS;
-}
+	bool follows = (pkt->part == 0) || (app->auData != NULL && pkt->data == app->auData + app->auLen);
+	if(follows && app->auHeldCount < CAP_MAX_HELD_PARTS)
+	{
+		void *ref = encoderHoldPacket(app->enc, pkt);
+		if(ref != NULL)
+		{
+			app->auHeld[app->auHeldCount++] = ref;
+			app->auData = (pkt->part == 0) ? pkt->data : app->auData;
+			app->auLen += pkt->len;
+			return CSTATUS_SUCCESS;
+		}
+	}
 
-// Stop Capture
-CStatus_t capStreamStop(App_t *app)
-{
-	int	ret = -1;
-	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	ret = ioctl (app->v4l2fd, VIDIOC_STREAMOFF, &type);
-	OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_STREAMOFF failed : %s\n", ERRSTR);
+	size_t len = app->auLen + pkt->len;
+	if(len > app->auCap)
+	{
+		size_t cap = len * 2;
+		uint8_t *auBuf = realloc(app->auBuf, cap);
+		OKAY_RETURN(auBuf == NULL, CSTATUS_MEMORY, "failed to allocate %zu bytes for an access unit\n", cap);
+		app->auBuf = auBuf;
+		app->auCap = cap;
+	}
+
+	//From here on by copy
+	if(app->auData != NULL)
+	{
+		memcpy(app->auBuf, app->auData, app->auLen);
+		app->auData = NULL;
+		capReleaseParts(app);
+	}
+	memcpy(app->auBuf + app->auLen, pkt->data, pkt->len);
+	app->auLen += pkt->len;
 	return CSTATUS_SUCCESS;
 }
 
-static void encoderHandler_NewPacket(unsigned char * data, int len, void *udata)
+static void encoderHandler_NewPacket(EncoderPacket_t *pkt, void *udata)
 {
 	App_t *app = udata;
-	//printf("new encoded packet received : %d bytes\n", len);
-	app->qSendCount = 0;
-	int retVal =  mpeg_ts_write(app->ts, app->tsStreamId, 0, 0, 0, (const void *)data, len);
+	//printf("new encoded packet received : %d bytes\n", pkt->len);
+	int64_t pts = pkt->pts * 90 / 1000;		//us to 90kHz
+	int flags = pkt->keyFrame ? MPEG_FLAG_IDR_FRAME : 0;
+	flags |= pkt->recoveryPoint ? MPEG_FLAG_RECOVERY_POINT : 0;
+	if(pkt->part == 0)
+	{
+		app->qSendCount = 0;
+		__atomic_add_fetch(&app->ausTotal, 1, __ATOMIC_RELAXED);
+		app->auLen = 0;
+		app->auData = NULL;
+		app->auBroken = false;
+	}
+	else if(app->auBroken)
+	{
+		//The unit is already lost
+		if(!pkt->partial)
+		{
+			capFreeSendQueue(app);
+			capReleaseParts(app);
+		}
+		return;
+	}
+
+	//TS packets of the earlier parts are already out to the TCP viewers
+	int sent = app->qSendCount;
+	int retVal = 0;
+	if(pkt->part == 0)
+	{
+		if(pkt->newHeaders)
+		{
+			//PAT/PMT and a PCR lead the IDR with the new parameter sets, the raw and
+			//fMP4 channels pick the sets up from the key frame itself
+			printf("new parameter sets at access unit %u\n", pkt->seq);
+			mpeg_ts_reset(app->ts);
+		}
+		retVal = mpeg_ts_write(app->ts, app->tsStreamId, flags | (pkt->partial ? MPEG_FLAG_PES_PARTIAL : 0),
+							   pts, pts, (const void *)pkt->data, pkt->len);
+	}
+	else
+	{
+		//Later slices extend the open PES while the frame is still being encoded
+		retVal = mpeg_ts_write_continue(app->ts, app->tsStreamId, (const void *)pkt->data, pkt->len);
+	}
+
+	//Parts are gathered for the sinks that take whole access units
+	if(retVal == 0 && (pkt->partial || pkt->part > 0) && capAppendPart(app, pkt) != CSTATUS_SUCCESS)
+	{
+		retVal = -ENOMEM;
+	}
+
 	if(retVal != 0)
 	{
-		printf("failed to packetize buffer (%d bytes) into ts payload. error : %d\n", len, retVal);
+		printf("failed to packetize buffer (%d bytes) into ts payload. error : %d\n", pkt->len, retVal);
+		app->auBroken = pkt->partial;
 	}
 	else
 	{
 		//Successfull
+		__atomic_add_fetch(&app->tsBytesTotal, (app->qSendCount - sent) * TS_PACKET_SIZE, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&app->lock);
 		NetConWrapper_t *w = NULL, *_w = NULL;
 		LIST_FOR_EACH_SAFE(w, _w, &app->lConnections, link)
 		{
+			int skip = sent;
 			NetBuffer_t * buf = NULL, *_buf = NULL;
 			LIST_FOR_EACH_SAFE(buf, _buf, &app->qSend, link)
 			{
+				if(skip > 0)
+				{
+					skip--;
+					continue;
+				}
 				if(-1 == netConSend(w->con, buf))
 				{
 					break;
 				}
 			}
 		}
-	}
 
-	while (1)
-	{
-		NetBuffer_t * buf = NULL;
-		LIST_POP_FRONT(buf, &app->qSend, link);
+		//The rest wait for the last part
+		if(pkt->partial)
+		{
+			pthread_mutex_unlock(&app->lock);
+			return;
+		}
 
-		//If NULL then there are no more packet left in queue
-		if(NULL == buf)
+		EncoderPacket_t au = *pkt;
+		if(pkt->part > 0)
 		{
-			break;
-		}	
+			au.data = (app->auData != NULL) ? (uint8_t *)app->auData : app->auBuf;
+			au.len = (int)app->auLen;
+		}
 
-		listInsertBack(&app->qFree, &buf->link);
+		int wsTs = 0, wsRaw = 0, wsFmp4 = 0;
+		SockConWrapper_t *ws = NULL;
+		LIST_FOR_EACH(ws, &app->lSocks, link)
+		{
+			wsTs += ws->channel == CAP_WS_CHANNEL_TS;
+			wsRaw += ws->channel == CAP_WS_CHANNEL_RAW || ws->channel == CAP_WS_CHANNEL_RAW_WAIT;
+			wsFmp4 += ws->channel == CAP_WS_CHANNEL_FMP4 || ws->channel == CAP_WS_CHANNEL_FMP4_WAIT;
+		}
+
+		if(wsRaw > 0)
+		{
+			capRawAccessUnit(app, &au);
+		}
+		if(wsFmp4 > 0 && app->fmp4 != NULL)
+		{
+			app->fmp4Key = au.keyFrame;
+			retVal = fmp4_writer_write(app->fmp4, flags, pts, pts, au.data, au.len);
+			if(retVal != 0)
+			{
+				printf("failed to mux buffer (%d bytes) into fmp4. error : %d\n", au.len, retVal);
+			}
+		}
+		pthread_mutex_unlock(&app->lock);
+
+		//Browser players, the HLS segmenter and the UDP sinks take whole access units
+		size_t auLen = (wsTs > 0 || app->hls != NULL || app->udp != NULL || app->rudp != NULL) ?
+			capGatherAccessUnit(app) : 0;
+		if(wsTs > 0 && auLen > 0)
+		{
+			websockBroadcast(app->sockServer, CAP_WS_CHANNEL_TS, app->wsBuf, (int)auLen);
+		}
+		if(app->hls != NULL && auLen > 0)
+		{
+			hlsWrite(app->hls, app->wsBuf, auLen);
+		}
+		if(app->udp != NULL && auLen > 0)
+		{
+			udpSend(app->udp, app->wsBuf, auLen, pts);
+		}
+		if(app->rudp != NULL && auLen > 0)
+		{
+			rudpSend(app->rudp, app->wsBuf, auLen);
+		}
 	}
 
+	if(!pkt->partial || app->auBroken)
+	{
+		capFreeSendQueue(app);
+		capReleaseParts(app);
+	}
 }
 
 EncoderInterface_t encInterface = {
@@ -325,225 +483,741 @@ EncoderInterface_t encInterface = {
 };
 
 
-// static void netConHandler_Close(NetCon_t *con, void *udata)
-// {
-// 	App_t *app = udata;
-// 	NetConWrapper_t *w = NULL, *_w = NULL;
-// 	LIST_FOR_EACH_SAFE(w, _w, &app->lConnections, link)
-// 	{
-// 		if(w->con == con)
-// 		{
-// 			listRemove(&w->link);
-// 		}
-// 	}
-// }
-
-// NetConInterface_t netConInterface = {
-// 	.Close = netConHandler_Close,
-// };
-
-// static void netHandler_NewClient(NetCon_t *con, void *udata)
-// {
-// 	App_t *app = udata;
-// 	netConnInit(con, &netConInterface, app);
-// 	NetConWrapper_t *w = calloc(1, sizeof(NetConWrapper_t));
-// 	listInsert(&app->lConnections, &w->link);
-// 	w->con = con;
-// }
-
-// NetInterface_t netInterface = {
-// 	.NewClient = netHandler_NewClient,
-// };
-
-int main()
-{
-	App_t app = {0};
-	int ret = 0;
-
-	//Image Setting
-	app.src.width = IMG_WIDTH;
-	app.src.height = IMG_HEIGHT;
-	app.src.pixfmt = V4L2_PIX_FMT_NV24;
-	app.src.numBufs = DMA_BUFF_COUNT;
-	app.memType = V4L2_MEMORY_MMAP;
-	app.bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	clock_gettime(CLOCK_REALTIME, &app.tsLastTick);
-	app.frameCount = 0;
-
-	listInit(&app.qSend);
-	listInit(&app.qFree);
-	listInit(&app.lConnections);
-
-	// NetConfig_t nConfig = {
-	// 	.port = 6700,
-	// };
-	
-	// app.net = netCreate(&nConfig, &netInterface, &app);
-	// OKAY_RETURN(app.net == NULL, 0, "failed to create network\n");
-
-	Websock_t *sock = websockCreate()
-
-	app.netBuffer = calloc(sizeof(NetBuffer_t), TS_TOTAL_PACKET);
-	OKAY_RETURN(app.netBuffer == NULL, 0, "failed to allocate network buffer\n");
+//Called from netConSend on the encoder thread, app->lock is already held
+static void netConHandler_Close(NetCon_t *con, void *udata)
+{
+	App_t *app = udata;
+	NetConWrapper_t *w = NULL, *_w = NULL;
+	LIST_FOR_EACH_SAFE(w, _w, &app->lConnections, link)
+	{
+		if(w->con == con)
+		{
+			listRemove(&w->link);
+			free(w);
+		}
+	}
+}
+
+NetConInterface_t netConInterface = {
+	.Close = netConHandler_Close,
+};
+
+//An intra refresh stream has no periodic IDR frames, a joining or recovering viewer asks for one
+static void capViewerJoined(App_t *app)
+{
+	if(app->enc != NULL && app->enc->config.refresh > 0)
+	{
+		encoderRequestKeyFrame(app->enc);
+	}
+}
+
+static void netHandler_NewClient(NetCon_t *con, void *udata)
+{
+	App_t *app = udata;
+	NetConWrapper_t *w = calloc(1, sizeof(NetConWrapper_t));
+	OKAY_RETURN(w == NULL, , "failed to allocate connection\n");
+
+	netConnInit(con, &netConInterface, app);
+	w->con = con;
+
+	pthread_mutex_lock(&app->lock);
+	listInsert(&app->lConnections, &w->link);
+	pthread_mutex_unlock(&app->lock);
+	capViewerJoined(app);
+}
+
+NetInterface_t netInterface = {
+	.NewClient = netHandler_NewClient,
+};
+
+static CStatus_t httpHandler_Upgrade(int fd, void *udata)
+{
+	App_t *app = udata;
+	OKAY_RETURN(app->sockServer == NULL, CSTATUS_CONTEXT, "websocket server disabled, upgrade refused\n");
+
+	//The socket is owned by the WebSocket server even if it refuses it
+	websockAdopt(app->sockServer, fd);
+	return CSTATUS_SUCCESS;
+}
+
+//Runs on an HTTP client thread
+static CStatus_t capServeMetrics(App_t *app, int fd, const NetHttpRequest_t *req)
+{
+	EncoderStats_t st;
+	encoderGetStats(app->enc, &st);
+
+	char text[4096];
+	int len = snprintf(text, sizeof(text),
+		"# TYPE capture_frames_total counter\ncapture_frames_total %llu\n"
+		"# TYPE capture_ts_bytes_total counter\ncapture_ts_bytes_total %llu\n"
+		"# TYPE capture_encoder_frames_total counter\n"
+		"capture_encoder_frames_total{type=\"key\"} %llu\n"
+		"capture_encoder_frames_total{type=\"recovery\"} %llu\n"
+		"capture_encoder_frames_total{type=\"other\"} %llu\n"
+		"# TYPE capture_encoder_bytes_total counter\ncapture_encoder_bytes_total %llu\n"
+		"# TYPE capture_encoder_frame_bytes gauge\n"
+		"capture_encoder_frame_bytes{stat=\"last\"} %d\n"
+		"capture_encoder_frame_bytes{stat=\"avg\"} %d\n"
+		"capture_encoder_frame_bytes{stat=\"max\"} %d\n"
+		"capture_encoder_frame_bytes{stat=\"avg_key\"} %d\n"
+		"# TYPE capture_encoder_latency_seconds gauge\n"
+		"capture_encoder_latency_seconds{stat=\"last\"} %.6f\n"
+		"capture_encoder_latency_seconds{stat=\"avg\"} %.6f\n"
+		"capture_encoder_latency_seconds{stat=\"max\"} %.6f\n"
+		"# TYPE capture_encoder_bitrate_bps gauge\n"
+		"capture_encoder_bitrate_bps{stat=\"target\"} %d\n"
+		"capture_encoder_bitrate_bps{stat=\"output\"} %d\n"
+		"# TYPE capture_encoder_fps gauge\ncapture_encoder_fps %d\n"
+		"# TYPE capture_encoder_rc_fullness_ratio gauge\ncapture_encoder_rc_fullness_ratio %.2f\n",
+		(unsigned long long)__atomic_load_n(&app->framesTotal, __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&app->tsBytesTotal, __ATOMIC_RELAXED),
+		(unsigned long long)st.keyFrames, (unsigned long long)st.recoveryPoints,
+		(unsigned long long)(st.frames - st.keyFrames - st.recoveryPoints), (unsigned long long)st.bytes,
+		st.last.bytes, st.avgBytes, st.maxBytes, st.avgKeyBytes,
+		st.last.latencyUs / 1e6, st.avgLatencyUs / 1e6, st.maxLatencyUs / 1e6,
+		st.targetBps, st.outBps, st.targetFps, st.rcFullness / 100.0);
+
+	//Left out while the backend does not report it
+	if(st.avgQp >= 0 && len < (int)sizeof(text))
+	{
+		len += snprintf(text + len, sizeof(text) - len, "# TYPE capture_encoder_qp gauge\n"
+			"capture_encoder_qp{stat=\"last\"} %d\ncapture_encoder_qp{stat=\"avg\"} %.2f\n", st.last.qp, st.avgQp);
+	}
+	len = (len >= (int)sizeof(text)) ? (int)sizeof(text) - 1 : len;
+
+	CStatus_t status = netHttpRespond(fd, 200, "OK", "text/plain; version=0.0.4", len, req->close, NULL);
+	if(status == CSTATUS_SUCCESS && !req->head)
+	{ status = netHttpSend(fd, text, len); }
+	return status;
+}
+
+static CStatus_t httpHandler_Request(int fd, const NetHttpRequest_t *req, void *udata)
+{
+	App_t *app = udata;
+	if(app->enc != NULL && strcmp(req->path, CAP_METRICS_PATH) == 0)
+	{ return capServeMetrics(app, fd, req); }
+	return (app->hls != NULL) ? hlsServe(app->hls, fd, req) : CSTATUS_AGAIN;
+}
+
+NetInterface_t httpInterface = {
+	.NewClient = netHandler_NewClient,
+	.Upgrade = httpHandler_Upgrade,
+	.Request = httpHandler_Request,
+};
+
+static void websockConnHandler_Close(WebsockConn_t *conn, void *udata)
+{
+	App_t *app = udata;
+	pthread_mutex_lock(&app->lock);
+	SockConWrapper_t *w = NULL, *_w = NULL;
+	LIST_FOR_EACH_SAFE(w, _w, &app->lSocks, link)
+	{
+		if(w->conn == conn)
+		{
+			listRemove(&w->link);
+			free(w);
+		}
+	}
+	pthread_mutex_unlock(&app->lock);
+}
+
+static void websockConnHandler_OnData(WebsockConn_t *conn, uint8_t *data, int size, void *udata)
+{
+	UNUSED_PARAMETER(conn);
+	if(size > 0 && data[0] == CAP_RAW_KEY_REQUEST)
+	{
+		capViewerJoined(udata);
+	}
+}
+
+WebsockConnInterface_t websockConnInterface = {
+	.OnData = websockConnHandler_OnData,
+	.Close = websockConnHandler_Close,
+};
+
+static void websockHandler_NewConn(WebsockConn_t *conn, void *udata)
+{
+	App_t *app = udata;
+	SockConWrapper_t *w = calloc(1, sizeof(SockConWrapper_t));
+	OKAY_RETURN(w == NULL, , "failed to allocate websocket connection\n");
+
+	websockConnSetInterface(conn, &websockConnInterface, app);
+	w->conn = conn;
+
+	const char *path = websockConnPath(conn);
+	bool raw = path != NULL && (strcmp(path, CAP_WS_RAW_PATH) == 0 ||
+		strcmp(path, NET_HTTP_WS_PATH CAP_WS_RAW_PATH) == 0);
+	bool fmp4 = path != NULL && (strcmp(path, CAP_WS_FMP4_PATH) == 0 ||
+		strcmp(path, NET_HTTP_WS_PATH CAP_WS_FMP4_PATH) == 0);
+
+	pthread_mutex_lock(&app->lock);
+	if(raw)
+	{
+		//Decoder config right away, frames follow from the next key frame
+		if(app->paramSetsLen > 0)
+		{ capSendParamSets(app, w); }
+		w->channel = CAP_WS_CHANNEL_RAW_WAIT;
+	}
+	else if(fmp4 && app->fmp4 != NULL)
+	{
+		//Init segment and fragments from the next key frame
+		w->channel = CAP_WS_CHANNEL_FMP4_WAIT;
+	}
+	else
+	{
+		w->channel = CAP_WS_CHANNEL_TS;
+	}
+	websockConnSetChannel(conn, w->channel);
+	listInsert(&app->lSocks, &w->link);
+	pthread_mutex_unlock(&app->lock);
+	capViewerJoined(app);
+}
+
+WebsockInterface_t websockInterface = {
+	.NewConn = websockHandler_NewConn,
+};
+
+static void capControlGet(App_t *app, int fd)
+{
+	Encoder_t *enc = app->enc;
+	controlReply(fd, "encoder %s %s %dx%d\n", enc->ops->name,
+		enc->config.codec == ENCODER_CODEC_H265 ? "h265" : "h264", enc->config.width, enc->config.height);
+	controlReply(fd, "bitrate %d\nfps %d\ngop %d\nrc %s\nqpmin %d\nqpmax %d\nprofile %d\nlevel %d\n",
+		enc->bps / 1000, enc->fps, enc->config.gop, encoderRcModeToString(enc->config.rcMode),
+		enc->config.qpMin, enc->config.qpMax, enc->config.profile, enc->config.level);
+	if(enc->config.codec == ENCODER_CODEC_H265)
+	{ controlReply(fd, "tier %s\nctu %d\n", enc->config.tier ? "high" : "main", enc->config.ctu); }
+}
+
+static void capControlStats(App_t *app, int fd)
+{
+	EncoderStats_t st;
+	encoderGetStats(app->enc, &st);
+	controlReply(fd, "frames %llu\nkeyframes %llu\nrecovery %llu\nbytes %llu\n", (unsigned long long)st.frames,
+		(unsigned long long)st.keyFrames, (unsigned long long)st.recoveryPoints, (unsigned long long)st.bytes);
+	controlReply(fd, "last %s %d bytes qp %d %.1f ms\n", st.last.keyFrame ? "key" : "inter", st.last.bytes,
+		st.last.qp, st.last.latencyUs / 1000.0);
+	controlReply(fd, "window %d\nsize avg %d max %d key %d\nlatency avg %.1f max %.1f ms\nqp avg %.1f\n",
+		st.window, st.avgBytes, st.maxBytes, st.avgKeyBytes, st.avgLatencyUs / 1000.0, st.maxLatencyUs / 1000.0, st.avgQp);
+	controlReply(fd, "bitrate %d of %d kbps\nfps %d\nrc fullness %d%%\n", st.outBps / 1000, st.targetBps / 1000,
+		st.targetFps, st.rcFullness);
+}
+
+static CStatus_t capControlUpdate(App_t *app, EncoderConfig_t *update, uint32_t fields)
+{
+	//Set by hand, the closed loop starts over from there within its bounds
+	if(app->rateCtl != NULL && (fields & (ENCODER_CFG_BITRATE | ENCODER_CFG_FPS)))
+	{
+		int bps = (fields & ENCODER_CFG_BITRATE) ? update->birate : app->enc->bps;
+		int fps = (fields & ENCODER_CFG_FPS) ? update->fps : app->enc->fps;
+		update->birate = rateCtlReset(app->rateCtl, bps, fps);
+		fields |= ENCODER_CFG_BITRATE;
+	}
+	return encoderUpdateConfig(app->enc, update, fields);
+}
+
+//ControlInterface_t.Command, runs on the capture loop like encoderPutFrame
+static CStatus_t capControlCommand(int fd, int argc, char *argv[], void *udata)
+{
+	App_t *app = udata;
+	EncoderConfig_t update;
+	uint32_t fields = 0;
+	memset(&update, 0, sizeof(update));
+
+	if(strcmp(argv[0], "get") == 0)
+	{
+		capControlGet(app, fd);
+		return CSTATUS_SUCCESS;
+	}
+
+	if(strcmp(argv[0], "stats") == 0)
+	{
+		capControlStats(app, fd);
+		return CSTATUS_SUCCESS;
+	}
+
+	if(strcmp(argv[0], "set") == 0 && argc > 1)
+	{
+		//Unset keys keep their value, qpmin alone keeps qpmax
+		update = app->enc->config;
+		for(int i = 1; i < argc; i++)
+		{
+			CStatus_t status = encoderParseSetting(&update, &fields, argv[i]);
+			OKAY_RETURN(status != CSTATUS_SUCCESS, status, "bad control command\n");
+		}
+		return capControlUpdate(app, &update, fields);
+	}
+
+	if(strcmp(argv[0], "preset") == 0 && argc == 2)
+	{
+		for(size_t i = 0; i < sizeof(capPresets) / sizeof(capPresets[0]); i++)
+		{
+			const CapPreset_t *p = &capPresets[i];
+			if(strcmp(p->name, argv[1]) != 0)
+			{ continue; }
+
+			update.rcMode = p->rcMode;
+			update.gop = p->gopMs * app->enc->config.fps / 1000;
+			update.qpMin = p->qpMin;
+			update.qpMax = p->qpMax;
+			return capControlUpdate(app, &update, ENCODER_CFG_RC_MODE | ENCODER_CFG_GOP | ENCODER_CFG_QP);
+		}
+		OKAY_RETURN(true, CSTATUS_BAD_PARAM, "unknown preset %s\n", argv[1]);
+	}
+
+	controlReply(fd, "get\n"
+		"stats\n"
+		"set [bitrate=<kbps>] [fps=<n>] [gop=<frames>] [rc=vbr|cbr|avbr|fixqp] [qpmin=<qp>] [qpmax=<qp>]\n"
+		"    [profile=<name|idc>] [level=<x.y|idc>] [tier=main|high] [ctu=<size>]\n"
+		"preset lowlatency|quality\n");
+	return (strcmp(argv[0], "help") == 0) ? CSTATUS_SUCCESS : CSTATUS_BAD_PARAM;
+}
+
+static ControlInterface_t controlInterface = {
+	.Command = capControlCommand,
+};
+
+CStatus_t capAppInit(App_t *app, CaptureConfig_t *config)
+{
+	memcpy(&app->config, config, sizeof(CaptureConfig_t));
+	clock_gettime(CLOCK_REALTIME, &app->tsLastTick);
+	app->frameCount = 0;
+
+	listInit(&app->qSend);
+	listInit(&app->qFree);
+	listInit(&app->lConnections);
+	listInit(&app->lSocks);
+	pthread_mutex_init(&app->lock, NULL);
+
+	//Open and Configure
+	app->source = sourceCreate(&app->config.source);
+	OKAY_RETURN(app->source == NULL, CSTATUS_FAIL, "failed to open and configure capture source\n");
+
+	if(app->config.tcpPort != 0)
+	{
+		NetConfig_t nConfig = {
+			.port = app->config.tcpPort,
+			.pacing = app->config.pacing,
+		};
+
+		app->net = netCreate(&nConfig, &netInterface, app);
+		OKAY_RETURN(app->net == NULL, CSTATUS_FAIL, "failed to create network\n");
+	}
+
+	if(app->config.wsPort != 0)
+	{
+		WebsockConfig_t wsConfig = {
+			.port = app->config.wsPort,
+		};
+
+		app->sockServer = websockCreate(&wsConfig, &websockInterface, app);
+		OKAY_RETURN(app->sockServer == NULL, CSTATUS_FAIL, "failed to create websocket server\n");
+	}
+
+	if(app->config.udp.dest != NULL)
+	{
+		app->config.udp.pacing = app->config.pacing;
+		app->udp = udpCreate(&app->config.udp);
+		OKAY_RETURN(app->udp == NULL, CSTATUS_FAIL, "failed to create udp sink\n");
+	}
+
+	if(app->config.rudp.port != 0)
+	{
+		app->config.rudp.pacing = app->config.pacing;
+		app->rudp = rudpCreate(&app->config.rudp);
+		OKAY_RETURN(app->rudp == NULL, CSTATUS_FAIL, "failed to create rudp sink\n");
+	}
+
+	//Before the http server that serves it
+	if(app->config.httpPort != 0 && app->config.hlsSegmentMs > 0)
+	{
+		HlsConfig_t hlsConfig = {
+			.segmentMs = app->config.hlsSegmentMs,
+			.segments = CAP_HLS_SEGMENTS,
+			.partMs = app->config.hlsPartMs,
+		};
+
+		app->hls = hlsCreate(&hlsConfig);
+		OKAY_RETURN(app->hls == NULL, CSTATUS_FAIL, "failed to create hls segmenter\n");
+	}
+
+	//After the WebSocket server, upgrades are handed over to it
+	if(app->config.httpPort != 0)
+	{
+		NetConfig_t hConfig = {
+			.port = app->config.httpPort,
+			.http = true,
+			.docRoot = app->config.docRoot,
+			.pacing = app->config.pacing,
+		};
+
+		app->http = netCreate(&hConfig, &httpInterface, app);
+		OKAY_RETURN(app->http == NULL, CSTATUS_FAIL, "failed to create http server\n");
+	}
+
+	app->netBuffer = calloc(sizeof(NetBuffer_t), TS_TOTAL_PACKET);
+	OKAY_RETURN(app->netBuffer == NULL, CSTATUS_MEMORY, "failed to allocate network buffer\n");
 	for(int i =0; i < TS_TOTAL_PACKET; i++)
 	{
-		NetBuffer_t *buf = (NetBuffer_t *)((uint8_t *)app.netBuffer + (i * sizeof(NetBuffer_t)));
+		NetBuffer_t *buf = (NetBuffer_t *)((uint8_t *)app->netBuffer + (i * sizeof(NetBuffer_t)));
 		buf->size = 0;
 		buf->capacity = TS_PACKET_SIZE;
-		listInsert(&app.qFree, &buf->link);
+		listInsert(&app->qFree, &buf->link);
 	}
 
 	//Setup TS Mxer
-	app.ts = mpeg_ts_create(&mpegHandler, &app);
-    if(app.ts == NULL)
-    {
-        printf("failed to create TS packetizer\n");
-		free(app.netBuffer);
-        return 0;
-    }
+	app->ts = mpeg_ts_create(&mpegHandler, app);
+	OKAY_RETURN(app->ts == NULL, CSTATUS_FAIL, "failed to create TS packetizer\n");
 
-    if((app.tsStreamId = mpeg_ts_add_stream(app.ts, PSI_STREAM_H264, NULL, 0)) <= 0)
-    {
-        printf("failed to add ts stream at packetizer\n");
-        return 0;
-    }
+	EncoderConfig_t *encConfig = &app->config.encoder;
+	encConfig->width = app->source->fmt.width;
+	encConfig->height = app->source->fmt.height;
+	encConfig->horStride = app->source->fmt.width;
+	encConfig->verStride = app->source->fmt.height;
+	encConfig->pixfmt = app->source->fmt.pixfmt;
 
-	EncoderConfig_t encConfig = {
-		.birate = 1000000,
-		.fps = 60,
-		.gop = 60,
-		.width = app.src.width,
-		.height = app.src.height,
-		.horStride = app.src.width,
-		.verStride = app.src.height,
-	};
+	app->enc = encoderCreate(encConfig, &encInterface, app);
+	OKAY_RETURN(app->enc == NULL, CSTATUS_FAIL, "failed to create encoder device\n");
 
-	app.enc = encoderCreate(&encConfig, &encInterface, &app);
-	OKAY_RETURN(app.enc == NULL, 0, "failed to create encoder device\n");
+	if(app->config.rateCtl.minBps > 0)
+	{
+		app->rateCtl = rateCtlCreate(&app->config.rateCtl, encConfig->birate, encConfig->fps);
+		OKAY_RETURN(app->rateCtl == NULL, CSTATUS_FAIL, "failed to create rate control\n");
+
+		//Start inside the bounds
+		int bps = encConfig->birate;
+		int fps = encConfig->fps;
+		bps = (bps < app->config.rateCtl.minBps) ? app->config.rateCtl.minBps : bps;
+		bps = (bps > app->config.rateCtl.maxBps) ? app->config.rateCtl.maxBps : bps;
+		if(bps != encConfig->birate)
+		{
+			OKAY_RETURN(encoderSetBitrate(app->enc, bps, fps) != CSTATUS_SUCCESS, CSTATUS_FAIL,
+				"failed to start the encoder at %d bps\n", bps);
+		}
+	}
 
-	do{
-		CStatus_t status;
+	if(app->config.control.path != NULL)
+	{
+		app->control = controlCreate(&app->config.control, &controlInterface, app);
+		OKAY_RETURN(app->control == NULL, CSTATUS_FAIL, "failed to create control socket\n");
+	}
 
-		//Open and Configure
-		status = capOpenAndConfigure(&app);
-		OKAY_STOP(status != CSTATUS_SUCCESS, "failed to open and configure device.\n");
+	//The mock encoder picks the codec of its recorded stream, frames are not fed yet
+	int codecId = (app->enc->config.codec == ENCODER_CODEC_H265) ? PSI_STREAM_H265 : PSI_STREAM_H264;
+	app->tsStreamId = mpeg_ts_add_stream(app->ts, codecId, NULL, 0);
+	OKAY_RETURN(app->tsStreamId <= 0, CSTATUS_FAIL, "failed to add ts stream at packetizer\n");
 
+	if(app->sockServer != NULL)
+	{
+		app->fmp4 = fmp4_writer_create(&fmp4Handler, app, codecId, encConfig->width, encConfig->height, FMP4_FRAGMENT_FRAME);
+		OKAY_RETURN(app->fmp4 == NULL, CSTATUS_FAIL, "failed to create fmp4 muxer\n");
+	}
+
+	if(app->config.display)
+	{
 		//Create Window
-		status = capCreateViewer(&app);
-		OKAY_STOP(status != CSTATUS_SUCCESS, "failed to create the viewer\n");
-		
-		//Allocate buffers
-		status = capAllocateBuffers(&app, app.src.numBufs);
-		OKAY_STOP(status != CSTATUS_SUCCESS, "failed to allocate buffers\n");
+		CStatus_t status = capCreateViewer(app);
+		OKAY_RETURN(status != CSTATUS_SUCCESS, status, "failed to create the viewer\n");
+	}
+
+	return CSTATUS_SUCCESS;
+}
+
+//Samples every viewer's backlog and lets the controller retarget the encoder
+static void capRateControl(App_t *app)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	int64_t now = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	if(now - app->rcLastMs < RATECTL_PERIOD_MS)
+	{
+		return;
+	}
+	app->rcLastMs = now;
+
+	pthread_mutex_lock(&app->lock);
+	int count = 0;
+	NetConWrapper_t *w = NULL;
+	LIST_FOR_EACH(w, &app->lConnections, link)
+	{
+		count++;
+	}
+	SockConWrapper_t *ws = NULL;
+	LIST_FOR_EACH(ws, &app->lSocks, link)
+	{
+		count++;
+	}
 
-		//Start Capture Thread
-		for(int i = 0; i < app.src.numBufs; i++)
+	if(count > app->rcSamplesCap)
+	{
+		RateCtlSample_t *samples = realloc(app->rcSamples, count * sizeof(RateCtlSample_t));
+		if(samples == NULL)
 		{
-			status = capQueueByIndex(&app, i);
-			OKAY_STOP(status != CSTATUS_SUCCESS, "failed to queue buffer %d\n", i);
+			pthread_mutex_unlock(&app->lock);
+			fprintf(stderr, "failed to allocate %d rate control samples\n", count);
+			return;
 		}
+		app->rcSamples = samples;
+		app->rcSamplesCap = count;
+	}
 
-		OKAY_STOP(status != CSTATUS_SUCCESS, "failed to queue all buffers\n");
+	int n = 0;
+	LIST_FOR_EACH(w, &app->lConnections, link)
+	{
+		rateCtlSampleSocket(&app->rcSamples[n++], w->con->fd, netConBacklog(w->con));
+	}
+	LIST_FOR_EACH(ws, &app->lSocks, link)
+	{
+		size_t queued = 0;
+		websockConnGetBacklog(ws->conn, &queued, NULL);
+		rateCtlSampleSocket(&app->rcSamples[n++], websockConnGetFd(ws->conn), queued);
+	}
+	pthread_mutex_unlock(&app->lock);
 
-		//Start the stream
-		capStreamStart(&app);
+	int bps, fps;
+	if(rateCtlUpdate(app->rateCtl, app->rcSamples, n, &bps, &fps))
+	{
+		encoderSetBitrate(app->enc, bps, fps);
+	}
+}
 
-		int fd_flags = fcntl(app.v4l2fd, F_GETFL);
-		fcntl(app.v4l2fd, F_SETFL, fd_flags | O_NONBLOCK);
-		bool quit = false;
-		while (!quit)
+CStatus_t capAppRun(App_t *app)
+{
+	CStatus_t status;
+
+	//Queue all buffers and start the stream
+	status = sourceStart(app->source);
+	OKAY_RETURN(status != CSTATUS_SUCCESS, status, "failed to start the capture source\n");
+
+	int srcFd = sourceGetFd(app->source);
+	int netFd = (app->net != NULL) ? netGetFd(app->net) : -1;
+	int httpFd = (app->http != NULL) ? netGetFd(app->http) : -1;
+	int ctlFd = (app->control != NULL) ? controlGetFd(app->control) : -1;
+	int maxFd = srcFd;
+	if(netFd > maxFd)
+	{ maxFd = netFd; }
+	if(httpFd > maxFd)
+	{ maxFd = httpFd; }
+	if(ctlFd > maxFd)
+	{ maxFd = ctlFd; }
+
+	while (!app->quit)
+	{
+		fd_set read_fds[2];
+		fd_set exception_fds;
+		struct timeval tv = { 0, 200000 };
+
+		FD_ZERO(&exception_fds);
+		FD_SET(srcFd, &exception_fds);
+		FD_ZERO(read_fds);
+		FD_SET(srcFd, read_fds);
+		if(netFd >= 0)
 		{
-			fd_set read_fds[2];
-			fd_set exception_fds;
-			struct timeval tv = { 2, 0 };
-			int r;
-
-			FD_ZERO(&exception_fds);
-			FD_SET(app.v4l2fd, &exception_fds);
-			FD_ZERO(read_fds);
-			FD_SET(app.v4l2fd, read_fds);
-			int netFd = netGetFd(app.net);
 			FD_SET(netFd, read_fds);
-			r = select(((app.v4l2fd > netFd)?app.v4l2fd:netFd) + 1, read_fds, NULL, &exception_fds, &tv);
-			
-			if (FD_ISSET(app.v4l2fd, &exception_fds))
-			{
-				printf("Exception is set\n");
-				break;
-			}
+		}
+		if(httpFd >= 0)
+		{
+			FD_SET(httpFd, read_fds);
+		}
+		if(ctlFd >= 0)
+		{
+			FD_SET(ctlFd, read_fds);
+		}
+
+		int r = select(maxFd + 1, read_fds, NULL, &exception_fds, &tv);
+		if(app->rateCtl != NULL)
+		{
+			capRateControl(app);
+		}
+		if(r <= 0)
+		{
+			continue;
+		}
 
-			if (FD_ISSET(app.v4l2fd, read_fds))
+		if (FD_ISSET(srcFd, &exception_fds))
+		{
+			printf("Exception is set\n");
+			break;
+		}
+
+		if (FD_ISSET(srcFd, read_fds))
+		{
+			Buffer_t *buf1 = NULL;
+			status = sourceDequeue(app->source, &buf1);
+			if(CSTATUS_AGAIN == status)
+			{ continue; }
+			else if(CSTATUS_SUCCESS == status)
 			{
-				Buffer_t *buf1 = NULL;
-				status = capDequeue(&app, &buf1);
-				if(CSTATUS_AGAIN == status)
-				{ continue; }
-				else if(CSTATUS_SUCCESS == status)
-				{
 
-					//TODO: Check return of Update Texture
-					//capDrawFrameFromBufferIndex(&app, buf1->index);
-					app.frameCount++;
+				//TODO: Check return of Update Texture
+				//capDrawFrameFromBufferIndex(app, buf1->index);
+				app->frameCount++;
+				__atomic_add_fetch(&app->framesTotal, 1, __ATOMIC_RELAXED);
 
-					struct timespec now;
-					double start_sec, end_sec, elapsed_sec;
-					clock_gettime(CLOCK_REALTIME, &now);
+				struct timespec now;
+				double start_sec, end_sec, elapsed_sec;
+				clock_gettime(CLOCK_REALTIME, &now);
 
-					end_sec = now.tv_sec + now.tv_nsec / NANO_PER_SEC;
-					start_sec = app.tsLastTick.tv_sec + app.tsLastTick.tv_nsec / NANO_PER_SEC;
-					elapsed_sec = end_sec - start_sec;
+				end_sec = now.tv_sec + now.tv_nsec / NANO_PER_SEC;
+				start_sec = app->tsLastTick.tv_sec + app->tsLastTick.tv_nsec / NANO_PER_SEC;
+				elapsed_sec = end_sec - start_sec;
 
-					if(elapsed_sec >= 1)
+				if(elapsed_sec >= 1)
+				{
+					app->tsLastTick = now;
+					if(app->config.verbose)
 					{
-						app.tsLastTick = now;
-						printf("Frames/Sec : %d\n", app.frameCount);
-						app.frameCount = 0;;
+						printf("Frames/Sec : %d\n", app->frameCount);
 					}
-					encoderPutFrame(app.enc, buf1);
-					status = capQueueByIndex(&app, buf1->index);
-					OKAY_STOP(status != CSTATUS_SUCCESS, "failed to enqueue : %d\n", buf1->index);
-				}
-				else
-				{
-					printf("Dequeue Failed\n");
+					app->frameCount = 0;
 				}
+				encoderPutFrame(app->enc, buf1);
+				status = sourceQueueByIndex(app->source, buf1->index);
+				OKAY_STOP(status != CSTATUS_SUCCESS, "failed to enqueue : %d\n", buf1->index);
 			}
-			else if (FD_ISSET(netFd, read_fds))
+			else
 			{
-				netDispatch(app.net);
+				printf("Dequeue Failed\n");
 			}
 		}
-		capStreamStop(&app);
 
-	}while(0);
+		if (netFd >= 0 && FD_ISSET(netFd, read_fds))
+		{
+			netDispatch(app->net);
+		}
+
+		if (httpFd >= 0 && FD_ISSET(httpFd, read_fds))
+		{
+			netDispatch(app->http);
+		}
+
+		if (ctlFd >= 0 && FD_ISSET(ctlFd, read_fds))
+		{
+			controlDispatch(app->control);
+		}
+	}
+
+	sourceStop(app->source);
+	return CSTATUS_SUCCESS;
+}
+
+void capAppStop(App_t *app)
+{
+	app->quit = true;
+}
+
+void capAppDeinit(App_t *app)
+{
+	//Stop the encoder first, it is the only one feeding the connections
+	if(app->enc != NULL)
+	{
+		encoderDestroy(app->enc);
+		app->enc = NULL;
+	}
+
+	if(app->rateCtl != NULL)
+	{
+		rateCtlDestroy(app->rateCtl);
+		app->rateCtl = NULL;
+	}
+	free(app->rcSamples);
+	app->rcSamples = NULL;
 
-	//TODO: Cleanup code
-	if(app.v4l2fd >= 0)
+	if(app->control != NULL)
 	{
-		close(app.v4l2fd);
+		controlDestroy(app->control);
+		app->control = NULL;
 	}
 
-	if(app.enc != NULL)
+	if(app->source != NULL)
 	{
-		encoderDestroy(app.enc);
+		sourceDestroy(app->source);
+		app->source = NULL;
 	}
 
-	if(app.net != NULL)
+	if(app->net != NULL || app->http != NULL)
 	{
 		NetConWrapper_t *w = NULL, *_w = NULL;
-		LIST_FOR_EACH_SAFE(w, _w, &app.lConnections, link)
+		LIST_FOR_EACH_SAFE(w, _w, &app->lConnections, link)
 		{
 			listRemove(&w->link);
 			netConClose(w->con);
 			free(w);
 		}
-		netDestroy(app.net);
 	}
 
-	if(app.netBuffer != NULL)
+	if(app->net != NULL)
 	{
-		free(app.netBuffer);
+		netDestroy(app->net);
+		app->net = NULL;
 	}
 
-	return 0;
+	if(app->http != NULL)
+	{
+		netDestroy(app->http);
+		app->http = NULL;
+	}
+
+	//Waits for the http threads blocked on a playlist or part
+	if(app->hls != NULL)
+	{
+		hlsDestroy(app->hls);
+		app->hls = NULL;
+	}
+
+	if(app->udp != NULL)
+	{
+		udpDestroy(app->udp);
+		app->udp = NULL;
+	}
+
+	if(app->rudp != NULL)
+	{
+		rudpDestroy(app->rudp);
+		app->rudp = NULL;
+	}
+
+	if(app->sockServer != NULL)
+	{
+		websockDestroy(app->sockServer);
+		app->sockServer = NULL;
+
+		SockConWrapper_t *w = NULL, *_w = NULL;
+		LIST_FOR_EACH_SAFE(w, _w, &app->lSocks, link)
+		{
+			listRemove(&w->link);
+			free(w);
+		}
+
+		if(app->fmp4 != NULL)
+		{
+			fmp4_writer_destroy(app->fmp4);
+			app->fmp4 = NULL;
+		}
+
+		free(app->paramSets);
+		app->paramSets = NULL;
+		app->paramSetsLen = 0;
+	}
+
+	//Shared by the WebSocket, HLS and UDP sinks
+	free(app->wsBuf);
+	app->wsBuf = NULL;
+	free(app->auBuf);
+	app->auBuf = NULL;
+	app->wsBufCap = 0;
+
+	if(app->ts != NULL)
+	{
+		mpeg_ts_destroy(app->ts);
+		app->ts = NULL;
+	}
+
+	if(app->netBuffer != NULL)
+	{
+		free(app->netBuffer);
+		app->netBuffer = NULL;
+	}
+
+	pthread_mutex_destroy(&app->lock);
 }
@@ -0,0 +1,185 @@
+#define _GNU_SOURCE
+#include "control.h"
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+struct Control
+{
+    int                 fd;
+    ControlConfig_t     config;
+    ControlInterface_t  *itf;
+    void                *udata;
+};
+
+
+static int64_t controlNowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+Control_t *controlCreate(ControlConfig_t *config, ControlInterface_t *itf, void *udata)
+{
+    Control_t *ctl = calloc(1, sizeof(Control_t));
+    OKAY_RETURN(ctl == NULL, NULL, "failed to allocate control socket\n");
+    memcpy(&ctl->config, config, sizeof(ControlConfig_t));
+    ctl->itf = itf;
+    ctl->udata = udata;
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    do
+    {
+        ctl->fd = -1;
+        OKAY_STOP(strlen(config->path) >= sizeof(addr.sun_path), "control socket path %s is too long\n", config->path);
+        strcpy(addr.sun_path, config->path);
+
+        ctl->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        OKAY_STOP(ctl->fd < 0, "failed to create control socket : %s\n", ERRSTR);
+
+        //Left behind by a previous run that did not exit cleanly
+        unlink(config->path);
+        int ret = bind(ctl->fd, (struct sockaddr *)&addr, sizeof(addr));
+        OKAY_STOP(ret != 0, "failed to bind control socket %s : %s\n", config->path, ERRSTR);
+
+        //Owner only, it reconfigures the encoder. Nobody can connect before listen
+        ret = chmod(config->path, 0600);
+        OKAY_STOP(ret != 0, "failed to restrict control socket %s : %s\n", config->path, ERRSTR);
+
+        ret = listen(ctl->fd, 4);
+        OKAY_STOP(ret != 0, "failed to listen on control socket %s : %s\n", config->path, ERRSTR);
+
+        printf("control socket : %s\n", config->path);
+        return ctl;
+
+    } while (false);
+
+    if(ctl->fd >= 0)
+    { close(ctl->fd); }
+
+    free(ctl);
+    return NULL;
+}
+
+void controlDestroy(Control_t *ctl)
+{
+    if(ctl->fd >= 0)
+    {
+        close(ctl->fd);
+        unlink(ctl->config.path);
+    }
+    free(ctl);
+}
+
+int controlGetFd(Control_t *ctl)
+{
+    return ctl->fd;
+}
+
+void controlReply(int fd, const char *fmt, ...)
+{
+    char buf[CONTROL_MAX_LINE * 2];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    len = (len >= (int)sizeof(buf)) ? (int)sizeof(buf) - 1 : len;
+    if(len > 0 && send(fd, buf, len, MSG_NOSIGNAL) != len)
+    {
+        printf("control reply cut short : %s\n", ERRSTR);
+    }
+}
+
+static void controlExecute(Control_t *ctl, int fd, char *line)
+{
+    char *argv[CONTROL_MAX_ARGS];
+    int argc = 0;
+    char *save = NULL;
+
+    for(char *arg = strtok_r(line, " \t\r", &save); arg != NULL; arg = strtok_r(NULL, " \t\r", &save))
+    {
+        if(argc == CONTROL_MAX_ARGS)
+        {
+            controlReply(fd, "error: more than %d arguments\n", CONTROL_MAX_ARGS);
+            return;
+        }
+        argv[argc++] = arg;
+    }
+
+    if(argc == 0)
+    { return; }
+
+    CStatus_t status = ctl->itf->Command(fd, argc, argv, ctl->udata);
+    if(status == CSTATUS_SUCCESS)
+    { controlReply(fd, "ok\n"); }
+    else
+    { controlReply(fd, "error: %s\n", CStatus_string(status)); }
+}
+
+void controlDispatch(Control_t *ctl)
+{
+    int fd = accept4(ctl->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK)
+        { printf("failed to accept control client : %s\n", ERRSTR); }
+        return;
+    }
+
+    //Runs on the capture loop, a client gets CONTROL_TIMEOUT_MS of it in all however
+    //it trickles. Replies do not block either, a client that does not read loses them
+    int64_t deadline = controlNowMs() + CONTROL_TIMEOUT_MS;
+    char buf[CONTROL_MAX_LINE];
+    size_t len = 0;
+    while (true)
+    {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int64_t left = deadline - controlNowMs();
+        if(left <= 0 || poll(&pfd, 1, (int)left) <= 0)
+        {
+            controlReply(fd, "error: commands not finished within %d ms\n", CONTROL_TIMEOUT_MS);
+            len = 0;
+            break;
+        }
+
+        ssize_t n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+        if(n < 0 && (errno == EAGAIN || errno == EINTR))
+        { continue; }
+        if(n <= 0)
+        { break; }
+        len += n;
+        buf[len] = '\0';
+
+        //Run every complete line, keep the rest for the next read
+        char *line = buf, *nl;
+        while ((nl = strchr(line, '\n')) != NULL)
+        {
+            *nl = '\0';
+            controlExecute(ctl, fd, line);
+            line = nl + 1;
+        }
+        len -= line - buf;
+        memmove(buf, line, len);
+
+        if(len == sizeof(buf) - 1)
+        {
+            controlReply(fd, "error: line longer than %d bytes\n", CONTROL_MAX_LINE - 1);
+            len = 0;
+            break;
+        }
+    }
+
+    //A last command without a newline
+    if(len > 0)
+    {
+        buf[len] = '\0';
+        controlExecute(ctl, fd, buf);
+    }
+    close(fd);
+}
@@ -1,218 +1,274 @@
+#define _GNU_SOURCE
 #include "encoder.h"
 #include "encoder_priv.h"
 #include "common.h"
+#include "mpeg-ts.h"
 #include <time.h>
 #include <errno.h>
-#include <rockchip/rk_mpi.h>
 
 
+int64_t encoderTimeUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//Fixed bits, ue(v) and se(v) into a short RBSP, MSB first
+static void encoderPutBits(uint64_t *acc, int *bits, uint32_t value, int n)
+{
+    *acc = (*acc << n) | value;
+    *bits += n;
+}
+
+static void encoderPutUe(uint64_t *acc, int *bits, uint32_t value)
+{
+    int n = 32 - __builtin_clz(value + 1);
+    encoderPutBits(acc, bits, 0, n - 1);
+    encoderPutBits(acc, bits, value + 1, n);
+}
+
+//Recovery point SEI NAL unit, a decoder that starts at it is exact again frames later
+static size_t encoderRecoverySei(uint8_t *dst, bool h265, int frames)
+{
+    uint64_t acc = 0;
+    int bits = 0;
+    if(h265)
+    {
+        //recovery_poc_cnt, exact_match_flag, broken_link_flag
+        encoderPutUe(&acc, &bits, frames > 0 ? 2 * frames - 1 : 0);
+        encoderPutBits(&acc, &bits, 0, 2);
+    }
+    else
+    {
+        //recovery_frame_cnt, exact_match_flag, broken_link_flag, changing_slice_group_idc
+        encoderPutUe(&acc, &bits, frames);
+        encoderPutBits(&acc, &bits, 0, 4);
+    }
+    if(bits % 8)
+    {
+        //Payload byte alignment, a one then zeros
+        encoderPutBits(&acc, &bits, 1, 1);
+        encoderPutBits(&acc, &bits, 0, (8 - bits % 8) % 8);
+    }
+
+    uint8_t rbsp[16];
+    int len = 0;
+    rbsp[len++] = 6;            //payloadType recovery point
+    rbsp[len++] = bits / 8;     //payloadSize
+    for(int i = bits - 8; i >= 0; i -= 8)
+    { rbsp[len++] = (uint8_t)(acc >> i); }
+    rbsp[len++] = 0x80;         //rbsp_trailing_bits
+
+    size_t n = 0;
+    dst[n++] = 0; dst[n++] = 0; dst[n++] = 0; dst[n++] = 1;
+    if(h265)
+    {
+        dst[n++] = 39 << 1;     //PREFIX_SEI_NUT
+        dst[n++] = 1;
+    }
+    else
+    {
+        dst[n++] = 6;           //SEI
+    }
+    for(int i = 0, zeros = 0; i < len; i++)
+    {
+        if(zeros == 2 && rbsp[i] <= 3)
+        {
+            dst[n++] = 3;       //emulation_prevention_three_byte
+            zeros = 0;
+        }
+        zeros = (rbsp[i] == 0) ? zeros + 1 : 0;
+        dst[n++] = rbsp[i];
+    }
+    return n;
+}
+
+//Parameter sets ahead of the first slice of a key frame
+static void encoderKeepParamSets(Encoder_t *enc, const uint8_t *data, size_t len)
+{
+    bool h265 = enc->config.codec == ENCODER_CODEC_H265;
+    size_t leading, end = 0;
+    int pos = mpeg_h264_find_nalu(data, len, &leading);
+    while(pos >= 0)
+    {
+        int type = h265 ? (data[pos] >> 1) & 0x3f : data[pos] & 0x1f;
+        if(h265 ? type < 32 : (type >= 1 && type <= 5))
+        {
+            end = pos - leading;
+            break;
+        }
+        int next = mpeg_h264_find_nalu(data + pos, len - pos, &leading);
+        pos = (next < 0) ? -1 : pos + next;
+    }
+
+    //Everything ahead of the first slice, the parameter sets and any SEI of the encoder
+    if(end == 0)
+    { return; }
+    uint8_t *sets = realloc(enc->paramSets, end);
+    OKAY_RETURN(sets == NULL, , "failed to keep %zu bytes of parameter sets\n", end);
+    memcpy(sets, data, end);
+    enc->paramSets = sets;
+    enc->paramSetsLen = end;
+}
+
+//Every refresh frames after a key frame a recovery point, led by the parameter sets so it decodes on its own
+static void encoderIntraRefresh(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    if(pkt->keyFrame)
+    {
+        encoderKeepParamSets(enc, pkt->data, pkt->len);
+        enc->refreshFrames = 0;
+        return;
+    }
+    if(++enc->refreshFrames % enc->config.refresh != 0 || enc->paramSetsLen == 0)
+    { return; }
+
+    size_t len = enc->paramSetsLen + 32 + pkt->len;
+    if(len > enc->recoveryCap)
+    {
+        uint8_t *buf = realloc(enc->recoveryBuf, len * 2);
+        OKAY_RETURN(buf == NULL, , "failed to allocate %zu bytes for a recovery point\n", len * 2);
+        enc->recoveryBuf = buf;
+        enc->recoveryCap = len * 2;
+    }
+
+    uint8_t *dst = enc->recoveryBuf;
+    memcpy(dst, enc->paramSets, enc->paramSetsLen);
+    dst += enc->paramSetsLen;
+    dst += encoderRecoverySei(dst, enc->config.codec == ENCODER_CODEC_H265, enc->config.refresh - 1);
+    memcpy(dst, pkt->data, pkt->len);
+    dst += pkt->len;
+
+    pkt->data = enc->recoveryBuf;
+    pkt->len = (int)(dst - enc->recoveryBuf);
+    pkt->recoveryPoint = true;
+}
+
+//Per frame telemetry, on the last part of every access unit
+static void encoderAccount(Encoder_t *enc, const EncoderPacket_t *pkt)
+{
+    enc->statsAuBytes += pkt->len;
+    if(pkt->partial)
+    { return; }
+
+    EncoderFrameStat_t f;
+    f.pts = pkt->pts;
+    f.latencyUs = encoderTimeUs() - pkt->pts;
+    f.bytes = enc->statsAuBytes;
+    f.qp = pkt->qp;
+    f.keyFrame = pkt->keyFrame;
+    enc->statsAuBytes = 0;
+
+    pthread_mutex_lock(&enc->statsLock);
+    EncoderStats_t *s = &enc->stats;
+    s->frames++;
+    s->keyFrames += pkt->keyFrame;
+    s->recoveryPoints += pkt->recoveryPoint;
+    s->bytes += f.bytes;
+    s->last = f;
+    enc->statsRing[enc->statsHead] = f;
+    enc->statsHead = (enc->statsHead + 1) % ENCODER_STATS_WINDOW;
+
+    //Leaky bucket of one second at the target bitrate, drained over the time between frames
+    if(enc->rcLastPts != 0 && f.pts > enc->rcLastPts)
+    { enc->rcLevel -= (double)enc->bps * (f.pts - enc->rcLastPts) / 1e6; }
+    enc->rcLevel = (enc->rcLevel < 0) ? 0 : enc->rcLevel;
+    enc->rcLevel += f.bytes * 8.0;
+    enc->rcLastPts = f.pts;
+    pthread_mutex_unlock(&enc->statsLock);
+}
+
 static void *recvThread(void *args)
 {
     Encoder_t *enc = args;
-    MppPacket packet = NULL;
-    RK_S64 last_pkt_time = 0;
-    RK_S64 first_pkt_time = 0;
-    RK_U32 eoi = 1;
-    MPP_RET ret = MPP_SUCCESS;
+    EncoderPacket_t pkt;
 
+    pthread_setname_np(pthread_self(), "encoder");
     while (enc->isRunning)
     {
-        ret = enc->api->encode_get_packet(enc->ctx, &packet);
-        if (ret || NULL == packet)
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.qp = -1;
+        CStatus_t status = enc->ops->GetPacket(enc, &pkt);
+        if(status != CSTATUS_SUCCESS)
         {
-            printf("Get Package error, %d\n", ret);
-            usleep(1);
             continue;
         }
 
-        last_pkt_time = mpp_time();
-        uint8_t *data = (uint8_t*)mpp_packet_get_pos(packet);
-        size_t len = mpp_packet_get_length(packet);
-        
-        if(first_pkt_time == 0)
+        //The parts of an access unit share its seq
+        pkt.seq = pkt.partial ? enc->seq : enc->seq++;
+        if(pkt.keyFrame && pkt.part == 0 && enc->headersPending)
         {
-            first_pkt_time = mpp_time();
+            pkt.newHeaders = true;
+            enc->headersPending = false;
         }
-
-        RK_U32 pkt_eos = mpp_packet_get_eos(packet);
-        /* for low delay partition encoding */
-        if (mpp_packet_is_partition(packet))
+        if(enc->config.refresh > 0 && pkt.part == 0 && pkt.len > 0)
         {
-            eoi = mpp_packet_is_eoi(packet);
+            encoderIntraRefresh(enc, &pkt);
         }
-
-        if(len > 0)
+        if(pkt.len > 0)
         {
-            enc->itf->NewPacket(data, len, enc->udata);
+            encoderAccount(enc, &pkt);
+            enc->itf->NewPacket(&pkt, enc->udata);
         }
 
-        ret = mpp_packet_deinit(&packet);
-        assert(ret == MPP_SUCCESS);
+        enc->ops->ReleasePacket(enc, &pkt);
     }
+    return NULL;
 }
 
-static CStatus_t encoderSetMppCfg(Encoder_t *enc)
+static CStatus_t encoderCheckConfig(Encoder_t *enc, const EncoderConfig_t *config, uint32_t fields)
 {
-    mpp_enc_cfg_set_s32(enc->cfg, "prep:width",         enc->config.width);
-    mpp_enc_cfg_set_s32(enc->cfg, "prep:height",        enc->config.height);
-    mpp_enc_cfg_set_s32(enc->cfg, "prep:hor_stride",    enc->config.horStride);
-    mpp_enc_cfg_set_s32(enc->cfg, "prep:ver_stride",    enc->config.verStride);
-    mpp_enc_cfg_set_s32(enc->cfg, "prep:format",        enc->frameFormat);
-
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:mode", enc->rcMode);
-
-    /* fix input / output frame rate */
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_in_flex", 0);
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_in_num", enc->config.fps);
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_in_denorm", 1);
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_out_flex", 0);
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_out_num", enc->config.fps);
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:fps_out_denorm", 1);
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:gop", enc->config.gop ? enc->config.gop : enc->config.fps * 2);
-
-    /* drop frame or not when bitrate overflow */
-    mpp_enc_cfg_set_u32(enc->cfg, "rc:drop_mode", MPP_ENC_RC_DROP_FRM_DISABLED);
-    mpp_enc_cfg_set_u32(enc->cfg, "rc:drop_thd", 20); /* 20% of max bps */
-    mpp_enc_cfg_set_u32(enc->cfg, "rc:drop_gap", 1); /* Do not continuous drop frame */
-
-    /* setup bitrate for different rc_mode */
-    mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_target", enc->config.birate);
-    switch (enc->rcMode) {
-    case MPP_ENC_RC_MODE_FIXQP: {
-        /* do not setup bitrate on FIXQP mode */
-    } break;
-    case MPP_ENC_RC_MODE_CBR: {
-        /* CBR mode has narrow bound */
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_max", enc->config.birate * 17 / 16);
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_min", enc->config.birate * 15 / 16);
-    } break;
-    case MPP_ENC_RC_MODE_VBR:
-    case MPP_ENC_RC_MODE_AVBR: {
-        /* VBR mode has wide bound */
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_max", enc->config.birate * 17 / 16);
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_min", enc->config.birate * 1 / 16);
-    } break;
-    default: {
-        /* default use CBR mode */
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_max", enc->config.birate * 17 / 16);
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:bps_min",  enc->config.birate * 15 / 16);
-    } break;
-    }
-
-    /* setup qp for different codec and rc_mode */
-    switch (enc->codecType) {
-    case MPP_VIDEO_CodingAVC:
-    case MPP_VIDEO_CodingHEVC: {
-        switch (enc->rcMode) {
-        case MPP_ENC_RC_MODE_FIXQP: {
-            RK_S32 fix_qp = 0;
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_init", fix_qp);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_max", fix_qp);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_min", fix_qp);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_max_i", fix_qp);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_min_i", fix_qp);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_ip", 0);
-        } break;
-        case MPP_ENC_RC_MODE_CBR:
-        case MPP_ENC_RC_MODE_VBR:
-        case MPP_ENC_RC_MODE_AVBR: {
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_init", -1);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_max", 51);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_min", 10);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_max_i", 51);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_min_i", 10);
-            mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_ip", 2);
-        } break;
-        default: {
-            printf("unsupport encoder rc mode %d\n", enc->rcMode);
-        } break;
-        }
-    } break;
-    case MPP_VIDEO_CodingVP8: {
-        /* vp8 only setup base qp range */
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_init", 40);
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_max", 127);
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_min", 0);
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_max_i", 127);
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_min_i", 0);
-        mpp_enc_cfg_set_s32(enc->cfg, "rc:qp_ip", 6);
-    } break;
-    case MPP_VIDEO_CodingMJPEG: {
-        /* jpeg use special codec config to control qtable */
-        mpp_enc_cfg_set_s32(enc->cfg, "jpeg:q_factor", 80);
-        mpp_enc_cfg_set_s32(enc->cfg, "jpeg:qf_max", 99);
-        mpp_enc_cfg_set_s32(enc->cfg, "jpeg:qf_min", 1);
-    } break;
-    default: {
-    } break;
-    }
-
-    /* setup codec  */
-    mpp_enc_cfg_set_s32(enc->cfg, "codec:type", enc->codecType);
-    switch (enc->codecType) {
-    case MPP_VIDEO_CodingAVC: {
-        RK_U32 constraint_set;
-        /*
-         * H.264 profile_idc parameter
-         * 66  - Baseline profile
-         * 77  - Main profile
-         * 100 - High profile
-         */
-        mpp_enc_cfg_set_s32(enc->cfg, "h264:profile", 100);
-        /*
-         * H.264 level_idc parameter
-         * 10 / 11 / 12 / 13    - qcif@15fps / cif@7.5fps / cif@15fps / cif@30fps
-         * 20 / 21 / 22         - cif@30fps / half-D1@@25fps / D1@12.5fps
-         * 30 / 31 / 32         - D1@25fps / 720p@30fps / 720p@60fps
-         * 40 / 41 / 42         - 1080p@30fps / 1080p@30fps / 1080p@60fps
-         * 50 / 51 / 52         - 4K@30fps
-         */
-        mpp_enc_cfg_set_s32(enc->cfg, "h264:level", 40);
-        mpp_enc_cfg_set_s32(enc->cfg, "h264:cabac_en", 1);
-        mpp_enc_cfg_set_s32(enc->cfg, "h264:cabac_idc", 0);
-        mpp_enc_cfg_set_s32(enc->cfg, "h264:trans8x8", 1);
-
-        // mpp_env_get_u32("constraint_set", &constraint_set, 0);
-        // if (constraint_set & 0x3f0000)
-        //     mpp_enc_cfg_set_s32(cfg_, "h264:constraint_set", constraint_set);
-    } break;
-    case MPP_VIDEO_CodingHEVC:
-    case MPP_VIDEO_CodingMJPEG:
-    case MPP_VIDEO_CodingVP8: {
-    } break;
-    default: {
-        printf("unsupport encoder coding type %d\n", enc->codecType);
-    } break;
-    }
-
-    // p->split_mode = 0;
-    // p->split_arg = 0;
-    // p->split_out = 0;
-
-    // mpp_env_get_u32("split_mode", &p->split_mode, MPP_ENC_SPLIT_NONE);
-    // mpp_env_get_u32("split_arg", &p->split_arg, 0);
-    // mpp_env_get_u32("split_out", &p->split_out, 0);
-
-    // if (p->split_mode) {
-    //     mpp_log_q(quiet, "%p split mode %d arg %d out %d\n", ctx,
-    //         p->split_mode, p->split_arg, p->split_out);
-    //     mpp_enc_cfg_set_s32(cfg_, "split:mode", p->split_mode);
-    //     mpp_enc_cfg_set_s32(cfg_, "split:arg", p->split_arg);
-    //     mpp_enc_cfg_set_s32(cfg_, "split:out", p->split_out);
-    // }
-
-    // mpp_env_get_u32("mirroring", &mirroring, 0);
-    // mpp_env_get_u32("rotation", &rotation, 0);
-    // mpp_env_get_u32("flip", &flip, 0);
-
-    // mpp_enc_cfg_set_s32(cfg_, "prep:mirroring", mirroring);
-    // mpp_enc_cfg_set_s32(cfg_, "prep:rotation", rotation);
-    // mpp_enc_cfg_set_s32(cfg_, "prep:flip", flip);
-
-    MPP_RET ret = enc->api->control(enc->ctx, MPP_ENC_SET_CFG, enc->cfg);
-    if (ret != MPP_SUCCESS) {
-        printf("mpi control enc set cfg failed ret %d\n", ret);
-        return CSTATUS_FAIL;
+    OKAY_RETURN((fields & ENCODER_CFG_CODEC) && config->codec != enc->config.codec, CSTATUS_BAD_PARAM,
+                "codec can not change while running, the TS stream type is fixed\n");
+    OKAY_RETURN((fields & ENCODER_CFG_BITRATE) && config->birate <= 0, CSTATUS_BAD_PARAM,
+                "bad bitrate %d\n", config->birate);
+    OKAY_RETURN((fields & ENCODER_CFG_FPS) && (config->fps <= 0 || config->fps > enc->config.fps), CSTATUS_BAD_PARAM,
+                "frame rate %d not in 1..%d\n", config->fps, enc->config.fps);
+    OKAY_RETURN((fields & ENCODER_CFG_GOP) && config->gop < 0, CSTATUS_BAD_PARAM, "bad gop %d\n", config->gop);
+    OKAY_RETURN((fields & ENCODER_CFG_RC_MODE) && (config->rcMode < ENCODER_RC_VBR || config->rcMode > ENCODER_RC_FIXQP),
+                CSTATUS_BAD_PARAM, "bad rate control mode %d\n", config->rcMode);
+
+    if(fields & ENCODER_CFG_QP)
+    {
+        OKAY_RETURN(config->qpMin < 0 || config->qpMax > 51 || (config->qpMax > 0 && config->qpMin > config->qpMax),
+                    CSTATUS_BAD_PARAM, "qp range %d..%d not within 0..51\n", config->qpMin, config->qpMax);
+    }
+
+    if(fields & ENCODER_CFG_PROFILE)
+    {
+        bool known = (enc->config.codec == ENCODER_CODEC_H265) ? (config->profile == 1 || config->profile == 2)
+                        : (config->profile == 66 || config->profile == 77 || config->profile == 100);
+        OKAY_RETURN(!known, CSTATUS_BAD_PARAM, "profile_idc %d not supported\n", config->profile);
+    }
+
+    if(fields & ENCODER_CFG_LEVEL)
+    {
+        bool known = (enc->config.codec == ENCODER_CODEC_H265) ? (config->level >= 30 && config->level <= 186 && config->level % 3 == 0)
+                        : (config->level >= 10 && config->level <= 62);
+        OKAY_RETURN(!known, CSTATUS_BAD_PARAM, "level_idc %d not supported\n", config->level);
+    }
+
+    bool h265 = enc->config.codec == ENCODER_CODEC_H265;
+    OKAY_RETURN((fields & ENCODER_CFG_TIER) && (!h265 || (config->tier != 0 && config->tier != 1)), CSTATUS_BAD_PARAM,
+                "tier %d needs H.265\n", config->tier);
+    OKAY_RETURN((fields & ENCODER_CFG_CTU) && (!h265 || (config->ctu != 0 && config->ctu != 16 && config->ctu != 32 && config->ctu != 64)),
+                CSTATUS_BAD_PARAM, "ctu %d needs H.265 and one of 16, 32 or 64\n", config->ctu);
+
+    if(fields & ENCODER_CFG_SPLIT)
+    {
+        OKAY_RETURN(enc->isRunning, CSTATUS_BAD_PARAM, "slice output can not change while running\n");
+        OKAY_RETURN(config->split != ENCODER_SPLIT_NONE && config->splitArg <= 0, CSTATUS_BAD_PARAM,
+                    "bad slice split %d\n", config->splitArg);
+        OKAY_RETURN(config->split == ENCODER_SPLIT_BYTES && config->splitArg < 256, CSTATUS_BAD_PARAM,
+                    "slices of %d bytes are below 256\n", config->splitArg);
+    }
+
+    if(fields & ENCODER_CFG_REFRESH)
+    {
+        OKAY_RETURN(enc->isRunning, CSTATUS_BAD_PARAM, "intra refresh can not change while running\n");
+        OKAY_RETURN(config->refresh < 0 || config->refresh > 1024, CSTATUS_BAD_PARAM,
+                    "intra refresh of %d frames not in 0..1024\n", config->refresh);
     }
     return CSTATUS_SUCCESS;
 }
@@ -220,74 +276,72 @@ static CStatus_t encoderSetMppCfg(Encoder_t *enc)
 Encoder_t * encoderCreate(EncoderConfig_t *config, EncoderInterface_t *itf, void *udata)
 {
     Encoder_t *enc = calloc(1, sizeof(Encoder_t));
+    OKAY_RETURN(enc == NULL, NULL, "failed to allocate encoder\n");
     memcpy(&enc->config, config, sizeof(EncoderConfig_t));
 
     enc->itf = itf;
     enc->udata = udata;
 
-    enc->codecType = MPP_VIDEO_CodingAVC; // H264 Codec
-    enc->frameFormat = MPP_FMT_YUV444SP;
-    enc->rcMode = MPP_ENC_RC_MODE_VBR;
-    enc->frameSize = GetFrameSize(enc->frameFormat, enc->config.horStride, enc->config.verStride);
-    enc->headerSize = GetHeaderSize(enc->frameFormat, enc->config.width, enc->config.height);
-    
-    MPP_RET ret = MPP_SUCCESS;
-    MppApi *api_ = NULL;
-    MppCtx ctx_ = NULL;
-
-    do
+    //Settings left at 0 take the backend default
+    uint32_t fields = (config->qpMin || config->qpMax ? ENCODER_CFG_QP : 0) | (config->profile ? ENCODER_CFG_PROFILE : 0) |
+                      (config->level ? ENCODER_CFG_LEVEL : 0) | (config->tier ? ENCODER_CFG_TIER : 0) |
+                      (config->ctu ? ENCODER_CFG_CTU : 0) | (config->split ? ENCODER_CFG_SPLIT : 0) |
+                      (config->refresh ? ENCODER_CFG_REFRESH : 0) |
+                      ENCODER_CFG_RC_MODE | ENCODER_CFG_GOP;
+    if(encoderCheckConfig(enc, config, fields) != CSTATUS_SUCCESS)
     {
-        ret = mpp_check_support_format(MPP_CTX_ENC, enc->codecType);
-        OKAY_RETURN(ret != MPP_SUCCESS, NULL, "Mpp don't support codec\n");
-
-        ret = mpp_create(&enc->ctx, &enc->api);
-        OKAY_RETURN(ret != MPP_SUCCESS, NULL, "failed to create mpp\n");
-
-        api_ = enc->api;
-        ctx_ = enc->ctx;
-
-        MppPollType timeout = MPP_POLL_NON_BLOCK;
-
-        ret = api_->control(ctx_, MPP_SET_INPUT_TIMEOUT, &timeout);
-        OKAY_STOP(ret != MPP_SUCCESS, "mpi control set input timeout ret %d\n", ret);
-
-        timeout = MPP_POLL_BLOCK;
-        ret = api_->control(ctx_, MPP_SET_OUTPUT_TIMEOUT, &timeout);
-        OKAY_STOP(ret != MPP_SUCCESS, "mpi control set output timeout ret %d\n", ret);
-
-        ret = mpp_init(ctx_, MPP_CTX_ENC, enc->codecType);
-        OKAY_STOP(ret != MPP_SUCCESS, "failed to init mpp\n");
-
-        ret = mpp_enc_cfg_init(&enc->cfg);
-        OKAY_STOP(ret != MPP_SUCCESS, "failed to init cfg\n");
-
-        ret = api_->control(ctx_, MPP_ENC_GET_CFG, enc->cfg);
-        OKAY_STOP(ret != MPP_SUCCESS, "get enc cfg failed ret %d\n", ret);
+        free(enc);
+        return NULL;
+    }
 
-        OKAY_STOP(CSTATUS_SUCCESS != encoderSetMppCfg(enc), NULL, "failed to set enc cfg\n");
-    } while (0);
+    switch (config->backend)
+    {
+    case ENCODER_BACKEND_MPP:
+#ifdef CAPTURE_WITH_MPP
+        enc->ops = &encoderMppOps;
+        break;
+#else
+        free(enc);
+        OKAY_RETURN(true, NULL, "built without MPP, only the mock encoder is available\n");
+#endif
+    case ENCODER_BACKEND_MOCK:
+        enc->ops = &encoderMockOps;
+        break;
+    default:
+        free(enc);
+        OKAY_RETURN(true, NULL, "unknown encoder backend %d\n", config->backend);
+    }
 
-    if(ret != MPP_SUCCESS)
+    if(enc->ops->Init(enc) != CSTATUS_SUCCESS)
     {
-        if(ctx_ != NULL)
-        {
-            mpp_destroy(ctx_);
-        }
+        printf("failed to init %s encoder\n", enc->ops->name);
+        enc->ops->Deinit(enc);
         free(enc);
         return NULL;
     }
 
     enc->isRunning = true;
+    enc->bps = enc->config.birate;
+    enc->fps = enc->config.fps;
+    pthread_mutex_init(&enc->statsLock, NULL);
 
-    //recv_thread_ = std::thread(&VideoEncoder::EncRecvThread, this);
     if(pthread_create(&enc->threadEnc, NULL, recvThread, enc))
     {
         printf("failed to create encoder thread : errno(%d)\n", errno);
-        mpp_destroy(ctx_);
+        pthread_mutex_destroy(&enc->statsLock);
+        enc->ops->Deinit(enc);
         free(enc);
         return NULL;
     }
 
+    printf("%s encoder : %dx%d, %d bps, %d fps%s\n", enc->ops->name,
+            enc->config.width, enc->config.height, enc->config.birate, enc->config.fps,
+            enc->config.split == ENCODER_SPLIT_NONE ? "" : ", slice output");
+    if(enc->config.refresh > 0)
+    {
+        printf("%s encoder : intra refresh over %d frames by %s\n", enc->ops->name,
+                enc->config.refresh, enc->config.refreshCols ? "columns" : "rows");
+    }
     return enc;
 }
 
@@ -295,39 +349,285 @@ void encoderDestroy(Encoder_t *enc)
 {
     enc->isRunning = false;
     pthread_join(enc->threadEnc, NULL);
-    mpp_destroy(enc->ctx);
+    enc->ops->Deinit(enc);
+    pthread_mutex_destroy(&enc->statsLock);
+    free(enc->paramSets);
+    free(enc->recoveryBuf);
     free(enc);
 }
 
 CStatus_t encoderPutFrame(Encoder_t *enc, Buffer_t *buff)
 {
-    MPP_RET ret = MPP_SUCCESS;
-    MppBuffer cam_buf = NULL;
-    MppFrame frame = NULL;
+    //Bresenham over the capture rate, fps of every config.fps frames go through
+    if(enc->fps < enc->config.fps)
+    {
+        enc->fpsAcc += enc->fps;
+        if(enc->fpsAcc < enc->config.fps)
+        { return CSTATUS_SUCCESS; }
+        enc->fpsAcc -= enc->config.fps;
+    }
+    return enc->ops->PutFrame(enc, buff, encoderTimeUs());
+}
 
-    ret = mpp_frame_init(&frame);
-    OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "mpp_frame_init failed %d\n", ret);
+CStatus_t encoderSetBitrate(Encoder_t *enc, int bps, int fps)
+{
+    OKAY_RETURN(enc->ops->SetRate == NULL, CSTATUS_CONTEXT, "%s encoder has a fixed rate\n", enc->ops->name);
+    fps = (fps <= 0 || fps > enc->config.fps) ? enc->config.fps : fps;
+    OKAY_RETURN(bps <= 0, CSTATUS_BAD_PARAM, "bad bitrate %d\n", bps);
+
+    CStatus_t status = enc->ops->SetRate(enc, bps, fps);
+    OKAY_RETURN(status != CSTATUS_SUCCESS, status, "failed to set %s encoder to %d bps %d fps\n", enc->ops->name, bps, fps);
+    pthread_mutex_lock(&enc->statsLock);
+    enc->bps = bps;
+    enc->fps = fps;
+    pthread_mutex_unlock(&enc->statsLock);
+    return CSTATUS_SUCCESS;
+}
 
-    mpp_frame_set_width(frame, enc->config.width);
-    mpp_frame_set_height(frame, enc->config.height);
-    mpp_frame_set_hor_stride(frame, enc->config.horStride);
-    mpp_frame_set_ver_stride(frame, enc->config.verStride);
-    mpp_frame_set_fmt(frame, enc->frameFormat);
-    mpp_frame_set_eos(frame, 0);
+void encoderGetStats(Encoder_t *enc, EncoderStats_t *stats)
+{
+    pthread_mutex_lock(&enc->statsLock);
+    *stats = enc->stats;
+    int count = (enc->stats.frames < ENCODER_STATS_WINDOW) ? (int)enc->stats.frames : ENCODER_STATS_WINDOW;
+    int64_t bytes = 0, keyBytes = 0, latency = 0, qpSum = 0, firstPts = 0, firstBytes = 0;
+    int keys = 0, qps = 0;
+    for(int i = 0; i < count; i++)
+    {
+        //Oldest first
+        const EncoderFrameStat_t *f = &enc->statsRing[(enc->statsHead - count + i + ENCODER_STATS_WINDOW) % ENCODER_STATS_WINDOW];
+        if(i == 0)
+        {
+            firstPts = f->pts;
+            firstBytes = f->bytes;
+        }
+        bytes += f->bytes;
+        latency += f->latencyUs;
+        stats->maxBytes = (f->bytes > stats->maxBytes) ? f->bytes : stats->maxBytes;
+        stats->maxLatencyUs = (f->latencyUs > stats->maxLatencyUs) ? f->latencyUs : stats->maxLatencyUs;
+        if(f->keyFrame)
+        {
+            keyBytes += f->bytes;
+            keys++;
+        }
+        if(f->qp >= 0)
+        {
+            qpSum += f->qp;
+            qps++;
+        }
+    }
 
+    int64_t drained = (enc->rcLastPts != 0) ? (int64_t)enc->bps * (encoderTimeUs() - enc->rcLastPts) / 1000000 : 0;
+    double level = (enc->rcLevel > drained) ? enc->rcLevel - drained : 0;
+    stats->rcFullness = (enc->bps > 0) ? (int)(level * 100 / enc->bps) : 0;
+    stats->targetBps = enc->bps;
+    stats->targetFps = enc->fps;
+
+    //The span from the first frame of the window carries the frames after it
+    int64_t span = stats->last.pts - firstPts;
+    stats->outBps = (span > 0) ? (int)((bytes - firstBytes) * 8 * 1000000 / span) : 0;
+    pthread_mutex_unlock(&enc->statsLock);
+
+    stats->window = count;
+    stats->avgBytes = count ? (int)(bytes / count) : 0;
+    stats->avgKeyBytes = keys ? (int)(keyBytes / keys) : 0;
+    stats->avgLatencyUs = count ? latency / count : 0;
+    stats->avgQp = qps ? (double)qpSum / qps : -1;
+}
 
-    MppBufferInfo info;
-    memset(&info, 0, sizeof(MppBufferInfo));
-    info.type = MPP_BUFFER_TYPE_EXT_DMA;
-    info.fd =  buff->dmafd[0];
-    info.size = (uint32_t)buff->size[0] & 0x07ffffff;
-    info.index = ((uint32_t)buff->size[0] & 0xf8000000) >> 27;
-    mpp_buffer_import(&cam_buf, &info);
+void *encoderHoldPacket(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    //A recovery point is rebuilt in recoveryBuf, which the next one overwrites
+    if(enc->ops->HoldPacket == NULL || pkt->recoveryPoint)
+    { return NULL; }
+    return enc->ops->HoldPacket(enc, pkt);
+}
 
-    mpp_frame_set_buffer(frame, cam_buf);
+void encoderReleaseHold(Encoder_t *enc, void *ref)
+{
+    if(ref != NULL)
+    { enc->ops->ReleaseHold(enc, ref); }
+}
 
-    ret = enc->api->encode_put_frame(enc->ctx, frame);
-    OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "frame encoding failed %d\n", ret);
+CStatus_t encoderRequestKeyFrame(Encoder_t *enc)
+{
+    OKAY_RETURN(enc->ops->RequestKeyFrame == NULL, CSTATUS_CONTEXT, "%s encoder can not force a key frame\n", enc->ops->name);
+    return enc->ops->RequestKeyFrame(enc);
+}
 
+CStatus_t encoderUpdateConfig(Encoder_t *enc, const EncoderConfig_t *config, uint32_t fields)
+{
+    OKAY_RETURN(enc->ops->UpdateConfig == NULL, CSTATUS_CONTEXT, "%s encoder can not be reconfigured\n", enc->ops->name);
+    CStatus_t status = encoderCheckConfig(enc, config, fields);
+    if(status != CSTATUS_SUCCESS || fields == 0)
+    { return status; }
+
+    //The backend sees the merged config, the output frame rate stays apart from the capture rate
+    EncoderConfig_t merged = enc->config;
+    merged.birate = (fields & ENCODER_CFG_BITRATE) ? config->birate : enc->bps;
+    merged.gop = (fields & ENCODER_CFG_GOP) ? config->gop : merged.gop;
+    merged.rcMode = (fields & ENCODER_CFG_RC_MODE) ? config->rcMode : merged.rcMode;
+    merged.qpMin = (fields & ENCODER_CFG_QP) ? config->qpMin : merged.qpMin;
+    merged.qpMax = (fields & ENCODER_CFG_QP) ? config->qpMax : merged.qpMax;
+    merged.profile = (fields & ENCODER_CFG_PROFILE) ? config->profile : merged.profile;
+    merged.level = (fields & ENCODER_CFG_LEVEL) ? config->level : merged.level;
+    merged.tier = (fields & ENCODER_CFG_TIER) ? config->tier : merged.tier;
+    merged.ctu = (fields & ENCODER_CFG_CTU) ? config->ctu : merged.ctu;
+    int fps = (fields & ENCODER_CFG_FPS) ? config->fps : enc->fps;
+
+    //Headers go out with the next key frame, flag it before the backend can produce it
+    bool headers = (fields & ENCODER_CFG_HEADERS) && (merged.profile != enc->config.profile || merged.level != enc->config.level
+                    || merged.tier != enc->config.tier || merged.ctu != enc->config.ctu);
+    enc->headersPending = enc->headersPending || headers;
+
+    merged.fps = fps;
+    status = enc->ops->UpdateConfig(enc, &merged, fields);
+    OKAY_RETURN(status != CSTATUS_SUCCESS, status, "failed to reconfigure %s encoder\n", enc->ops->name);
+
+    merged.fps = enc->config.fps;
+    enc->config = merged;
+    pthread_mutex_lock(&enc->statsLock);
+    enc->bps = merged.birate;
+    enc->fps = fps;
+    pthread_mutex_unlock(&enc->statsLock);
+    printf("%s encoder : %d bps, %d fps, gop %d, %s, qp %d..%d, profile %d, level %d%s%s\n", enc->ops->name,
+            enc->bps, enc->fps, enc->config.gop, encoderRcModeToString(enc->config.rcMode), enc->config.qpMin,
+            enc->config.qpMax, enc->config.profile, enc->config.level, enc->config.tier ? ", high tier" : "",
+            headers ? ", new headers" : "");
     return CSTATUS_SUCCESS;
-}
\ No newline at end of file
+}
+
+CStatus_t encoderParseSetting(EncoderConfig_t *config, uint32_t *fields, char *setting)
+{
+    bool h265 = config->codec == ENCODER_CODEC_H265;
+    char *value = strchr(setting, '=');
+    OKAY_RETURN(value == NULL, CSTATUS_BAD_PARAM, "encoder setting %s is not key=value\n", setting);
+    *value++ = '\0';
+
+    if(strcmp(setting, "bitrate") == 0)
+    {
+        config->birate = atoi(value) * 1000;
+        *fields |= ENCODER_CFG_BITRATE;
+    }
+    else if(strcmp(setting, "fps") == 0)
+    {
+        config->fps = atoi(value);
+        *fields |= ENCODER_CFG_FPS;
+    }
+    else if(strcmp(setting, "gop") == 0)
+    {
+        config->gop = atoi(value);
+        *fields |= ENCODER_CFG_GOP;
+    }
+    else if(strcmp(setting, "rc") == 0)
+    {
+        int mode = encoderRcModeFromString(value);
+        OKAY_RETURN(mode < 0, CSTATUS_BAD_PARAM, "unknown rate control mode %s\n", value);
+        config->rcMode = mode;
+        *fields |= ENCODER_CFG_RC_MODE;
+    }
+    else if(strcmp(setting, "qpmin") == 0 || strcmp(setting, "qpmax") == 0)
+    {
+        *(setting[3] == 'i' ? &config->qpMin : &config->qpMax) = atoi(value);
+        *fields |= ENCODER_CFG_QP;
+    }
+    else if(strcmp(setting, "profile") == 0)
+    {
+        static const struct { const char *name; int idc; bool h265; } profiles[] = {
+            { "baseline", 66, false }, { "main", 77, false }, { "high", 100, false },
+            { "main", 1, true }, { "main10", 2, true },
+        };
+        config->profile = atoi(value);
+        for(size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+        {
+            if(profiles[i].h265 == h265 && strcmp(profiles[i].name, value) == 0)
+            { config->profile = profiles[i].idc; }
+        }
+        *fields |= ENCODER_CFG_PROFILE;
+    }
+    else if(strcmp(setting, "level") == 0)
+    {
+        //"4.1" or level_idc as is
+        double level = atof(value);
+        config->level = (strchr(value, '.') != NULL || level < 10) ? (int)(level * (h265 ? 30 : 10) + 0.5) : (int)level;
+        *fields |= ENCODER_CFG_LEVEL;
+    }
+    else if(strcmp(setting, "tier") == 0)
+    {
+        OKAY_RETURN(strcmp(value, "main") != 0 && strcmp(value, "high") != 0, CSTATUS_BAD_PARAM, "unknown tier %s\n", value);
+        config->tier = strcmp(value, "high") == 0;
+        *fields |= ENCODER_CFG_TIER;
+    }
+    else if(strcmp(setting, "ctu") == 0)
+    {
+        config->ctu = atoi(value);
+        *fields |= ENCODER_CFG_CTU;
+    }
+    else if(strcmp(setting, "slices") == 0 || strcmp(setting, "slicebytes") == 0)
+    {
+        config->splitArg = atoi(value);
+        config->split = (config->splitArg <= 0) ? ENCODER_SPLIT_NONE : (setting[5] == 'b') ? ENCODER_SPLIT_BYTES : ENCODER_SPLIT_SLICES;
+        *fields |= ENCODER_CFG_SPLIT;
+    }
+    else if(strcmp(setting, "refresh") == 0)
+    {
+        //"<frames>" by rows or "<frames>:cols"
+        char *by = strchr(value, ':');
+        OKAY_RETURN(by != NULL && strcmp(by, ":cols") != 0 && strcmp(by, ":rows") != 0, CSTATUS_BAD_PARAM,
+                    "intra refresh %s is not <frames>[:rows|:cols]\n", value);
+        config->refresh = atoi(value);
+        config->refreshCols = by != NULL && strcmp(by, ":cols") == 0;
+        *fields |= ENCODER_CFG_REFRESH;
+    }
+    else if(strcmp(setting, "codec") == 0)
+    {
+        int codec = encoderCodecFromString(value);
+        OKAY_RETURN(codec < 0, CSTATUS_BAD_PARAM, "unknown codec %s\n", value);
+        config->codec = codec;
+        *fields |= ENCODER_CFG_CODEC;
+    }
+    else
+    {
+        OKAY_RETURN(true, CSTATUS_BAD_PARAM, "unknown encoder setting %s\n", setting);
+    }
+    return CSTATUS_SUCCESS;
+}
+
+int encoderCodecFromString(const char *name)
+{
+    if(strcmp(name, "h264") == 0)
+    { return ENCODER_CODEC_H264; }
+    if(strcmp(name, "h265") == 0 || strcmp(name, "hevc") == 0)
+    { return ENCODER_CODEC_H265; }
+    return -1;
+}
+
+int encoderRcModeFromString(const char *name)
+{
+    for(int mode = ENCODER_RC_VBR; mode <= ENCODER_RC_FIXQP; mode++)
+    {
+        if(strcmp(name, encoderRcModeToString(mode)) == 0)
+        { return mode; }
+    }
+    return -1;
+}
+
+const char *encoderRcModeToString(EncoderRcMode_t mode)
+{
+    switch (mode)
+    {
+    case ENCODER_RC_VBR:    return "vbr";
+    case ENCODER_RC_CBR:    return "cbr";
+    case ENCODER_RC_AVBR:   return "avbr";
+    case ENCODER_RC_FIXQP:  return "fixqp";
+    default:                return "unknown";
+    }
+}
+
+int encoderBackendFromString(const char *name)
+{
+    if(strcmp(name, "mpp") == 0)
+    { return ENCODER_BACKEND_MPP; }
+    if(strcmp(name, "mock") == 0)
+    { return ENCODER_BACKEND_MOCK; }
+    return -1;
+}
@@ -0,0 +1,545 @@
+#include "encoder.h"
+#include "encoder_priv.h"
+#include "common.h"
+#include "mpeg-ts.h"
+#include <time.h>
+
+/*
+ * Mock encoder, hands out recorded access units instead of encoding. Every
+ * input frame releases exactly one access unit, stamped with that frame's pts,
+ * so the output follows the capture rate just like the hardware would.
+ *
+ * With mockPath the units come from an Annex-B H.264/H.265 file, split on
+ * access unit boundaries and replayed in a loop from the first keyframe.
+ * Without a file a stream is synthesized from the configured bitrate and gop:
+ * one I frame R times the size of a P frame, P = bitrate * gop / (R + gop - 1)
+ * per gop. The synthesized NAL units have valid headers and realistic sizes
+ * but are not decodable.
+ *
+ * A synthesized stream follows encoderSetBitrate below the configured bitrate by
+ * cutting every unit short, a replayed file keeps its own rate. A new profile,
+ * level or tier from encoderUpdateConfig is written into the synthesized SPS and
+ * the stream restarts at its first key frame, once no packet is held; gop, rc
+ * mode, qp and ctu are accepted but do not change the synthesized stream.
+ *
+ * With config.refresh the synthesized stream has a single key frame and P frames of
+ * even size, the replay wraps to the first P frame. encoderRequestKeyFrame jumps
+ * back to the key frame. A replayed file keeps its own key frames.
+ *
+ * With config.split a unit is handed out in parts of splitArg bytes or in splitArg
+ * even parts, back to back. The parts are cut at byte offsets, not slice bounds.
+ */
+
+#define MOCK_IP_RATIO       6       //I frame size over P frame size
+#define MOCK_SYNTH_GOPS     4       //Distinct gops before the synthetic stream repeats
+#define MOCK_MAX_INPUT      8       //Frames waiting to be "encoded", more are dropped
+#define MOCK_WAIT_MS        100
+#define MOCK_MAX_HELD       64      //encoderHoldPacket references at a time
+
+typedef struct
+{
+    size_t      offset;
+    size_t      len;
+    bool        keyFrame;
+}MockAu_t;
+
+typedef struct
+{
+    //Elementary stream, file mapping or synthesized
+    uint8_t         *stream;
+    size_t          size;
+    bool            mapped;
+
+    MockAu_t        *aus;
+    int             numAus;
+    int             next;
+    int             firstKey;
+    int             loop;           //Where the replay wraps to
+
+    //Input frames waiting for an access unit
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int64_t         input[MOCK_MAX_INPUT];
+    int             head;
+    int             count;
+    uint64_t        dropped;
+
+    //Permille of each synthesized unit handed out
+    volatile int    scale;
+    int             baseBps;        //Bitrate the stream was synthesized at
+
+    //New parameter sets for the next unit, under lock
+    bool            restart;
+    bool            forceKey;
+    int             held;           //Held units, the stream is not rewritten while any are
+    int             profile;
+    int             level;
+    int             tier;
+
+    //Rest of the unit being handed out in parts
+    const uint8_t   *partData;
+    size_t          partLeft;
+    size_t          partSize;
+    int64_t         partPts;
+    bool            partKey;
+    int             part;
+}EncoderMock_t;
+
+
+static bool mockIsKey(const uint8_t *p, size_t len, EncoderCodec_t codec)
+{
+    for(size_t i = 0; i + 3 < len; i++)
+    {
+        if(p[i] != 0 || p[i + 1] != 0 || p[i + 2] != 1)
+        { continue; }
+
+        uint8_t type = (codec == ENCODER_CODEC_H265) ? (p[i + 3] >> 1) & 0x3f : p[i + 3] & 0x1f;
+        if(codec == ENCODER_CODEC_H265 ? (type >= 16 && type <= 21) : (type == 5))
+        { return true; }
+        i += 2;
+    }
+    return false;
+}
+
+static CStatus_t mockSplit(Encoder_t *enc)
+{
+    EncoderMock_t *m = enc->priv;
+    size_t offset = 0;
+    int capacity = 1024;
+
+    m->aus = malloc(capacity * sizeof(MockAu_t));
+    OKAY_RETURN(m->aus == NULL, CSTATUS_MEMORY, "failed to allocate access unit index\n");
+
+    while (offset < m->size)
+    {
+        int vcl = 0;
+        int n = (enc->config.codec == ENCODER_CODEC_H265)
+                    ? mpeg_h265_find_new_access_unit(m->stream + offset, m->size - offset, &vcl)
+                    : mpeg_h264_find_new_access_unit(m->stream + offset, m->size - offset, &vcl);
+        size_t len = (n <= 0) ? m->size - offset : (size_t)n;
+
+        if(m->numAus == capacity)
+        {
+            capacity *= 2;
+            MockAu_t *aus = realloc(m->aus, capacity * sizeof(MockAu_t));
+            OKAY_RETURN(aus == NULL, CSTATUS_MEMORY, "failed to grow access unit index\n");
+            m->aus = aus;
+        }
+
+        MockAu_t *au = &m->aus[m->numAus++];
+        au->offset = offset;
+        au->len = len;
+        au->keyFrame = mockIsKey(m->stream + offset, len, enc->config.codec);
+        offset += len;
+    }
+
+    m->firstKey = -1;
+    for(int i = 0; i < m->numAus && m->firstKey < 0; i++)
+    {
+        if(m->aus[i].keyFrame)
+        { m->firstKey = i; }
+    }
+    OKAY_RETURN(m->firstKey < 0, CSTATUS_FAIL, "no keyframe in %d access units\n", m->numAus);
+    m->loop = m->firstKey;
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t mockLoadFile(Encoder_t *enc)
+{
+    EncoderMock_t *m = enc->priv;
+    struct stat st;
+
+    int fd = open(enc->config.mockPath, O_RDONLY | O_CLOEXEC);
+    OKAY_RETURN(fd < 0, CSTATUS_SYSCALL, "failed to open %s : %s\n", enc->config.mockPath, ERRSTR);
+
+    if(fstat(fd, &st) < 0 || st.st_size <= 0)
+    {
+        close(fd);
+        OKAY_RETURN(true, CSTATUS_FAIL, "%s is empty or unreadable\n", enc->config.mockPath);
+    }
+
+    m->size = st.st_size;
+    m->stream = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    OKAY_RETURN(m->stream == MAP_FAILED, CSTATUS_SYSCALL, "failed to mmap %s : %s\n", enc->config.mockPath, ERRSTR);
+    m->mapped = true;
+
+    int codec = 0;
+    OKAY_RETURN(mpeg_h26x_verify(m->stream, m->size, &codec) != 0 || (codec != 1 && codec != 2),
+                CSTATUS_BAD_PARAM, "%s is not an H.264/H.265 Annex-B stream\n", enc->config.mockPath);
+    enc->config.codec = (codec == 2) ? ENCODER_CODEC_H265 : ENCODER_CODEC_H264;
+
+    return mockSplit(enc);
+}
+
+static size_t mockPutNal(uint8_t *dst, const uint8_t *hdr, int hdrLen, size_t len, uint32_t *seed)
+{
+    static const uint8_t startCode[4] = {0x00, 0x00, 0x00, 0x01};
+
+    memcpy(dst, startCode, sizeof(startCode));
+    memcpy(dst + sizeof(startCode), hdr, hdrLen);
+    size_t pos = sizeof(startCode) + hdrLen;
+
+    //Never 0x00, keeps the payload free of start code emulation
+    for(; pos < len; pos++)
+    {
+        *seed = *seed * 1103515245 + 12345;
+        dst[pos] = (*seed >> 24) | 0x01;
+    }
+    return len;
+}
+
+static CStatus_t mockSynthesize(Encoder_t *enc)
+{
+    EncoderMock_t *m = enc->priv;
+    bool hevc = (enc->config.codec == ENCODER_CODEC_H265);
+    int fps = enc->config.fps > 0 ? enc->config.fps : 30;
+    int gop = enc->config.gop > 0 ? enc->config.gop : fps * 2;
+
+    //Parameter sets, IDR slice and non IDR slice headers (first slice of the picture)
+    static const uint8_t avcSps[] = {0x67, 0x64, 0x00, 0x28, 0xac};
+    static const uint8_t avcPps[] = {0x68, 0xee, 0x3c, 0x80};
+    static const uint8_t avcIdr[] = {0x65, 0x88};
+    static const uint8_t avcP[]   = {0x41, 0x9a};
+    static const uint8_t hevcVps[] = {0x40, 0x01, 0x0c, 0x01};
+    static const uint8_t hevcSps[] = {0x42, 0x01, 0x01, 0x01};
+    static const uint8_t hevcPps[] = {0x44, 0x01, 0xc1, 0x72};
+    static const uint8_t hevcIdr[] = {0x26, 0x01, 0xaf};
+    static const uint8_t hevcP[]   = {0x02, 0x01, 0xd0};
+
+    //Intra refresh spreads the key frame over the P frames
+    bool refresh = enc->config.refresh > 0;
+    size_t avg = (size_t)enc->config.birate / 8 / fps;
+    size_t pSize = refresh ? avg : avg * gop / (MOCK_IP_RATIO + gop - 1);
+    if(pSize < 32)
+    { pSize = 32; }
+    size_t iSize = pSize * MOCK_IP_RATIO;
+
+    m->numAus = gop * MOCK_SYNTH_GOPS;
+    m->aus = calloc(m->numAus, sizeof(MockAu_t));
+    OKAY_RETURN(m->aus == NULL, CSTATUS_MEMORY, "failed to allocate access unit index\n");
+
+    //Worst case +10% on every unit plus parameter sets
+    m->size = (iSize + pSize * (gop - 1)) * MOCK_SYNTH_GOPS * 11 / 10 + m->numAus * 64;
+    m->stream = malloc(m->size);
+    OKAY_RETURN(m->stream == NULL, CSTATUS_MEMORY, "failed to allocate %zu bytes of mock stream\n", m->size);
+
+    uint32_t seed = 0x5eed;
+    size_t offset = 0;
+    for(int i = 0; i < m->numAus; i++)
+    {
+        MockAu_t *au = &m->aus[i];
+        au->offset = offset;
+        au->keyFrame = refresh ? i == 0 : (i % gop) == 0;
+
+        //Deterministic +-10% jitter around the nominal size
+        seed = seed * 1103515245 + 12345;
+        size_t size = au->keyFrame ? iSize : pSize;
+        size = size * (90 + (seed >> 16) % 21) / 100;
+
+        uint8_t *dst = m->stream + offset;
+        if(au->keyFrame)
+        {
+            if(hevc)
+            {
+                dst += mockPutNal(dst, hevcVps, sizeof(hevcVps), 4 + 24, &seed);
+                dst += mockPutNal(dst, hevcSps, sizeof(hevcSps), 4 + 40, &seed);
+                dst += mockPutNal(dst, hevcPps, sizeof(hevcPps), 4 + 8, &seed);
+                dst += mockPutNal(dst, hevcIdr, sizeof(hevcIdr), size, &seed);
+            }
+            else
+            {
+                dst += mockPutNal(dst, avcSps, sizeof(avcSps), 4 + 24, &seed);
+                dst += mockPutNal(dst, avcPps, sizeof(avcPps), 4 + 8, &seed);
+                dst += mockPutNal(dst, avcIdr, sizeof(avcIdr), size, &seed);
+            }
+        }
+        else
+        {
+            dst += mockPutNal(dst, hevc ? hevcP : avcP, hevc ? sizeof(hevcP) : sizeof(avcP), size, &seed);
+        }
+
+        au->len = dst - (m->stream + offset);
+        offset += au->len;
+    }
+
+    m->size = offset;
+    m->firstKey = 0;
+    m->loop = refresh ? 1 : 0;
+    return CSTATUS_SUCCESS;
+}
+
+//profile_idc, level_idc and the H.265 tier into the SPS of every synthesized key frame, no readers may hold a unit
+static void mockPatchHeaders(Encoder_t *enc, int profile, int level, int tier)
+{
+    EncoderMock_t *m = enc->priv;
+    for(int i = 0; i < m->numAus; i++)
+    {
+        if(!m->aus[i].keyFrame)
+        { continue; }
+
+        uint8_t *au = m->stream + m->aus[i].offset;
+        if(enc->config.codec == ENCODER_CODEC_H265)
+        {
+            //After the VPS, profile_tier_level starts at the third byte of the SPS
+            uint8_t *sps = au + 4 + 24 + 4;
+            sps[3] = (sps[3] & 0xc0) | (tier ? 0x20 : 0) | (profile & 0x1f);
+            sps[14] = level;
+        }
+        else
+        {
+            uint8_t *sps = au + 4;
+            sps[1] = profile;
+            sps[3] = level;
+        }
+    }
+}
+
+static CStatus_t mockInit(Encoder_t *enc)
+{
+    EncoderMock_t *m = calloc(1, sizeof(EncoderMock_t));
+    OKAY_RETURN(m == NULL, CSTATUS_MEMORY, "failed to allocate mock encoder\n");
+    enc->priv = m;
+
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&m->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    CStatus_t status = enc->config.mockPath ? mockLoadFile(enc) : mockSynthesize(enc);
+    OKAY_RETURN(status != CSTATUS_SUCCESS, status, "failed to prepare mock stream\n");
+
+    m->next = m->firstKey;
+    m->scale = 1000;
+    m->baseBps = enc->config.birate;
+    if(!m->mapped)
+    {
+        bool hevc = (enc->config.codec == ENCODER_CODEC_H265);
+        enc->config.profile = enc->config.profile ? enc->config.profile : (hevc ? 1 : 100);
+        enc->config.level = enc->config.level ? enc->config.level : (hevc ? 123 : 40);
+        mockPatchHeaders(enc, enc->config.profile, enc->config.level, enc->config.tier);
+    }
+    printf("mock encoder : %d %s access units, %zu bytes from %s\n", m->numAus,
+            enc->config.codec == ENCODER_CODEC_H265 ? "H.265" : "H.264", m->size,
+            enc->config.mockPath ? enc->config.mockPath : "synthesizer");
+    return CSTATUS_SUCCESS;
+}
+
+static void mockDeinit(Encoder_t *enc)
+{
+    EncoderMock_t *m = enc->priv;
+    if(m == NULL)
+    { return; }
+
+    if(m->mapped)
+    { munmap(m->stream, m->size); }
+    else
+    { free(m->stream); }
+
+    if(m->dropped)
+    { printf("mock encoder : dropped %llu input frames\n", (unsigned long long)m->dropped); }
+
+    free(m->aus);
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->lock);
+    free(m);
+    enc->priv = NULL;
+}
+
+static CStatus_t mockPutFrame(Encoder_t *enc, Buffer_t *buff, int64_t pts)
+{
+    UNUSED_PARAMETER(buff);
+    EncoderMock_t *m = enc->priv;
+    CStatus_t status = CSTATUS_SUCCESS;
+
+    pthread_mutex_lock(&m->lock);
+    if(m->count == MOCK_MAX_INPUT)
+    {
+        //Input port full, same as MPP rejecting a non blocking put
+        m->dropped++;
+        status = CSTATUS_AGAIN;
+    }
+    else
+    {
+        m->input[(m->head + m->count) % MOCK_MAX_INPUT] = pts;
+        m->count++;
+        pthread_cond_signal(&m->cond);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return status;
+}
+
+//Next part of the unit in progress, the whole unit without split
+static void mockNextPart(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    EncoderMock_t *m = enc->priv;
+    size_t len = (m->partLeft < m->partSize) ? m->partLeft : m->partSize;
+
+    pkt->data = (uint8_t*)m->partData;
+    pkt->len = (int)len;
+    pkt->pts = m->partPts;
+    pkt->keyFrame = m->partKey;
+    pkt->part = m->part++;
+    pkt->partial = len < m->partLeft;
+
+    m->partData += len;
+    m->partLeft -= len;
+}
+
+static CStatus_t mockGetPacket(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    EncoderMock_t *m = enc->priv;
+    struct timespec deadline;
+
+    if(m->partLeft > 0)
+    {
+        mockNextPart(enc, pkt);
+        return CSTATUS_SUCCESS;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += MOCK_WAIT_MS * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&m->lock);
+    while (m->count == 0 && enc->isRunning)
+    {
+        if(pthread_cond_timedwait(&m->cond, &m->lock, &deadline) != 0)
+        { break; }
+    }
+
+    if(m->count == 0)
+    {
+        pthread_mutex_unlock(&m->lock);
+        return CSTATUS_AGAIN;
+    }
+
+    m->partPts = m->input[m->head];
+    m->head = (m->head + 1) % MOCK_MAX_INPUT;
+    m->count--;
+
+    //The last unit was released before this call, the stream is ours to rewrite
+    if(m->forceKey)
+    {
+        m->next = m->firstKey;
+        m->forceKey = false;
+    }
+    if(m->restart && m->held == 0)
+    {
+        mockPatchHeaders(enc, m->profile, m->level, m->tier);
+        m->next = m->firstKey;
+        m->restart = false;
+    }
+    pthread_mutex_unlock(&m->lock);
+
+    MockAu_t *au = &m->aus[m->next];
+    m->partData = m->stream + au->offset;
+    m->partLeft = au->len;
+    m->partKey = au->keyFrame;
+    m->part = 0;
+    if(!m->mapped && m->scale < 1000)
+    {
+        //Parameter sets and slice headers stay whole
+        size_t len = au->len * m->scale / 1000;
+        m->partLeft = (len < 128) ? ((au->len < 128) ? au->len : 128) : len;
+    }
+
+    const EncoderConfig_t *c = &enc->config;
+    m->partSize = (c->split == ENCODER_SPLIT_BYTES) ? (size_t)c->splitArg :
+                  (c->split == ENCODER_SPLIT_SLICES) ? (m->partLeft + c->splitArg - 1) / c->splitArg : m->partLeft;
+
+    m->next++;
+    if(m->next == m->numAus)
+    { m->next = m->loop; }
+
+    mockNextPart(enc, pkt);
+    return CSTATUS_SUCCESS;
+}
+
+static void mockReleasePacket(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    //Packets point into the stream, nothing to release
+    UNUSED_PARAMETER(enc);
+    UNUSED_PARAMETER(pkt);
+}
+
+static CStatus_t mockSetRate(Encoder_t *enc, int bps, int fps)
+{
+    UNUSED_PARAMETER(fps);
+    EncoderMock_t *m = enc->priv;
+    int64_t scale = (int64_t)bps * 1000 / (m->baseBps > 0 ? m->baseBps : bps);
+    m->scale = (int)((scale > 1000) ? 1000 : scale);
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t mockUpdateConfig(Encoder_t *enc, const EncoderConfig_t *config, uint32_t fields)
+{
+    EncoderMock_t *m = enc->priv;
+    OKAY_RETURN(m->mapped && (fields & ENCODER_CFG_HEADERS), CSTATUS_CONTEXT,
+                "%s keeps its own parameter sets\n", enc->config.mockPath);
+
+    mockSetRate(enc, config->birate, config->fps);
+    if(fields & ENCODER_CFG_HEADERS)
+    {
+        pthread_mutex_lock(&m->lock);
+        m->profile = config->profile;
+        m->level = config->level;
+        m->tier = config->tier;
+        m->restart = true;
+        pthread_mutex_unlock(&m->lock);
+    }
+    return CSTATUS_SUCCESS;
+}
+
+static void *mockHoldPacket(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    UNUSED_PARAMETER(pkt);
+    EncoderMock_t *m = enc->priv;
+    void *ref = NULL;
+    pthread_mutex_lock(&m->lock);
+    if(m->held < MOCK_MAX_HELD)
+    {
+        m->held++;
+        ref = m;
+    }
+    pthread_mutex_unlock(&m->lock);
+    return ref;
+}
+
+static void mockReleaseHold(Encoder_t *enc, void *ref)
+{
+    UNUSED_PARAMETER(ref);
+    EncoderMock_t *m = enc->priv;
+    pthread_mutex_lock(&m->lock);
+    m->held--;
+    pthread_mutex_unlock(&m->lock);
+}
+
+static CStatus_t mockRequestKeyFrame(Encoder_t *enc)
+{
+    EncoderMock_t *m = enc->priv;
+    pthread_mutex_lock(&m->lock);
+    m->forceKey = true;
+    pthread_mutex_unlock(&m->lock);
+    return CSTATUS_SUCCESS;
+}
+
+const EncoderOps_t encoderMockOps = {
+    .name = "mock",
+    .Init = mockInit,
+    .Deinit = mockDeinit,
+    .PutFrame = mockPutFrame,
+    .GetPacket = mockGetPacket,
+    .ReleasePacket = mockReleasePacket,
+    .SetRate = mockSetRate,
+    .UpdateConfig = mockUpdateConfig,
+    .RequestKeyFrame = mockRequestKeyFrame,
+    .HoldPacket = mockHoldPacket,
+    .ReleaseHold = mockReleaseHold,
+};
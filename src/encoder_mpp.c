@@ -0,0 +1,787 @@
+#include "encoder.h"
+#include "encoder_priv.h"
+#include "common.h"
+#include <time.h>
+#include <errno.h>
+#include <rockchip/rk_mpi.h>
+
+#define MPP_PKT_BUFFERS     4       //Output buffers, in the encoder or held downstream
+#define MPP_POLL_MS         100     //Output wait before the thread checks isRunning
+
+typedef struct
+{
+    MppBuffer           buf;
+    bool                busy;       //Attached to a task the encoder has not returned
+    int                 held;       //encoderHoldPacket references
+}MppPktSlot_t;
+
+typedef struct
+{
+    //Handles
+    MppCtx              ctx;
+    MppApi              *api;
+    MppEncCfg           cfg;
+
+    //Library Settings
+    int                 frameSize;
+    int                 headerSize;
+    MppCodingType       codecType;
+    MppFrameFormat      frameFormat;
+    MppEncRcMode        rcMode;
+    MppEncHeaderMode    headerMode;
+    MppEncSeiMode       seiMode;
+
+    //Low delay slice output, state of the access unit in progress
+    int                 part;
+    bool                partKey;
+
+    //Packets are encoded into a preallocated pool through the task interface. Slice
+    //output keeps MPP's own packet queue, each slice comes as a packet of its own
+    bool                useTasks;
+    MppBufferGroup      pktGroup;
+    MppPktSlot_t        pktSlots[MPP_PKT_BUFFERS];
+    pthread_mutex_t     pktLock;
+
+    //Frames of sources without a dmabuf are copied in here, made on the first one
+    MppBufferGroup      frmGroup;
+}EncoderMpp_t;
+
+
+static MppFrameFormat mppFormatFromFourcc(uint32_t pixfmt)
+{
+    switch (pixfmt)
+    {
+    case V4L2_PIX_FMT_NV12:
+        return MPP_FMT_YUV420SP;
+    case V4L2_PIX_FMT_NV16:
+        return MPP_FMT_YUV422SP;
+    case V4L2_PIX_FMT_NV24:
+    default:
+        return MPP_FMT_YUV444SP;
+    }
+}
+
+static MppEncRcMode mppRcMode(EncoderRcMode_t mode)
+{
+    switch (mode)
+    {
+    case ENCODER_RC_CBR:
+        return MPP_ENC_RC_MODE_CBR;
+    case ENCODER_RC_AVBR:
+        return MPP_ENC_RC_MODE_AVBR;
+    case ENCODER_RC_FIXQP:
+        return MPP_ENC_RC_MODE_FIXQP;
+    case ENCODER_RC_VBR:
+    default:
+        return MPP_ENC_RC_MODE_VBR;
+    }
+}
+
+//Caller holds pktLock
+static MppPktSlot_t *mppFindSlot(EncoderMpp_t *mpp, MppPacket packet)
+{
+    MppBuffer buf = mpp_packet_get_buffer(packet);
+    for(int i = 0; i < MPP_PKT_BUFFERS; i++)
+    {
+        if(mpp->pktSlots[i].buf == buf)
+        { return &mpp->pktSlots[i]; }
+    }
+    return NULL;
+}
+
+static CStatus_t mppInitPacketPool(EncoderMpp_t *mpp)
+{
+    //A packet never outgrows the raw frame
+    MPP_RET ret = mpp_buffer_group_get_internal(&mpp->pktGroup, MPP_BUFFER_TYPE_DRM);
+    OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "failed to get packet buffer group ret %d\n", ret);
+    ret = mpp_buffer_group_limit_config(mpp->pktGroup, mpp->frameSize, MPP_PKT_BUFFERS);
+    OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "failed to limit packet buffer group ret %d\n", ret);
+
+    for(int i = 0; i < MPP_PKT_BUFFERS; i++)
+    {
+        ret = mpp_buffer_get(mpp->pktGroup, &mpp->pktSlots[i].buf, mpp->frameSize);
+        OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_MEMORY, "failed to get packet buffer %d of %d bytes ret %d\n",
+                    i, mpp->frameSize, ret);
+    }
+    printf("mpp packet pool : %d x %d bytes\n", MPP_PKT_BUFFERS, mpp->frameSize);
+    return CSTATUS_SUCCESS;
+}
+
+//Input task with the frame and a free pool buffer that the encoder writes the packet into
+static CStatus_t mppPutTask(EncoderMpp_t *mpp, MppFrame frame)
+{
+    MppPktSlot_t *slot = NULL;
+    pthread_mutex_lock(&mpp->pktLock);
+    for(int i = 0; i < MPP_PKT_BUFFERS && slot == NULL; i++)
+    {
+        if(!mpp->pktSlots[i].busy && mpp->pktSlots[i].held == 0)
+        {
+            slot = &mpp->pktSlots[i];
+            slot->busy = true;
+        }
+    }
+    pthread_mutex_unlock(&mpp->pktLock);
+
+    //Same as a full input port, the frame is dropped
+    if(slot == NULL)
+    { return CSTATUS_AGAIN; }
+
+    MppPacket packet = NULL;
+    MppTask task = NULL;
+    bool full = false;
+    MPP_RET ret = mpp_packet_init_with_buffer(&packet, slot->buf);
+    if(ret == MPP_SUCCESS)
+    {
+        //No input task free is a full port
+        mpp_packet_set_length(packet, 0);
+        full = mpp->api->poll(mpp->ctx, MPP_PORT_INPUT, MPP_POLL_NON_BLOCK) != MPP_SUCCESS;
+    }
+    if(ret == MPP_SUCCESS && !full)
+    {
+        ret = mpp->api->dequeue(mpp->ctx, MPP_PORT_INPUT, &task);
+    }
+    if(ret == MPP_SUCCESS && task != NULL)
+    {
+        mpp_task_meta_set_frame(task, KEY_INPUT_FRAME, frame);
+        mpp_task_meta_set_packet(task, KEY_OUTPUT_PACKET, packet);
+        ret = mpp->api->enqueue(mpp->ctx, MPP_PORT_INPUT, task);
+        if(ret == MPP_SUCCESS)
+        { return CSTATUS_SUCCESS; }
+    }
+
+    if(packet != NULL)
+    { mpp_packet_deinit(&packet); }
+    pthread_mutex_lock(&mpp->pktLock);
+    slot->busy = false;
+    pthread_mutex_unlock(&mpp->pktLock);
+    OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "mpp input task failed ret %d\n", ret);
+    return CSTATUS_AGAIN;
+}
+
+//Output task, the frame it took is done with
+static MppPacket mppGetTask(EncoderMpp_t *mpp)
+{
+    MPP_RET ret = mpp->api->poll(mpp->ctx, MPP_PORT_OUTPUT, (MppPollType)MPP_POLL_MS);
+    if(ret != MPP_SUCCESS)
+    { return NULL; }
+
+    MppTask task = NULL;
+    ret = mpp->api->dequeue(mpp->ctx, MPP_PORT_OUTPUT, &task);
+    if(ret != MPP_SUCCESS || task == NULL)
+    { return NULL; }
+
+    MppPacket packet = NULL;
+    MppFrame frame = NULL;
+    mpp_task_meta_get_packet(task, KEY_OUTPUT_PACKET, &packet);
+    mpp_task_meta_get_frame(task, KEY_INPUT_FRAME, &frame);
+    mpp->api->enqueue(mpp->ctx, MPP_PORT_OUTPUT, task);
+
+    if(frame != NULL)
+    { mpp_frame_deinit(&frame); }
+    return packet;
+}
+
+static CStatus_t mppGetPacket(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    EncoderMpp_t *mpp = enc->priv;
+    MppPacket packet = NULL;
+
+    if(mpp->useTasks)
+    {
+        packet = mppGetTask(mpp);
+        if(packet == NULL)
+        { return CSTATUS_AGAIN; }
+    }
+    else
+    {
+        MPP_RET ret = mpp->api->encode_get_packet(mpp->ctx, &packet);
+        if (ret || NULL == packet)
+        {
+            printf("Get Package error, %d\n", ret);
+            usleep(1);
+            return CSTATUS_AGAIN;
+        }
+    }
+
+    RK_S32 intra = 0, qp = -1;
+    MppMeta meta = mpp_packet_get_meta(packet);
+    if(meta != NULL)
+    {
+        mpp_meta_get_s32(meta, KEY_OUTPUT_INTRA, &intra);
+        //Only the last slice of a split frame may carry it
+        mpp_meta_get_s32(meta, KEY_ENC_AVERAGE_QP, &qp);
+    }
+
+    pkt->data = (uint8_t*)mpp_packet_get_pos(packet);
+    pkt->len = mpp_packet_get_length(packet);
+    pkt->pts = mpp_packet_get_pts(packet);
+    pkt->keyFrame = (intra != 0);
+    pkt->qp = qp;
+    pkt->handle = packet;
+
+    //With split:out low delay every slice comes on its own, the last one is eoi
+    if(mpp_packet_is_partition(packet))
+    {
+        pkt->keyFrame = (mpp->part == 0) ? pkt->keyFrame : mpp->partKey;
+        pkt->part = mpp->part;
+        pkt->partial = !mpp_packet_is_eoi(packet);
+        mpp->partKey = pkt->keyFrame;
+        mpp->part = pkt->partial ? mpp->part + 1 : 0;
+    }
+    return CSTATUS_SUCCESS;
+}
+
+static void mppReleasePacket(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    EncoderMpp_t *mpp = enc->priv;
+    MppPacket packet = pkt->handle;
+    if(packet == NULL)
+    {
+        //Held, freed by mppReleaseHold
+        return;
+    }
+
+    if(mpp->useTasks)
+    {
+        //The pool buffer takes a new task once nobody holds it
+        pthread_mutex_lock(&mpp->pktLock);
+        MppPktSlot_t *slot = mppFindSlot(mpp, packet);
+        if(slot != NULL)
+        { slot->busy = false; }
+        pthread_mutex_unlock(&mpp->pktLock);
+    }
+    MPP_RET ret = mpp_packet_deinit(&packet);
+    assert(ret == MPP_SUCCESS);
+    pkt->handle = NULL;
+}
+
+static void *mppHoldPacket(Encoder_t *enc, EncoderPacket_t *pkt)
+{
+    EncoderMpp_t *mpp = enc->priv;
+    if(!mpp->useTasks)
+    {
+        //MPP's own packet, kept alive until released
+        void *ref = pkt->handle;
+        pkt->handle = NULL;
+        return ref;
+    }
+
+    pthread_mutex_lock(&mpp->pktLock);
+    MppPktSlot_t *slot = mppFindSlot(mpp, pkt->handle);
+    if(slot != NULL)
+    { slot->held++; }
+    pthread_mutex_unlock(&mpp->pktLock);
+    return slot;
+}
+
+static void mppReleaseHold(Encoder_t *enc, void *ref)
+{
+    EncoderMpp_t *mpp = enc->priv;
+    if(!mpp->useTasks)
+    {
+        MppPacket packet = ref;
+        mpp_packet_deinit(&packet);
+        return;
+    }
+
+    MppPktSlot_t *slot = ref;
+    pthread_mutex_lock(&mpp->pktLock);
+    slot->held--;
+    pthread_mutex_unlock(&mpp->pktLock);
+}
+
+//Frame rate and bitrate bounds, at start and from encoderSetBitrate
+static void encoderSetMppRc(EncoderMpp_t *mpp, int bps, int fps)
+{
+    /* fix input / output frame rate */
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:fps_in_flex", 0);
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:fps_in_num", fps);
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:fps_in_denorm", 1);
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:fps_out_flex", 0);
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:fps_out_num", fps);
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:fps_out_denorm", 1);
+
+    /* setup bitrate for different rc_mode */
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:bps_target", bps);
+    switch (mpp->rcMode) {
+    case MPP_ENC_RC_MODE_FIXQP: {
+        /* do not setup bitrate on FIXQP mode */
+    } break;
+    case MPP_ENC_RC_MODE_CBR: {
+        /* CBR mode has narrow bound */
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:bps_max", bps * 17 / 16);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:bps_min", bps * 15 / 16);
+    } break;
+    case MPP_ENC_RC_MODE_VBR:
+    case MPP_ENC_RC_MODE_AVBR: {
+        /* VBR mode has wide bound */
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:bps_max", bps * 17 / 16);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:bps_min", bps * 1 / 16);
+    } break;
+    default: {
+        /* default use CBR mode */
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:bps_max", bps * 17 / 16);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:bps_min",  bps * 15 / 16);
+    } break;
+    }
+}
+
+//QP bounds of the rc mode, at start and from encoderUpdateConfig
+static void encoderSetMppQp(EncoderMpp_t *mpp, const EncoderConfig_t *config)
+{
+    /* setup qp for different codec and rc_mode */
+    switch (mpp->codecType) {
+    case MPP_VIDEO_CodingAVC:
+    case MPP_VIDEO_CodingHEVC: {
+        RK_S32 qp_min = config->qpMin > 0 ? config->qpMin : 10;
+        RK_S32 qp_max = config->qpMax > 0 ? config->qpMax : 51;
+        switch (mpp->rcMode) {
+        case MPP_ENC_RC_MODE_FIXQP: {
+            RK_S32 fix_qp = config->qpMin;
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_init", fix_qp);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_max", fix_qp);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_min", fix_qp);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_max_i", fix_qp);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_min_i", fix_qp);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_ip", 0);
+        } break;
+        case MPP_ENC_RC_MODE_CBR:
+        case MPP_ENC_RC_MODE_VBR:
+        case MPP_ENC_RC_MODE_AVBR: {
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_init", -1);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_max", qp_max);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_min", qp_min);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_max_i", qp_max);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_min_i", qp_min);
+            mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_ip", 2);
+        } break;
+        default: {
+            printf("unsupport encoder rc mode %d\n", mpp->rcMode);
+        } break;
+        }
+    } break;
+    case MPP_VIDEO_CodingVP8: {
+        /* vp8 only setup base qp range */
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_init", 40);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_max", 127);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_min", 0);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_max_i", 127);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_min_i", 0);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:qp_ip", 6);
+    } break;
+    case MPP_VIDEO_CodingMJPEG: {
+        /* jpeg use special codec config to control qtable */
+        mpp_enc_cfg_set_s32(mpp->cfg, "jpeg:q_factor", 80);
+        mpp_enc_cfg_set_s32(mpp->cfg, "jpeg:qf_max", 99);
+        mpp_enc_cfg_set_s32(mpp->cfg, "jpeg:qf_min", 1);
+    } break;
+    default: {
+    } break;
+    }
+}
+
+//Profile and level, they go into the SPS
+static void encoderSetMppProfile(EncoderMpp_t *mpp, const EncoderConfig_t *config)
+{
+    switch (mpp->codecType) {
+    case MPP_VIDEO_CodingAVC: {
+        /*
+         * H.264 profile_idc parameter
+         * 66  - Baseline profile
+         * 77  - Main profile
+         * 100 - High profile
+         */
+        mpp_enc_cfg_set_s32(mpp->cfg, "h264:profile", config->profile);
+        /*
+         * H.264 level_idc parameter
+         * 10 / 11 / 12 / 13    - qcif@15fps / cif@7.5fps / cif@15fps / cif@30fps
+         * 20 / 21 / 22         - cif@30fps / half-D1@@25fps / D1@12.5fps
+         * 30 / 31 / 32         - D1@25fps / 720p@30fps / 720p@60fps
+         * 40 / 41 / 42         - 1080p@30fps / 1080p@30fps / 1080p@60fps
+         * 50 / 51 / 52         - 4K@30fps
+         */
+        mpp_enc_cfg_set_s32(mpp->cfg, "h264:level", config->level);
+        /* CABAC and 8x8 transform are not in the Baseline profile */
+        mpp_enc_cfg_set_s32(mpp->cfg, "h264:cabac_en", config->profile > 66);
+        mpp_enc_cfg_set_s32(mpp->cfg, "h264:cabac_idc", 0);
+        mpp_enc_cfg_set_s32(mpp->cfg, "h264:trans8x8", config->profile == 100);
+    } break;
+    case MPP_VIDEO_CodingHEVC: {
+        /*
+         * H.265 general_profile_idc 1 - Main, 2 - Main 10
+         * general_level_idc is 30 x level, 93 / 120 / 123 / 150 / 153 - 3.1 / 4 / 4.1 / 5 / 5.1
+         * general_tier_flag 0 - Main, 1 - High, for broadcast bitrates at a level
+         */
+        mpp_enc_cfg_set_s32(mpp->cfg, "h265:profile", config->profile);
+        mpp_enc_cfg_set_s32(mpp->cfg, "h265:level", config->level);
+        mpp_enc_cfg_set_s32(mpp->cfg, "h265:tier", config->tier);
+        if(config->ctu > 0 && mpp_enc_cfg_set_s32(mpp->cfg, "h265:max_cu_size", config->ctu) != MPP_SUCCESS)
+        {
+            printf("mpp does not take a ctu size, staying at the hardware default\n");
+        }
+    } break;
+    default: {
+    } break;
+    }
+}
+
+static CStatus_t mppUpdateConfig(Encoder_t *enc, const EncoderConfig_t *config, uint32_t fields)
+{
+    EncoderMpp_t *mpp = enc->priv;
+
+    if(fields & ENCODER_CFG_RC_MODE)
+    {
+        mpp->rcMode = mppRcMode(config->rcMode);
+        mpp_enc_cfg_set_s32(mpp->cfg, "rc:mode", mpp->rcMode);
+    }
+
+    //Takes effect from the next frame, the gop keeps its duration at a lower frame rate
+    int gop = config->gop ? config->gop : enc->config.fps * 2;
+    encoderSetMppRc(mpp, config->birate, config->fps);
+    gop = (gop * config->fps + enc->config.fps - 1) / enc->config.fps;
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:gop", config->refresh ? 0 : gop);
+
+    if(fields & (ENCODER_CFG_RC_MODE | ENCODER_CFG_QP))
+    {
+        encoderSetMppQp(mpp, config);
+    }
+    if(fields & ENCODER_CFG_HEADERS)
+    {
+        encoderSetMppProfile(mpp, config);
+    }
+
+    MPP_RET ret = mpp->api->control(mpp->ctx, MPP_ENC_SET_CFG, mpp->cfg);
+    OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "mpi control enc set cfg failed ret %d\n", ret);
+
+    //New SPS/PPS are only valid from an IDR frame on
+    if(fields & ENCODER_CFG_HEADERS)
+    {
+        ret = mpp->api->control(mpp->ctx, MPP_ENC_SET_IDR_FRAME, NULL);
+        OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "mpi control enc set idr frame failed ret %d\n", ret);
+    }
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t mppRequestKeyFrame(Encoder_t *enc)
+{
+    EncoderMpp_t *mpp = enc->priv;
+    MPP_RET ret = mpp->api->control(mpp->ctx, MPP_ENC_SET_IDR_FRAME, NULL);
+    OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "mpi control enc set idr frame failed ret %d\n", ret);
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t mppSetRate(Encoder_t *enc, int bps, int fps)
+{
+    EncoderConfig_t config = enc->config;
+    config.birate = bps;
+    config.fps = fps;
+    return mppUpdateConfig(enc, &config, ENCODER_CFG_BITRATE | ENCODER_CFG_FPS);
+}
+
+static int mppCtuSize(EncoderMpp_t *mpp, const EncoderConfig_t *config)
+{
+    return (mpp->codecType == MPP_VIDEO_CodingHEVC) ? (config->ctu ? config->ctu : 64) : 16;
+}
+
+//Intra rows or columns that sweep the picture over config->refresh frames, no IDR after the first
+static void encoderSetMppRefresh(EncoderMpp_t *mpp, const EncoderConfig_t *config)
+{
+    if(config->refresh <= 0)
+    {
+        mpp_enc_cfg_set_u32(mpp->cfg, "rc:refresh_en", 0);
+        return;
+    }
+
+    int ctu = mppCtuSize(mpp, config);
+    int lines = config->refreshCols ? (config->width + ctu - 1) / ctu : (config->height + ctu - 1) / ctu;
+    int num = (lines + config->refresh - 1) / config->refresh;
+    mpp_enc_cfg_set_u32(mpp->cfg, "rc:refresh_en", 1);
+    mpp_enc_cfg_set_u32(mpp->cfg, "rc:refresh_mode", config->refreshCols ? MPP_ENC_RC_INTRA_REFRESH_COL : MPP_ENC_RC_INTRA_REFRESH_ROW);
+    mpp_enc_cfg_set_u32(mpp->cfg, "rc:refresh_num", num);
+}
+
+//Slices that are handed out as soon as the hardware finishes each of them
+static void encoderSetMppSplit(EncoderMpp_t *mpp, const EncoderConfig_t *config)
+{
+    if(config->split == ENCODER_SPLIT_NONE)
+    {
+        mpp_enc_cfg_set_s32(mpp->cfg, "split:mode", MPP_ENC_SPLIT_NONE);
+        return;
+    }
+
+    int mode = MPP_ENC_SPLIT_BY_BYTE, arg = config->splitArg;
+    if(config->split == ENCODER_SPLIT_SLICES)
+    {
+        //A slice count becomes whole CTU rows per slice
+        int ctu = mppCtuSize(mpp, config);
+        int cols = (config->width + ctu - 1) / ctu;
+        int rows = (config->height + ctu - 1) / ctu;
+        int slices = (config->splitArg > rows) ? rows : config->splitArg;
+        mode = MPP_ENC_SPLIT_BY_CTU;
+        arg = (rows + slices - 1) / slices * cols;
+    }
+
+    printf("mpp slice output : split mode %d arg %d\n", mode, arg);
+    mpp_enc_cfg_set_s32(mpp->cfg, "split:mode", mode);
+    mpp_enc_cfg_set_s32(mpp->cfg, "split:arg", arg);
+    mpp_enc_cfg_set_s32(mpp->cfg, "split:out", MPP_ENC_SPLIT_OUT_LOWDELAY);
+}
+
+static CStatus_t encoderSetMppCfg(EncoderMpp_t *mpp, EncoderConfig_t *config)
+{
+    mpp_enc_cfg_set_s32(mpp->cfg, "prep:width",         config->width);
+    mpp_enc_cfg_set_s32(mpp->cfg, "prep:height",        config->height);
+    mpp_enc_cfg_set_s32(mpp->cfg, "prep:hor_stride",    config->horStride);
+    mpp_enc_cfg_set_s32(mpp->cfg, "prep:ver_stride",    config->verStride);
+    mpp_enc_cfg_set_s32(mpp->cfg, "prep:format",        mpp->frameFormat);
+
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:mode", mpp->rcMode);
+    encoderSetMppRc(mpp, config->birate, config->fps);
+    //With intra refresh only the first frame and those asked for are IDR frames
+    mpp_enc_cfg_set_s32(mpp->cfg, "rc:gop", config->refresh ? 0 : config->gop ? config->gop : config->fps * 2);
+    encoderSetMppRefresh(mpp, config);
+
+    /* drop frame or not when bitrate overflow */
+    mpp_enc_cfg_set_u32(mpp->cfg, "rc:drop_mode", MPP_ENC_RC_DROP_FRM_DISABLED);
+    mpp_enc_cfg_set_u32(mpp->cfg, "rc:drop_thd", 20); /* 20% of max bps */
+    mpp_enc_cfg_set_u32(mpp->cfg, "rc:drop_gap", 1); /* Do not continuous drop frame */
+
+    encoderSetMppQp(mpp, config);
+
+    /* setup codec  */
+    mpp_enc_cfg_set_s32(mpp->cfg, "codec:type", mpp->codecType);
+    switch (mpp->codecType) {
+    case MPP_VIDEO_CodingHEVC: {
+        encoderSetMppProfile(mpp, config);
+    } break;
+    case MPP_VIDEO_CodingAVC: {
+        encoderSetMppProfile(mpp, config);
+
+        // RK_U32 constraint_set;
+        // mpp_env_get_u32("constraint_set", &constraint_set, 0);
+        // if (constraint_set & 0x3f0000)
+        //     mpp_enc_cfg_set_s32(cfg_, "h264:constraint_set", constraint_set);
+    } break;
+    case MPP_VIDEO_CodingMJPEG:
+    case MPP_VIDEO_CodingVP8: {
+    } break;
+    default: {
+        printf("unsupport encoder coding type %d\n", mpp->codecType);
+    } break;
+    }
+
+    encoderSetMppSplit(mpp, config);
+
+    // mpp_env_get_u32("mirroring", &mirroring, 0);
+    // mpp_env_get_u32("rotation", &rotation, 0);
+    // mpp_env_get_u32("flip", &flip, 0);
+
+    // mpp_enc_cfg_set_s32(cfg_, "prep:mirroring", mirroring);
+    // mpp_enc_cfg_set_s32(cfg_, "prep:rotation", rotation);
+    // mpp_enc_cfg_set_s32(cfg_, "prep:flip", flip);
+
+    MPP_RET ret = mpp->api->control(mpp->ctx, MPP_ENC_SET_CFG, mpp->cfg);
+    if (ret != MPP_SUCCESS) {
+        printf("mpi control enc set cfg failed ret %d\n", ret);
+        return CSTATUS_FAIL;
+    }
+    return CSTATUS_SUCCESS;
+}
+
+
+static CStatus_t mppInit(Encoder_t *enc)
+{
+    EncoderMpp_t *mpp = calloc(1, sizeof(EncoderMpp_t));
+    OKAY_RETURN(mpp == NULL, CSTATUS_MEMORY, "failed to allocate mpp encoder\n");
+    enc->priv = mpp;
+    pthread_mutex_init(&mpp->pktLock, NULL);
+
+    bool hevc = (enc->config.codec == ENCODER_CODEC_H265);
+    mpp->codecType = hevc ? MPP_VIDEO_CodingHEVC : MPP_VIDEO_CodingAVC;
+    mpp->frameFormat = mppFormatFromFourcc(enc->config.pixfmt);
+    mpp->rcMode = mppRcMode(enc->config.rcMode);
+    enc->config.profile = enc->config.profile ? enc->config.profile : (hevc ? 1 : 100);
+    enc->config.level = enc->config.level ? enc->config.level : (hevc ? 123 : 40);
+    mpp->frameSize = GetFrameSize(mpp->frameFormat, enc->config.horStride, enc->config.verStride);
+    mpp->headerSize = GetHeaderSize(mpp->frameFormat, enc->config.width, enc->config.height);
+
+    MPP_RET ret = MPP_SUCCESS;
+    MppApi *api_ = NULL;
+    MppCtx ctx_ = NULL;
+
+    do
+    {
+        ret = mpp_check_support_format(MPP_CTX_ENC, mpp->codecType);
+        OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "Mpp don't support codec\n");
+
+        ret = mpp_create(&mpp->ctx, &mpp->api);
+        OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "failed to create mpp\n");
+
+        api_ = mpp->api;
+        ctx_ = mpp->ctx;
+
+        MppPollType timeout = MPP_POLL_NON_BLOCK;
+
+        ret = api_->control(ctx_, MPP_SET_INPUT_TIMEOUT, &timeout);
+        OKAY_STOP(ret != MPP_SUCCESS, "mpi control set input timeout ret %d\n", ret);
+
+        timeout = MPP_POLL_BLOCK;
+        ret = api_->control(ctx_, MPP_SET_OUTPUT_TIMEOUT, &timeout);
+        OKAY_STOP(ret != MPP_SUCCESS, "mpi control set output timeout ret %d\n", ret);
+
+        ret = mpp_init(ctx_, MPP_CTX_ENC, mpp->codecType);
+        OKAY_STOP(ret != MPP_SUCCESS, "failed to init mpp\n");
+
+        ret = mpp_enc_cfg_init(&mpp->cfg);
+        OKAY_STOP(ret != MPP_SUCCESS, "failed to init cfg\n");
+
+        ret = api_->control(ctx_, MPP_ENC_GET_CFG, mpp->cfg);
+        OKAY_STOP(ret != MPP_SUCCESS, "get enc cfg failed ret %d\n", ret);
+
+        if(CSTATUS_SUCCESS != encoderSetMppCfg(mpp, &enc->config))
+        {
+            printf("failed to set enc cfg\n");
+            ret = MPP_NOK;
+            break;
+        }
+
+        mpp->useTasks = (enc->config.split == ENCODER_SPLIT_NONE);
+        if(mpp->useTasks && CSTATUS_SUCCESS != mppInitPacketPool(mpp))
+        {
+            ret = MPP_NOK;
+        }
+    } while (0);
+
+    return (ret == MPP_SUCCESS) ? CSTATUS_SUCCESS : CSTATUS_FAIL;
+}
+
+static void mppDeinit(Encoder_t *enc)
+{
+    EncoderMpp_t *mpp = enc->priv;
+    if(mpp == NULL)
+    {
+        return;
+    }
+
+    if(mpp->cfg != NULL)
+    {
+        mpp_enc_cfg_deinit(mpp->cfg);
+    }
+    if(mpp->ctx != NULL)
+    {
+        mpp_destroy(mpp->ctx);
+    }
+    for(int i = 0; i < MPP_PKT_BUFFERS; i++)
+    {
+        if(mpp->pktSlots[i].buf != NULL)
+        { mpp_buffer_put(mpp->pktSlots[i].buf); }
+    }
+    if(mpp->pktGroup != NULL)
+    {
+        mpp_buffer_group_put(mpp->pktGroup);
+    }
+    if(mpp->frmGroup != NULL)
+    {
+        mpp_buffer_group_put(mpp->frmGroup);
+    }
+    pthread_mutex_destroy(&mpp->pktLock);
+    free(mpp);
+    enc->priv = NULL;
+}
+
+//The VPU only reads dmabufs, a frame in plain memory goes through one of MPP's own
+static MPP_RET mppCopyFrame(EncoderMpp_t *mpp, Buffer_t *buff, MppBuffer *out)
+{
+    MPP_RET ret = MPP_SUCCESS;
+    if(mpp->frmGroup == NULL)
+    {
+        ret = mpp_buffer_group_get_internal(&mpp->frmGroup, MPP_BUFFER_TYPE_DRM);
+        OKAY_RETURN(ret != MPP_SUCCESS, ret, "failed to get frame buffer group ret %d\n", ret);
+        printf("mpp encoder : copying input frames, the source has no dmabuf\n");
+    }
+
+    //Released buffers of the group are reused, it settles at the frames in flight
+    ret = mpp_buffer_get(mpp->frmGroup, out, mpp->frameSize);
+    OKAY_RETURN(ret != MPP_SUCCESS, ret, "failed to get %d bytes frame buffer ret %d\n", mpp->frameSize, ret);
+
+    int len = (buff->len[0] < mpp->frameSize) ? buff->len[0] : mpp->frameSize;
+    memcpy(mpp_buffer_get_ptr(*out), buff->ptr[0] + buff->offset[0], len);
+    return MPP_SUCCESS;
+}
+
+static CStatus_t mppPutFrame(Encoder_t *enc, Buffer_t *buff, int64_t pts)
+{
+    EncoderMpp_t *mpp = enc->priv;
+    MPP_RET ret = MPP_SUCCESS;
+    MppBuffer cam_buf = NULL;
+    MppFrame frame = NULL;
+
+    ret = mpp_frame_init(&frame);
+    OKAY_RETURN(ret != MPP_SUCCESS, CSTATUS_FAIL, "mpp_frame_init failed %d\n", ret);
+
+    mpp_frame_set_width(frame, enc->config.width);
+    mpp_frame_set_height(frame, enc->config.height);
+    mpp_frame_set_hor_stride(frame, enc->config.horStride);
+    mpp_frame_set_ver_stride(frame, enc->config.verStride);
+    mpp_frame_set_fmt(frame, mpp->frameFormat);
+    mpp_frame_set_eos(frame, 0);
+    mpp_frame_set_pts(frame, pts);
+
+
+    if(buff->dmafd[0] >= 0)
+    {
+        MppBufferInfo info;
+        memset(&info, 0, sizeof(MppBufferInfo));
+        info.type = MPP_BUFFER_TYPE_EXT_DMA;
+        info.fd =  buff->dmafd[0];
+        info.size = (uint32_t)buff->size[0] & 0x07ffffff;
+        info.index = ((uint32_t)buff->size[0] & 0xf8000000) >> 27;
+        ret = mpp_buffer_import(&cam_buf, &info);
+    }
+    else
+    {
+        ret = mppCopyFrame(mpp, buff, &cam_buf);
+    }
+    if(ret != MPP_SUCCESS)
+    {
+        mpp_frame_deinit(&frame);
+        OKAY_RETURN(true, CSTATUS_FAIL, "failed to attach input frame %d\n", ret);
+    }
+
+    mpp_frame_set_buffer(frame, cam_buf);
+
+    CStatus_t status = CSTATUS_SUCCESS;
+    if(mpp->useTasks)
+    {
+        //A queued frame is freed with its output task
+        status = mppPutTask(mpp, frame);
+        if(status != CSTATUS_SUCCESS)
+        { mpp_frame_deinit(&frame); }
+    }
+    else
+    {
+        ret = mpp->api->encode_put_frame(mpp->ctx, frame);
+        status = (ret == MPP_SUCCESS) ? CSTATUS_SUCCESS : CSTATUS_FAIL;
+        mpp_frame_deinit(&frame);
+    }
+
+    //The encoder keeps its own references, drop ours whether it took the frame or not
+    mpp_buffer_put(cam_buf);
+
+    OKAY_RETURN(status == CSTATUS_FAIL, status, "frame encoding failed %d\n", ret);
+    return status;
+}
+
+const EncoderOps_t encoderMppOps = {
+    .name = "mpp",
+    .Init = mppInit,
+    .Deinit = mppDeinit,
+    .PutFrame = mppPutFrame,
+    .GetPacket = mppGetPacket,
+    .ReleasePacket = mppReleasePacket,
+    .SetRate = mppSetRate,
+    .UpdateConfig = mppUpdateConfig,
+    .RequestKeyFrame = mppRequestKeyFrame,
+    .HoldPacket = mppHoldPacket,
+    .ReleaseHold = mppReleaseHold,
+};
@@ -3,6 +3,13 @@
 
 #include "encoder.h"
 
+extern const EncoderOps_t encoderMockOps;
+
+#ifdef CAPTURE_WITH_MPP
+#include <rockchip/rk_mpi.h>
+
+extern const EncoderOps_t encoderMppOps;
+
 #define MPP_ALIGN(x, a) (((x) + (a)-1) & ~((a)-1))
 #define SZ_1K (1024)
 #define SZ_2K (SZ_1K * 2)
@@ -11,4 +18,6 @@
 int GetFrameSize(MppFrameFormat frame_format, int32_t hor_stride, int32_t ver_stride);
 int GetHeaderSize(MppFrameFormat frame_format, uint32_t width, uint32_t height);
 RK_S64 mpp_time();
-#endif
\ No newline at end of file
+#endif
+
+#endif
@@ -0,0 +1,481 @@
+#include "fec.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define FEC_DEC_WINDOW          512         //Media packets kept for recovery, > 2 x (L x D + reorder)
+#define FEC_DEC_GROUPS          128         //FEC packets kept, > L + D
+#define FEC_DEC_REORDER         16          //Packets a FEC packet may arrive after the last one it covers
+#define FEC_DEC_PASSES          4           //2D recovery rounds per missing packet
+
+//XOR sum of a column or row, also the received FEC packet
+typedef struct
+{
+    bool                valid;
+    FecDirection_t      dir;
+    uint16_t            base;
+    int                 offset;
+    int                 na;
+    uint16_t            lenRec;
+    uint8_t             ptRec;
+    uint32_t            tsRec;
+    uint32_t            lastTs;
+    uint16_t            len;            //Longest payload so far, the rest is zero
+    uint8_t             payload[FEC_MAX_PAYLOAD];
+}FecGroup_t;
+
+struct FecEnc
+{
+    FecConfig_t         config;
+    int                 index;          //Next cell of the matrix, row by row
+    FecGroup_t          cols[FEC_MAX_COLS];
+    FecGroup_t          row;
+    uint16_t            seq[2];         //Per direction
+};
+
+typedef struct
+{
+    bool                valid;
+    uint16_t            seq;
+    uint8_t             pt;
+    uint32_t            ts;
+    uint16_t            len;
+    uint8_t             payload[FEC_MAX_PAYLOAD];
+}FecSlot_t;
+
+struct FecDec
+{
+    void                (*Deliver)(const uint8_t *ts, size_t len, void *udata);
+    void                *udata;
+
+    FecSlot_t           *slots;         //FEC_DEC_WINDOW, by sequence
+    FecGroup_t          *groups;        //FEC_DEC_GROUPS, round robin
+    int                 nextGroup;
+
+    bool                started;
+    uint16_t            next;           //Next sequence to deliver
+    uint16_t            highest;
+    int                 holdback;       //Packets a missing one waits for, from the FEC seen
+    bool                dirty;          //New packets since the last recovery pass
+
+    FecDecStats_t       stats;
+};
+
+
+void fecXor(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    for(; i + 64 <= len; i += 64)
+    {
+        __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), _mm_loadu_si128((const __m128i *)(src + i)));
+        __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i + 16)), _mm_loadu_si128((const __m128i *)(src + i + 16)));
+        __m128i c = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i + 32)), _mm_loadu_si128((const __m128i *)(src + i + 32)));
+        __m128i d = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i + 48)), _mm_loadu_si128((const __m128i *)(src + i + 48)));
+        _mm_storeu_si128((__m128i *)(dst + i), a);
+        _mm_storeu_si128((__m128i *)(dst + i + 16), b);
+        _mm_storeu_si128((__m128i *)(dst + i + 32), c);
+        _mm_storeu_si128((__m128i *)(dst + i + 48), d);
+    }
+    for(; i + 16 <= len; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(src + i))));
+    }
+#elif defined(__ARM_NEON)
+    for(; i + 64 <= len; i += 64)
+    {
+        uint8x16_t a = veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i));
+        uint8x16_t b = veorq_u8(vld1q_u8(dst + i + 16), vld1q_u8(src + i + 16));
+        uint8x16_t c = veorq_u8(vld1q_u8(dst + i + 32), vld1q_u8(src + i + 32));
+        uint8x16_t d = veorq_u8(vld1q_u8(dst + i + 48), vld1q_u8(src + i + 48));
+        vst1q_u8(dst + i, a);
+        vst1q_u8(dst + i + 16, b);
+        vst1q_u8(dst + i + 32, c);
+        vst1q_u8(dst + i + 48, d);
+    }
+    for(; i + 16 <= len; i += 16)
+    {
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), vld1q_u8(src + i)));
+    }
+#endif
+
+    //memcpy keeps the unaligned words legal, it compiles to a move
+    for(; i + 8 <= len; i += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+
+    for(; i < len; i++)
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+CStatus_t fecParseConfig(FecConfig_t *config, const char *str)
+{
+    char rest[8] = "";
+    memset(config, 0, sizeof(FecConfig_t));
+    int n = sscanf(str, "%dx%d%7s", &config->cols, &config->rows, rest);
+    OKAY_RETURN(n < 2, CSTATUS_BAD_PARAM, "fec %s is not LxD\n", str);
+    OKAY_RETURN(n == 3 && strcmp(rest, ",row") != 0, CSTATUS_BAD_PARAM, "fec %s has an unknown option %s\n", str, rest);
+    config->rowFec = n == 3;
+
+    OKAY_RETURN(config->cols < 1 || config->cols > FEC_MAX_COLS || config->rows < 1 || config->rows > FEC_MAX_ROWS ||
+                config->cols * config->rows > FEC_MAX_CELLS, CSTATUS_BAD_PARAM,
+                "fec %s out of range, L and D up to %d, L x D up to %d\n", str, FEC_MAX_COLS, FEC_MAX_CELLS);
+    return CSTATUS_SUCCESS;
+}
+
+//Version 2, CSRCs and an extension skipped. Returns the header length, 0 if it is no RTP packet
+static size_t fecRtpHeader(const uint8_t *rtp, size_t len)
+{
+    if(len < FEC_RTP_HEADER || (rtp[0] >> 6) != 2)
+    { return 0; }
+
+    size_t header = FEC_RTP_HEADER + 4 * (rtp[0] & 0x0f);
+    if((rtp[0] & 0x10) && len >= header + 4)
+    { header += 4 + 4 * (((size_t)rtp[header + 2] << 8) | rtp[header + 3]); }
+    return (header <= len) ? header : 0;
+}
+
+static uint16_t fecRd16(const uint8_t *p) { return (uint16_t)((p[0] << 8) | p[1]); }
+static uint32_t fecRd32(const uint8_t *p) { return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]; }
+static void fecWr16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = v; }
+static void fecWr32(uint8_t *p, uint32_t v) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+
+
+/****************************************************************************** */
+/**************************** Sender ****************************************** */
+/****************************************************************************** */
+
+FecEnc_t *fecEncCreate(FecConfig_t *config)
+{
+    FecEnc_t *fec = calloc(1, sizeof(FecEnc_t));
+    OKAY_RETURN(fec == NULL, NULL, "failed to allocate fec encoder\n");
+    memcpy(&fec->config, config, sizeof(FecConfig_t));
+    return fec;
+}
+
+void fecEncDestroy(FecEnc_t *fec)
+{
+    free(fec);
+}
+
+static void fecGroupStart(FecGroup_t *g, FecDirection_t dir, uint16_t base, int offset, int na)
+{
+    memset(g->payload, 0, g->len);
+    g->dir = dir;
+    g->base = base;
+    g->offset = offset;
+    g->na = na;
+    g->lenRec = 0;
+    g->ptRec = 0;
+    g->tsRec = 0;
+    g->len = 0;
+}
+
+static void fecGroupAdd(FecGroup_t *g, uint8_t pt, uint32_t ts, const uint8_t *payload, uint16_t len)
+{
+    fecXor(g->payload, payload, len);
+    g->lenRec ^= len;
+    g->ptRec ^= pt;
+    g->tsRec ^= ts;
+    g->lastTs = ts;
+    if(len > g->len)
+    { g->len = len; }
+}
+
+static void fecGroupEmit(FecEnc_t *fec, FecGroup_t *g, FecPacket_t *out)
+{
+    uint8_t *p = out->data;
+    p[0] = 0x80;
+    p[1] = FEC_RTP_PT;
+    fecWr16(p + 2, fec->seq[g->dir]++);
+    fecWr32(p + 4, g->lastTs);
+    fecWr32(p + 8, 0);
+
+    uint8_t *h = p + FEC_RTP_HEADER;
+    fecWr16(h, g->base);
+    fecWr16(h + 2, g->lenRec);
+    h[4] = 0x80 | (g->ptRec & 0x7f);
+    h[5] = h[6] = h[7] = 0;
+    fecWr32(h + 8, g->tsRec);
+    h[12] = (g->dir == FEC_ROW) ? 0x40 : 0x00;
+    h[13] = (uint8_t)g->offset;
+    h[14] = (uint8_t)g->na;
+    h[15] = 0;
+
+    memcpy(h + FEC_HEADER, g->payload, g->len);
+    out->dir = g->dir;
+    out->len = FEC_RTP_HEADER + FEC_HEADER + g->len;
+}
+
+int fecEncode(FecEnc_t *fec, const uint8_t *rtp, size_t len, FecPacket_t out[2])
+{
+    size_t header = fecRtpHeader(rtp, len);
+    OKAY_RETURN(header == 0 || len - header > FEC_MAX_PAYLOAD, 0, "fec got no rtp media packet\n");
+
+    const FecConfig_t *config = &fec->config;
+    uint16_t seq = fecRd16(rtp + 2);
+    uint8_t pt = rtp[1] & 0x7f;
+    uint32_t ts = fecRd32(rtp + 4);
+    uint16_t plen = (uint16_t)(len - header);
+    int col = fec->index % config->cols;
+    int row = fec->index / config->cols;
+    int count = 0;
+
+    FecGroup_t *g = &fec->cols[col];
+    if(row == 0)
+    { fecGroupStart(g, FEC_COLUMN, seq, config->cols, config->rows); }
+    fecGroupAdd(g, pt, ts, rtp + header, plen);
+    if(row == config->rows - 1)
+    { fecGroupEmit(fec, g, &out[count++]); }
+
+    if(config->rowFec)
+    {
+        g = &fec->row;
+        if(col == 0)
+        { fecGroupStart(g, FEC_ROW, seq, 1, config->cols); }
+        fecGroupAdd(g, pt, ts, rtp + header, plen);
+        if(col == config->cols - 1)
+        { fecGroupEmit(fec, g, &out[count++]); }
+    }
+
+    fec->index = (fec->index + 1) % (config->cols * config->rows);
+    return count;
+}
+
+
+/****************************************************************************** */
+/**************************** Receiver **************************************** */
+/****************************************************************************** */
+
+FecDec_t *fecDecCreate(void (*Deliver)(const uint8_t *ts, size_t len, void *udata), void *udata)
+{
+    FecDec_t *fec = calloc(1, sizeof(FecDec_t));
+    OKAY_RETURN(fec == NULL, NULL, "failed to allocate fec decoder\n");
+    fec->Deliver = Deliver;
+    fec->udata = udata;
+    fec->holdback = FEC_DEC_REORDER;
+
+    fec->slots = calloc(FEC_DEC_WINDOW, sizeof(FecSlot_t));
+    fec->groups = calloc(FEC_DEC_GROUPS, sizeof(FecGroup_t));
+    if(fec->slots == NULL || fec->groups == NULL)
+    {
+        fecDecDestroy(fec);
+        OKAY_RETURN(true, NULL, "failed to allocate fec decoder window\n");
+    }
+    return fec;
+}
+
+void fecDecDestroy(FecDec_t *fec)
+{
+    free(fec->slots);
+    free(fec->groups);
+    free(fec);
+}
+
+void fecDecGetStats(FecDec_t *fec, FecDecStats_t *stats)
+{
+    memcpy(stats, &fec->stats, sizeof(FecDecStats_t));
+}
+
+static FecSlot_t *fecDecSlot(FecDec_t *fec, uint16_t seq)
+{
+    FecSlot_t *slot = &fec->slots[seq % FEC_DEC_WINDOW];
+    return (slot->valid && slot->seq == seq) ? slot : NULL;
+}
+
+//Rebuilds the member of g that is missing if it is the only one, true on success
+static bool fecDecRecover(FecDec_t *fec, FecGroup_t *g)
+{
+    uint16_t missing = 0;
+    int numMissing = 0;
+    for(int k = 0; k < g->na && numMissing < 2; k++)
+    {
+        uint16_t seq = (uint16_t)(g->base + k * g->offset);
+        if(fecDecSlot(fec, seq) == NULL)
+        {
+            missing = seq;
+            numMissing++;
+        }
+    }
+
+    //Complete, or the one missing was already given up on
+    if(numMissing != 1 || (int16_t)(missing - fec->next) < 0)
+    {
+        g->valid = numMissing > 1 && (int16_t)(g->base + (g->na - 1) * g->offset - fec->next) >= 0;
+        return false;
+    }
+
+    FecSlot_t *slot = &fec->slots[missing % FEC_DEC_WINDOW];
+    uint16_t len = g->lenRec;
+    uint8_t pt = g->ptRec;
+    uint32_t ts = g->tsRec;
+    memcpy(slot->payload, g->payload, g->len);
+    memset(slot->payload + g->len, 0, FEC_MAX_PAYLOAD - g->len);
+    for(int k = 0; k < g->na; k++)
+    {
+        FecSlot_t *m = fecDecSlot(fec, (uint16_t)(g->base + k * g->offset));
+        if(m == NULL)
+        { continue; }
+        fecXor(slot->payload, m->payload, m->len);
+        len ^= m->len;
+        pt ^= m->pt;
+        ts ^= m->ts;
+    }
+
+    g->valid = false;
+    if(len > g->len)
+    { return false; }
+
+    slot->valid = true;
+    slot->seq = missing;
+    slot->pt = pt;
+    slot->ts = ts;
+    slot->len = len;
+    fec->stats.recovered++;
+    fec->stats.media++;
+    return true;
+}
+
+//Column and row FEC feed each other, a few rounds repair most 2D patterns
+static void fecDecRecoverAll(FecDec_t *fec)
+{
+    for(int pass = 0; pass < FEC_DEC_PASSES; pass++)
+    {
+        bool progress = false;
+        for(int i = 0; i < FEC_DEC_GROUPS; i++)
+        {
+            if(fec->groups[i].valid && fecDecRecover(fec, &fec->groups[i]))
+            { progress = true; }
+        }
+        if(!progress)
+        { break; }
+    }
+}
+
+static void fecDecDrain(FecDec_t *fec, bool flush)
+{
+    while(fec->started && (int16_t)(fec->highest - fec->next) >= 0)
+    {
+        FecSlot_t *slot = fecDecSlot(fec, fec->next);
+        if(slot == NULL && fec->dirty)
+        {
+            fecDecRecoverAll(fec);
+            fec->dirty = false;
+            slot = fecDecSlot(fec, fec->next);
+        }
+
+        if(slot != NULL)
+        {
+            fec->Deliver(slot->payload, slot->len, fec->udata);
+        }
+        else if(flush || (int16_t)(fec->highest - fec->next) > fec->holdback)
+        {
+            fec->stats.lost++;
+        }
+        else
+        {
+            break;
+        }
+        fec->next++;
+    }
+}
+
+void fecDecMedia(FecDec_t *fec, const uint8_t *rtp, size_t len)
+{
+    size_t header = fecRtpHeader(rtp, len);
+    if(header == 0 || len - header > FEC_MAX_PAYLOAD)
+    { return; }
+
+    uint16_t seq = fecRd16(rtp + 2);
+    if(!fec->started)
+    {
+        fec->started = true;
+        fec->next = seq;
+        fec->highest = seq;
+    }
+
+    int16_t ahead = (int16_t)(seq - fec->next);
+    if(ahead < 0 || fecDecSlot(fec, seq) != NULL)
+    {
+        fec->stats.late++;
+        return;
+    }
+
+    //A jump past the window is a restarted sender, start over from here
+    if(ahead >= FEC_DEC_WINDOW / 2)
+    {
+        fecDecDrain(fec, true);
+        fec->next = seq;
+        fec->highest = seq;
+    }
+
+    FecSlot_t *slot = &fec->slots[seq % FEC_DEC_WINDOW];
+    slot->valid = true;
+    slot->seq = seq;
+    slot->pt = rtp[1] & 0x7f;
+    slot->ts = fecRd32(rtp + 4);
+    slot->len = (uint16_t)(len - header);
+    memcpy(slot->payload, rtp + header, slot->len);
+    if((int16_t)(seq - fec->highest) > 0)
+    { fec->highest = seq; }
+
+    fec->stats.media++;
+    fec->dirty = true;
+    fecDecDrain(fec, false);
+}
+
+void fecDecFec(FecDec_t *fec, const uint8_t *pkt, size_t len)
+{
+    size_t header = fecRtpHeader(pkt, len);
+    if(header == 0 || len < header + FEC_HEADER || len - header - FEC_HEADER > FEC_MAX_PAYLOAD)
+    { return; }
+
+    const uint8_t *h = pkt + header;
+    int offset = h[13], na = h[14];
+    if(offset < 1 || na < 1 || (h[12] & 0x38) != 0)
+    { return; }
+    fec->stats.fec++;
+
+    //Everything it covers is delivered already, the usual case without loss
+    uint16_t base = fecRd16(h);
+    if(fec->started && (int16_t)(base + (na - 1) * offset - fec->next) < 0)
+    { return; }
+
+    FecGroup_t *g = &fec->groups[fec->nextGroup];
+    fec->nextGroup = (fec->nextGroup + 1) % FEC_DEC_GROUPS;
+    g->valid = true;
+    g->dir = (h[12] & 0x40) ? FEC_ROW : FEC_COLUMN;
+    g->base = base;
+    g->offset = offset;
+    g->na = na;
+    g->lenRec = fecRd16(h + 2);
+    g->ptRec = h[4] & 0x7f;
+    g->tsRec = fecRd32(h + 8);
+    g->len = (uint16_t)(len - header - FEC_HEADER);
+    memcpy(g->payload, h + FEC_HEADER, g->len);
+
+    //Missing packets wait as long as a FEC packet covering them can still come
+    int span = (na - 1) * offset + FEC_DEC_REORDER;
+    if(span > fec->holdback && span < FEC_DEC_WINDOW / 2)
+    { fec->holdback = span; }
+
+    fec->dirty = true;
+    fecDecDrain(fec, false);
+}
+
+void fecDecFlush(FecDec_t *fec)
+{
+    fecDecDrain(fec, true);
+}
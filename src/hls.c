@@ -0,0 +1,559 @@
+#define _GNU_SOURCE
+#include "hls.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define HLS_TS_PACKET           188
+#define HLS_PTS_MASK            ((1LL << 33) - 1)
+#define HLS_PART_MIN_CAPACITY   (64 * 1024)
+#define HLS_LL_PART_SEGMENTS    2           //Complete segments still listed with their parts
+#define HLS_BLOCK_TARGETS       3           //Blocking requests give up after this many target durations
+
+typedef struct
+{
+    int                 refs;           //Ring plus viewers sending it, atomic
+    bool                closed;         //Immutable from here on
+    bool                independent;    //Starts at a random access point
+    int64_t             duration;       //90kHz, set on close
+    size_t              len;
+    size_t              capacity;
+    uint8_t             *data;
+}HlsPart_t;
+
+typedef struct
+{
+    int64_t             msn;            //Media sequence number, -1 if unused
+    int64_t             startPts;
+    int64_t             duration;       //90kHz, set on completion
+    bool                complete;
+    int                 numParts;       //Last one is open until complete
+    HlsPart_t           *parts[HLS_MAX_PARTS];
+}HlsSegment_t;
+
+struct Hls
+{
+    HlsConfig_t         config;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;           //Broadcast on every closed part and on destroy
+
+    HlsSegment_t        *ring;
+    int                 ringSize;
+    int64_t             msn;            //Segment being written, -1 until the first random access point
+    int64_t             partStartPts;
+    int64_t             lastPts;
+    int64_t             maxDuration;    //Longest segment so far, for the target duration
+
+    int                 users;          //Requests inside hlsServe
+    bool                destroyed;
+};
+
+
+static void hlsPartRelease(HlsPart_t *part)
+{
+    if(part != NULL && __atomic_sub_fetch(&part->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(part->data);
+        free(part);
+    }
+}
+
+static HlsPart_t *hlsPartCreate(bool independent)
+{
+    HlsPart_t *part = calloc(1, sizeof(HlsPart_t));
+    OKAY_RETURN(part == NULL, NULL, "failed to allocate hls part\n");
+    part->refs = 1;
+    part->independent = independent;
+    return part;
+}
+
+static int64_t hlsPtsDiff(int64_t a, int64_t b)
+{
+    return (a - b) & HLS_PTS_MASK;
+}
+
+//Finds the first video PES start of an access unit: its PTS and the random access indicator ts_write_pes sets
+static bool hlsScan(const uint8_t *data, size_t len, int64_t *pts, bool *key)
+{
+    for(size_t i = 0; i + HLS_TS_PACKET <= len; i += HLS_TS_PACKET)
+    {
+        const uint8_t *p = data + i;
+        if(p[0] != 0x47 || !(p[1] & 0x40))
+        { continue; }
+
+        int afc = (p[3] >> 4) & 0x03;
+        size_t payload = 4;
+        bool rai = false;
+        if(afc & 0x02)
+        {
+            rai = p[4] > 0 && (p[5] & 0x40);
+            payload += 1 + p[4];
+        }
+        if(!(afc & 0x01) || payload + 14 > HLS_TS_PACKET)
+        { continue; }
+
+        const uint8_t *pes = p + payload;
+        if(pes[0] != 0 || pes[1] != 0 || pes[2] != 1 || (pes[3] & 0xF0) != 0xE0 || !(pes[7] & 0x80))
+        { continue; }
+
+        *pts = ((int64_t)(pes[9] & 0x0E) << 29) | ((int64_t)pes[10] << 22) | ((int64_t)(pes[11] & 0xFE) << 14) |
+               ((int64_t)pes[12] << 7) | (pes[13] >> 1);
+        *key = rai;
+        return true;
+    }
+    return false;
+}
+
+//Caller holds hls->lock
+static void hlsClosePart(Hls_t *hls, HlsSegment_t *seg, int64_t pts)
+{
+    if(seg->numParts == 0)
+    { return; }
+
+    HlsPart_t *part = seg->parts[seg->numParts - 1];
+    part->duration = hlsPtsDiff(pts, hls->partStartPts);
+    part->closed = true;
+    hls->partStartPts = pts;
+    pthread_cond_broadcast(&hls->cond);
+}
+
+//Caller holds hls->lock
+static CStatus_t hlsOpenPart(HlsSegment_t *seg, bool independent)
+{
+    HlsPart_t *part = hlsPartCreate(independent);
+    OKAY_RETURN(part == NULL, CSTATUS_MEMORY, "failed to open hls part\n");
+    seg->parts[seg->numParts++] = part;
+    return CSTATUS_SUCCESS;
+}
+
+//Caller holds hls->lock, the oldest segment of the ring is dropped
+static CStatus_t hlsStartSegment(Hls_t *hls, int64_t msn, int64_t pts)
+{
+    HlsSegment_t *seg = &hls->ring[msn % hls->ringSize];
+    for(int i = 0; i < seg->numParts; i++)
+    { hlsPartRelease(seg->parts[i]); }
+
+    memset(seg, 0, sizeof(HlsSegment_t));
+    seg->msn = msn;
+    seg->startPts = pts;
+    hls->msn = msn;
+    hls->partStartPts = pts;
+    return hlsOpenPart(seg, true);
+}
+
+static HlsSegment_t *hlsFindSegment(Hls_t *hls, int64_t msn)
+{
+    if(msn < 0)
+    { return NULL; }
+    HlsSegment_t *seg = &hls->ring[msn % hls->ringSize];
+    return (seg->msn == msn) ? seg : NULL;
+}
+
+Hls_t *hlsCreate(HlsConfig_t *config)
+{
+    OKAY_RETURN(config->segmentMs <= 0 || config->segments <= 0 || config->partMs < 0, NULL,
+                "bad hls configuration\n");
+
+    Hls_t *hls = calloc(1, sizeof(Hls_t));
+    OKAY_RETURN(hls == NULL, NULL, "failed to allocate hls\n");
+    memcpy(&hls->config, config, sizeof(HlsConfig_t));
+
+    //One extra for the segment being written, one for viewers still fetching the one that just left
+    hls->ringSize = config->segments + 2;
+    hls->ring = calloc(hls->ringSize, sizeof(HlsSegment_t));
+    if(hls->ring == NULL)
+    {
+        free(hls);
+        OKAY_RETURN(true, NULL, "failed to allocate hls segments\n");
+    }
+    for(int i = 0; i < hls->ringSize; i++)
+    { hls->ring[i].msn = -1; }
+    hls->msn = -1;
+
+    pthread_mutex_init(&hls->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&hls->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return hls;
+}
+
+void hlsDestroy(Hls_t *hls)
+{
+    //Wake up blocked requests and wait for them to leave
+    pthread_mutex_lock(&hls->lock);
+    hls->destroyed = true;
+    pthread_cond_broadcast(&hls->cond);
+    while (hls->users > 0)
+    { pthread_cond_wait(&hls->cond, &hls->lock); }
+    pthread_mutex_unlock(&hls->lock);
+
+    for(int i = 0; i < hls->ringSize; i++)
+    {
+        for(int p = 0; p < hls->ring[i].numParts; p++)
+        { hlsPartRelease(hls->ring[i].parts[p]); }
+    }
+    pthread_cond_destroy(&hls->cond);
+    pthread_mutex_destroy(&hls->lock);
+    free(hls->ring);
+    free(hls);
+}
+
+CStatus_t hlsWrite(Hls_t *hls, const uint8_t *data, size_t len)
+{
+    int64_t pts = 0;
+    bool key = false;
+    bool start = hlsScan(data, len, &pts, &key);
+    CStatus_t status = CSTATUS_SUCCESS;
+
+    pthread_mutex_lock(&hls->lock);
+    do
+    {
+        if(hls->msn < 0)
+        {
+            //Playlists start at a random access point
+            if(!start || !key)
+            { break; }
+            status = hlsStartSegment(hls, 0, pts);
+            OKAY_STOP(status != CSTATUS_SUCCESS, "failed to start hls\n");
+        }
+        else if(start)
+        {
+            HlsSegment_t *seg = &hls->ring[hls->msn % hls->ringSize];
+            int64_t segDuration = hlsPtsDiff(pts, seg->startPts);
+            int64_t frameDuration = hlsPtsDiff(pts, hls->lastPts);
+
+            //Half a frame of slack, capture timestamps jitter around the GOP length
+            if(key && segDuration + frameDuration / 2 >= (int64_t)hls->config.segmentMs * 90)
+            {
+                hlsClosePart(hls, seg, pts);
+                seg->duration = segDuration;
+                seg->complete = true;
+                if(segDuration > hls->maxDuration)
+                { hls->maxDuration = segDuration; }
+
+                status = hlsStartSegment(hls, hls->msn + 1, pts);
+                OKAY_STOP(status != CSTATUS_SUCCESS, "failed to start hls segment\n");
+            }
+            //Cut before the part would run past its target, PART-TARGET is a hard limit
+            else if(hls->config.partMs > 0 && seg->numParts < HLS_MAX_PARTS &&
+                    hlsPtsDiff(pts, hls->partStartPts) + frameDuration > (int64_t)hls->config.partMs * 90)
+            {
+                hlsClosePart(hls, seg, pts);
+                status = hlsOpenPart(seg, key);
+                OKAY_STOP(status != CSTATUS_SUCCESS, "failed to open hls part\n");
+            }
+        }
+
+        if(start)
+        { hls->lastPts = pts; }
+
+        //A part that failed to open is retried on the next access unit
+        HlsSegment_t *seg = &hls->ring[hls->msn % hls->ringSize];
+        if(seg->numParts == 0)
+        {
+            status = hlsOpenPart(seg, key);
+            OKAY_STOP(status != CSTATUS_SUCCESS, "failed to open hls part\n");
+        }
+
+        HlsPart_t *part = seg->parts[seg->numParts - 1];
+        if(part->len + len > part->capacity)
+        {
+            size_t capacity = part->capacity ? part->capacity * 2 : HLS_PART_MIN_CAPACITY;
+            while (capacity < part->len + len)
+            { capacity *= 2; }
+            uint8_t *grown = realloc(part->data, capacity);
+            OKAY_STOP(grown == NULL, "failed to grow hls part to %zu bytes\n", capacity);
+            part->data = grown;
+            part->capacity = capacity;
+        }
+        memcpy(part->data + part->len, data, len);
+        part->len += len;
+    } while (false);
+    pthread_mutex_unlock(&hls->lock);
+
+    return status;
+}
+
+//Caller holds hls->lock
+static int hlsTargetDuration(Hls_t *hls)
+{
+    //Constant unless an encoder GOP outlasts the configured duration
+    int64_t duration = hls->maxDuration > (int64_t)hls->config.segmentMs * 90 ?
+                       hls->maxDuration : (int64_t)hls->config.segmentMs * 90;
+    //EXTINF rounded to the nearest second may not exceed it
+    int target = (int)((duration + 45000) / 90000);
+    return target > 0 ? target : 1;
+}
+
+//Caller holds hls->lock
+static int hlsPartLines(char *buf, size_t capacity, HlsSegment_t *seg)
+{
+    int len = 0;
+    for(int i = 0; i < seg->numParts && seg->parts[i]->closed; i++)
+    {
+        len += snprintf(buf + len, capacity - len, "#EXT-X-PART:DURATION=%.5f,URI=\"%lld.%d.ts\"%s\n",
+                        seg->parts[i]->duration / 90000.0, (long long)seg->msn, i,
+                        seg->parts[i]->independent ? ",INDEPENDENT=YES" : "");
+    }
+    return len;
+}
+
+//Caller holds hls->lock, returns a malloc'ed playlist
+static char *hlsPlaylist(Hls_t *hls, int *outLen)
+{
+    bool ll = hls->config.partMs > 0;
+    size_t capacity = 512 + (size_t)hls->config.segments * 64 +
+                      (ll ? (HLS_LL_PART_SEGMENTS + 1) * HLS_MAX_PARTS * 80 : 0);
+    char *buf = malloc(capacity);
+    OKAY_RETURN(buf == NULL, NULL, "failed to allocate hls playlist\n");
+
+    int64_t first = hls->msn - hls->config.segments;
+    if(first < 0)
+    { first = 0; }
+
+    int len = snprintf(buf, capacity,
+                       "#EXTM3U\n"
+                       "#EXT-X-VERSION:%d\n"
+                       "#EXT-X-TARGETDURATION:%d\n"
+                       "#EXT-X-MEDIA-SEQUENCE:%lld\n",
+                       ll ? 6 : 3, hlsTargetDuration(hls), (long long)first);
+    if(ll)
+    {
+        double part = hls->config.partMs / 1000.0;
+        len += snprintf(buf + len, capacity - len,
+                        "#EXT-X-SERVER-CONTROL:CAN-BLOCK-RELOAD=YES,PART-HOLD-BACK=%.3f\n"
+                        "#EXT-X-PART-INF:PART-TARGET=%.3f\n",
+                        3 * part, part);
+    }
+
+    for(int64_t msn = first; msn < hls->msn; msn++)
+    {
+        HlsSegment_t *seg = hlsFindSegment(hls, msn);
+        if(seg == NULL || !seg->complete)
+        { continue; }
+
+        if(ll && msn >= hls->msn - HLS_LL_PART_SEGMENTS)
+        { len += hlsPartLines(buf + len, capacity - len, seg); }
+        len += snprintf(buf + len, capacity - len, "#EXTINF:%.5f,\n%lld.ts\n",
+                        seg->duration / 90000.0, (long long)msn);
+    }
+
+    if(ll)
+    {
+        HlsSegment_t *seg = hlsFindSegment(hls, hls->msn);
+        len += hlsPartLines(buf + len, capacity - len, seg);
+        len += snprintf(buf + len, capacity - len, "#EXT-X-PRELOAD-HINT:TYPE=PART,URI=\"%lld.%d.ts\"\n",
+                        (long long)hls->msn, seg->numParts - 1);
+    }
+
+    *outLen = len;
+    return buf;
+}
+
+//Closed parts of a segment, all of them once it is complete
+static int hlsClosedParts(HlsSegment_t *seg)
+{
+    return seg->complete ? seg->numParts : seg->numParts - 1;
+}
+
+//Caller holds hls->lock. Waits for part of segment msn, or the whole segment if part < 0
+static CStatus_t hlsWait(Hls_t *hls, int64_t msn, int part)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    int64_t ms = (int64_t)HLS_BLOCK_TARGETS * hls->config.segmentMs;
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (ms % 1000) * 1000000;
+    if(deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    while (!hls->destroyed)
+    {
+        if(hls->msn > msn)
+        { return CSTATUS_SUCCESS; }
+        if(hls->msn == msn && part >= 0 && hlsClosedParts(hlsFindSegment(hls, msn)) > part)
+        { return CSTATUS_SUCCESS; }
+        if(pthread_cond_timedwait(&hls->cond, &hls->lock, &deadline) == ETIMEDOUT)
+        { return CSTATUS_AGAIN; }
+    }
+    return CSTATUS_CONTEXT;
+}
+
+static bool hlsQueryInt(const char *query, const char *name, long long *value)
+{
+    size_t nlen = strlen(name);
+    for(const char *p = query; p != NULL && *p != '\0'; p = strchr(p, '&'), p = p ? p + 1 : NULL)
+    {
+        if(strncmp(p, name, nlen) == 0 && p[nlen] == '=')
+        {
+            char *end;
+            *value = strtoll(p + nlen + 1, &end, 10);
+            return end != p + nlen + 1 && (*end == '\0' || *end == '&');
+        }
+    }
+    return false;
+}
+
+//Every viewer is sent the same immutable part buffers, nothing is copied per request
+static CStatus_t hlsSendParts(int fd, HlsPart_t **parts, int numParts, size_t total)
+{
+    struct iovec iov[HLS_MAX_PARTS];
+    for(int i = 0; i < numParts; i++)
+    {
+        iov[i].iov_base = parts[i]->data;
+        iov[i].iov_len = parts[i]->len;
+    }
+
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = numParts };
+    while (total > 0)
+    {
+        ssize_t ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(ret < 0 && errno == EINTR)
+        { continue; }
+        OKAY_RETURN(ret <= 0, CSTATUS_SYSCALL, "hls send failed : errno (%d)\n", errno);
+        total -= ret;
+
+        while (msg.msg_iovlen > 0 && (size_t)ret >= msg.msg_iov->iov_len)
+        {
+            ret -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if(msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + ret;
+            msg.msg_iov->iov_len -= ret;
+        }
+    }
+    return CSTATUS_SUCCESS;
+}
+
+//Caller holds hls->lock, fills parts with references for a segment or one part of it
+static CStatus_t hlsRequestMedia(Hls_t *hls, int64_t msn, int part, HlsPart_t **parts, int *numParts)
+{
+    //LL-HLS players ask for the preload hint before it exists
+    if(part >= 0 && part < HLS_MAX_PARTS && (msn == hls->msn || msn == hls->msn + 1))
+    {
+        CStatus_t status = hlsWait(hls, msn, part);
+        if(status != CSTATUS_SUCCESS)
+        { return status; }
+    }
+
+    HlsSegment_t *seg = hlsFindSegment(hls, msn);
+    if(seg == NULL || (part < 0 && !seg->complete) || part >= hlsClosedParts(seg))
+    { return CSTATUS_BAD_PARAM; }
+
+    int first = part < 0 ? 0 : part;
+    int last = part < 0 ? seg->numParts : part + 1;
+    *numParts = 0;
+    for(int i = first; i < last; i++)
+    {
+        __atomic_add_fetch(&seg->parts[i]->refs, 1, __ATOMIC_RELAXED);
+        parts[(*numParts)++] = seg->parts[i];
+    }
+    return CSTATUS_SUCCESS;
+}
+
+CStatus_t hlsServe(Hls_t *hls, int fd, const NetHttpRequest_t *req)
+{
+    size_t plen = strlen(HLS_PATH);
+    if(strncmp(req->path, HLS_PATH, plen) != 0)
+    { return CSTATUS_AGAIN; }
+
+    const char *name = req->path + plen;
+    bool playlist = strcmp(name, "live.m3u8") == 0;
+    long long msn = -1;
+    int part = -1, n = 0;
+    if(!playlist && sscanf(name, "%lld.%d.ts%n", &msn, &part, &n) != 2)
+    {
+        part = -1;
+        n = 0;
+        sscanf(name, "%lld.ts%n", &msn, &n);
+    }
+    if(!playlist && (n == 0 || name[n] != '\0' || msn < 0))
+    { return netHttpError(fd, 404, "Not Found", req->close, NULL); }
+
+    char *text = NULL;
+    int textLen = 0;
+    HlsPart_t *parts[HLS_MAX_PARTS];
+    int numParts = 0;
+    CStatus_t status = CSTATUS_SUCCESS;
+    int code = 200;
+
+    pthread_mutex_lock(&hls->lock);
+    hls->users++;
+    do
+    {
+        if(playlist)
+        {
+            long long waitMsn, waitPart;
+            if(hlsQueryInt(req->query, "_HLS_msn", &waitMsn))
+            {
+                //Blocking playlist reload, at most one segment ahead
+                if(!hlsQueryInt(req->query, "_HLS_part", &waitPart))
+                { waitPart = -1; }
+                if(hls->config.partMs == 0 || waitMsn > hls->msn + 1)
+                {
+                    code = 400;
+                    break;
+                }
+                status = hlsWait(hls, waitMsn, (int)waitPart);
+            }
+            if(status == CSTATUS_SUCCESS && hls->msn < 0)
+            { status = CSTATUS_AGAIN; }
+            if(status == CSTATUS_SUCCESS)
+            {
+                text = hlsPlaylist(hls, &textLen);
+                status = (text != NULL) ? CSTATUS_SUCCESS : CSTATUS_MEMORY;
+            }
+        }
+        else
+        {
+            status = hlsRequestMedia(hls, msn, part, parts, &numParts);
+        }
+
+        if(status == CSTATUS_BAD_PARAM)
+        { code = 404; }
+        else if(status != CSTATUS_SUCCESS)
+        { code = 503; }
+    } while (false);
+    hls->users--;
+    if(hls->destroyed)
+    { pthread_cond_broadcast(&hls->cond); }
+    pthread_mutex_unlock(&hls->lock);
+
+    const char *cors = "Access-Control-Allow-Origin: *\r\n";
+    if(code == 400)
+    { return netHttpError(fd, 400, "Bad Request", req->close, cors); }
+    if(code == 404)
+    { return netHttpError(fd, 404, "Not Found", req->close, cors); }
+    if(code != 200)
+    { return netHttpError(fd, 503, "Service Unavailable", req->close, cors); }
+
+    if(playlist)
+    {
+        status = netHttpRespond(fd, 200, "OK", "application/vnd.apple.mpegurl", textLen, req->close, cors);
+        if(status == CSTATUS_SUCCESS && !req->head)
+        { status = netHttpSend(fd, text, textLen); }
+        free(text);
+        return status;
+    }
+
+    size_t total = 0;
+    for(int i = 0; i < numParts; i++)
+    { total += parts[i]->len; }
+
+    status = netHttpRespond(fd, 200, "OK", "video/mp2t", total, req->close, cors);
+    if(status == CSTATUS_SUCCESS && !req->head)
+    { status = hlsSendParts(fd, parts, numParts, total); }
+
+    for(int i = 0; i < numParts; i++)
+    { hlsPartRelease(parts[i]); }
+    return status;
+}
@@ -0,0 +1,72 @@
+#ifndef _fmp4_writer_h_
+#define _fmp4_writer_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "mpeg-ts-proto.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// Fragmented MP4 (CMAF style) muxer for one H.264/H.265 video track, e.g. for
+/// Media Source Extensions. The output is an init segment (ftyp + moov) followed
+/// by self contained fragments (moof + mdat), each handed to write() in one call
+/// so it can go out as a WebSocket message or an HTTP chunk as is.
+
+enum
+{
+	FMP4_FRAGMENT_FRAME		= 0, // one moof/mdat per frame, lowest latency
+	FMP4_FRAGMENT_GOP		= 1, // one moof/mdat per GOP, emitted at the next IDR frame
+};
+
+struct fmp4_writer_func_t
+{
+	/// alloc new segment
+	/// @param[in] param user-defined parameter(by fmp4_writer_create)
+	/// @param[in] bytes alloc memory size in byte
+	/// @return memory pointer
+	void* (*alloc)(void* param, size_t bytes);
+
+	/// free segment
+	/// @param[in] param user-defined parameter(by fmp4_writer_create)
+	/// @param[in] packet segment pointer(alloc return pointer)
+	void (*free)(void* param, void* packet);
+
+	/// callback on init segment or fragment done
+	/// @param[in] param user-defined parameter(by fmp4_writer_create)
+	/// @param[in] packet segment pointer(alloc return pointer)
+	/// @param[in] bytes segment size
+	/// @param[in] init 1-init segment, 0-fragment
+	/// @return 0-ok, other-error
+	int (*write)(void* param, const void* packet, size_t bytes, int init);
+};
+
+/// Create/Destroy fMP4 muxer
+/// @param[in] codecid PSI_STREAM_H264/PSI_STREAM_H265
+/// @param[in] width/height coded picture size, for the track header
+/// @param[in] mode FMP4_FRAGMENT_FRAME/FMP4_FRAGMENT_GOP
+void* fmp4_writer_create(const struct fmp4_writer_func_t* func, void* param, int codecid, int width, int height, int mode);
+int fmp4_writer_destroy(void* fmp4);
+
+/// Mux one access unit. Nothing is written before the first IDR frame carrying
+/// its parameter sets, a new init segment goes out whenever they change.
+/// @param[in] flags 0x0001-video IDR frame
+/// @param[in] pts/dts timestamp in 90*ms
+/// @param[in] data H.264/H.265-AnnexB access unit(include 00 00 00 01)
+/// @return 0-ok, ENOMEM-alloc failed, <0-error
+int fmp4_writer_write(void* fmp4, int flags, int64_t pts, int64_t dts, const void* data, size_t bytes);
+
+/// Write the buffered samples of FMP4_FRAGMENT_GOP mode as a fragment now
+/// @return 0-ok, other-error
+int fmp4_writer_flush(void* fmp4);
+
+/// Init segment for the current parameter sets, e.g. for a viewer joining late
+/// @param[out] bytes init segment size
+/// @return NULL before the first IDR frame, the pointer is valid until the next fmp4_writer_write
+const void* fmp4_writer_get_init(void* fmp4, size_t* bytes);
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* !_fmp4_writer_h_ */
@@ -187,6 +187,8 @@ enum EPSI_STREAM_TYPE
 enum
 {
     MPEG_FLAG_IDR_FRAME				= 0x0001,
+	MPEG_FLAG_RECOVERY_POINT		= 0x0002, // non-IDR random access point, e.g. recovery point SEI of an intra refresh
+	MPEG_FLAG_PES_PARTIAL			= 0x0100, // more of the access unit follows with mpeg_ts_write_continue
 	MPEG_FLAG_PACKET_LOST			= 0x1000, // packet(s) lost before the packet(this packet is ok, but previous packet has missed or corrupted)
 	MPEG_FLAG_PACKET_CORRUPT		= 0x2000, // this packet miss same data(packet lost)
     MPEG_FLAG_H264_H265_WITH_AUD	= 0x8000,
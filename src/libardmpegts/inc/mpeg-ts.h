@@ -43,16 +43,42 @@ int mpeg_ts_add_stream(void* ts, int codecid, const void* extradata, size_t extr
 
 /// Muxer audio/video stream data
 /// @param[in] stream stream id by mpeg_ts_add_stream
-/// @param[in] flags 0x0001-video IDR frame, 0x8000-H.264/H.265 with AUD
+/// @param[in] flags 0x0001-video IDR frame, 0x0002-recovery point, 0x0100-partial access unit, 0x8000-H.264/H.265 with AUD
 /// @param[in] pts audio/video stream timestamp in 90*ms
 /// @param[in] dts audio/video stream timestamp in 90*ms
 /// @param[in] data H.264/H.265-AnnexB stream(include 00 00 00 01), AAC-ADTS stream
 /// @return 0-ok, other-error
 int mpeg_ts_write(void* ts, int stream, int flags, int64_t pts, int64_t dts, const void* data, size_t bytes);
 
+/// Append to the PES of the last mpeg_ts_write, which had MPEG_FLAG_PES_PARTIAL, e.g. the
+/// next slices of a frame still being encoded. The last TS packet of every part is stuffed
+/// so a part can be sent on its own.
+/// @param[in] stream stream id by mpeg_ts_add_stream
+/// @param[in] data rest of the access unit, any split
+/// @return 0-ok, other-error
+int mpeg_ts_write_continue(void* ts, int stream, const void* data, size_t bytes);
+
 /// Reset PAT/PCR period
 int mpeg_ts_reset(void* ts);
 
+/// H.264/H.265 Annex-B helpers
+/// @param[in] data stream starting at an access unit
+/// @param[in,out] vcl 0 on first call, count of VCL NALUs seen so far
+/// @return offset of the next access unit, -1 if data holds a single access unit
+int mpeg_h264_find_new_access_unit(const uint8_t* data, size_t bytes, int* vcl);
+int mpeg_h265_find_new_access_unit(const uint8_t* data, size_t bytes, int* vcl);
+
+/// @param[out] codec 1-H.264, 2-H.265, 3-MPEG-4 part 2
+/// @return 0-ok, other-unknown stream
+int mpeg_h26x_verify(const uint8_t* data, size_t bytes, int* codec);
+
+/// @param[out] leading start code bytes before the nalu
+/// @return -1-not found, other nalu position(after 00 00 01)
+int mpeg_h264_find_nalu(const uint8_t* p, size_t bytes, size_t* leading);
+
+/// PSI section CRC32(MPEG-2), crc starts at 0xffffffff
+uint32_t mpeg_crc32(uint32_t crc, const uint8_t *buffer, uint32_t size);
+
 
 /// FOR MULTI-PROGRAM TS STREAM ONLY
 /// Add a program
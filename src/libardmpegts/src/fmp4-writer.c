@@ -0,0 +1,696 @@
+// ISO/IEC 14496-12 ISO base media file format, fragmented (8.8 Movie fragments)
+// ISO/IEC 14496-15 Carriage of NAL unit structured video (5.3.3 avcC, 8.3.3 hvcC)
+// ISO/IEC 23000-19 CMAF
+
+#include "fmp4-writer.h"
+#include "mpeg-util.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define FMP4_TIMESCALE			90000
+#define FMP4_TRACK_ID			1
+#define FMP4_PARAM_SET_SIZE		512
+#define FMP4_INIT_SIZE			(1024 + 3 * FMP4_PARAM_SET_SIZE)
+#define FMP4_MOOF_SIZE			128 // moof without the trun samples
+#define FMP4_TRUN_SAMPLE_SIZE	16 // duration, size, flags, composition offset
+#define FMP4_DEFAULT_DURATION	3000 // 30fps, until two frames have been seen
+
+// 8.8.3.1 sample flags
+#define FMP4_SAMPLE_SYNC		0x02000000 // sample_depends_on=2
+#define FMP4_SAMPLE_NON_SYNC	0x01010000 // sample_depends_on=1, sample_is_non_sync_sample=1
+
+enum { FMP4_VPS = 0, FMP4_SPS, FMP4_PPS, FMP4_PARAM_SETS };
+
+struct fmp4_sample_t
+{
+	uint32_t size;
+	int64_t dts;
+	int32_t cto; // pts - dts
+	int key;
+};
+
+struct fmp4_writer_t
+{
+	struct fmp4_writer_func_t func;
+	void* param;
+
+	int codecid;
+	int width;
+	int height;
+	int mode;
+
+	// parameter sets of the current init segment, without start code
+	uint8_t ps[FMP4_PARAM_SETS][FMP4_PARAM_SET_SIZE];
+	size_t ps_len[FMP4_PARAM_SETS];
+	uint8_t init[FMP4_INIT_SIZE];
+	size_t init_len;
+
+	uint32_t sequence; // moof sequence number
+	int64_t base_dts; // decode time 0
+	int64_t last_dts;
+	uint32_t duration; // last sample duration
+	int started;
+
+	// samples not written yet, all of a GOP or the current frame
+	struct fmp4_sample_t* samples;
+	size_t nsamples;
+	size_t capacity;
+	uint8_t* mdat;
+	size_t mdat_len;
+	size_t mdat_cap;
+};
+
+struct fmp4_box_t
+{
+	uint8_t* ptr;
+	size_t off;
+};
+
+static void w8(struct fmp4_box_t* b, uint8_t v) { b->ptr[b->off++] = v; }
+static void w16(struct fmp4_box_t* b, uint16_t v) { nbo_w16(b->ptr + b->off, v); b->off += 2; }
+static void w24(struct fmp4_box_t* b, uint32_t v) { w8(b, (uint8_t)(v >> 16)); w16(b, (uint16_t)v); }
+static void w32(struct fmp4_box_t* b, uint32_t v) { nbo_w32(b->ptr + b->off, v); b->off += 4; }
+static void w64(struct fmp4_box_t* b, uint64_t v) { w32(b, (uint32_t)(v >> 32)); w32(b, (uint32_t)v); }
+static void wzero(struct fmp4_box_t* b, size_t n) { memset(b->ptr + b->off, 0, n); b->off += n; }
+static void wdata(struct fmp4_box_t* b, const void* data, size_t n) { memcpy(b->ptr + b->off, data, n); b->off += n; }
+
+/// @return box start, for fmp4_box_end
+static size_t fmp4_box_begin(struct fmp4_box_t* b, const char* type)
+{
+	size_t start = b->off;
+	w32(b, 0);
+	wdata(b, type, 4);
+	return start;
+}
+
+static size_t fmp4_full_box_begin(struct fmp4_box_t* b, const char* type, uint8_t version, uint32_t flags)
+{
+	size_t start = fmp4_box_begin(b, type);
+	w8(b, version);
+	w24(b, flags);
+	return start;
+}
+
+static void fmp4_box_end(struct fmp4_box_t* b, size_t start)
+{
+	nbo_w32(b->ptr + start, (uint32_t)(b->off - start));
+}
+
+static void fmp4_matrix(struct fmp4_box_t* b)
+{
+	static const uint32_t unity[9] = { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 };
+	int i;
+	for (i = 0; i < 9; i++)
+		w32(b, unity[i]);
+}
+
+/// RBSP bit reader for the few SPS fields the decoder configuration records repeat
+struct fmp4_rbsp_t
+{
+	uint8_t data[64];
+	size_t bytes;
+	size_t bit;
+};
+
+static void fmp4_rbsp_init(struct fmp4_rbsp_t* r, const uint8_t* nalu, size_t bytes)
+{
+	size_t i, zeros;
+	// strip emulation prevention bytes, the fields needed are near the start
+	for (r->bytes = 0, r->bit = 0, zeros = i = 0; i < bytes && r->bytes < sizeof(r->data); i++)
+	{
+		if (zeros >= 2 && 0x03 == nalu[i])
+		{
+			zeros = 0;
+			continue;
+		}
+		zeros = 0 == nalu[i] ? zeros + 1 : 0;
+		r->data[r->bytes++] = nalu[i];
+	}
+}
+
+static uint32_t fmp4_rbsp_u(struct fmp4_rbsp_t* r, int n)
+{
+	uint32_t v = 0;
+	for (; n > 0; n--, r->bit++)
+	{
+		v <<= 1;
+		if (r->bit / 8 < r->bytes)
+			v |= (r->data[r->bit / 8] >> (7 - r->bit % 8)) & 0x01;
+	}
+	return v;
+}
+
+static uint32_t fmp4_rbsp_ue(struct fmp4_rbsp_t* r)
+{
+	int zeros = 0;
+	while (0 == fmp4_rbsp_u(r, 1) && zeros < 31 && r->bit / 8 < r->bytes)
+		zeros++;
+	return ((1U << zeros) - 1) + fmp4_rbsp_u(r, zeros);
+}
+
+static int fmp4_is_h265(const struct fmp4_writer_t* w)
+{
+	return PSI_STREAM_H265 == w->codecid;
+}
+
+/// @return FMP4_VPS/FMP4_SPS/FMP4_PPS, -1 if not a parameter set
+static int fmp4_param_set(const struct fmp4_writer_t* w, const uint8_t* nalu)
+{
+	int type;
+	if (fmp4_is_h265(w))
+	{
+		type = (nalu[0] >> 1) & 0x3f;
+		return (type >= 32 && type <= 34) ? type - 32 : -1;
+	}
+
+	type = nalu[0] & 0x1f;
+	return 7 == type ? FMP4_SPS : (8 == type ? FMP4_PPS : -1);
+}
+
+static int fmp4_is_aud(const struct fmp4_writer_t* w, const uint8_t* nalu)
+{
+	return fmp4_is_h265(w) ? 35 == ((nalu[0] >> 1) & 0x3f) : 9 == (nalu[0] & 0x1f);
+}
+
+// ISO/IEC 14496-15 5.3.3.1 AVCDecoderConfigurationRecord
+static void fmp4_avcc(struct fmp4_writer_t* w, struct fmp4_box_t* b)
+{
+	struct fmp4_rbsp_t r;
+	uint32_t profile, chroma = 1, depth_luma = 0, depth_chroma = 0;
+	size_t box;
+
+	fmp4_rbsp_init(&r, w->ps[FMP4_SPS] + 1, w->ps_len[FMP4_SPS] - 1);
+	profile = fmp4_rbsp_u(&r, 8);
+	fmp4_rbsp_u(&r, 16); // constraint flags, level
+	fmp4_rbsp_ue(&r); // seq_parameter_set_id
+	if (100 == profile || 110 == profile || 122 == profile || 244 == profile || 44 == profile
+		|| 83 == profile || 86 == profile || 118 == profile || 128 == profile || 138 == profile
+		|| 139 == profile || 134 == profile || 135 == profile)
+	{
+		chroma = fmp4_rbsp_ue(&r);
+		if (3 == chroma)
+			fmp4_rbsp_u(&r, 1); // separate_colour_plane_flag
+		depth_luma = fmp4_rbsp_ue(&r);
+		depth_chroma = fmp4_rbsp_ue(&r);
+	}
+
+	box = fmp4_box_begin(b, "avcC");
+	w8(b, 1); // configurationVersion
+	w8(b, w->ps[FMP4_SPS][1]); // AVCProfileIndication
+	w8(b, w->ps[FMP4_SPS][2]); // profile_compatibility
+	w8(b, w->ps[FMP4_SPS][3]); // AVCLevelIndication
+	w8(b, 0xFC | 3); // lengthSizeMinusOne
+	w8(b, 0xE0 | 1); // numOfSequenceParameterSets
+	w16(b, (uint16_t)w->ps_len[FMP4_SPS]);
+	wdata(b, w->ps[FMP4_SPS], w->ps_len[FMP4_SPS]);
+	w8(b, 1); // numOfPictureParameterSets
+	w16(b, (uint16_t)w->ps_len[FMP4_PPS]);
+	wdata(b, w->ps[FMP4_PPS], w->ps_len[FMP4_PPS]);
+	if (100 == profile || 110 == profile || 122 == profile || 144 == profile)
+	{
+		w8(b, 0xFC | (uint8_t)chroma);
+		w8(b, 0xF8 | (uint8_t)depth_luma);
+		w8(b, 0xF8 | (uint8_t)depth_chroma);
+		w8(b, 0); // numOfSequenceParameterSetExt
+	}
+	fmp4_box_end(b, box);
+}
+
+// ISO/IEC 14496-15 8.3.3.1 HEVCDecoderConfigurationRecord
+static void fmp4_hvcc(struct fmp4_writer_t* w, struct fmp4_box_t* b)
+{
+	struct fmp4_rbsp_t r;
+	uint8_t ptl[12]; // profile_space..general_level_idc
+	uint32_t sub_layers, temporal_nesting, chroma, depth_luma, depth_chroma;
+	uint32_t profile_present[8], level_present[8];
+	size_t box;
+	int i;
+
+	fmp4_rbsp_init(&r, w->ps[FMP4_SPS] + 2, w->ps_len[FMP4_SPS] - 2);
+	fmp4_rbsp_u(&r, 4); // sps_video_parameter_set_id
+	sub_layers = fmp4_rbsp_u(&r, 3); // sps_max_sub_layers_minus1
+	temporal_nesting = fmp4_rbsp_u(&r, 1);
+	for (i = 0; i < (int)sizeof(ptl); i++)
+		ptl[i] = (uint8_t)fmp4_rbsp_u(&r, 8);
+	for (i = 0; i < (int)sub_layers; i++)
+	{
+		profile_present[i] = fmp4_rbsp_u(&r, 1);
+		level_present[i] = fmp4_rbsp_u(&r, 1);
+	}
+	if (sub_layers > 0)
+		fmp4_rbsp_u(&r, 2 * (8 - sub_layers)); // reserved_zero_2bits
+	for (i = 0; i < (int)sub_layers; i++)
+	{
+		fmp4_rbsp_u(&r, profile_present[i] ? 88 / 2 : 0);
+		fmp4_rbsp_u(&r, profile_present[i] ? 88 / 2 : 0);
+		fmp4_rbsp_u(&r, level_present[i] ? 8 : 0);
+	}
+	fmp4_rbsp_ue(&r); // sps_seq_parameter_set_id
+	chroma = fmp4_rbsp_ue(&r);
+	if (3 == chroma)
+		fmp4_rbsp_u(&r, 1); // separate_colour_plane_flag
+	fmp4_rbsp_ue(&r); // pic_width_in_luma_samples
+	fmp4_rbsp_ue(&r); // pic_height_in_luma_samples
+	if (fmp4_rbsp_u(&r, 1)) // conformance_window_flag
+	{
+		for (i = 0; i < 4; i++)
+			fmp4_rbsp_ue(&r);
+	}
+	depth_luma = fmp4_rbsp_ue(&r);
+	depth_chroma = fmp4_rbsp_ue(&r);
+
+	box = fmp4_box_begin(b, "hvcC");
+	w8(b, 1); // configurationVersion
+	wdata(b, ptl, sizeof(ptl)); // profile, tier, compatibility and constraint flags, level
+	w16(b, 0xF000); // min_spatial_segmentation_idc
+	w8(b, 0xFC); // parallelismType
+	w8(b, 0xFC | (uint8_t)chroma);
+	w8(b, 0xF8 | (uint8_t)depth_luma);
+	w8(b, 0xF8 | (uint8_t)depth_chroma);
+	w16(b, 0); // avgFrameRate
+	w8(b, (uint8_t)(((sub_layers + 1) << 3) | (temporal_nesting << 2) | 3)); // lengthSizeMinusOne
+	w8(b, FMP4_PARAM_SETS); // numOfArrays
+	for (i = 0; i < FMP4_PARAM_SETS; i++)
+	{
+		w8(b, 0x80 | (uint8_t)(32 + i)); // array_completeness, NAL_unit_type
+		w16(b, 1); // numNalus
+		w16(b, (uint16_t)w->ps_len[i]);
+		wdata(b, w->ps[i], w->ps_len[i]);
+	}
+	fmp4_box_end(b, box);
+}
+
+static void fmp4_stsd(struct fmp4_writer_t* w, struct fmp4_box_t* b)
+{
+	size_t stsd, entry;
+
+	stsd = fmp4_full_box_begin(b, "stsd", 0, 0);
+	w32(b, 1); // entry_count
+
+	// 12.1.3 VisualSampleEntry, parameter sets only in the init segment
+	entry = fmp4_box_begin(b, fmp4_is_h265(w) ? "hvc1" : "avc1");
+	wzero(b, 6);
+	w16(b, 1); // data_reference_index
+	wzero(b, 16); // pre_defined, reserved
+	w16(b, (uint16_t)w->width);
+	w16(b, (uint16_t)w->height);
+	w32(b, 0x00480000); // horizresolution 72 dpi
+	w32(b, 0x00480000); // vertresolution 72 dpi
+	w32(b, 0); // reserved
+	w16(b, 1); // frame_count
+	wzero(b, 32); // compressorname
+	w16(b, 0x0018); // depth
+	w16(b, 0xFFFF); // pre_defined
+	if (fmp4_is_h265(w))
+		fmp4_hvcc(w, b);
+	else
+		fmp4_avcc(w, b);
+	fmp4_box_end(b, entry);
+
+	fmp4_box_end(b, stsd);
+}
+
+// ftyp + moov, no samples: they all travel in fragments
+static void fmp4_write_init(struct fmp4_writer_t* w)
+{
+	static const char* empty_tables[] = { "stts", "stsc", "stco" };
+	struct fmp4_box_t b = { w->init, 0 };
+	size_t moov, trak, mdia, minf, dinf, dref, url, stbl, mvex, box;
+	int i;
+
+	box = fmp4_box_begin(&b, "ftyp");
+	wdata(&b, "iso5", 4); // major_brand
+	w32(&b, 512); // minor_version
+	wdata(&b, "iso5iso6mp41", 12); // compatible_brands
+	fmp4_box_end(&b, box);
+
+	moov = fmp4_box_begin(&b, "moov");
+
+	box = fmp4_full_box_begin(&b, "mvhd", 0, 0);
+	w32(&b, 0); // creation_time
+	w32(&b, 0); // modification_time
+	w32(&b, 1000); // timescale
+	w32(&b, 0); // duration, unknown
+	w32(&b, 0x00010000); // rate 1.0
+	w16(&b, 0x0100); // volume 1.0
+	wzero(&b, 10); // reserved
+	fmp4_matrix(&b);
+	wzero(&b, 24); // pre_defined
+	w32(&b, FMP4_TRACK_ID + 1); // next_track_ID
+	fmp4_box_end(&b, box);
+
+	trak = fmp4_box_begin(&b, "trak");
+	box = fmp4_full_box_begin(&b, "tkhd", 0, 0x000003); // enabled, in movie
+	w32(&b, 0); // creation_time
+	w32(&b, 0); // modification_time
+	w32(&b, FMP4_TRACK_ID);
+	w32(&b, 0); // reserved
+	w32(&b, 0); // duration
+	wzero(&b, 8); // reserved
+	w16(&b, 0); // layer
+	w16(&b, 0); // alternate_group
+	w16(&b, 0); // volume, video track
+	w16(&b, 0); // reserved
+	fmp4_matrix(&b);
+	w32(&b, (uint32_t)w->width << 16);
+	w32(&b, (uint32_t)w->height << 16);
+	fmp4_box_end(&b, box);
+
+	mdia = fmp4_box_begin(&b, "mdia");
+	box = fmp4_full_box_begin(&b, "mdhd", 0, 0);
+	w32(&b, 0); // creation_time
+	w32(&b, 0); // modification_time
+	w32(&b, FMP4_TIMESCALE);
+	w32(&b, 0); // duration
+	w16(&b, 0x55C4); // language 'und'
+	w16(&b, 0); // pre_defined
+	fmp4_box_end(&b, box);
+
+	box = fmp4_full_box_begin(&b, "hdlr", 0, 0);
+	w32(&b, 0); // pre_defined
+	wdata(&b, "vide", 4); // handler_type
+	wzero(&b, 12); // reserved
+	wdata(&b, "VideoHandler", 13); // name
+	fmp4_box_end(&b, box);
+
+	minf = fmp4_box_begin(&b, "minf");
+	box = fmp4_full_box_begin(&b, "vmhd", 0, 1);
+	wzero(&b, 8); // graphicsmode, opcolor
+	fmp4_box_end(&b, box);
+
+	dinf = fmp4_box_begin(&b, "dinf");
+	dref = fmp4_full_box_begin(&b, "dref", 0, 0);
+	w32(&b, 1); // entry_count
+	url = fmp4_full_box_begin(&b, "url ", 0, 1); // media data in the same file
+	fmp4_box_end(&b, url);
+	fmp4_box_end(&b, dref);
+	fmp4_box_end(&b, dinf);
+
+	stbl = fmp4_box_begin(&b, "stbl");
+	fmp4_stsd(w, &b);
+	for (i = 0; i < (int)(sizeof(empty_tables) / sizeof(empty_tables[0])); i++)
+	{
+		box = fmp4_full_box_begin(&b, empty_tables[i], 0, 0);
+		w32(&b, 0); // entry_count
+		fmp4_box_end(&b, box);
+	}
+	box = fmp4_full_box_begin(&b, "stsz", 0, 0);
+	w32(&b, 0); // sample_size
+	w32(&b, 0); // sample_count
+	fmp4_box_end(&b, box);
+	fmp4_box_end(&b, stbl);
+
+	fmp4_box_end(&b, minf);
+	fmp4_box_end(&b, mdia);
+	fmp4_box_end(&b, trak);
+
+	mvex = fmp4_box_begin(&b, "mvex");
+	box = fmp4_full_box_begin(&b, "trex", 0, 0);
+	w32(&b, FMP4_TRACK_ID);
+	w32(&b, 1); // default_sample_description_index
+	w32(&b, 0); // default_sample_duration
+	w32(&b, 0); // default_sample_size
+	w32(&b, 0); // default_sample_flags
+	fmp4_box_end(&b, box);
+	fmp4_box_end(&b, mvex);
+
+	fmp4_box_end(&b, moov);
+	assert(b.off <= sizeof(w->init));
+	w->init_len = b.off;
+}
+
+static int fmp4_emit(struct fmp4_writer_t* w, const void* data, size_t bytes, int init)
+{
+	int r;
+	void* packet = w->func.alloc(w->param, bytes);
+	if (NULL == packet)
+		return ENOMEM;
+
+	memcpy(packet, data, bytes);
+	r = w->func.write(w->param, packet, bytes, init);
+	w->func.free(w->param, packet);
+	return r;
+}
+
+/// @param[in] next_dts decode time of the sample after the last one, < 0 if unknown
+static int fmp4_write_fragment(struct fmp4_writer_t* w, int64_t next_dts)
+{
+	struct fmp4_box_t b;
+	size_t moof, traf, box, data_offset, i;
+	uint32_t duration;
+	void* packet;
+	int r;
+
+	if (0 == w->nsamples)
+		return 0;
+
+	b.off = 0;
+	b.ptr = (uint8_t*)w->func.alloc(w->param, FMP4_MOOF_SIZE + w->nsamples * FMP4_TRUN_SAMPLE_SIZE + 8 + w->mdat_len);
+	if (NULL == b.ptr)
+	{
+		w->nsamples = 0; // drop them, the next IDR frame starts over
+		w->mdat_len = 0;
+		return ENOMEM;
+	}
+	packet = b.ptr;
+
+	moof = fmp4_box_begin(&b, "moof");
+	box = fmp4_full_box_begin(&b, "mfhd", 0, 0);
+	w32(&b, ++w->sequence);
+	fmp4_box_end(&b, box);
+
+	traf = fmp4_box_begin(&b, "traf");
+	box = fmp4_full_box_begin(&b, "tfhd", 0, 0x020000); // default-base-is-moof
+	w32(&b, FMP4_TRACK_ID);
+	fmp4_box_end(&b, box);
+
+	box = fmp4_full_box_begin(&b, "tfdt", 1, 0);
+	w64(&b, (uint64_t)(w->samples[0].dts - w->base_dts)); // baseMediaDecodeTime
+	fmp4_box_end(&b, box);
+
+	// data-offset, sample-duration, sample-size, sample-flags, sample-composition-time-offset
+	box = fmp4_full_box_begin(&b, "trun", 1, 0x000F01);
+	w32(&b, (uint32_t)w->nsamples);
+	data_offset = b.off;
+	w32(&b, 0);
+	for (i = 0; i < w->nsamples; i++)
+	{
+		// the last duration is a guess unless the next frame is known
+		if (i + 1 < w->nsamples)
+			duration = (uint32_t)(w->samples[i + 1].dts - w->samples[i].dts);
+		else if (next_dts >= 0)
+			duration = (uint32_t)(next_dts - w->samples[i].dts);
+		else
+			duration = w->duration;
+
+		w32(&b, duration);
+		w32(&b, w->samples[i].size);
+		w32(&b, w->samples[i].key ? FMP4_SAMPLE_SYNC : FMP4_SAMPLE_NON_SYNC);
+		w32(&b, (uint32_t)w->samples[i].cto);
+	}
+	fmp4_box_end(&b, box);
+	fmp4_box_end(&b, traf);
+	fmp4_box_end(&b, moof);
+	nbo_w32(b.ptr + data_offset, (uint32_t)(b.off - moof + 8));
+
+	box = fmp4_box_begin(&b, "mdat");
+	wdata(&b, w->mdat, w->mdat_len);
+	fmp4_box_end(&b, box);
+
+	r = w->func.write(w->param, packet, b.off, 0);
+	w->func.free(w->param, packet);
+
+	w->nsamples = 0;
+	w->mdat_len = 0;
+	return r;
+}
+
+static int fmp4_reserve(struct fmp4_writer_t* w, size_t bytes)
+{
+	void* p;
+	size_t capacity;
+
+	if (w->nsamples >= w->capacity)
+	{
+		capacity = w->capacity ? w->capacity * 2 : 64;
+		p = realloc(w->samples, capacity * sizeof(struct fmp4_sample_t));
+		if (NULL == p)
+			return ENOMEM;
+		w->samples = (struct fmp4_sample_t*)p;
+		w->capacity = capacity;
+	}
+
+	if (w->mdat_len + bytes > w->mdat_cap)
+	{
+		capacity = w->mdat_cap ? w->mdat_cap * 2 : 256 * 1024;
+		while (capacity < w->mdat_len + bytes)
+			capacity *= 2;
+		p = realloc(w->mdat, capacity);
+		if (NULL == p)
+			return ENOMEM;
+		w->mdat = (uint8_t*)p;
+		w->mdat_cap = capacity;
+	}
+	return 0;
+}
+
+void* fmp4_writer_create(const struct fmp4_writer_func_t* func, void* param, int codecid, int width, int height, int mode)
+{
+	struct fmp4_writer_t* w;
+	if (PSI_STREAM_H264 != codecid && PSI_STREAM_H265 != codecid)
+		return NULL;
+
+	w = (struct fmp4_writer_t*)calloc(1, sizeof(struct fmp4_writer_t));
+	if (NULL == w)
+		return NULL;
+
+	memcpy(&w->func, func, sizeof(w->func));
+	w->param = param;
+	w->codecid = codecid;
+	w->width = width;
+	w->height = height;
+	w->mode = mode;
+	w->duration = FMP4_DEFAULT_DURATION;
+	return w;
+}
+
+int fmp4_writer_destroy(void* fmp4)
+{
+	struct fmp4_writer_t* w = (struct fmp4_writer_t*)fmp4;
+	free(w->samples);
+	free(w->mdat);
+	free(w);
+	return 0;
+}
+
+int fmp4_writer_flush(void* fmp4)
+{
+	return fmp4_write_fragment((struct fmp4_writer_t*)fmp4, -1);
+}
+
+const void* fmp4_writer_get_init(void* fmp4, size_t* bytes)
+{
+	struct fmp4_writer_t* w = (struct fmp4_writer_t*)fmp4;
+	*bytes = w->init_len;
+	return w->init_len > 0 ? w->init : NULL;
+}
+
+int fmp4_writer_write(void* fmp4, int flags, int64_t pts, int64_t dts, const void* data, size_t bytes)
+{
+	struct fmp4_writer_t* w = (struct fmp4_writer_t*)fmp4;
+	const uint8_t* p = (const uint8_t*)data;
+	const uint8_t* end = p + bytes;
+	const uint8_t* nalu[FMP4_PARAM_SETS] = { NULL };
+	size_t nalu_len[FMP4_PARAM_SETS] = { 0 };
+	struct fmp4_sample_t* sample;
+	size_t leading, len, offset;
+	int key, changed, type, n, r;
+
+	key = (flags & MPEG_FLAG_IDR_FRAME) ? 1 : 0;
+	if (!key && 0 == w->init_len)
+		return 0; // decoders start at an IDR frame
+
+	// flush the previous GOP first, its last duration is known now
+	if (key)
+	{
+		r = fmp4_write_fragment(w, dts);
+		if (0 != r)
+			return r;
+	}
+
+	r = fmp4_reserve(w, bytes + bytes / 3 + 4); // a length prefix is at most 1 byte over its start code
+	if (0 != r)
+		return r;
+
+	// Annex-B to 4 byte length prefixes, parameter sets move to the init segment
+	sample = &w->samples[w->nsamples];
+	offset = w->mdat_len;
+	n = mpeg_h264_find_nalu(p, bytes, &leading);
+	while (n >= 0)
+	{
+		const uint8_t* start = p + n;
+		n = mpeg_h264_find_nalu(start, end - start, &leading);
+		len = n < 0 ? (size_t)(end - start) : (size_t)n - leading;
+		p = start;
+
+		// trailing zero bytes belong to no NAL unit
+		while (len > 0 && 0 == start[len - 1])
+			len--;
+
+		if (len > 0)
+		{
+			type = fmp4_param_set(w, start);
+			if (type >= 0)
+			{
+				nalu[type] = start;
+				nalu_len[type] = len;
+			}
+			else if (!fmp4_is_aud(w, start))
+			{
+				nbo_w32(w->mdat + w->mdat_len, (uint32_t)len);
+				memcpy(w->mdat + w->mdat_len + 4, start, len);
+				w->mdat_len += 4 + len;
+			}
+		}
+	}
+
+	if (key && nalu[FMP4_SPS] && nalu[FMP4_PPS] && (!fmp4_is_h265(w) || nalu[FMP4_VPS]))
+	{
+		for (changed = 0, type = 0; type < FMP4_PARAM_SETS; type++)
+		{
+			if (NULL == nalu[type])
+				continue;
+			if (nalu_len[type] > FMP4_PARAM_SET_SIZE)
+			{
+				w->mdat_len = offset;
+				return -E2BIG;
+			}
+			if (nalu_len[type] != w->ps_len[type] || 0 != memcmp(nalu[type], w->ps[type], nalu_len[type]))
+			{
+				memcpy(w->ps[type], nalu[type], nalu_len[type]);
+				w->ps_len[type] = nalu_len[type];
+				changed = 1;
+			}
+		}
+
+		// MSE takes a new init segment between fragments, none is pending at an IDR frame
+		if (changed)
+		{
+			fmp4_write_init(w);
+			r = fmp4_emit(w, w->init, w->init_len, 1);
+			if (0 != r)
+			{
+				w->mdat_len = offset;
+				return r;
+			}
+		}
+	}
+
+	if (0 == w->init_len)
+	{
+		w->mdat_len = offset;
+		return 0; // no parameter sets yet
+	}
+
+	// a gap, e.g. while nobody was watching, is no frame duration
+	if (!w->started)
+	{
+		w->base_dts = dts;
+		w->started = 1;
+	}
+	else if (dts > w->last_dts && dts - w->last_dts < FMP4_TIMESCALE)
+	{
+		w->duration = (uint32_t)(dts - w->last_dts);
+	}
+	w->last_dts = dts;
+
+	sample->size = (uint32_t)(w->mdat_len - offset);
+	sample->dts = dts;
+	sample->cto = (int32_t)(pts - dts);
+	sample->key = key;
+	w->nsamples++;
+
+	return FMP4_FRAGMENT_FRAME == w->mode ? fmp4_write_fragment(w, -1) : 0;
+}
@@ -27,6 +27,7 @@ typedef struct _mpeg_ts_enc_context_t
 {
     struct pat_t pat;
     int h264_h265_with_aud;
+    int recovery_point; // random_access_indicator on a non-IDR access unit
 
 	int64_t sdt_period;
 	int64_t pat_period;
@@ -94,14 +95,14 @@ static int mpeg_ts_write_section_header(const mpeg_ts_enc_context_t *ts, int pid
 	return r;
 }
 
-static int ts_write_pes(mpeg_ts_enc_context_t *tsctx, const struct pmt_t* pmt, struct pes_t *stream, const uint8_t* payload, size_t bytes)
+// start-0 continues the PES of the previous call, unbounded-PES_packet_length 0 as more follows
+static int ts_write_pes(mpeg_ts_enc_context_t *tsctx, const struct pmt_t* pmt, struct pes_t *stream, const uint8_t* payload, size_t bytes, int start, int unbounded)
 {
 	// 2.4.3.6 PES packet
 	// Table 2-21
 
 	int r = 0;
 	size_t len = 0;
-	int start = 1; // first packet
     uint8_t *p = NULL;
 	uint8_t *data = NULL;
     uint8_t *header = NULL;
@@ -131,7 +132,7 @@ static int ts_write_pes(mpeg_ts_enc_context_t *tsctx, const struct pmt_t* pmt, s
 		}
 
 		// random_access_indicator
-		if(start && stream->data_alignment_indicator && PTS_NO_VALUE != stream->pts)
+		if(start && (stream->data_alignment_indicator || tsctx->recovery_point) && PTS_NO_VALUE != stream->pts)
 		{
 			//In the PCR_PID the random_access_indicator may only be set to '1' 
 			//in a transport stream packet containing the PCR fields.
@@ -191,7 +192,7 @@ static int ts_write_pes(mpeg_ts_enc_context_t *tsctx, const struct pmt_t* pmt, s
 			// A value of 0 indicates that the PES packet length is neither specified nor bounded 
 			// and is allowed only in PES packets whose payload consists of bytes from a 
 			// video elementary stream contained in transport stream packets
-			if((p - header - PES_HEADER_LEN) + bytes > 0xFFFF)
+			if(unbounded || (p - header - PES_HEADER_LEN) + bytes > 0xFFFF)
 				nbo_w16(header + 4, 0); // 2.4.3.7 PES packet => PES_packet_length
 			else
 				nbo_w16(header + 4, (uint16_t)((p - header - PES_HEADER_LEN) + bytes));
@@ -284,6 +285,7 @@ int mpeg_ts_write(void* ts, int pid, int flags, int64_t pts, int64_t dts, const
     stream->dts = dts;
     stream->data_alignment_indicator = (flags & MPEG_FLAG_IDR_FRAME) ? 1 : 0; // idr frame
     tsctx->h264_h265_with_aud = (flags & MPEG_FLAG_H264_H265_WITH_AUD) ? 1 : 0;
+    tsctx->recovery_point = (flags & MPEG_FLAG_RECOVERY_POINT) ? 1 : 0;
 
     // set PCR_PID
     //assert(1 == tsctx->pat.pmt_count);
@@ -297,7 +299,10 @@ int mpeg_ts_write(void* ts, int pid, int flags, int64_t pts, int64_t dts, const
 	if (pmt->PCR_PID == stream->pid)
 		++tsctx->pcr_clock;
 
-	if(0 == ++tsctx->pat_cycle % PAT_CYCLE || 0 == tsctx->pat_period || tsctx->pat_period + PAT_PERIOD <= dts)
+	// PAT/PMT ahead of every IDR frame and recovery point too, so a cut at a random
+	// access point (e.g. an HLS segment) decodes on its own
+	if(0 == ++tsctx->pat_cycle % PAT_CYCLE || 0 == tsctx->pat_period || tsctx->pat_period + PAT_PERIOD <= dts
+		|| (flags & (MPEG_FLAG_IDR_FRAME | MPEG_FLAG_RECOVERY_POINT)))
 	{
 		tsctx->pat_cycle = 0;
 		tsctx->pat_period = dts;
@@ -325,7 +330,21 @@ int mpeg_ts_write(void* ts, int pid, int flags, int64_t pts, int64_t dts, const
 		}
 	}
 
-	return ts_write_pes(tsctx, pmt, stream, data, bytes);
+	return ts_write_pes(tsctx, pmt, stream, data, bytes, 1, (flags & MPEG_FLAG_PES_PARTIAL) ? 1 : 0);
+}
+
+int mpeg_ts_write_continue(void* ts, int pid, const void* data, size_t bytes)
+{
+	struct pmt_t *pmt = NULL;
+	struct pes_t *stream = NULL;
+	mpeg_ts_enc_context_t *tsctx;
+
+	tsctx = (mpeg_ts_enc_context_t*)ts;
+	stream = mpeg_ts_find(tsctx, pid, &pmt);
+	if (NULL == stream)
+		return -ENOENT; // not found
+
+	return ts_write_pes(tsctx, pmt, stream, data, bytes, 0, 1);
 }
 
 void* mpeg_ts_create(const struct mpeg_ts_func_t *func, void* param)
@@ -0,0 +1,231 @@
+#include "common.h"
+#include "capture.h"
+#include <signal.h>
+
+#ifdef CAPTURE_WITH_MPP
+#define CAP_DEFAULT_BACKEND		ENCODER_BACKEND_MPP
+#define CAP_DEFAULT_ENCODER		"mpp"
+#else
+#define CAP_DEFAULT_BACKEND		ENCODER_BACKEND_MOCK
+#define CAP_DEFAULT_ENCODER		"mock"
+#endif
+
+#define CAP_TCP_PORT			6700
+#define CAP_WS_PORT				8080
+#define CAP_HTTP_PORT			8000
+#define CAP_DOC_ROOT			"webserver"
+#define CAP_HLS_SEGMENT_MS		2000
+
+static App_t app;
+
+static void capSignal(int sig)
+{
+	UNUSED_PARAMETER(sig);
+	capAppStop(&app);
+}
+
+static void capUsage(const char *prog)
+{
+	printf("usage: %s [options]\n"
+		"  -s <v4l2|synth|file>   capture source (default v4l2)\n"
+		"  -i <path>              v4l2 device, raw dump or frame-%%d.raw pattern\n"
+		"  -W <width>             frame width (default %d)\n"
+		"  -H <height>            frame height (default %d)\n"
+		"  -r <fps>               synth/file frame rate (default 60)\n"
+		"  -f <nv24|nv12>         synth/file pixel format (default nv24)\n"
+		"  -e <mpp|mock>          encoder backend (default %s)\n"
+		"  -m <file>              Annex-B H.264/H.265 stream replayed by the mock encoder\n"
+		"  -c <h264|h265>[,<key>=<value>...]\n"
+		"                         codec and encoder settings: bitrate (kbps), gop, rc, qpmin, qpmax,\n"
+		"                         profile, level, tier, ctu, slices or slicebytes to send each frame in\n"
+		"                         parts as it encodes, and refresh=<frames>[:cols] for intra refresh\n"
+		"                         instead of gop IDR frames, e.g. h265,level=5.1,tier=high (default h264)\n"
+		"  -p <port>              raw TS over TCP port, 0 disables (default %d)\n"
+		"  -w <port>              websocket port, 0 disables (default %d)\n"
+		"  -t <port>              http port for /live.ts, /metrics, the player and /ws, 0 disables (default %d)\n"
+		"  -d <dir>               player files served over http (default %s)\n"
+		"  -g <ms>                hls segment duration under /hls/, 0 disables (default %d)\n"
+		"  -l <ms>                LL-HLS partial segment duration, 0 disables (default 0)\n"
+		"  -u <host:port[,...]>   TS over UDP to unicast or multicast destinations (default off)\n"
+		"  -R                     RTP (RFC 2250) header on the UDP datagrams\n"
+		"  -I <ifname>            UDP egress interface\n"
+		"  -T <ttl>               UDP unicast and multicast TTL\n"
+		"  -F <L>x<D>[,row]       SMPTE 2022-1 FEC on UDP port+2 (columns) and port+4 (rows), implies -R\n"
+		"  -n <port>              TS over reliable UDP, receivers register on this port (default off)\n"
+		"  -L <ms>                reliable UDP retransmission latency budget (default %d)\n"
+		"  -P <peak>[,etf[=<us>]] kernel pacing of the TCP and UDP sinks at peak x average rate,\n"
+		"                         SO_TXTIME on CLOCK_TAI for the etf qdisc, else fq (default off). etf\n"
+		"                         departures lead now by more than the qdisc delta (default %d us)\n"
+		"  -A <min>:<max>[:<fps>] bitrate in kbps from the viewers' backlog, frame rate down to fps (default off)\n"
+		"  -C <path>              unix control socket for runtime encoder settings and stats (default off)\n"
+		"  -D                     no preview window\n",
+		prog, IMG_WIDTH, IMG_HEIGHT, CAP_DEFAULT_ENCODER, CAP_TCP_PORT, CAP_WS_PORT, CAP_HTTP_PORT, CAP_DOC_ROOT,
+		CAP_HLS_SEGMENT_MS, RUDP_DEFAULT_LATENCY_MS, PACING_ETF_LEAD_US);
+}
+
+static CStatus_t capParseArgs(CaptureConfig_t *config, int argc, char *argv[])
+{
+	SourceConfig_t *srcConfig = &config->source;
+	EncoderConfig_t *encConfig = &config->encoder;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:i:W:H:r:f:e:m:c:p:w:t:d:g:l:u:RI:T:F:n:L:P:A:C:D")) != -1)
+	{
+		switch (opt)
+		{
+		case 's':
+			srcConfig->type = sourceTypeFromString(optarg);
+			OKAY_RETURN((int)srcConfig->type < 0, CSTATUS_BAD_PARAM, "unknown source %s\n", optarg);
+			break;
+		case 'i':
+			srcConfig->path = optarg;
+			break;
+		case 'W':
+			srcConfig->width = atoi(optarg);
+			break;
+		case 'H':
+			srcConfig->height = atoi(optarg);
+			break;
+		case 'r':
+			srcConfig->fps = atoi(optarg);
+			break;
+		case 'f':
+			if(strcmp(optarg, "nv12") == 0)
+			{ srcConfig->pixfmt = V4L2_PIX_FMT_NV12; }
+			else if(strcmp(optarg, "nv24") == 0)
+			{ srcConfig->pixfmt = V4L2_PIX_FMT_NV24; }
+			else
+			{ OKAY_RETURN(true, CSTATUS_BAD_PARAM, "unknown pixel format %s\n", optarg); }
+			break;
+		case 'e':
+			encConfig->backend = encoderBackendFromString(optarg);
+			OKAY_RETURN((int)encConfig->backend < 0, CSTATUS_BAD_PARAM, "unknown encoder %s\n", optarg);
+			break;
+		case 'm':
+			encConfig->mockPath = optarg;
+			break;
+		case 'c':
+		{
+			//Codec first, the profile and level names depend on it
+			uint32_t fields = 0;
+			char *save = NULL;
+			char *codec = strtok_r(optarg, ",", &save);
+			OKAY_RETURN(codec == NULL || encoderCodecFromString(codec) < 0, CSTATUS_BAD_PARAM, "unknown codec %s\n", optarg);
+			encConfig->codec = encoderCodecFromString(codec);
+			for(char *s = strtok_r(NULL, ",", &save); s != NULL; s = strtok_r(NULL, ",", &save))
+			{
+				OKAY_RETURN(encoderParseSetting(encConfig, &fields, s) != CSTATUS_SUCCESS, CSTATUS_BAD_PARAM,
+					"bad encoder setting %s\n", s);
+			}
+			break;
+		}
+		case 'p':
+			config->tcpPort = atoi(optarg);
+			break;
+		case 'w':
+			config->wsPort = atoi(optarg);
+			break;
+		case 't':
+			config->httpPort = atoi(optarg);
+			break;
+		case 'd':
+			config->docRoot = optarg;
+			break;
+		case 'g':
+			config->hlsSegmentMs = atoi(optarg);
+			break;
+		case 'l':
+			config->hlsPartMs = atoi(optarg);
+			break;
+		case 'u':
+			config->udp.dest = optarg;
+			break;
+		case 'R':
+			config->udp.rtp = true;
+			break;
+		case 'I':
+			config->udp.iface = optarg;
+			break;
+		case 'T':
+			config->udp.ttl = atoi(optarg);
+			break;
+		case 'F':
+			OKAY_RETURN(fecParseConfig(&config->udp.fec, optarg) != CSTATUS_SUCCESS, CSTATUS_BAD_PARAM,
+				"bad fec matrix %s\n", optarg);
+			config->udp.rtp = true;
+			break;
+		case 'n':
+			config->rudp.port = atoi(optarg);
+			break;
+		case 'L':
+			config->rudp.latencyMs = atoi(optarg);
+			break;
+		case 'P':
+			OKAY_RETURN(pacingParseConfig(&config->pacing, optarg) != CSTATUS_SUCCESS, CSTATUS_BAD_PARAM,
+				"bad pacing %s\n", optarg);
+			break;
+		case 'A':
+			OKAY_RETURN(rateCtlParseConfig(&config->rateCtl, optarg) != CSTATUS_SUCCESS, CSTATUS_BAD_PARAM,
+				"bad rate control %s\n", optarg);
+			break;
+		case 'C':
+			config->control.path = optarg;
+			break;
+		case 'D':
+			config->display = false;
+			break;
+		default:
+			return CSTATUS_BAD_PARAM;
+		}
+	}
+	return CSTATUS_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+	CaptureConfig_t config = {
+		//Image Setting
+		.source = {
+			.type = SOURCE_V4L2,
+			.path = NULL,
+			.pixfmt = V4L2_PIX_FMT_NV24,
+			.width = IMG_WIDTH,
+			.height = IMG_HEIGHT,
+			.fps = 60,
+			.numBufs = DMA_BUFF_COUNT,
+		},
+		.encoder = {
+			.birate = 1000000,
+			.fps = 60,
+			.gop = 60,
+			.backend = CAP_DEFAULT_BACKEND,
+			.codec = ENCODER_CODEC_H264,
+		},
+		.tcpPort = CAP_TCP_PORT,
+		.wsPort = CAP_WS_PORT,
+		.httpPort = CAP_HTTP_PORT,
+		.docRoot = CAP_DOC_ROOT,
+		.hlsSegmentMs = CAP_HLS_SEGMENT_MS,
+		.display = true,
+		.verbose = true,
+	};
+
+	if(CSTATUS_SUCCESS != capParseArgs(&config, argc, argv))
+	{
+		capUsage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGINT, capSignal);
+	signal(SIGTERM, capSignal);
+	signal(SIGPIPE, SIG_IGN);
+
+	int ret = 1;
+	if(CSTATUS_SUCCESS == capAppInit(&app, &config))
+	{
+		ret = (CSTATUS_SUCCESS == capAppRun(&app)) ? 0 : 1;
+	}
+
+	capAppDeinit(&app);
+	return ret;
+}
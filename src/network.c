@@ -1,4 +1,5 @@
-#include "network.h"
+#define _GNU_SOURCE
+#include "network_priv.h"
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -15,7 +16,8 @@
 
 Net_t *netCreate(NetConfig_t *config, NetInterface_t *itf, void *udata)
 {
-    Net_t *n = calloc(1, sizeof(NetCon_t));
+    Net_t *n = calloc(1, sizeof(Net_t));
+    OKAY_RETURN(n == NULL, NULL, "failed to allocate network\n");
     memcpy(&n->config, config, sizeof(NetConfig_t));
     n->itf = itf;
     n->udata = udata;
@@ -43,7 +45,7 @@ Net_t *netCreate(NetConfig_t *config, NetInterface_t *itf, void *udata)
         ret = bind(n->fd, (struct sockaddr *)&servaddr, sizeof(servaddr));
         OKAY_STOP(ret != 0, "failed to find tcp at :%d, with errno %d\n", n->config.port, errno);
             
-        ret = listen(n->fd, 5);
+        ret = listen(n->fd, config->http ? SOMAXCONN : 5);
         OKAY_STOP(ret != 0, "failed to listen tcp at :%d, with errno %d\n", n->config.port, errno);
 
         return n;
@@ -53,8 +55,7 @@ Net_t *netCreate(NetConfig_t *config, NetInterface_t *itf, void *udata)
     if(n->fd > 0)
     { close(n->fd); }
 
-    if(NULL == n)
-    { free(n); }
+    free(n);
 
     return NULL;
 }
@@ -83,8 +84,15 @@ void netDispatch(Net_t *n)
     if(fd < 0)
     { return; }
 
+    if(n->config.http)
+    {
+        netHttpDispatch(n, fd);
+        return;
+    }
+
     NetCon_t * con = calloc(1, sizeof(NetCon_t));
     con->fd = fd;
+    pacerInit(&con->pacer, &n->config.pacing);
     n->itf->NewClient(con, n->udata);
 }
 
@@ -99,6 +107,7 @@ static void *senderThread(void *args)
     signal(SIGPIPE, SIG_IGN);
     clock_gettime(CLOCK_REALTIME, &last);
     NetCon_t *con = args;
+    pthread_setname_np(pthread_self(), "net-send");
     while (con->running)
     {
         NetBuffer_t *buf = NULL;
@@ -113,7 +122,7 @@ static void *senderThread(void *args)
         }
 
         //Send the packet and put it back into lFree
-        int ret = write(con->fd, buf->buffer, buf->size);
+        int ret = write(con->fd, buf->buffer + buf->offset, buf->size - buf->offset);
         if(ret < 0)
         { 
             if(errno == EWOULDBLOCK)
@@ -129,14 +138,15 @@ static void *senderThread(void *args)
         {
             buf->offset += ret;
             bytesSend += ret;
+            pthread_mutex_lock(&con->lock);
+            con->sendBytes -= ret;
             if(buf->offset >= buf->size)
             {
                 //Put the list back into free list
-                pthread_mutex_lock(&con->lock);
                 listRemove(&buf->link);
                 listInsert(&con->lFree, &buf->link);
-                pthread_mutex_unlock(&con->lock);
             }
+            pthread_mutex_unlock(&con->lock);
         }
 
         struct timespec now;
@@ -154,7 +164,7 @@ static void *senderThread(void *args)
             bytesSend = 0;
         }
     }
-    
+    return NULL;
 }
 
 char *tab_alphabet="abcdefghijklmnopqrstuvwxyz";
@@ -202,7 +212,7 @@ void netConnInit(NetCon_t *con, NetConInterface_t *itf, void *udata)
 
 void netConClose(NetCon_t *con)
 {
-    con->running = true;
+    con->running = false;
     if(con->fd > 0)
     { close(con->fd); }
     pthread_join(con->senderThread, NULL);
@@ -243,16 +253,36 @@ int netConSend(NetCon_t *n, NetBuffer_t *buf)
         pthread_mutex_unlock(&n->lock);
         return -2;
     }
-    listInsertBack(&n->lSend, &b->link);
     pthread_mutex_unlock(&n->lock);
 
+    //Held to peak x the average the stream has had so far, IDR bursts included
+    if(n->pacer.config.peak > 0 && pacerAccount(&n->pacer, buf->size))
+    {
+        pacerApplyRate(&n->pacer, n->fd);
+    }
+
+    //Fill before publishing, the sender picks it up as soon as it is on lSend
     memcpy(b->buffer, buf->buffer, buf->size);
     b->offset = 0;
     b->size = buf->size;
+
+    pthread_mutex_lock(&n->lock);
+    listInsertBack(&n->lSend, &b->link);
+    n->sendBytes += b->size;
+    pthread_mutex_unlock(&n->lock);
     return 0;
 }
 
 
+size_t netConBacklog(NetCon_t *con)
+{
+    pthread_mutex_lock(&con->lock);
+    size_t bytes = con->sendBytes;
+    pthread_mutex_unlock(&con->lock);
+    return bytes;
+}
+
+
 int netConRecv(Net_t *n, uint8_t *buffer, int capacity)
 {
     (void)n;
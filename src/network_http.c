@@ -0,0 +1,410 @@
+#define _GNU_SOURCE
+#include "network_priv.h"
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <limits.h>
+
+/*
+ * Minimal HTTP/1.1 front end for a Net_t. Every connection gets a short lived
+ * thread that waits for the request head, so a slow client never holds up the
+ * capture loop calling netDispatch. The head is only peeked at until the route
+ * is known: WebSocket upgrades are handed over with the handshake unread.
+ */
+
+#define HTTP_MAX_HEAD           4096
+#define HTTP_TIMEOUT_MS         10000
+#define HTTP_MAX_REQUESTS       100     //Per keep-alive connection
+#define HTTP_PEEK_WAIT_US       2000    //Head split over several segments
+
+typedef struct
+{
+    int                 fd;
+    NetConfig_t         config;
+    NetInterface_t      *itf;
+    void                *udata;
+}HttpConn_t;
+
+static const struct
+{
+    const char *ext;
+    const char *type;
+}httpTypes[] = {
+    { ".html",  "text/html; charset=utf-8" },
+    { ".js",    "text/javascript; charset=utf-8" },
+    { ".mjs",   "text/javascript; charset=utf-8" },
+    { ".css",   "text/css; charset=utf-8" },
+    { ".json",  "application/json" },
+    { ".wasm",  "application/wasm" },
+    { ".svg",   "image/svg+xml" },
+    { ".png",   "image/png" },
+    { ".ico",   "image/x-icon" },
+    { ".ts",    "video/mp2t" },
+};
+
+
+static int64_t httpTimeMs(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static const char *httpContentType(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    for(size_t i = 0; ext != NULL && i < sizeof(httpTypes) / sizeof(httpTypes[0]); i++)
+    {
+        if(strcasecmp(ext, httpTypes[i].ext) == 0)
+        { return httpTypes[i].type; }
+    }
+    return "application/octet-stream";
+}
+
+CStatus_t netHttpSend(int fd, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    while (len > 0)
+    {
+        ssize_t ret = send(fd, p, len, MSG_NOSIGNAL);
+        if(ret < 0 && errno == EINTR)
+        { continue; }
+        OKAY_RETURN(ret <= 0, CSTATUS_SYSCALL, "http send failed : errno (%d)\n", errno);
+        p += ret;
+        len -= ret;
+    }
+    return CSTATUS_SUCCESS;
+}
+
+CStatus_t netHttpRespond(int fd, int code, const char *reason, const char *type, int64_t length, bool close,
+                         const char *extra)
+{
+    char head[512];
+    int len = snprintf(head, sizeof(head),
+        "HTTP/1.1 %d %s\r\n"
+        "Server: capture\r\n"
+        "Content-Type: %s\r\n"
+        "Cache-Control: no-cache\r\n",
+        code, reason, type);
+
+    if(length >= 0)
+    { len += snprintf(head + len, sizeof(head) - len, "Content-Length: %lld\r\n", (long long)length); }
+    len += snprintf(head + len, sizeof(head) - len, "Connection: %s\r\n%s\r\n",
+                    close ? "close" : "keep-alive", extra ? extra : "");
+    OKAY_RETURN(len >= (int)sizeof(head), CSTATUS_FAIL, "http response head too long\n");
+    return netHttpSend(fd, head, len);
+}
+
+CStatus_t netHttpError(int fd, int code, const char *reason, bool close, const char *extra)
+{
+    char body[64];
+    int len = snprintf(body, sizeof(body), "%d %s\n", code, reason);
+    CStatus_t status = netHttpRespond(fd, code, reason, "text/plain; charset=utf-8", len, close, extra);
+    return (status == CSTATUS_SUCCESS) ? netHttpSend(fd, body, len) : status;
+}
+
+//Waits for the full request head without consuming it, returns its length
+static int httpPeekHead(int fd, char *buf, int capacity)
+{
+    int64_t deadline = httpTimeMs() + HTTP_TIMEOUT_MS;
+    int last = 0;
+
+    while (true)
+    {
+        int64_t left = deadline - httpTimeMs();
+        OKAY_RETURN(left <= 0, -1, "http request timed out\n");
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ret = poll(&pfd, 1, left);
+        if(ret < 0 && errno == EINTR)
+        { continue; }
+        if(ret <= 0)
+        { return -1; }
+
+        int len = recv(fd, buf, capacity - 1, MSG_PEEK);
+        if(len <= 0)
+        { return -1; }
+        buf[len] = '\0';
+
+        char *end = strstr(buf, "\r\n\r\n");
+        if(end != NULL)
+        { return end + 4 - buf; }
+        OKAY_RETURN(len >= capacity - 1, 0, "http request head over %d bytes\n", capacity);
+
+        //Peeked data keeps the socket readable, back off until more arrives
+        if(len == last)
+        { usleep(HTTP_PEEK_WAIT_US); }
+        last = len;
+    }
+}
+
+static bool httpHeaderHas(const char *value, const char *token)
+{
+    const char *end = strstr(value, "\r\n");
+    size_t tlen = strlen(token);
+    for(const char *p = value; p + tlen <= end; p++)
+    {
+        if(strncasecmp(p, token, tlen) == 0)
+        { return true; }
+    }
+    return false;
+}
+
+//Percent decoded path and raw query, false if the path could escape the root
+static bool httpDecodeTarget(const char *target, size_t len, NetHttpRequest_t *req)
+{
+    char *path = req->path;
+    size_t capacity = sizeof(req->path);
+    size_t o = 0, i;
+    for(i = 0; i < len && target[i] != '?' && target[i] != '#'; i++)
+    {
+        char c = target[i];
+        if(c == '%' && i + 2 < len && isxdigit((unsigned char)target[i + 1]) &&
+           isxdigit((unsigned char)target[i + 2]))
+        {
+            char hex[3] = { target[i + 1], target[i + 2], '\0' };
+            c = (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+        if(c == '\0' || o + 1 >= capacity)
+        { return false; }
+        path[o++] = c;
+    }
+    path[o] = '\0';
+
+    if(i < len && target[i] == '?')
+    {
+        const char *query = target + i + 1;
+        const char *end = memchr(query, '#', len - i - 1);
+        size_t qlen = (end ? end : target + len) - query;
+        if(qlen >= sizeof(req->query))
+        { return false; }
+        memcpy(req->query, query, qlen);
+        req->query[qlen] = '\0';
+    }
+
+    return path[0] == '/' && strstr(path, "/..") == NULL && strchr(path, '\\') == NULL;
+}
+
+static CStatus_t httpParse(char *head, int headLen, NetHttpRequest_t *req)
+{
+    memset(req, 0, sizeof(NetHttpRequest_t));
+    req->headLen = headLen;
+
+    char *lineEnd = strstr(head, "\r\n");
+    char *sp1 = memchr(head, ' ', lineEnd - head);
+    OKAY_RETURN(sp1 == NULL || sp1 - head >= (int)sizeof(req->method), CSTATUS_BAD_PARAM, "bad http request line\n");
+    char *sp2 = memchr(sp1 + 1, ' ', lineEnd - sp1 - 1);
+    OKAY_RETURN(sp2 == NULL || strncmp(sp2 + 1, "HTTP/1.", 7) != 0, CSTATUS_BAD_PARAM, "bad http request line\n");
+
+    memcpy(req->method, head, sp1 - head);
+    req->head = strcmp(req->method, "HEAD") == 0;
+    req->close = sp2[8] == '0';
+    OKAY_RETURN(!httpDecodeTarget(sp1 + 1, sp2 - sp1 - 1, req), CSTATUS_BAD_PARAM,
+                "bad http path\n");
+
+    for(char *line = lineEnd + 2; line < head + headLen - 2; line = strstr(line, "\r\n") + 2)
+    {
+        if(strncasecmp(line, "Upgrade:", 8) == 0)
+        { req->upgrade = httpHeaderHas(line + 8, "websocket"); }
+        else if(strncasecmp(line, "Connection:", 11) == 0)
+        {
+            if(httpHeaderHas(line + 11, "close"))
+            { req->close = true; }
+            else if(httpHeaderHas(line + 11, "keep-alive"))
+            { req->close = false; }
+        }
+    }
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t httpConsume(int fd, int len)
+{
+    char scratch[HTTP_MAX_HEAD];
+    while (len > 0)
+    {
+        int ret = recv(fd, scratch, len, 0);
+        if(ret < 0 && errno == EINTR)
+        { continue; }
+        OKAY_RETURN(ret <= 0, CSTATUS_SYSCALL, "http recv failed : errno (%d)\n", errno);
+        len -= ret;
+    }
+    return CSTATUS_SUCCESS;
+}
+
+static void httpSetTimeout(int fd, int ms)
+{
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+static CStatus_t httpServeFile(HttpConn_t *hc, NetHttpRequest_t *req)
+{
+    const char *docRoot = hc->config.docRoot;
+    if(docRoot == NULL)
+    { return netHttpError(hc->fd, 404, "Not Found", req->close, NULL); }
+
+    char file[PATH_MAX];
+    size_t len = strlen(req->path);
+    int n = snprintf(file, sizeof(file), "%s%s%s", docRoot, req->path,
+                     (req->path[len - 1] == '/') ? "index.html" : "");
+    if(n >= (int)sizeof(file))
+    { return netHttpError(hc->fd, 404, "Not Found", req->close, NULL); }
+
+    struct stat st;
+    int ffd = open(file, O_RDONLY | O_CLOEXEC);
+    if(ffd < 0 || fstat(ffd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        if(ffd >= 0)
+        { close(ffd); }
+        return netHttpError(hc->fd, 404, "Not Found", req->close, NULL);
+    }
+
+    CStatus_t status = netHttpRespond(hc->fd, 200, "OK", httpContentType(file), st.st_size, req->close, NULL);
+
+    //Straight from the page cache, the file never passes through user space
+    off_t offset = 0;
+    while (status == CSTATUS_SUCCESS && !req->head && offset < st.st_size)
+    {
+        ssize_t ret = sendfile(hc->fd, ffd, &offset, st.st_size - offset);
+        if(ret < 0 && errno == EINTR)
+        { continue; }
+        if(ret <= 0)
+        { status = CSTATUS_SYSCALL; }
+    }
+
+    close(ffd);
+    return status;
+}
+
+//Returns true once fd has been handed over
+static bool httpServeStream(HttpConn_t *hc, NetHttpRequest_t *req)
+{
+    //Close delimited, the stream has no length and chunking it buys nothing
+    CStatus_t status = netHttpRespond(hc->fd, 200, "OK", "video/mp2t", -1, true, NULL);
+    if(status != CSTATUS_SUCCESS || req->head)
+    { return false; }
+
+    NetCon_t *con = calloc(1, sizeof(NetCon_t));
+    OKAY_RETURN(con == NULL, false, "failed to allocate connection\n");
+
+    //The sender thread has its own EWOULDBLOCK handling
+    httpSetTimeout(hc->fd, 0);
+    con->fd = hc->fd;
+    pacerInit(&con->pacer, &hc->config.pacing);
+    hc->itf->NewClient(con, hc->udata);
+    return true;
+}
+
+static void *httpThread(void *args)
+{
+    HttpConn_t *hc = args;
+    char head[HTTP_MAX_HEAD];
+    bool handedOver = false;
+    pthread_setname_np(pthread_self(), "http");
+
+    //A client that stops reading must not pin this thread
+    httpSetTimeout(hc->fd, HTTP_TIMEOUT_MS);
+
+    for(int i = 0; i < HTTP_MAX_REQUESTS && !handedOver; i++)
+    {
+        NetHttpRequest_t req;
+        int headLen = httpPeekHead(hc->fd, head, sizeof(head));
+        if(headLen < 0)
+        { break; }
+        if(headLen == 0)
+        {
+            netHttpError(hc->fd, 431, "Request Header Fields Too Large", true, NULL);
+            break;
+        }
+
+        if(httpParse(head, headLen, &req) != CSTATUS_SUCCESS)
+        {
+            httpConsume(hc->fd, headLen);
+            netHttpError(hc->fd, 400, "Bad Request", true, NULL);
+            break;
+        }
+
+        //WebSocket engine reads the handshake itself
+        size_t wsLen = strlen(NET_HTTP_WS_PATH);
+        bool wsPath = strncmp(req.path, NET_HTTP_WS_PATH, wsLen) == 0 &&
+                      (req.path[wsLen] == '\0' || req.path[wsLen] == '/');
+        if(req.upgrade && wsPath && hc->itf->Upgrade != NULL)
+        {
+            httpSetTimeout(hc->fd, 0);
+            if(hc->itf->Upgrade(hc->fd, hc->udata) == CSTATUS_SUCCESS)
+            {
+                handedOver = true;
+                break;
+            }
+            httpSetTimeout(hc->fd, HTTP_TIMEOUT_MS);
+        }
+
+        if(httpConsume(hc->fd, headLen) != CSTATUS_SUCCESS)
+        { break; }
+
+        CStatus_t status;
+        if(strcmp(req.method, "GET") != 0 && !req.head)
+        {
+            //No request bodies are read, the connection can not be reused
+            status = netHttpError(hc->fd, 405, "Method Not Allowed", true, "Allow: GET, HEAD\r\n");
+            break;
+        }
+        else if(wsPath)
+        {
+            status = netHttpError(hc->fd, req.upgrade ? 503 : 426, req.upgrade ? "Service Unavailable" : "Upgrade Required",
+                               req.close, NULL);
+        }
+        else if(strcmp(req.path, NET_HTTP_STREAM_PATH) == 0)
+        {
+            handedOver = httpServeStream(hc, &req);
+            break;
+        }
+        else
+        {
+            status = (hc->itf->Request != NULL) ? hc->itf->Request(hc->fd, &req, hc->udata) : CSTATUS_AGAIN;
+            if(status == CSTATUS_AGAIN)
+            { status = httpServeFile(hc, &req); }
+        }
+
+        if(status != CSTATUS_SUCCESS || req.close)
+        { break; }
+    }
+
+    if(!handedOver)
+    { close(hc->fd); }
+    free(hc);
+    return NULL;
+}
+
+void netHttpDispatch(Net_t *n, int fd)
+{
+    HttpConn_t *hc = calloc(1, sizeof(HttpConn_t));
+    if(hc == NULL)
+    {
+        printf("failed to allocate http connection\n");
+        close(fd);
+        return;
+    }
+
+    hc->fd = fd;
+    memcpy(&hc->config, &n->config, sizeof(NetConfig_t));
+    hc->itf = n->itf;
+    hc->udata = n->udata;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int ret = pthread_create(&thread, &attr, httpThread, hc);
+    pthread_attr_destroy(&attr);
+    if(ret != 0)
+    {
+        printf("failed to create http thread : %d\n", ret);
+        close(fd);
+        free(hc);
+    }
+}
@@ -0,0 +1,11 @@
+#ifndef __NETWORK_PRIV_H__
+#define __NETWORK_PRIV_H__
+
+#include "network.h"
+
+/**
+ * Serve an accepted connection of an HTTP Net_t, owns fd from now on
+ */
+void netHttpDispatch(Net_t *n, int fd);
+
+#endif
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+#include "pacing.h"
+#include <linux/net_tstamp.h>
+#include <sys/socket.h>
+
+#ifndef SO_TXTIME
+#define SO_TXTIME               61
+#endif
+
+#ifndef CLOCK_TAI
+#define CLOCK_TAI               11
+#endif
+
+
+static int64_t pacerNowNs(Pacer_t *pacer)
+{
+    struct timespec ts;
+    clock_gettime(pacer->clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+CStatus_t pacingParseConfig(PacingConfig_t *config, const char *str)
+{
+    char rest[24] = "", tail;
+    memset(config, 0, sizeof(PacingConfig_t));
+    int n = sscanf(str, "%lf%23s", &config->peak, rest);
+    OKAY_RETURN(n < 1, CSTATUS_BAD_PARAM, "pacing %s has no peak to average ratio\n", str);
+    OKAY_RETURN(config->peak < 1.0, CSTATUS_BAD_PARAM, "pacing peak to average ratio %s is below 1\n", str);
+
+    config->etf = n == 2;
+    config->leadUs = PACING_ETF_LEAD_US;
+    if(n == 2 && strcmp(rest, ",etf") != 0)
+    {
+        OKAY_RETURN(sscanf(rest, ",etf=%d%c", &config->leadUs, &tail) != 1, CSTATUS_BAD_PARAM,
+                    "pacing %s has an unknown option %s\n", str, rest);
+        OKAY_RETURN(config->leadUs <= 0, CSTATUS_BAD_PARAM, "pacing etf lead %d us is not positive\n", config->leadUs);
+    }
+    return CSTATUS_SUCCESS;
+}
+
+void pacerInit(Pacer_t *pacer, const PacingConfig_t *config)
+{
+    memset(pacer, 0, sizeof(Pacer_t));
+    pacer->config = *config;
+    pacer->clock = config->etf ? CLOCK_TAI : CLOCK_MONOTONIC;
+    pacer->windowStartNs = pacerNowNs(pacer);
+}
+
+bool pacerAccount(Pacer_t *pacer, size_t bytes)
+{
+    pacer->windowBytes += bytes;
+
+    int64_t now = pacerNowNs(pacer);
+    int64_t elapsed = now - pacer->windowStartNs;
+    if(elapsed < PACING_WINDOW_MS * 1000000LL)
+    { return false; }
+
+    //Exponential average, the first sample seeds it
+    double sample = (double)pacer->windowBytes * 1e9 / (double)elapsed;
+    double alpha = (double)elapsed / (PACING_AVERAGE_MS * 1000000.0);
+    alpha = (alpha > 1.0) ? 1.0 : alpha;
+    pacer->avgRate = (pacer->rate == 0) ? sample : pacer->avgRate + (sample - pacer->avgRate) * alpha;
+    pacer->rate = (uint64_t)(pacer->avgRate * pacer->config.peak) + 1;
+    pacer->windowStartNs = now;
+    pacer->windowBytes = 0;
+
+    uint64_t diff = (pacer->rate > pacer->appliedRate) ? pacer->rate - pacer->appliedRate : pacer->appliedRate - pacer->rate;
+    return diff * 100 > pacer->appliedRate * PACING_RATE_SLACK;
+}
+
+CStatus_t pacerApplyRate(Pacer_t *pacer, int fd)
+{
+    //Unsigned int is accepted by every kernel, ~0U leaves the socket unpaced
+    unsigned int rate = (pacer->rate == 0 || pacer->rate >= ~0U) ? ~0U : (unsigned int)pacer->rate;
+    int ret = setsockopt(fd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate));
+    OKAY_RETURN(ret != 0, CSTATUS_SYSCALL, "failed to set pacing rate %u : %s\n", rate, ERRSTR);
+    pacer->appliedRate = pacer->rate;
+    return CSTATUS_SUCCESS;
+}
+
+CStatus_t pacerEnableTxtime(Pacer_t *pacer, int fd)
+{
+    struct sock_txtime txtime = { .clockid = pacer->clock, .flags = 0 };
+    int ret = setsockopt(fd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime));
+    OKAY_RETURN(ret != 0, CSTATUS_SYSCALL, "failed to enable SO_TXTIME : %s\n", ERRSTR);
+    return CSTATUS_SUCCESS;
+}
+
+int64_t pacerDepart(Pacer_t *pacer, size_t bytes)
+{
+    //ETF drops what is already due on enqueue, an idle queue departs a lead from now
+    int64_t now = pacerNowNs(pacer) + (pacer->config.etf ? pacer->config.leadUs * 1000LL : 0);
+    if(pacer->rate == 0)
+    { return now; }
+
+    //A queue the rate cannot drain before the horizon bursts at it
+    int64_t depart = (pacer->nextNs > now) ? pacer->nextNs : now;
+    int64_t horizon = now + PACING_MAX_DELAY_MS * 1000000LL;
+    depart = (depart > horizon) ? horizon : depart;
+    pacer->nextNs = depart + (int64_t)((double)bytes * 1e9 / (double)pacer->rate);
+    return depart;
+}
@@ -0,0 +1,177 @@
+#include "ratectl.h"
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+
+struct RateCtl
+{
+    RateCtlConfig_t     config;
+    int                 bps;
+    int                 fps;
+    int                 baseFps;        //Frame rate the capture runs at
+    int                 congested;      //Samples in a row above highMs
+    int64_t             lastChangeMs;
+    int64_t             lastCutMs;
+    int64_t             cutBacklogMs;   //Worst backlog that triggered the last cut
+    int                 cutFromBps;     //Bitrate the backlog queued before the last cut was encoded at
+};
+
+
+static int64_t rateCtlNowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+CStatus_t rateCtlParseConfig(RateCtlConfig_t *config, const char *str)
+{
+    int minKbps = 0, maxKbps = 0, minFps = 0;
+    memset(config, 0, sizeof(RateCtlConfig_t));
+    int n = sscanf(str, "%d:%d:%d", &minKbps, &maxKbps, &minFps);
+    OKAY_RETURN(n < 2, CSTATUS_BAD_PARAM, "rate control %s is not min:max[:minfps]\n", str);
+    OKAY_RETURN(minKbps <= 0 || maxKbps < minKbps || minFps < 0, CSTATUS_BAD_PARAM, "rate control %s out of range\n", str);
+
+    config->minBps = minKbps * 1000;
+    config->maxBps = maxKbps * 1000;
+    config->minFps = minFps;
+    return CSTATUS_SUCCESS;
+}
+
+RateCtl_t *rateCtlCreate(RateCtlConfig_t *config, int bps, int fps)
+{
+    RateCtl_t *rc = calloc(1, sizeof(RateCtl_t));
+    OKAY_RETURN(rc == NULL, NULL, "failed to allocate rate control\n");
+    memcpy(&rc->config, config, sizeof(RateCtlConfig_t));
+
+    RateCtlConfig_t *c = &rc->config;
+    c->highMs = c->highMs > 0 ? c->highMs : RATECTL_DEFAULT_HIGH_MS;
+    c->lowMs = c->lowMs > 0 ? c->lowMs : RATECTL_DEFAULT_LOW_MS;
+    c->holdMs = c->holdMs > 0 ? c->holdMs : RATECTL_DEFAULT_HOLD_MS;
+    c->minFps = (c->minFps > fps) ? fps : c->minFps;
+
+    rc->bps = (bps < c->minBps) ? c->minBps : (bps > c->maxBps) ? c->maxBps : bps;
+    rc->fps = fps;
+    rc->baseFps = fps;
+    rc->lastChangeMs = rateCtlNowMs();
+    rc->lastCutMs = rc->lastChangeMs - c->holdMs;
+
+    printf("rate control : %d..%d kbps, from %d kbps, %s %d fps, backlog %d..%d ms\n", c->minBps / 1000, c->maxBps / 1000,
+           rc->bps / 1000, c->minFps > 0 ? "down to" : "fixed", c->minFps > 0 ? c->minFps : fps, c->lowMs, c->highMs);
+    return rc;
+}
+
+void rateCtlDestroy(RateCtl_t *rc)
+{
+    free(rc);
+}
+
+int rateCtlReset(RateCtl_t *rc, int bps, int fps)
+{
+    const RateCtlConfig_t *c = &rc->config;
+    rc->bps = (bps < c->minBps) ? c->minBps : (bps > c->maxBps) ? c->maxBps : bps;
+    rc->fps = (fps > rc->baseFps) ? rc->baseFps : fps;
+    rc->congested = 0;
+    rc->lastChangeMs = rateCtlNowMs();
+    rc->lastCutMs = rc->lastChangeMs - c->holdMs;
+    return rc->bps;
+}
+
+void rateCtlSampleSocket(RateCtlSample_t *sample, int fd, size_t queued)
+{
+    memset(sample, 0, sizeof(RateCtlSample_t));
+    sample->backlog = queued;
+
+    //Older kernels fill less, the rest stays zero
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    memset(&info, 0, sizeof(info));
+    if(fd < 0 || getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) != 0)
+    { return; }
+
+    sample->backlog += info.tcpi_notsent_bytes;
+    sample->rttUs = info.tcpi_rtt;
+    sample->deliveryRate = info.tcpi_delivery_rate_app_limited ? 0 : info.tcpi_delivery_rate;
+}
+
+bool rateCtlUpdate(RateCtl_t *rc, const RateCtlSample_t *samples, int count, int *bps, int *fps)
+{
+    const RateCtlConfig_t *c = &rc->config;
+    int64_t now = rateCtlNowMs();
+
+    //Worst viewer, in the time its backlog takes to drain. Without a measured delivery
+    //rate use the bitrate the queued data was encoded at, right after a cut that is
+    //still the one before it
+    bool holding = now - rc->lastCutMs < c->holdMs;
+    int64_t encodedBps = holding ? rc->cutFromBps : rc->bps;
+    int64_t worstMs = 0;
+    uint64_t worstDelivery = 0;
+    for(int i = 0; i < count; i++)
+    {
+        int64_t ms = (samples[i].deliveryRate > 0) ? (int64_t)(samples[i].backlog * 1000 / samples[i].deliveryRate) :
+                     (int64_t)samples[i].backlog * 8 * 1000 / encodedBps;
+        if(ms >= worstMs)
+        {
+            worstMs = ms;
+            worstDelivery = samples[i].deliveryRate;
+        }
+    }
+
+    int newBps = rc->bps, newFps = rc->fps;
+    if(worstMs > c->highMs)
+    {
+        if(++rc->congested < RATECTL_CONGESTED_SAMPLES)
+        { return false; }
+        //The last cut needs time to drain the queue, within holdMs only a growing backlog cuts again
+        if(holding && worstMs <= rc->cutBacklogMs)
+        { return false; }
+        rc->congested = 0;
+
+        if(rc->bps > c->minBps)
+        {
+            int64_t target = (int64_t)rc->bps * 3 / 4;
+            int64_t fits = (int64_t)worstDelivery * 8 * RATECTL_DELIVERY_SHARE / 100;
+            target = (worstDelivery > 0 && fits < target) ? fits : target;
+            newBps = (target < c->minBps) ? c->minBps : (int)target;
+        }
+        else if(c->minFps > 0 && rc->fps > c->minFps)
+        {
+            newFps = (rc->fps / 2 < c->minFps) ? c->minFps : rc->fps / 2;
+        }
+    }
+    else
+    {
+        rc->congested = 0;
+        if(worstMs >= c->lowMs || now - rc->lastChangeMs < c->holdMs)
+        { return false; }
+
+        if(rc->fps < rc->baseFps)
+        {
+            newFps = (rc->fps * 2 > rc->baseFps) ? rc->baseFps : rc->fps * 2;
+        }
+        else if(rc->bps < c->maxBps)
+        {
+            int64_t target = (int64_t)rc->bps * (100 + RATECTL_STEP_UP) / 100;
+            newBps = (target > c->maxBps) ? c->maxBps : (int)target;
+        }
+    }
+
+    if(newBps == rc->bps && newFps == rc->fps)
+    { return false; }
+
+    printf("rate control : %d -> %d kbps, %d -> %d fps, backlog %lld ms\n", rc->bps / 1000, newBps / 1000,
+           rc->fps, newFps, (long long)worstMs);
+    if(newBps < rc->bps || newFps < rc->fps)
+    {
+        rc->cutFromBps = holding ? rc->cutFromBps : rc->bps;
+        rc->cutBacklogMs = worstMs;
+        rc->lastCutMs = now;
+    }
+    rc->bps = newBps;
+    rc->fps = newFps;
+    rc->lastChangeMs = now;
+    *bps = newBps;
+    *fps = newFps;
+    return true;
+}
@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+#include "rudp.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT             103
+#endif
+
+#define RUDP_RING               4096        //Datagrams kept for retransmission, power of two
+#define RUDP_GSO_MAX_SEGS       44          //44 * 1332 stays under the 64KB datagram limit
+#define RUDP_BATCH              64          //Messages per sendmmsg
+#define RUDP_POLL_MS            10
+#define RUDP_INITIAL_RTT_US     100000      //Until the first pong
+
+typedef struct
+{
+    bool                active;
+    struct sockaddr_in  addr;
+    int64_t             lastHeardUs;
+    int64_t             lastPingUs;
+    int64_t             srttUs;             //RFC 6298 smoothing
+    int64_t             rttvarUs;
+    bool                hasRtt;
+    uint32_t            firstSeq;           //Earlier sequences were never sent to it
+}RudpPeer_t;
+
+typedef struct
+{
+    uint32_t            seq;
+    size_t              len;
+    int64_t             sentUs;
+    int64_t             rexmitUs[RUDP_MAX_PEERS];   //Last retransmission to each peer
+}RudpSlot_t;
+
+typedef struct
+{
+    struct mmsghdr      msgs[RUDP_BATCH];
+    struct iovec        iovs[RUDP_BATCH];
+    uint8_t             ctrl[RUDP_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+    int                 segs[RUDP_BATCH];
+    int                 numMsgs;
+}RudpBatch_t;
+
+struct Rudp
+{
+    RudpConfig_t        config;
+    int                 fd;
+    bool                gso;
+    int64_t             latencyUs;
+    Pacer_t             pacer;
+
+    pthread_t           thread;
+    pthread_mutex_t     lock;               //Ring, peers and stats
+    volatile bool       running;
+
+    RudpPeer_t          peers[RUDP_MAX_PEERS];
+    uint64_t            secret;             //Keys the PING cookies
+
+    //Slots back to back so a run of full datagrams is one GSO message
+    uint8_t             *dgrams;
+    RudpSlot_t          *slots;
+    uint32_t            nextSeq;
+
+    RudpBatch_t         send;               //Encoder thread
+    RudpBatch_t         rexmit;             //Control thread
+    uint8_t             rexmitBufs[RUDP_BATCH][RUDP_MAX_DGRAM];
+
+    RudpStats_t         stats;
+};
+
+static void *rudpThread(void *args);
+
+
+static int64_t rudpNowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void rudpPut32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t rudpGet32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void rudpHeader(uint8_t *p, int type, uint32_t seq, int64_t us)
+{
+    memset(p, 0, RUDP_HEADER);
+    p[0] = (uint8_t)type;
+    rudpPut32(p + 4, seq);
+    rudpPut32(p + 8, (uint32_t)((uint64_t)us >> 32));
+    rudpPut32(p + 12, (uint32_t)us);
+}
+
+static int64_t rudpHeaderUs(const uint8_t *p)
+{
+    return (int64_t)(((uint64_t)rudpGet32(p + 8) << 32) | rudpGet32(p + 12));
+}
+
+//Keyed hash of the address and the PING clock, only whoever receives at the address can echo it
+static uint32_t rudpCookie(Rudp_t *rudp, const struct sockaddr_in *addr, int64_t us)
+{
+    uint64_t x = rudp->secret ^ ((uint64_t)addr->sin_addr.s_addr << 16 | addr->sin_port);
+    for(int i = 0; i < 2; i++)
+    {
+        //splitmix64 rounds
+        x += 0x9e3779b97f4a7c15ULL ^ (i ? (uint64_t)us : 0);
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+        x ^= x >> 31;
+    }
+    return (uint32_t)(x ^ (x >> 32));
+}
+
+static bool rudpCookieValid(Rudp_t *rudp, const struct sockaddr_in *addr, const uint8_t *p, int64_t now)
+{
+    int64_t us = rudpHeaderUs(p);
+    return us <= now && now - us <= RUDP_PEER_TIMEOUT_MS * 1000LL && rudpGet32(p + 4) == rudpCookie(rudp, addr, us);
+}
+
+Rudp_t *rudpCreate(RudpConfig_t *config)
+{
+    Rudp_t *rudp = calloc(1, sizeof(Rudp_t));
+    OKAY_RETURN(rudp == NULL, NULL, "failed to allocate rudp sink\n");
+    memcpy(&rudp->config, config, sizeof(RudpConfig_t));
+    rudp->fd = -1;
+    if(getrandom(&rudp->secret, sizeof(rudp->secret), GRND_NONBLOCK) != sizeof(rudp->secret))
+    { rudp->secret = (uint64_t)rudpNowUs() * 0x9e3779b97f4a7c15ULL ^ (uint64_t)getpid(); }
+    rudp->latencyUs = (config->latencyMs > 0 ? config->latencyMs : RUDP_DEFAULT_LATENCY_MS) * 1000LL;
+    pthread_mutex_init(&rudp->lock, NULL);
+
+    do
+    {
+        rudp->dgrams = malloc((size_t)RUDP_RING * RUDP_MAX_DGRAM);
+        rudp->slots = calloc(RUDP_RING, sizeof(RudpSlot_t));
+        OKAY_STOP(rudp->dgrams == NULL || rudp->slots == NULL, "failed to allocate the rudp ring\n");
+
+        rudp->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        OKAY_STOP(rudp->fd < 0, "failed to create rudp socket : %s\n", ERRSTR);
+
+        setsockopt(rudp->fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+        setsockopt(rudp->fd, SOL_SOCKET, SO_SNDBUF, &(int){4 * 1024 * 1024}, sizeof(int));
+        setsockopt(rudp->fd, SOL_SOCKET, SO_RCVBUF, &(int){1024 * 1024}, sizeof(int));
+
+        struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(config->port),
+            .sin_addr.s_addr = htonl(INADDR_ANY),
+        };
+        int ret = bind(rudp->fd, (struct sockaddr *)&addr, sizeof(addr));
+        OKAY_STOP(ret != 0, "failed to bind rudp port %d : %s\n", config->port, ERRSTR);
+
+        rudp->gso = setsockopt(rudp->fd, SOL_UDP, UDP_SEGMENT, &(int){RUDP_MAX_DGRAM}, sizeof(int)) == 0;
+        if(rudp->gso)
+        {
+            setsockopt(rudp->fd, SOL_UDP, UDP_SEGMENT, &(int){0}, sizeof(int));
+        }
+
+        pacerInit(&rudp->pacer, &config->pacing);
+
+        rudp->running = true;
+        ret = pthread_create(&rudp->thread, NULL, rudpThread, rudp);
+        OKAY_STOP(ret != 0, "failed to start the rudp thread\n");
+
+        printf("rudp sink : port %d, latency %lld ms, %s", config->port, (long long)(rudp->latencyUs / 1000),
+               rudp->gso ? "gso" : "no gso");
+        if(config->pacing.peak > 0)
+        {
+            printf(", paced %.2fx", config->pacing.peak);
+        }
+        printf("\n");
+        return rudp;
+
+    } while (false);
+
+    rudp->running = false;
+    rudpDestroy(rudp);
+    return NULL;
+}
+
+void rudpDestroy(Rudp_t *rudp)
+{
+    if(rudp->running)
+    {
+        rudp->running = false;
+        pthread_join(rudp->thread, NULL);
+
+        uint8_t bye[RUDP_HEADER];
+        rudpHeader(bye, RUDP_BYE, 0, rudpNowUs());
+        for(int i = 0; i < RUDP_MAX_PEERS; i++)
+        {
+            if(rudp->peers[i].active)
+            {
+                sendto(rudp->fd, bye, sizeof(bye), MSG_DONTWAIT, (struct sockaddr *)&rudp->peers[i].addr,
+                       sizeof(struct sockaddr_in));
+            }
+        }
+    }
+
+    if(rudp->fd >= 0)
+    { close(rudp->fd); }
+
+    pthread_mutex_destroy(&rudp->lock);
+    free(rudp->slots);
+    free(rudp->dgrams);
+    free(rudp);
+}
+
+void rudpGetStats(Rudp_t *rudp, RudpStats_t *stats)
+{
+    pthread_mutex_lock(&rudp->lock);
+    memcpy(stats, &rudp->stats, sizeof(RudpStats_t));
+    stats->peers = 0;
+    stats->maxRttUs = 0;
+    for(int i = 0; i < RUDP_MAX_PEERS; i++)
+    {
+        RudpPeer_t *peer = &rudp->peers[i];
+        if(peer->active)
+        {
+            stats->peers++;
+            stats->maxRttUs = (peer->srttUs > stats->maxRttUs) ? peer->srttUs : stats->maxRttUs;
+        }
+    }
+    pthread_mutex_unlock(&rudp->lock);
+}
+
+//Sends the pending batch, the socket buffer drops what does not fit and NACKs bring it back
+static void rudpFlush(Rudp_t *rudp, RudpBatch_t *batch, uint64_t *counter)
+{
+    int sent = 0;
+    while(sent < batch->numMsgs)
+    {
+        int ret = sendmmsg(rudp->fd, batch->msgs + sent, batch->numMsgs - sent, MSG_DONTWAIT);
+        if(ret < 0 && errno == EINTR)
+        { continue; }
+
+        if(ret <= 0)
+        {
+            if(errno == EIO && batch->segs[sent] > 1)
+            {
+                printf("rudp gso refused by the device, sending datagrams one by one\n");
+                rudp->gso = false;
+            }
+            rudp->stats.dropped += batch->segs[sent];
+            sent++;
+            continue;
+        }
+
+        for(int i = sent; i < sent + ret; i++)
+        { *counter += batch->segs[i]; }
+        sent += ret;
+    }
+    batch->numMsgs = 0;
+}
+
+static void rudpQueue(Rudp_t *rudp, RudpBatch_t *batch, uint64_t *counter, const struct sockaddr_in *dest,
+                      uint8_t *data, size_t len, int segs)
+{
+    if(batch->numMsgs == RUDP_BATCH)
+    { rudpFlush(rudp, batch, counter); }
+
+    int i = batch->numMsgs++;
+    struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    batch->iovs[i].iov_base = data;
+    batch->iovs[i].iov_len = len;
+    batch->segs[i] = segs;
+    hdr->msg_name = (void *)dest;
+    hdr->msg_namelen = sizeof(*dest);
+    hdr->msg_iov = &batch->iovs[i];
+    hdr->msg_iovlen = 1;
+
+    if(segs > 1)
+    {
+        hdr->msg_control = batch->ctrl[i];
+        hdr->msg_controllen = sizeof(batch->ctrl[i]);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cm) = RUDP_MAX_DGRAM;
+    }
+}
+
+CStatus_t rudpSend(Rudp_t *rudp, const uint8_t *data, size_t len)
+{
+    OKAY_RETURN(len == 0 || len % RUDP_TS_PACKET != 0, CSTATUS_BAD_PARAM, "rudp payload of %zu bytes is not whole ts packets\n", len);
+
+    int numDgrams = (int)((len + RUDP_MAX_PAYLOAD - 1) / RUDP_MAX_PAYLOAD);
+    OKAY_RETURN(numDgrams > RUDP_RING / 2, CSTATUS_BAD_PARAM, "rudp access unit of %zu bytes does not fit the ring\n", len);
+
+    pthread_mutex_lock(&rudp->lock);
+
+    //Fill the ring, a slot is only reused once it is older than the whole ring
+    int64_t now = rudpNowUs();
+    uint32_t firstSeq = rudp->nextSeq;
+    for(size_t off = 0; off < len; off += RUDP_MAX_PAYLOAD)
+    {
+        size_t chunk = (len - off < RUDP_MAX_PAYLOAD) ? len - off : RUDP_MAX_PAYLOAD;
+        uint32_t idx = rudp->nextSeq & (RUDP_RING - 1);
+        uint8_t *dgram = rudp->dgrams + (size_t)idx * RUDP_MAX_DGRAM;
+        rudpHeader(dgram, RUDP_DATA, rudp->nextSeq, now);
+        memcpy(dgram + RUDP_HEADER, data + off, chunk);
+
+        RudpSlot_t *slot = &rudp->slots[idx];
+        memset(slot, 0, sizeof(RudpSlot_t));
+        slot->seq = rudp->nextSeq++;
+        slot->len = RUDP_HEADER + chunk;
+        slot->sentUs = now;
+    }
+
+    int peers = 0;
+    for(int p = 0; p < RUDP_MAX_PEERS; p++)
+    { peers += rudp->peers[p].active; }
+
+    //fq paces whole GSO messages, hold them to a millisecond at the rate
+    int perMsg = rudp->gso ? RUDP_GSO_MAX_SEGS : 1;
+    if(rudp->config.pacing.peak > 0 && peers > 0)
+    {
+        if(pacerAccount(&rudp->pacer, (len + (size_t)numDgrams * RUDP_HEADER) * peers))
+        { pacerApplyRate(&rudp->pacer, rudp->fd); }
+
+        int segs = (int)(rudp->pacer.rate / 1000 / RUDP_MAX_DGRAM);
+        perMsg = (rudp->pacer.rate == 0) ? perMsg : (segs < 1) ? 1 : (segs < perMsg) ? segs : perMsg;
+    }
+
+    //Runs of slots up to the ring end, all full but the access unit's last
+    for(int p = 0; p < RUDP_MAX_PEERS; p++)
+    {
+        RudpPeer_t *peer = &rudp->peers[p];
+        if(!peer->active)
+        { continue; }
+
+        for(uint32_t seq = firstSeq; seq != rudp->nextSeq; )
+        {
+            uint32_t idx = seq & (RUDP_RING - 1);
+            int segs = (int)(rudp->nextSeq - seq);
+            segs = (segs > perMsg) ? perMsg : segs;
+            segs = (segs > (int)(RUDP_RING - idx)) ? (int)(RUDP_RING - idx) : segs;
+
+            size_t msgLen = (size_t)(segs - 1) * RUDP_MAX_DGRAM + rudp->slots[(idx + segs - 1)].len;
+            rudpQueue(rudp, &rudp->send, &rudp->stats.datagrams, &peer->addr,
+                      rudp->dgrams + (size_t)idx * RUDP_MAX_DGRAM, msgLen, segs);
+            seq += segs;
+        }
+    }
+    rudpFlush(rudp, &rudp->send, &rudp->stats.datagrams);
+
+    pthread_mutex_unlock(&rudp->lock);
+    return CSTATUS_SUCCESS;
+}
+
+static RudpPeer_t *rudpFindPeer(Rudp_t *rudp, const struct sockaddr_in *addr)
+{
+    for(int i = 0; i < RUDP_MAX_PEERS; i++)
+    {
+        RudpPeer_t *peer = &rudp->peers[i];
+        if(peer->active && peer->addr.sin_addr.s_addr == addr->sin_addr.s_addr && peer->addr.sin_port == addr->sin_port)
+        { return peer; }
+    }
+    return NULL;
+}
+
+//An unknown address is only asked to prove it receives there, a PING the size of its HELLO
+static void rudpHello(Rudp_t *rudp, const struct sockaddr_in *addr, int64_t now)
+{
+    if(rudpFindPeer(rudp, addr) != NULL)
+    { return; }
+
+    uint8_t ping[RUDP_HEADER];
+    rudpHeader(ping, RUDP_PING, rudpCookie(rudp, addr, now), now);
+    sendto(rudp->fd, ping, sizeof(ping), MSG_DONTWAIT, (const struct sockaddr *)addr, sizeof(*addr));
+}
+
+//Its PONG echoed the cookie, the address is the receiver's own
+static RudpPeer_t *rudpAdmit(Rudp_t *rudp, const struct sockaddr_in *addr)
+{
+    RudpPeer_t *peer = NULL;
+    for(int i = 0; i < RUDP_MAX_PEERS && peer == NULL; i++)
+    {
+        peer = rudp->peers[i].active ? NULL : &rudp->peers[i];
+    }
+    if(peer == NULL)
+    {
+        printf("rudp peer %s:%d refused, %d peers already\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), RUDP_MAX_PEERS);
+        return NULL;
+    }
+
+    //Start with the next access unit, retransmission state of the slot is per peer index
+    memset(peer, 0, sizeof(RudpPeer_t));
+    peer->active = true;
+    peer->addr = *addr;
+    peer->firstSeq = rudp->nextSeq;
+    peer->srttUs = RUDP_INITIAL_RTT_US;
+    peer->rttvarUs = RUDP_INITIAL_RTT_US / 2;
+    int index = (int)(peer - rudp->peers);
+    for(int i = 0; i < RUDP_RING; i++)
+    { rudp->slots[i].rexmitUs[index] = 0; }
+    printf("rudp peer %s:%d joined\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    return peer;
+}
+
+static void rudpPong(Rudp_t *rudp, RudpPeer_t *peer, const uint8_t *p, int64_t now)
+{
+    UNUSED_PARAMETER(rudp);
+    int64_t rtt = now - rudpHeaderUs(p);
+    if(rtt < 0 || rtt > RUDP_PEER_TIMEOUT_MS * 1000LL)
+    { return; }
+
+    if(!peer->hasRtt)
+    {
+        peer->srttUs = rtt;
+        peer->rttvarUs = rtt / 2;
+        peer->hasRtt = true;
+        return;
+    }
+    int64_t err = rtt - peer->srttUs;
+    peer->rttvarUs += ((err < 0 ? -err : err) - peer->rttvarUs) / 4;
+    peer->srttUs += err / 8;
+}
+
+//Retransmit what can still make the deadline, at most once per round trip to the same peer
+static void rudpNack(Rudp_t *rudp, RudpPeer_t *peer, const uint8_t *p, size_t len, int64_t now)
+{
+    int index = (int)(peer - rudp->peers);
+    uint32_t ranges = rudpGet32(p + 4);
+    ranges = (ranges > RUDP_MAX_NACK_RANGES) ? RUDP_MAX_NACK_RANGES : ranges;
+    ranges = (ranges > (len - RUDP_HEADER) / 8) ? (uint32_t)((len - RUDP_HEADER) / 8) : ranges;
+
+    int64_t oneWay = peer->srttUs / 2;
+    int64_t again = peer->srttUs + peer->rttvarUs;
+    int used = 0;
+    for(uint32_t r = 0; r < ranges; r++)
+    {
+        uint32_t first = rudpGet32(p + RUDP_HEADER + 8 * r);
+        uint32_t last = rudpGet32(p + RUDP_HEADER + 8 * r + 4);
+        if((int32_t)(last - first) < 0 || last - first >= RUDP_RING)
+        { continue; }
+
+        for(uint32_t seq = first; seq != last + 1; seq++)
+        {
+            rudp->stats.nacked++;
+            RudpSlot_t *slot = &rudp->slots[seq & (RUDP_RING - 1)];
+            if((int32_t)(seq - peer->firstSeq) < 0 || (int32_t)(rudp->nextSeq - seq) <= 0 || slot->seq != seq ||
+               slot->sentUs + rudp->latencyUs < now + oneWay)
+            {
+                rudp->stats.late++;
+                continue;
+            }
+            if(slot->rexmitUs[index] != 0 && now - slot->rexmitUs[index] < again)
+            { continue; }
+            slot->rexmitUs[index] = now;
+
+            if(used == RUDP_BATCH)
+            {
+                rudpFlush(rudp, &rudp->rexmit, &rudp->stats.rexmits);
+                used = 0;
+            }
+            uint8_t *buf = rudp->rexmitBufs[used++];
+            memcpy(buf, rudp->dgrams + (size_t)(seq & (RUDP_RING - 1)) * RUDP_MAX_DGRAM, slot->len);
+            buf[1] |= RUDP_FLAG_REXMIT;
+            rudpQueue(rudp, &rudp->rexmit, &rudp->stats.rexmits, &peer->addr, buf, slot->len, 1);
+        }
+    }
+    rudpFlush(rudp, &rudp->rexmit, &rudp->stats.rexmits);
+}
+
+static void rudpPing(Rudp_t *rudp, int64_t now)
+{
+    uint8_t ping[RUDP_HEADER + 8];
+    for(int i = 0; i < RUDP_MAX_PEERS; i++)
+    {
+        RudpPeer_t *peer = &rudp->peers[i];
+        if(!peer->active)
+        { continue; }
+
+        if(now - peer->lastHeardUs > RUDP_PEER_TIMEOUT_MS * 1000LL)
+        {
+            printf("rudp peer %s:%d timed out\n", inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port));
+            peer->active = false;
+            continue;
+        }
+        if(now - peer->lastPingUs < RUDP_PING_MS * 1000LL)
+        { continue; }
+
+        peer->lastPingUs = now;
+        rudpHeader(ping, RUDP_PING, rudpCookie(rudp, &peer->addr, now), now);
+        rudpPut32(ping + RUDP_HEADER, (uint32_t)peer->srttUs);
+        rudpPut32(ping + RUDP_HEADER + 4, (uint32_t)peer->rttvarUs);
+        sendto(rudp->fd, ping, sizeof(ping), MSG_DONTWAIT, (struct sockaddr *)&peer->addr, sizeof(peer->addr));
+    }
+}
+
+static void *rudpThread(void *args)
+{
+    Rudp_t *rudp = args;
+    pthread_setname_np(pthread_self(), "rudp-ctrl");
+
+    uint8_t buf[RUDP_HEADER + 8 * RUDP_MAX_NACK_RANGES];
+    while(rudp->running)
+    {
+        struct pollfd pfd = { .fd = rudp->fd, .events = POLLIN };
+        int ret = poll(&pfd, 1, RUDP_POLL_MS);
+        int64_t now = rudpNowUs();
+
+        pthread_mutex_lock(&rudp->lock);
+        while(ret > 0)
+        {
+            struct sockaddr_in addr;
+            socklen_t addrLen = sizeof(addr);
+            ssize_t len = recvfrom(rudp->fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&addr, &addrLen);
+            if(len < RUDP_HEADER)
+            {
+                if(len < 0)
+                { break; }
+                continue;
+            }
+
+            if(buf[0] == RUDP_HELLO)
+            {
+                rudpHello(rudp, &addr, now);
+                continue;
+            }
+
+            //Only an echoed cookie admits a peer or keeps it alive, a spoofed source never gets data
+            RudpPeer_t *peer = rudpFindPeer(rudp, &addr);
+            if(buf[0] == RUDP_PONG && rudpCookieValid(rudp, &addr, buf, now))
+            {
+                peer = (peer == NULL) ? rudpAdmit(rudp, &addr) : peer;
+                if(peer != NULL)
+                {
+                    peer->lastHeardUs = now;
+                    rudpPong(rudp, peer, buf, now);
+                }
+                continue;
+            }
+            if(peer == NULL)
+            { continue; }
+
+            switch(buf[0])
+            {
+            case RUDP_NACK:
+                rudpNack(rudp, peer, buf, (size_t)len, now);
+                break;
+            case RUDP_BYE:
+                printf("rudp peer %s:%d left\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+                peer->active = false;
+                break;
+            default:
+                break;
+            }
+        }
+
+        rudpPing(rudp, now);
+        pthread_mutex_unlock(&rudp->lock);
+    }
+    return NULL;
+}
@@ -0,0 +1,230 @@
+#include "source.h"
+#include "source_priv.h"
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <sys/timerfd.h>
+#include <time.h>
+
+#define SOURCE_DMA_HEAP     "/dev/dma_heap/system"
+
+int sourceFrameSize(uint32_t pixfmt, uint32_t width, uint32_t height)
+{
+    switch (pixfmt)
+    {
+    case V4L2_PIX_FMT_NV24:
+        return width * height * 3;
+    case V4L2_PIX_FMT_NV12:
+        return width * height * 3 / 2;
+    default:
+        return 0;
+    }
+}
+
+int sourceTimerCreate(int fps)
+{
+    OKAY_RETURN(fps <= 0, -1, "invalid source frame rate %d\n", fps);
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    OKAY_RETURN(fd < 0, -1, "failed to create timerfd : %s\n", ERRSTR);
+    return fd;
+}
+
+CStatus_t sourceTimerArm(int fd, int fps)
+{
+    struct itimerspec its = {0};
+    long period = (long)(NANO_PER_SEC / fps);
+    its.it_interval.tv_sec = period / 1000000000L;
+    its.it_interval.tv_nsec = period % 1000000000L;
+    its.it_value = its.it_interval;
+
+    int ret = timerfd_settime(fd, 0, &its, NULL);
+    OKAY_RETURN(ret < 0, CSTATUS_SYSCALL, "failed to arm timerfd : %s\n", ERRSTR);
+    return CSTATUS_SUCCESS;
+}
+
+CStatus_t sourceTimerDisarm(int fd)
+{
+    struct itimerspec its = {0};
+    int ret = timerfd_settime(fd, 0, &its, NULL);
+    OKAY_RETURN(ret < 0, CSTATUS_SYSCALL, "failed to disarm timerfd : %s\n", ERRSTR);
+    return CSTATUS_SUCCESS;
+}
+
+uint64_t sourceTimerRead(int fd)
+{
+    uint64_t expirations = 0;
+    if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    { return 0; }
+    return expirations;
+}
+
+CStatus_t sourceAllocFrame(Buffer_t *buf, int size)
+{
+    buf->dmafd[0] = -1;
+    buf->size[0] = size;
+    buf->offset[0] = 0;
+
+    int heap = open(SOURCE_DMA_HEAP, O_RDWR | O_CLOEXEC);
+    if(heap >= 0)
+    {
+        struct dma_heap_allocation_data alloc = { .len = size, .fd_flags = O_RDWR | O_CLOEXEC };
+        if(ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc) == 0)
+        { buf->dmafd[0] = alloc.fd; }
+        else
+        { printf("failed to allocate %d bytes from %s : %s\n", size, SOURCE_DMA_HEAP, ERRSTR); }
+        close(heap);
+    }
+
+    if(buf->dmafd[0] >= 0)
+    {
+        buf->ptr[0] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, buf->dmafd[0], 0);
+        if(buf->ptr[0] != MAP_FAILED)
+        { return CSTATUS_SUCCESS; }
+
+        printf("failed to mmap dmabuf : %s\n", ERRSTR);
+        close(buf->dmafd[0]);
+        buf->dmafd[0] = -1;
+    }
+
+    //No heap, consumers copy out of plain memory instead of importing it
+    buf->ptr[0] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    OKAY_RETURN(buf->ptr[0] == MAP_FAILED, CSTATUS_MEMORY, "failed to allocate %d bytes frame : %s\n", size, ERRSTR);
+    return CSTATUS_SUCCESS;
+}
+
+void sourceFreeFrame(Buffer_t *buf)
+{
+    if(buf->ptr[0] != NULL && buf->ptr[0] != MAP_FAILED)
+    { munmap(buf->ptr[0], buf->size[0]); }
+    if(buf->dmafd[0] >= 0)
+    { close(buf->dmafd[0]); }
+    buf->ptr[0] = NULL;
+    buf->dmafd[0] = -1;
+}
+
+void sourceSyncFrame(Buffer_t *buf, bool begin)
+{
+    if(buf->dmafd[0] < 0)
+    { return; }
+
+    struct dma_buf_sync sync = { .flags = (begin ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END) | DMA_BUF_SYNC_WRITE };
+    if(ioctl(buf->dmafd[0], DMA_BUF_IOCTL_SYNC, &sync) != 0)
+    { printf("failed to sync dmabuf %d : %s\n", buf->dmafd[0], ERRSTR); }
+}
+
+int sourcePickQueued(Source_t *src, int *next)
+{
+    for(int i = 0; i < src->fmt.numBufs; i++)
+    {
+        int index = (*next + i) % src->fmt.numBufs;
+        if(src->queued[index])
+        {
+            src->queued[index] = false;
+            *next = (index + 1) % src->fmt.numBufs;
+            return index;
+        }
+    }
+    return -1;
+}
+
+Source_t *sourceCreate(SourceConfig_t *config)
+{
+    OKAY_RETURN(config->numBufs <= 0 || config->numBufs > DMA_BUFF_COUNT, NULL,
+                "invalid source buffer count %d\n", config->numBufs);
+
+    Source_t *src = calloc(1, sizeof(Source_t));
+    OKAY_RETURN(src == NULL, NULL, "failed to allocate source\n");
+    memcpy(&src->config, config, sizeof(SourceConfig_t));
+    src->fd = -1;
+
+    switch (config->type)
+    {
+    case SOURCE_V4L2:
+        src->ops = &sourceV4l2Ops;
+        break;
+    case SOURCE_SYNTHETIC:
+        src->ops = &sourceSynthOps;
+        break;
+    case SOURCE_FILE:
+        src->ops = &sourceFileOps;
+        break;
+    default:
+        free(src);
+        OKAY_RETURN(true, NULL, "unknown source type %d\n", config->type);
+    }
+
+    for(int i = 0; i < DMA_BUFF_COUNT; i++)
+    {
+        for(int j = 0; j < NUM_PLANES; j++)
+        { src->buffers[i].dmafd[j] = -1; }
+    }
+
+    CStatus_t status = CSTATUS_FAIL;
+    do
+    {
+        status = src->ops->Open(src);
+        OKAY_STOP(status != CSTATUS_SUCCESS, "failed to open %s source\n", src->ops->name);
+
+        status = src->ops->AllocateBuffers(src);
+        OKAY_STOP(status != CSTATUS_SUCCESS, "failed to allocate %s buffers\n", src->ops->name);
+
+        printf("%s source : %ux%u, %d bytes/frame, %d buffers\n", src->ops->name,
+                src->fmt.width, src->fmt.height, src->fmt.frameSize, src->fmt.numBufs);
+        return src;
+    } while (0);
+
+    src->ops->Close(src);
+    free(src);
+    return NULL;
+}
+
+void sourceDestroy(Source_t *src)
+{
+    if(src == NULL)
+    { return; }
+
+    src->ops->Close(src);
+    free(src);
+}
+
+int sourceGetFd(Source_t *src)
+{
+    return src->fd;
+}
+
+CStatus_t sourceStart(Source_t *src)
+{
+    CStatus_t status = CSTATUS_SUCCESS;
+    for(int i = 0; i < src->fmt.numBufs; i++)
+    {
+        status = src->ops->Queue(src, i);
+        OKAY_RETURN(status != CSTATUS_SUCCESS, status, "failed to queue buffer %d\n", i);
+    }
+    return src->ops->Start(src);
+}
+
+CStatus_t sourceStop(Source_t *src)
+{
+    return src->ops->Stop(src);
+}
+
+CStatus_t sourceDequeue(Source_t *src, Buffer_t **buff)
+{
+    return src->ops->Dequeue(src, buff);
+}
+
+CStatus_t sourceQueueByIndex(Source_t *src, int index)
+{
+    OKAY_RETURN(index < 0 || index >= src->fmt.numBufs, CSTATUS_BAD_PARAM, "invalid buffer index %d\n", index);
+    return src->ops->Queue(src, index);
+}
+
+int sourceTypeFromString(const char *name)
+{
+    if(strcmp(name, "v4l2") == 0)
+    { return SOURCE_V4L2; }
+    if(strcmp(name, "synth") == 0)
+    { return SOURCE_SYNTHETIC; }
+    if(strcmp(name, "file") == 0)
+    { return SOURCE_FILE; }
+    return -1;
+}
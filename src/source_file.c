@@ -0,0 +1,214 @@
+#include "source.h"
+#include "source_priv.h"
+#include <limits.h>
+
+/*
+ * File replay source. The path is either a single file holding back to back
+ * raw frames, or a printf pattern such as "frame-%d.raw" (the files written by
+ * example/example.c, numbered from 1). Frames are mmap'ed once and handed out
+ * in place, the Buffer_t pool only carries pointers into the mappings.
+ */
+
+#define FILE_MAX_FRAMES     4096
+
+typedef struct
+{
+    uint8_t     *map;
+    size_t      size;
+}SourceFileMap_t;
+
+typedef struct
+{
+    int                 next;
+    SourceFileMap_t     *maps;
+    int                 numMaps;
+
+    //Frames across all the mappings
+    int                 numFrames;
+    int                 frame;
+}SourceFile_t;
+
+
+static CStatus_t fileMap(SourceFileMap_t *m, const char *path)
+{
+    struct stat st;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    { return CSTATUS_SYSCALL; }
+
+    CStatus_t status = CSTATUS_SUCCESS;
+    do
+    {
+        status = CSTATUS_SYSCALL;
+        OKAY_STOP(fstat(fd, &st) < 0, "failed to stat %s : %s\n", path, ERRSTR);
+        status = CSTATUS_FAIL;
+        OKAY_STOP(st.st_size <= 0, "%s is empty\n", path);
+
+        status = CSTATUS_SYSCALL;
+        m->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        OKAY_STOP(m->map == MAP_FAILED, "failed to mmap %s : %s\n", path, ERRSTR);
+
+        m->size = st.st_size;
+        madvise(m->map, m->size, MADV_WILLNEED);
+        status = CSTATUS_SUCCESS;
+    } while (false);
+
+    //The mapping outlives the fd, a pattern of thousands of files stays under RLIMIT_NOFILE
+    close(fd);
+    if(status != CSTATUS_SUCCESS)
+    { m->map = NULL; }
+    return status;
+}
+
+static CStatus_t fileOpen(Source_t *src)
+{
+    OKAY_RETURN(src->config.path == NULL, CSTATUS_BAD_PARAM, "file source needs a path\n");
+
+    SourceFile_t *f = calloc(1, sizeof(SourceFile_t));
+    OKAY_RETURN(f == NULL, CSTATUS_MEMORY, "failed to allocate file source\n");
+    src->priv = f;
+
+    src->fmt.pixfmt = src->config.pixfmt;
+    src->fmt.width = src->config.width;
+    src->fmt.height = src->config.height;
+    src->fmt.numPlanes = 1;
+    src->fmt.bytesPerLine[0] = src->config.width;
+    src->fmt.frameSize = sourceFrameSize(src->fmt.pixfmt, src->fmt.width, src->fmt.height);
+    src->fmt.numBufs = src->config.numBufs;
+    OKAY_RETURN(src->fmt.frameSize <= 0, CSTATUS_BAD_PARAM, "file source supports only NV24/NV12\n");
+
+    if(strchr(src->config.path, '%') != NULL)
+    {
+        f->maps = calloc(FILE_MAX_FRAMES, sizeof(SourceFileMap_t));
+        OKAY_RETURN(f->maps == NULL, CSTATUS_MEMORY, "failed to allocate file maps\n");
+
+        char path[PATH_MAX];
+        for(int i = 0; i < FILE_MAX_FRAMES; i++)
+        {
+            snprintf(path, sizeof(path), src->config.path, i + 1);
+            if(fileMap(&f->maps[i], path) != CSTATUS_SUCCESS)
+            { break; }
+            f->numMaps++;
+
+            if(f->maps[i].size < (size_t)src->fmt.frameSize)
+            {
+                printf("%s is %zu bytes, shorter than a %d bytes frame\n", path, f->maps[i].size, src->fmt.frameSize);
+                return CSTATUS_FAIL;
+            }
+        }
+        f->numFrames = f->numMaps;
+    }
+    else
+    {
+        f->maps = calloc(1, sizeof(SourceFileMap_t));
+        OKAY_RETURN(f->maps == NULL, CSTATUS_MEMORY, "failed to allocate file maps\n");
+        OKAY_RETURN(fileMap(&f->maps[0], src->config.path) != CSTATUS_SUCCESS, CSTATUS_FAIL,
+                    "failed to open %s\n", src->config.path);
+        f->numMaps = 1;
+        f->numFrames = f->maps[0].size / src->fmt.frameSize;
+    }
+
+    OKAY_RETURN(f->numFrames <= 0, CSTATUS_FAIL, "no %ux%u frames found in %s\n",
+                src->fmt.width, src->fmt.height, src->config.path);
+    printf("file source : replaying %d frames from %s\n", f->numFrames, src->config.path);
+
+    src->fd = sourceTimerCreate(src->config.fps);
+    OKAY_RETURN(src->fd < 0, CSTATUS_SYSCALL, "failed to create file frame timer\n");
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t fileAllocateBuffers(Source_t *src)
+{
+    //Nothing to allocate, the buffers point into the mappings when dequeued
+    for(int i = 0; i < src->fmt.numBufs; i++)
+    {
+        src->buffers[i].index = i;
+        src->buffers[i].size[0] = src->fmt.frameSize;
+    }
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t fileQueueByIndex(Source_t *src, int index)
+{
+    src->queued[index] = true;
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t fileDequeue(Source_t *src, Buffer_t **buff)
+{
+    SourceFile_t *f = src->priv;
+    *buff = NULL;
+
+    if(sourceTimerRead(src->fd) == 0)
+    { return CSTATUS_AGAIN; }
+
+    int index = sourcePickQueued(src, &f->next);
+    if(index < 0)
+    { return CSTATUS_AGAIN; }
+
+    SourceFileMap_t *m;
+    size_t offset;
+    if(f->numMaps > 1)
+    {
+        m = &f->maps[f->frame];
+        offset = 0;
+    }
+    else
+    {
+        m = &f->maps[0];
+        offset = (size_t)f->frame * src->fmt.frameSize;
+    }
+    f->frame = (f->frame + 1) % f->numFrames;
+
+    Buffer_t *buf = &src->buffers[index];
+    //Plain memory with no dmabuf behind it, ptr is the frame itself
+    buf->ptr[0] = (char *)m->map + offset;
+    buf->dmafd[0] = -1;
+    buf->offset[0] = 0;
+    buf->len[0] = src->fmt.frameSize;
+    *buff = buf;
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t fileStart(Source_t *src)
+{
+    return sourceTimerArm(src->fd, src->config.fps);
+}
+
+static CStatus_t fileStop(Source_t *src)
+{
+    return sourceTimerDisarm(src->fd);
+}
+
+static void fileClose(Source_t *src)
+{
+    SourceFile_t *f = src->priv;
+
+    if(f != NULL && f->maps != NULL)
+    {
+        for(int i = 0; i < f->numMaps; i++)
+        {
+            if(f->maps[i].map != NULL)
+            { munmap(f->maps[i].map, f->maps[i].size); }
+        }
+        free(f->maps);
+    }
+
+    if(src->fd >= 0)
+    { close(src->fd); }
+
+    free(f);
+    src->priv = NULL;
+}
+
+const SourceOps_t sourceFileOps = {
+    .name = "file",
+    .Open = fileOpen,
+    .AllocateBuffers = fileAllocateBuffers,
+    .Queue = fileQueueByIndex,
+    .Dequeue = fileDequeue,
+    .Start = fileStart,
+    .Stop = fileStop,
+    .Close = fileClose,
+};
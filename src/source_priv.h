@@ -0,0 +1,45 @@
+#ifndef __SOURCE_PRIV_H__
+#define __SOURCE_PRIV_H__
+
+#include "source.h"
+
+extern const SourceOps_t sourceV4l2Ops;
+extern const SourceOps_t sourceSynthOps;
+extern const SourceOps_t sourceFileOps;
+
+/**
+ * Frame size of a single plane NV24/NV12 image, 0 if unsupported
+ */
+int sourceFrameSize(uint32_t pixfmt, uint32_t width, uint32_t height);
+
+/**
+ * Non blocking periodic timerfd firing at fps, used to pace software sources
+ */
+int sourceTimerCreate(int fps);
+CStatus_t sourceTimerArm(int fd, int fps);
+CStatus_t sourceTimerDisarm(int fd);
+
+/**
+ * Consume timer expirations, returns the count or 0 if not expired
+ */
+uint64_t sourceTimerRead(int fd);
+
+/**
+ * Plane 0 of a software source's buffer, a dmabuf from the system DMA heap that the
+ * encoder and display import like a V4L2 one. Without the heap it is plain memory and
+ * dmafd stays -1
+ */
+CStatus_t sourceAllocFrame(Buffer_t *buf, int size);
+void sourceFreeFrame(Buffer_t *buf);
+
+/**
+ * Bracket CPU writes into a dmabuf frame, nothing for plain memory
+ */
+void sourceSyncFrame(Buffer_t *buf, bool begin);
+
+/**
+ * Take the next queued buffer round robin, -1 if the consumer holds all of them
+ */
+int sourcePickQueued(Source_t *src, int *next);
+
+#endif
@@ -0,0 +1,231 @@
+#define _GNU_SOURCE
+#include "source.h"
+#include "source_priv.h"
+
+/*
+ * Synthetic source, generates BT.601 colour bars with a bouncing box at a fixed
+ * frame rate. The bars are painted once per buffer, each frame only repaints
+ * the previous box position of that buffer and draws the new one.
+ */
+
+#define SYNTH_BARS  8
+
+static const uint8_t synthBars[SYNTH_BARS][3] = {
+    {235, 128, 128},    //White
+    {210,  16, 146},    //Yellow
+    {170, 166,  16},    //Cyan
+    {145,  54,  34},    //Green
+    {106, 202, 222},    //Magenta
+    { 81,  90, 240},    //Red
+    { 41, 240, 110},    //Blue
+    { 16, 128, 128},    //Black
+};
+
+typedef struct
+{
+    int         next;
+    uint64_t    frame;
+
+    //Background rows
+    uint8_t     *bgY;
+    uint8_t     *bgUV;
+    int         uvRowBytes;
+    bool        subsampled;     //NV12 chroma is shared by 2x2 pixels
+
+    //Bouncing box
+    int         boxW;
+    int         boxH;
+    int         lastX[DMA_BUFF_COUNT];
+    int         lastY[DMA_BUFF_COUNT];
+}SourceSynth_t;
+
+
+static void synthPaint(Source_t *src, Buffer_t *buf, int x, int y, int w, int h, bool box)
+{
+    SourceSynth_t *s = src->priv;
+    int width = src->fmt.width;
+    uint8_t *luma = (uint8_t *)buf->ptr[0];
+    uint8_t *chroma = luma + width * src->fmt.height;
+
+    for(int r = y; r < y + h; r++)
+    {
+        uint8_t *dstY = luma + r * width + x;
+        if(box)
+        { memset(dstY, 235, w); }
+        else
+        { memcpy(dstY, s->bgY + x, w); }
+
+        if(s->subsampled && (r & 1))
+        { continue; }
+
+        int uvRow = s->subsampled ? r / 2 : r;
+        int uvOff = s->subsampled ? x : x * 2;
+        int uvLen = s->subsampled ? w : w * 2;
+        uint8_t *dstUV = chroma + uvRow * s->uvRowBytes + uvOff;
+        if(box)
+        { memset(dstUV, 128, uvLen); }
+        else
+        { memcpy(dstUV, s->bgUV + uvOff, uvLen); }
+    }
+}
+
+static int synthBounce(uint64_t pos, int range)
+{
+    if(range <= 0)
+    { return 0; }
+    int p = pos % (2 * range);
+    return (p > range) ? 2 * range - p : p;
+}
+
+static CStatus_t synthOpen(Source_t *src)
+{
+    OKAY_RETURN(src->config.pixfmt != V4L2_PIX_FMT_NV24 && src->config.pixfmt != V4L2_PIX_FMT_NV12,
+                CSTATUS_BAD_PARAM, "synthetic source supports only NV24/NV12\n");
+    OKAY_RETURN(src->config.width < 16 || src->config.height < 16 || (src->config.width & 1) || (src->config.height & 1),
+                CSTATUS_BAD_PARAM, "invalid synthetic resolution %ux%u\n", src->config.width, src->config.height);
+
+    SourceSynth_t *s = calloc(1, sizeof(SourceSynth_t));
+    OKAY_RETURN(s == NULL, CSTATUS_MEMORY, "failed to allocate synthetic source\n");
+    src->priv = s;
+
+    src->fmt.pixfmt = src->config.pixfmt;
+    src->fmt.width = src->config.width;
+    src->fmt.height = src->config.height;
+    src->fmt.numPlanes = 1;
+    src->fmt.bytesPerLine[0] = src->config.width;
+    src->fmt.frameSize = sourceFrameSize(src->fmt.pixfmt, src->fmt.width, src->fmt.height);
+    src->fmt.numBufs = src->config.numBufs;
+
+    s->subsampled = (src->fmt.pixfmt == V4L2_PIX_FMT_NV12);
+    s->uvRowBytes = s->subsampled ? src->fmt.width : src->fmt.width * 2;
+    s->boxW = (src->fmt.width / 8) & ~1;
+    s->boxH = (src->fmt.height / 8) & ~1;
+
+    s->bgY = malloc(src->fmt.width);
+    s->bgUV = malloc(s->uvRowBytes);
+    OKAY_RETURN(s->bgY == NULL || s->bgUV == NULL, CSTATUS_MEMORY, "failed to allocate pattern rows\n");
+
+    for(uint32_t x = 0; x < src->fmt.width; x++)
+    {
+        const uint8_t *c = synthBars[x * SYNTH_BARS / src->fmt.width];
+        s->bgY[x] = c[0];
+        if(s->subsampled)
+        {
+            if((x & 1) == 0)
+            {
+                s->bgUV[x] = c[1];
+                s->bgUV[x + 1] = c[2];
+            }
+        }
+        else
+        {
+            s->bgUV[2 * x] = c[1];
+            s->bgUV[2 * x + 1] = c[2];
+        }
+    }
+
+    src->fd = sourceTimerCreate(src->config.fps);
+    OKAY_RETURN(src->fd < 0, CSTATUS_SYSCALL, "failed to create synthetic frame timer\n");
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t synthAllocateBuffers(Source_t *src)
+{
+    SourceSynth_t *s = src->priv;
+
+    for(int i = 0; i < src->fmt.numBufs; i++)
+    {
+        Buffer_t *buf = &src->buffers[i];
+
+        CStatus_t status = sourceAllocFrame(buf, src->fmt.frameSize);
+        OKAY_RETURN(status != CSTATUS_SUCCESS, status, "failed to allocate synthetic buffer %d\n", i);
+
+        buf->index = i;
+        buf->len[0] = src->fmt.frameSize;
+
+        sourceSyncFrame(buf, true);
+        synthPaint(src, buf, 0, 0, src->fmt.width, src->fmt.height, false);
+        sourceSyncFrame(buf, false);
+        s->lastX[i] = -1;
+    }
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t synthQueueByIndex(Source_t *src, int index)
+{
+    src->queued[index] = true;
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t synthDequeue(Source_t *src, Buffer_t **buff)
+{
+    SourceSynth_t *s = src->priv;
+    *buff = NULL;
+
+    if(sourceTimerRead(src->fd) == 0)
+    { return CSTATUS_AGAIN; }
+
+    //Consumer still holds every buffer, drop this tick like a real device would
+    int index = sourcePickQueued(src, &s->next);
+    if(index < 0)
+    { return CSTATUS_AGAIN; }
+
+    Buffer_t *buf = &src->buffers[index];
+    sourceSyncFrame(buf, true);
+    if(s->lastX[index] >= 0)
+    {
+        synthPaint(src, buf, s->lastX[index], s->lastY[index], s->boxW, s->boxH, false);
+    }
+
+    int x = synthBounce(s->frame * 8, src->fmt.width - s->boxW) & ~1;
+    int y = synthBounce(s->frame * 4, src->fmt.height - s->boxH) & ~1;
+    synthPaint(src, buf, x, y, s->boxW, s->boxH, true);
+    s->lastX[index] = x;
+    s->lastY[index] = y;
+    s->frame++;
+    sourceSyncFrame(buf, false);
+
+    buf->len[0] = src->fmt.frameSize;
+    *buff = buf;
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t synthStart(Source_t *src)
+{
+    return sourceTimerArm(src->fd, src->config.fps);
+}
+
+static CStatus_t synthStop(Source_t *src)
+{
+    return sourceTimerDisarm(src->fd);
+}
+
+static void synthClose(Source_t *src)
+{
+    SourceSynth_t *s = src->priv;
+
+    for(int i = 0; i < DMA_BUFF_COUNT; i++)
+    { sourceFreeFrame(&src->buffers[i]); }
+
+    if(src->fd >= 0)
+    { close(src->fd); }
+
+    if(s != NULL)
+    {
+        free(s->bgY);
+        free(s->bgUV);
+        free(s);
+    }
+    src->priv = NULL;
+}
+
+const SourceOps_t sourceSynthOps = {
+    .name = "synth",
+    .Open = synthOpen,
+    .AllocateBuffers = synthAllocateBuffers,
+    .Queue = synthQueueByIndex,
+    .Dequeue = synthDequeue,
+    .Start = synthStart,
+    .Stop = synthStop,
+    .Close = synthClose,
+};
@@ -0,0 +1,229 @@
+#include "source.h"
+#include "source_priv.h"
+
+typedef struct
+{
+	enum v4l2_buf_type 		bufType;
+	enum v4l2_memory 		memType;
+}SourceV4l2_t;
+
+
+static CStatus_t v4l2Open(Source_t *src)
+{
+	CStatus_t status = CSTATUS_FAIL;
+	const char *device = src->config.path ? src->config.path : V4L2_DEVICE;
+
+	SourceV4l2_t *v = calloc(1, sizeof(SourceV4l2_t));
+	OKAY_RETURN(v == NULL, CSTATUS_MEMORY, "failed to allocate v4l2 source\n");
+	v->bufType = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	v->memType = V4L2_MEMORY_MMAP;
+	src->priv = v;
+
+	do
+	{
+		int ret = -1;
+
+		//Open Device
+		src->fd = open(device, O_RDWR, 0);
+		OKAY_STOP(src->fd < 0, "failed to open : %s (%s)\n", device, ERRSTR);
+
+		//Query Capabilities
+		struct v4l2_capability caps = {0};
+		ret = ioctl(src->fd, VIDIOC_QUERYCAP, &caps);
+		OKAY_STOP(ret, "failed to query cap\n");
+		OKAY_STOP(!(caps.capabilities & (V4L2_CAP_VIDEO_CAPTURE_MPLANE | V4L2_CAP_STREAMING)),
+					"device doesn't support capturing\n");
+
+
+		//Get and Set Supported Image format
+		struct v4l2_format fmt = {0};
+		fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		ret = ioctl(src->fd, VIDIOC_G_FMT, &fmt);
+		OKAY_STOP(ret < 0, "VIDIOC_G_FMT failed: %s\n", ERRSTR);
+
+		fmt.fmt.pix_mp.width = src->config.width;
+		fmt.fmt.pix_mp.height = src->config.height;
+		fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+		fmt.fmt.pix_mp.num_planes = 1;
+
+
+		ret = ioctl(src->fd, VIDIOC_S_FMT, &fmt);
+		OKAY_STOP(ret < 0, "VIDIOC_S_FMT failed: %s\n", ERRSTR);
+
+		//Store src value
+		src->fmt.pixfmt = fmt.fmt.pix_mp.pixelformat;
+		src->fmt.width = fmt.fmt.pix_mp.width;
+		src->fmt.height = fmt.fmt.pix_mp.height;
+		src->fmt.numPlanes = fmt.fmt.pix_mp.num_planes;
+		src->fmt.bytesPerLine[0] =  fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+		src->fmt.frameSize = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+		src->fmt.numBufs = src->config.numBufs;
+
+		status = CSTATUS_SUCCESS;
+	} while (0);
+
+	return status;
+}
+
+
+static CStatus_t v4l2AllocateBuffers(Source_t *src)
+{
+	SourceV4l2_t *v = src->priv;
+	int ret = 0;
+
+	//Request DMA Buffer
+	struct v4l2_requestbuffers rqbufs = {0};
+	rqbufs.count = src->fmt.numBufs;
+	rqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	rqbufs.memory = v->memType;
+	ret = ioctl(src->fd, VIDIOC_REQBUFS, &rqbufs);
+	OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_REQBUFS failed: %s\n", ERRSTR);
+	OKAY_RETURN(rqbufs.count < DMA_BUFF_COUNT, CSTATUS_FAIL, "video node allocated only "
+				"%u of %u buffers\n", rqbufs.count, DMA_BUFF_COUNT);
+
+	for(int i = 0; i < src->fmt.numBufs; i++)
+	{
+		struct v4l2_buffer buf = {0};
+		buf.type    = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+        buf.memory  = v->memType;
+        buf.index   = i;
+        struct v4l2_plane planes[NUM_PLANES];		//We are only going to use 1
+        buf.m.planes = planes;
+        buf.length = NUM_PLANES;
+
+		ret = ioctl(src->fd, VIDIOC_QUERYBUF, &buf);
+		OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_QUERYBUF failed : index %d, %s\n", i, ERRSTR);
+
+		for(int j = 0; j < NUM_PLANES; j++)
+		{
+			src->buffers[i].size[j] = buf.m.planes[j].length;
+			src->buffers[i].ptr[j] = mmap(NULL,
+										buf.m.planes[j].length,
+										PROT_READ | PROT_WRITE,	//Required
+										MAP_SHARED, 			//Recommended
+										src->fd, buf.m.planes[0].m.mem_offset);
+			OKAY_RETURN(src->buffers[i].ptr[j] == MAP_FAILED, CSTATUS_FAIL, "failed to mmap : %i, %s\n", i, ERRSTR);
+
+			struct v4l2_exportbuffer expbuf = (struct v4l2_exportbuffer) {0} ;
+			expbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+			expbuf.index = i;
+			expbuf.flags = O_CLOEXEC;
+			ret = ioctl(src->fd, VIDIOC_EXPBUF, &expbuf);
+			OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_EXPBUF failed : index %d, %s\n", i, ERRSTR);
+
+			src->buffers[i].dmafd[j] = expbuf.fd;
+			src->buffers[i].offset[j] = buf.m.planes[j].data_offset;
+		}
+
+		src->buffers[i].index = i;
+	}
+
+	return CSTATUS_SUCCESS;
+}
+
+//Enqueue Buffer
+static CStatus_t v4l2QueueByIndex(Source_t *src, int index)
+{
+	SourceV4l2_t *v = src->priv;
+	struct v4l2_buffer	buffer;
+	struct v4l2_plane	buf_planes[NUM_PLANES] = {0};
+	int					ret = -1;
+
+
+	memset(&buffer, 0, sizeof(buffer));
+	buffer.type	= V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buffer.memory	= v->memType;
+	buffer.index	= index;
+	buffer.m.planes	= buf_planes;
+	buffer.length	= src->fmt.numPlanes;
+
+	ret = ioctl (src->fd, VIDIOC_QBUF, &buffer);
+	OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_QBUF failed : index %d, %s\n", index, ERRSTR);
+	return CSTATUS_SUCCESS;
+}
+
+//Deuque Buffer
+static CStatus_t v4l2Dequeue(Source_t *src, Buffer_t ** buff)
+{
+	SourceV4l2_t *v = src->priv;
+	struct v4l2_buffer	buf;
+	struct v4l2_plane	buf_planes[NUM_PLANES] = {0};
+	int			ret = -1;
+
+	memset(&buf, 0, sizeof(buf));
+	memset(&buf_planes[0], 0, sizeof(struct v4l2_plane));
+
+	buf.type		= V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory		= v->memType;
+	buf.m.planes	= buf_planes;
+	buf.length		= src->fmt.numPlanes;
+
+	ret = ioctl (src->fd, VIDIOC_DQBUF, &buf);
+	if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		*buff = NULL;
+		return CSTATUS_AGAIN;
+	}
+
+	OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_DBUF failed : %s\n", ERRSTR);
+
+	Buffer_t *b = &src->buffers[buf.index];
+	b->len[0] = buf.m.planes[0].bytesused;
+	*buff = b;
+
+	return CSTATUS_SUCCESS;
+}
+
+//Start capturing
+static CStatus_t v4l2StreamStart(Source_t *src)
+{
+	int	ret = -1;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	ret = ioctl (src->fd, VIDIOC_STREAMON, &type);
+	OKAY_RETURN(ret < 0, CSTATUS_FAIL , "VIDIOC_STREAMON failed : %s\n", ERRSTR);
+
+	int fd_flags = fcntl(src->fd, F_GETFL);
+	fcntl(src->fd, F_SETFL, fd_flags | O_NONBLOCK);
+	return CSTATUS_SUCCESS;
+}
+
+// Stop Capture
+static CStatus_t v4l2StreamStop(Source_t *src)
+{
+	int	ret = -1;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	ret = ioctl (src->fd, VIDIOC_STREAMOFF, &type);
+	OKAY_RETURN(ret < 0, CSTATUS_FAIL, "VIDIOC_STREAMOFF failed : %s\n", ERRSTR);
+	return CSTATUS_SUCCESS;
+}
+
+static void v4l2Close(Source_t *src)
+{
+	for(int i = 0; i < DMA_BUFF_COUNT; i++)
+	{
+		for(int j = 0; j < NUM_PLANES; j++)
+		{
+			if(src->buffers[i].ptr[j] != NULL && src->buffers[i].ptr[j] != MAP_FAILED)
+			{ munmap(src->buffers[i].ptr[j], src->buffers[i].size[j]); }
+			if(src->buffers[i].dmafd[j] >= 0)
+			{ close(src->buffers[i].dmafd[j]); }
+		}
+	}
+
+	if(src->fd >= 0)
+	{ close(src->fd); }
+
+	free(src->priv);
+	src->priv = NULL;
+}
+
+const SourceOps_t sourceV4l2Ops = {
+	.name = "v4l2",
+	.Open = v4l2Open,
+	.AllocateBuffers = v4l2AllocateBuffers,
+	.Queue = v4l2QueueByIndex,
+	.Dequeue = v4l2Dequeue,
+	.Start = v4l2StreamStart,
+	.Stop = v4l2StreamStop,
+	.Close = v4l2Close,
+};
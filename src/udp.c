@@ -0,0 +1,404 @@
+#define _GNU_SOURCE
+#include "udp.h"
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT             103
+#endif
+
+#define UDP_PAYLOAD             (UDP_TS_PER_DGRAM * UDP_TS_PACKET)
+#define UDP_GSO_MAX_SEGS        44          //44 * (12 + 1316) stays under the 64KB datagram limit
+#define UDP_BATCH               64          //Messages per sendmmsg
+
+struct Udp
+{
+    UdpConfig_t         config;
+    int                 fd;
+    struct sockaddr_in  dests[UDP_MAX_DESTS];
+    struct sockaddr_in  fecDests[UDP_MAX_DESTS][2];     //Column and row FEC ports
+    int                 numDests;
+    bool                gso;
+    bool                txtime;     //SO_TXTIME departure times
+    Pacer_t             pacer;
+
+    //RTP
+    uint16_t            seq;
+    uint32_t            ssrc;
+
+    //Datagrams of one access unit back to back, all dgramSize but the last
+    uint8_t             *dgrams;
+    size_t              dgramsCap;
+    size_t              dgramSize;
+
+    //FEC packets completed by one access unit
+    FecEnc_t            *fec;
+    FecPacket_t         *fecOut;
+    int                 fecOutCap;
+
+    //Pending sendmmsg batch
+    struct mmsghdr      msgs[UDP_BATCH];
+    struct iovec        iovs[UDP_BATCH];
+    uint8_t             ctrl[UDP_BATCH][CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+    int                 segs[UDP_BATCH];
+    bool                isFec[UDP_BATCH];
+    int                 numMsgs;
+
+    UdpStats_t          stats;
+};
+
+
+static CStatus_t udpParseDests(Udp_t *udp, const char *list)
+{
+    char buf[512];
+    OKAY_RETURN(list == NULL || strlen(list) >= sizeof(buf), CSTATUS_BAD_PARAM, "bad udp destination list\n");
+    strcpy(buf, list);
+
+    char *save = NULL;
+    for(char *dest = strtok_r(buf, ",", &save); dest != NULL; dest = strtok_r(NULL, ",", &save))
+    {
+        OKAY_RETURN(udp->numDests == UDP_MAX_DESTS, CSTATUS_BAD_PARAM, "more than %d udp destinations\n", UDP_MAX_DESTS);
+
+        char *port = strrchr(dest, ':');
+        OKAY_RETURN(port == NULL, CSTATUS_BAD_PARAM, "udp destination %s has no port\n", dest);
+        *port++ = '\0';
+
+        struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+        struct addrinfo *res = NULL;
+        int ret = getaddrinfo(dest, port, &hints, &res);
+        OKAY_RETURN(ret != 0, CSTATUS_BAD_PARAM, "failed to resolve %s:%s : %s\n", dest, port, gai_strerror(ret));
+
+        struct sockaddr_in *addr = &udp->dests[udp->numDests];
+        memcpy(addr, res->ai_addr, sizeof(struct sockaddr_in));
+        freeaddrinfo(res);
+
+        for(int dir = FEC_COLUMN; dir <= FEC_ROW; dir++)
+        {
+            int offset = (dir == FEC_COLUMN) ? FEC_COLUMN_PORT_OFFSET : FEC_ROW_PORT_OFFSET;
+            udp->fecDests[udp->numDests][dir] = *addr;
+            udp->fecDests[udp->numDests][dir].sin_port = htons(ntohs(addr->sin_port) + offset);
+        }
+        udp->numDests++;
+    }
+
+    OKAY_RETURN(udp->numDests == 0, CSTATUS_BAD_PARAM, "no udp destination\n");
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t udpSetupSocket(Udp_t *udp)
+{
+    const UdpConfig_t *config = &udp->config;
+    int ret;
+
+    if(config->iface != NULL)
+    {
+        struct ip_mreqn mreq = { .imr_ifindex = (int)if_nametoindex(config->iface) };
+        OKAY_RETURN(mreq.imr_ifindex == 0, CSTATUS_BAD_PARAM, "no interface %s\n", config->iface);
+
+        ret = setsockopt(udp->fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq));
+        OKAY_RETURN(ret != 0, CSTATUS_SYSCALL, "failed to set multicast interface %s : %s\n", config->iface, ERRSTR);
+
+        //Unicast follows the routing table without CAP_NET_RAW
+        ret = setsockopt(udp->fd, SOL_SOCKET, SO_BINDTODEVICE, config->iface, strlen(config->iface));
+        if(ret != 0)
+        {
+            printf("udp unicast not bound to %s : %s\n", config->iface, ERRSTR);
+        }
+    }
+
+    if(config->ttl > 0)
+    {
+        ret = setsockopt(udp->fd, IPPROTO_IP, IP_TTL, &config->ttl, sizeof(int));
+        OKAY_RETURN(ret != 0, CSTATUS_SYSCALL, "failed to set ttl %d : %s\n", config->ttl, ERRSTR);
+        ret = setsockopt(udp->fd, IPPROTO_IP, IP_MULTICAST_TTL, &config->ttl, sizeof(int));
+        OKAY_RETURN(ret != 0, CSTATUS_SYSCALL, "failed to set multicast ttl %d : %s\n", config->ttl, ERRSTR);
+    }
+
+    //A socket buffer for a few IDR frames, the encoder thread never blocks on it
+    setsockopt(udp->fd, SOL_SOCKET, SO_SNDBUF, &(int){4 * 1024 * 1024}, sizeof(int));
+
+    //Probe GSO, the segment size itself goes with every message
+    udp->gso = setsockopt(udp->fd, SOL_UDP, UDP_SEGMENT, &(int){(int)udp->dgramSize}, sizeof(int)) == 0;
+    if(udp->gso)
+    {
+        setsockopt(udp->fd, SOL_UDP, UDP_SEGMENT, &(int){0}, sizeof(int));
+    }
+
+    //Without SO_TXTIME the socket rate alone paces, on fq only
+    if(config->pacing.peak > 0)
+    {
+        pacerInit(&udp->pacer, &config->pacing);
+        udp->txtime = pacerEnableTxtime(&udp->pacer, udp->fd) == CSTATUS_SUCCESS;
+    }
+    return CSTATUS_SUCCESS;
+}
+
+Udp_t *udpCreate(UdpConfig_t *config)
+{
+    Udp_t *udp = calloc(1, sizeof(Udp_t));
+    OKAY_RETURN(udp == NULL, NULL, "failed to allocate udp sink\n");
+    memcpy(&udp->config, config, sizeof(UdpConfig_t));
+    udp->dgramSize = UDP_PAYLOAD + (config->rtp ? UDP_RTP_HEADER : 0);
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    udp->ssrc = (uint32_t)(now.tv_nsec ^ (now.tv_sec << 20) ^ getpid());
+    udp->seq = (uint16_t)(udp->ssrc >> 7);
+
+    do
+    {
+        OKAY_STOP(udpParseDests(udp, config->dest) != CSTATUS_SUCCESS, "failed to parse udp destinations\n");
+
+        udp->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+        OKAY_STOP(udp->fd < 0, "failed to create udp socket : %s\n", ERRSTR);
+
+        OKAY_STOP(udpSetupSocket(udp) != CSTATUS_SUCCESS, "failed to set up udp socket\n");
+
+        if(config->fec.cols > 0)
+        {
+            OKAY_STOP(!config->rtp, "udp fec needs the rtp header\n");
+            udp->fec = fecEncCreate(&udp->config.fec);
+            OKAY_STOP(udp->fec == NULL, "failed to create udp fec\n");
+        }
+
+        printf("udp sink : %d destination(s), %s, %s", udp->numDests, config->rtp ? "rtp" : "raw ts",
+               udp->gso ? "gso" : "no gso");
+        if(udp->fec != NULL)
+        {
+            printf(", fec %dx%d %s", config->fec.cols, config->fec.rows, config->fec.rowFec ? "column+row" : "column");
+        }
+        if(config->pacing.peak > 0)
+        {
+            printf(", paced %.2fx%s", config->pacing.peak, udp->txtime ? (config->pacing.etf ? " etf" : " txtime") : "");
+            if(udp->txtime && config->pacing.etf)
+            { printf(" %d us ahead", config->pacing.leadUs); }
+        }
+        printf("\n");
+        return udp;
+
+    } while (false);
+
+    udpDestroy(udp);
+    return NULL;
+}
+
+void udpDestroy(Udp_t *udp)
+{
+    if(udp->fd > 0)
+    { close(udp->fd); }
+
+    if(udp->fec != NULL)
+    { fecEncDestroy(udp->fec); }
+
+    free(udp->fecOut);
+    free(udp->dgrams);
+    free(udp);
+}
+
+void udpGetStats(Udp_t *udp, UdpStats_t *stats)
+{
+    memcpy(stats, &udp->stats, sizeof(UdpStats_t));
+}
+
+//Sends the pending batch, the socket buffer drops what does not fit
+static void udpFlush(Udp_t *udp)
+{
+    int sent = 0;
+    while(sent < udp->numMsgs)
+    {
+        int ret = sendmmsg(udp->fd, udp->msgs + sent, udp->numMsgs - sent, MSG_DONTWAIT);
+        udp->stats.syscalls++;
+        if(ret < 0 && errno == EINTR)
+        { continue; }
+
+        if(ret <= 0)
+        {
+            //Skip the message at fault, later ones may still fit
+            if(errno == EIO && udp->segs[sent] > 1)
+            {
+                printf("udp gso refused by the device, sending datagrams one by one\n");
+                udp->gso = false;
+            }
+            else if(errno != EAGAIN && errno != ENOBUFS)
+            {
+                printf("udp send failed : %s\n", ERRSTR);
+            }
+            udp->stats.dropped += udp->segs[sent];
+            sent++;
+            continue;
+        }
+
+        for(int i = sent; i < sent + ret; i++)
+        {
+            if(udp->isFec[i])
+            {
+                udp->stats.fecDatagrams++;
+                udp->stats.fecBytes += udp->iovs[i].iov_len;
+                continue;
+            }
+            udp->stats.datagrams += udp->segs[i];
+            udp->stats.bytes += udp->iovs[i].iov_len;
+        }
+        sent += ret;
+    }
+    udp->numMsgs = 0;
+}
+
+static void udpQueue(Udp_t *udp, const struct sockaddr_in *dest, uint8_t *data, size_t len, int segs, bool isFec,
+                     int64_t txtime)
+{
+    if(udp->numMsgs == UDP_BATCH)
+    { udpFlush(udp); }
+
+    int i = udp->numMsgs++;
+    struct msghdr *hdr = &udp->msgs[i].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    udp->iovs[i].iov_base = data;
+    udp->iovs[i].iov_len = len;
+    udp->segs[i] = segs;
+    udp->isFec[i] = isFec;
+    hdr->msg_name = (void *)dest;
+    hdr->msg_namelen = sizeof(*dest);
+    hdr->msg_iov = &udp->iovs[i];
+    hdr->msg_iovlen = 1;
+
+    if(segs == 1 && !udp->txtime)
+    { return; }
+
+    hdr->msg_control = udp->ctrl[i];
+    hdr->msg_controllen = sizeof(udp->ctrl[i]);
+    memset(udp->ctrl[i], 0, sizeof(udp->ctrl[i]));
+    struct cmsghdr *cm = CMSG_FIRSTHDR(hdr);
+    size_t ctrlLen = 0;
+    if(segs > 1)
+    {
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        *(uint16_t *)CMSG_DATA(cm) = (uint16_t)udp->dgramSize;
+        ctrlLen += CMSG_SPACE(sizeof(uint16_t));
+        cm = CMSG_NXTHDR(hdr, cm);
+    }
+    if(udp->txtime)
+    {
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_TXTIME;
+        cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cm), &(uint64_t){(uint64_t)txtime}, sizeof(uint64_t));
+        ctrlLen += CMSG_SPACE(sizeof(uint64_t));
+    }
+    hdr->msg_controllen = ctrlLen;
+}
+
+static void udpRtpHeader(Udp_t *udp, uint8_t *hdr, uint32_t ts)
+{
+    hdr[0] = 0x80;                  //V=2
+    hdr[1] = UDP_RTP_PT_MP2T;
+    hdr[2] = udp->seq >> 8;
+    hdr[3] = udp->seq;
+    hdr[4] = ts >> 24;
+    hdr[5] = ts >> 16;
+    hdr[6] = ts >> 8;
+    hdr[7] = ts;
+    hdr[8] = udp->ssrc >> 24;
+    hdr[9] = udp->ssrc >> 16;
+    hdr[10] = udp->ssrc >> 8;
+    hdr[11] = udp->ssrc;
+    udp->seq++;
+}
+
+CStatus_t udpSend(Udp_t *udp, const uint8_t *data, size_t len, int64_t pts)
+{
+    OKAY_RETURN(len == 0 || len % UDP_TS_PACKET != 0, CSTATUS_BAD_PARAM, "udp payload of %zu bytes is not whole ts packets\n", len);
+
+    int numDgrams = (int)((len + UDP_PAYLOAD - 1) / UDP_PAYLOAD);
+    size_t header = udp->dgramSize - UDP_PAYLOAD;
+    size_t total = len + (size_t)numDgrams * header;
+    if(total > udp->dgramsCap)
+    {
+        uint8_t *dgrams = realloc(udp->dgrams, total);
+        OKAY_RETURN(dgrams == NULL, CSTATUS_MEMORY, "failed to allocate %zu bytes of udp datagrams\n", total);
+        udp->dgrams = dgrams;
+        udp->dgramsCap = total;
+    }
+
+    //Every datagram completes at most one column and one row
+    if(udp->fec != NULL && 2 * numDgrams > udp->fecOutCap)
+    {
+        FecPacket_t *fecOut = realloc(udp->fecOut, 2 * numDgrams * sizeof(FecPacket_t));
+        OKAY_RETURN(fecOut == NULL, CSTATUS_MEMORY, "failed to allocate %d udp fec packets\n", 2 * numDgrams);
+        udp->fecOut = fecOut;
+        udp->fecOutCap = 2 * numDgrams;
+    }
+
+    //Lay the datagrams out back to back, GSO cuts them at dgramSize
+    uint8_t *dst = udp->dgrams;
+    int numFec = 0;
+    for(size_t off = 0; off < len; off += UDP_PAYLOAD)
+    {
+        size_t chunk = (len - off < UDP_PAYLOAD) ? len - off : UDP_PAYLOAD;
+        uint8_t *dgram = dst;
+        if(udp->config.rtp)
+        {
+            udpRtpHeader(udp, dst, (uint32_t)pts);
+            dst += UDP_RTP_HEADER;
+        }
+        memcpy(dst, data + off, chunk);
+        dst += chunk;
+
+        if(udp->fec != NULL)
+        {
+            numFec += fecEncode(udp->fec, dgram, (size_t)(dst - dgram), udp->fecOut + numFec);
+        }
+    }
+
+    //Paced GSO messages hold at most a millisecond at the pacing rate
+    int perMsg = udp->gso ? UDP_GSO_MAX_SEGS : 1;
+    bool paced = udp->config.pacing.peak > 0;
+    if(paced)
+    {
+        size_t fecBytes = 0;
+        for(int i = 0; i < numFec; i++)
+        { fecBytes += udp->fecOut[i].len; }
+        if(pacerAccount(&udp->pacer, (total + fecBytes) * udp->numDests))
+        { pacerApplyRate(&udp->pacer, udp->fd); }
+
+        if(udp->txtime && udp->pacer.rate > 0)
+        {
+            int segs = (int)(udp->pacer.rate / 1000 / udp->dgramSize);
+            perMsg = (segs < 1) ? 1 : (segs < perMsg) ? segs : perMsg;
+        }
+    }
+
+    //Every destination gets each message in turn, none waits for the others' whole frame
+    for(int first = 0; first < numDgrams; first += perMsg)
+    {
+        int segs = (numDgrams - first < perMsg) ? numDgrams - first : perMsg;
+        size_t offset = (size_t)first * udp->dgramSize;
+        size_t msgLen = (first + segs == numDgrams) ? total - offset : (size_t)segs * udp->dgramSize;
+        int64_t txtime = paced ? pacerDepart(&udp->pacer, msgLen * udp->numDests) : 0;
+        for(int d = 0; d < udp->numDests; d++)
+        {
+            udpQueue(udp, &udp->dests[d], udp->dgrams + offset, msgLen, segs, false, txtime);
+        }
+    }
+
+    //After the media they protect, a receiver that has it all never waits for them
+    for(int i = 0; i < numFec; i++)
+    {
+        FecPacket_t *fp = &udp->fecOut[i];
+        int64_t txtime = paced ? pacerDepart(&udp->pacer, fp->len * udp->numDests) : 0;
+        for(int d = 0; d < udp->numDests; d++)
+        {
+            udpQueue(udp, &udp->fecDests[d][fp->dir], fp->data, fp->len, 1, true, txtime);
+        }
+    }
+    udpFlush(udp);
+    return CSTATUS_SUCCESS;
+}
@@ -3,39 +3,41 @@
 
 static Websock_t sock;
 
-static WebsockConn_t *getWebconnFromConnId(ws_cli_conn_t id)
+static void onopen(ws_cli_conn_t client)
 {
-	WebsockConn_t *conn = NULL;
-	LIST_FOR_EACH(conn, &sock.lConnections, link)
+    WebsockConn_t *conn = calloc(1, sizeof(WebsockConn_t));
+	if(NULL == conn)
 	{
-		if(conn->conn == id)
-		{
-			return conn;
-		}
+		ws_close_client(client);
+		return;
 	}
 
-	return NULL;
-}
-
-static void onopen(ws_cli_conn_t client)
-{
-    WebsockConn_t *conn = calloc(1, sizeof(WebsockConn_t));
-	listInsert(&sock.lConnections, &conn->link);
 	conn->conn = client;
+	ws_set_connection_context(client, conn);
+	pthread_mutex_lock(&sock.lock);
+	listInsert(&sock.lConnections, &conn->link);
+	pthread_mutex_unlock(&sock.lock);
 	sock.itf->NewConn(conn, sock.udata);
 }
 
 
 static void onclose(ws_cli_conn_t  client)
 {
-	WebsockConn_t *conn = getWebconnFromConnId(client);
-	if(NULL == conn)
+	//The connection context saves a scan of every client
+	WebsockConn_t *conn = ws_get_connection_context(client);
+	if(NULL != conn)
+	{
+		pthread_mutex_lock(&sock.lock);
+		listRemove(&conn->link);
+		pthread_mutex_unlock(&sock.lock);
+	}
+
+	if(NULL != conn)
 	{
 		if(conn->itf != NULL && conn->itf->Close != NULL)
 		{
 			conn->itf->Close(conn, conn->udata);
 		}
-		listRemove(&conn->link);
 		free(conn);
 	}
 }
@@ -45,10 +47,11 @@ static void onmessage(ws_cli_conn_t client,
 	const unsigned char *msg, uint64_t size, int type)
 {
 	((void)type);
-	WebsockConn_t *conn = getWebconnFromConnId(client);
-	if(conn->itf != NULL && conn->itf->OnData != NULL)
+	WebsockConn_t *conn = ws_get_connection_context(client);
+
+	if(conn != NULL && conn->itf != NULL && conn->itf->OnData != NULL)
 	{
-		conn->itf->OnData(conn, msg, size, conn->udata);
+		conn->itf->OnData(conn, (uint8_t *)msg, size, conn->udata);
 	}
 }
 
@@ -60,11 +63,13 @@ Websock_t * websockCreate(WebsockConfig_t *config, WebsockInterface_t *itf, void
 		sock.itf = itf;
 		sock.udata = udata;
 		listInit(&sock.lConnections);
+		pthread_mutex_init(&sock.lock, NULL);
 
 		ws_socket(&(struct ws_server){
 			.host = "0.0.0.0",
 			.port = config->port,
 			.thread_loop   = 1,
+			.event_loop    = 1,
 			.timeout_ms    = 1000,
 			.evs.onopen    = &onopen,
 			.evs.onclose   = &onclose,
@@ -80,17 +85,51 @@ Websock_t * websockCreate(WebsockConfig_t *config, WebsockInterface_t *itf, void
 void websockDestroy(Websock_t *sock)
 {
 	WebsockConn_t *conn = NULL, *_conn = NULL;
+	pthread_mutex_lock(&sock->lock);
 	LIST_FOR_EACH_SAFE(conn, _conn, &sock->lConnections, link)
 	{
-		listRemove(conn);
+		listRemove(&conn->link);
+		ws_set_connection_context(conn->conn, NULL);
 		ws_close_client(conn->conn);
 		free(conn);
 	}
+	pthread_mutex_unlock(&sock->lock);
 }
 
 int websockConnSend(WebsockConn_t *conn, uint8_t *data, int len)
 {
-	return ws_sendframe_bin(conn->conn, data, len);
+	return ws_sendframe_bin(conn->conn, (const char *)data, len);
+}
+
+int websockBroadcast(Websock_t *sock, int channel, uint8_t *data, int len)
+{
+	//Framed once and queued by reference to every connection of the channel
+	return ws_sendframe_bcast_channel(sock->config.port, channel, (const char *)data, len, WS_FR_OP_BIN);
+}
+
+int websockAdopt(Websock_t *sock, int fd)
+{
+	return ws_adopt(sock->config.port, fd);
+}
+
+int websockConnSetChannel(WebsockConn_t *conn, int channel)
+{
+	return ws_set_channel(conn->conn, channel);
+}
+
+const char *websockConnPath(WebsockConn_t *conn)
+{
+	return ws_getpath(conn->conn);
+}
+
+int websockConnGetBacklog(WebsockConn_t *conn, size_t *bytes, uint64_t *dropped)
+{
+	return ws_get_backlog(conn->conn, bytes, dropped);
+}
+
+int websockConnGetFd(WebsockConn_t *conn)
+{
+	return ws_getfd(conn->conn);
 }
 
 void websockConnSetInterface(WebsockConn_t *conn, WebsockConnInterface_t *itf, void *udata)
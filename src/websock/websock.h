@@ -1,6 +1,7 @@
 #ifndef _WEBSOCK_H_
 #define _WEBSOCK_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 struct Websock;
@@ -42,6 +43,24 @@ void websockDestroy(Websock_t *sock);
 
 int websockConnSend(WebsockConn_t *conn, uint8_t *data, int len);
 
+//Sends one binary message to every connection of a channel
+int websockBroadcast(Websock_t *sock, int channel, uint8_t *data, int len);
+
+//Connections start in channel 0, which no broadcast should use
+int websockConnSetChannel(WebsockConn_t *conn, int channel);
+
+//Takes over a socket accepted elsewhere with the upgrade request still unread
+int websockAdopt(Websock_t *sock, int fd);
+
+//Path of the upgrade request, e.g. "/"
+const char *websockConnPath(WebsockConn_t *conn);
+
+//Bytes queued and not written yet, and broadcast messages dropped for a full backlog
+int websockConnGetBacklog(WebsockConn_t *conn, size_t *bytes, uint64_t *dropped);
+
+//Socket of the connection, owned by the server
+int websockConnGetFd(WebsockConn_t *conn);
+
 void websockConnSetInterface(WebsockConn_t *conn, WebsockConnInterface_t *itf, void *udata);
 
 #endif
\ No newline at end of file
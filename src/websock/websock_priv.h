@@ -1,6 +1,8 @@
 #include "websock.h"
 #include "ws.h"
 #include "list_common.h"
+#include <pthread.h>
+#include <string.h>
 
 struct Websock
 {
@@ -9,6 +11,7 @@ struct Websock
     WebsockConfig_t     config;
     WebsockInterface_t  *itf;
     void                *udata;
+    pthread_mutex_t     lock;       //ws.c calls back from its worker threads
     List_t              lConnections;
 };
 
@@ -0,0 +1,14 @@
+/*
+ * WebSocket payload unmasking.
+ */
+
+#ifndef UNMASK_H
+#define UNMASK_H
+
+	#include <stddef.h>
+	#include <stdint.h>
+
+	extern void ws_unmask(uint8_t *dst, const uint8_t *src, size_t len,
+		const uint8_t *mask, size_t phase);
+
+#endif
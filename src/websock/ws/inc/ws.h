@@ -30,6 +30,7 @@ extern "C" {
 #endif
 
 	#include <stdbool.h>
+	#include <stddef.h>
 	#include <stdint.h>
 	#include <inttypes.h>
 
@@ -48,6 +49,42 @@ extern "C" {
 	 * @name Key and message configurations.
 	 */
 	/**@{*/
+	/**
+	 * @brief Outbound queue entries per client.
+	 */
+	#define WS_OUT_QUEUE_LEN 256
+
+	/**
+	 * @brief Default per client backlog, in bytes, past which
+	 * broadcast frames are dropped for that client.
+	 */
+	#define WS_OUT_MAX_BACKLOG (8*1024*1024)
+
+	/**
+	 * @brief Default event loop workers.
+	 */
+	#define WS_EVL_WORKERS 2
+
+	/**
+	 * @brief Default client limit in event loop mode.
+	 */
+	#define WS_EVL_MAX_CLIENTS 1024
+
+	/**
+	 * @brief Servers ws_adopt() can hand connections to.
+	 */
+	#define WS_MAX_LISTENERS 8
+
+	/**
+	 * @brief Request path length kept per client.
+	 */
+	#define WS_PATH_LEN 64
+
+	/**
+	 * @brief Broadcast to every client regardless of its channel.
+	 */
+	#define WS_CHANNEL_ALL (-1)
+
 	/**
 	 * @brief Message buffer length.
 	 */
@@ -218,9 +255,11 @@ extern "C" {
 
 	#ifndef AFL_FUZZ
 	#define SEND(client,buf,len) send_all((client), (buf), (len), MSG_NOSIGNAL)
+	#define SENDV(client,iov,cnt) send_all_iov((client), (iov), (cnt), MSG_NOSIGNAL)
 	#define RECV(fd,buf,len) recv((fd)->client_sock, (buf), (len), 0)
 	#else
 	#define SEND(client,buf,len) write(fileno(stdout), (buf), (len))
+	#define SENDV(client,iov,cnt) writev(fileno(stdout), (iov), (cnt))
 	#define RECV(fd,buf,len) read((fd)->client_sock, (buf), (len))
 	#endif
 
@@ -298,6 +337,25 @@ extern "C" {
 		 * Provided by the user, can be accessed via `ws_get_server_context` from `onopen`.
 		 */
 		void* context;
+		/**
+		 * @brief Per client outbound backlog limit in bytes,
+		 * 0 for WS_OUT_MAX_BACKLOG.
+		 */
+		size_t max_backlog;
+		/**
+		 * @brief Serve every client from a small pool of epoll
+		 * workers (1) instead of a thread per client (0). Linux only,
+		 * ignored elsewhere.
+		 */
+		int event_loop;
+		/**
+		 * @brief Event loop workers, 0 for WS_EVL_WORKERS.
+		 */
+		int workers;
+		/**
+		 * @brief Event loop client limit, 0 for WS_EVL_MAX_CLIENTS.
+		 */
+		uint32_t max_clients;
 	};
 
 	/* Forward declarations. */
@@ -309,10 +367,15 @@ extern "C" {
 	/* External usage. */
 	extern char *ws_getaddress(ws_cli_conn_t client);
 	extern char *ws_getport(ws_cli_conn_t client);
+	extern char *ws_getpath(ws_cli_conn_t client);
+	extern int ws_getfd(ws_cli_conn_t client);
+	extern int ws_set_channel(ws_cli_conn_t client, int channel);
 	extern int ws_sendframe(
 		ws_cli_conn_t client, const char *msg, uint64_t size, int type);
 	extern int ws_sendframe_bcast(
 		uint16_t port, const char *msg, uint64_t size, int type);
+	extern int ws_sendframe_bcast_channel(uint16_t port, int channel,
+		const char *msg, uint64_t size, int type);
 	extern int ws_sendframe_txt(ws_cli_conn_t client, const char *msg);
 	extern int ws_sendframe_txt_bcast(uint16_t port, const char *msg);
 	extern int ws_sendframe_bin(ws_cli_conn_t client, const char *msg,
@@ -320,8 +383,11 @@ extern "C" {
 	extern int ws_sendframe_bin_bcast(uint16_t port, const char *msg,
 		uint64_t size);
 	extern int ws_get_state(ws_cli_conn_t client);
+	extern int ws_get_backlog(ws_cli_conn_t client, size_t *bytes,
+		uint64_t *dropped);
 	extern int ws_close_client(ws_cli_conn_t client);
 	extern int ws_socket(struct ws_server *ws_srv);
+	extern int ws_adopt(uint16_t port, int fd);
 
 	/* Ping routines. */
 	extern void ws_ping(ws_cli_conn_t cid, int threshold);
@@ -0,0 +1,92 @@
+/*
+ * WebSocket payload unmasking (RFC 6455, 5.3).
+ *
+ * The 4 byte mask repeats every 4 bytes, so it is widened once to a
+ * 16 byte key and the payload is XORed a vector (SSE2/NEON) or a 64-bit
+ * word at a time, with a byte loop only for the tail.
+ */
+
+#include <string.h>
+#include "unmask.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * @brief Unmasks @p len bytes from @p src into @p dst.
+ *
+ * @param dst   Destination, may be @p src for in place unmasking.
+ * @param src   Masked payload.
+ * @param len   Bytes to unmask.
+ * @param mask  Frame masking key.
+ * @param phase Offset of @p src within the frame payload, so a frame
+ *              can be unmasked in several spans.
+ */
+void ws_unmask(uint8_t *dst, const uint8_t *src, size_t len,
+	const uint8_t *mask, size_t phase)
+{
+	uint8_t key[16];
+	uint64_t key64;
+	uint64_t w;
+	size_t i;
+
+	for (i = 0; i < sizeof(key); i++)
+		key[i] = mask[(phase + i) & 3];
+
+	i = 0;
+
+#if defined(__SSE2__)
+	{
+		__m128i k = _mm_loadu_si128((const __m128i *)key);
+		for (; i + 64 <= len; i += 64)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+			__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+			__m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+			__m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+			_mm_storeu_si128((__m128i *)(dst + i),      _mm_xor_si128(a, k));
+			_mm_storeu_si128((__m128i *)(dst + i + 16), _mm_xor_si128(b, k));
+			_mm_storeu_si128((__m128i *)(dst + i + 32), _mm_xor_si128(c, k));
+			_mm_storeu_si128((__m128i *)(dst + i + 48), _mm_xor_si128(d, k));
+		}
+		for (; i + 16 <= len; i += 16)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(a, k));
+		}
+	}
+#elif defined(__ARM_NEON)
+	{
+		uint8x16_t k = vld1q_u8(key);
+		for (; i + 64 <= len; i += 64)
+		{
+			uint8x16_t a = vld1q_u8(src + i);
+			uint8x16_t b = vld1q_u8(src + i + 16);
+			uint8x16_t c = vld1q_u8(src + i + 32);
+			uint8x16_t d = vld1q_u8(src + i + 48);
+			vst1q_u8(dst + i,      veorq_u8(a, k));
+			vst1q_u8(dst + i + 16, veorq_u8(b, k));
+			vst1q_u8(dst + i + 32, veorq_u8(c, k));
+			vst1q_u8(dst + i + 48, veorq_u8(d, k));
+		}
+		for (; i + 16 <= len; i += 16)
+			vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), k));
+	}
+#endif
+
+	/* memcpy() keeps unaligned accesses legal, it compiles to a move. */
+	memcpy(&key64, key, sizeof(key64));
+	for (; i + 8 <= len; i += 8)
+	{
+		memcpy(&w, src + i, sizeof(w));
+		w ^= key64;
+		memcpy(dst + i, &w, sizeof(w));
+	}
+
+	/* Tail, key[i & 3] is the mask byte for payload offset i. */
+	for (; i < len; i++)
+		dst[i] = src[i] ^ key[i & 3];
+}
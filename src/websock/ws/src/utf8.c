@@ -27,8 +27,15 @@
  * All rights goes to the original author.
  */
 
+#include <string.h>
 #include "utf8.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 static const uint8_t utf8d[] = {
 	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 00..1f
 	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 20..3f
@@ -67,14 +74,38 @@ int is_utf8(uint8_t *s) {
 	return state == UTF8_ACCEPT;
 }
 
-int is_utf8_len(uint8_t *s, size_t len) {
-	uint32_t codepoint, state = 0;
-	size_t i;
+/*
+ * Length of the ASCII run at the start of s, in whole blocks: text
+ * messages are mostly ASCII, which needs no DFA step at all, so it is
+ * checked 16 (SSE2/NEON) or 8 bytes at a time.
+ */
+static size_t ascii_span(const uint8_t *s, size_t len) {
+	uint64_t w;
+	size_t i = 0;
 
-	for (i = 0; i < len; i++)
-		decode(&state, &codepoint, *s++);
+#if defined(__SSE2__)
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		if (_mm_movemask_epi8(v))
+			return i;
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= len; i += 16) {
+		if (vmaxvq_u8(vld1q_u8(s + i)) & 0x80)
+			return i;
+	}
+#endif
 
-	return state == UTF8_ACCEPT;
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&w, s + i, sizeof(w));
+		if (w & 0x8080808080808080ull)
+			return i;
+	}
+	return i;
+}
+
+int is_utf8_len(uint8_t *s, size_t len) {
+	return is_utf8_len_state(s, len, UTF8_ACCEPT) == UTF8_ACCEPT;
 }
 
 uint32_t is_utf8_len_state(uint8_t *s, size_t len, uint32_t state) {
@@ -82,8 +113,19 @@ uint32_t is_utf8_len_state(uint8_t *s, size_t len, uint32_t state) {
 	size_t i;
 
 	codepoint = 0;
-	for (i = 0; i < len; i++)
-		decode(&state, &codepoint, *s++);
+	i = 0;
+	while (i < len) {
+		/* Between code points, skip ASCII runs in bulk. */
+		if (state == UTF8_ACCEPT) {
+			i += ascii_span(s + i, len - i);
+			if (i == len)
+				break;
+		}
+
+		/* Reject is a sink, no need to read further. */
+		if (decode(&state, &codepoint, s[i++]) == UTF8_REJECT)
+			break;
+	}
 
 	return state;
-}
\ No newline at end of file
+}
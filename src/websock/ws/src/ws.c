@@ -26,11 +26,18 @@
 #include <string.h>
 #include <time.h>
 #include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#define WS_HAVE_EPOLL
+#endif
 
 /* clang-format off */
 #ifndef _WIN32
 #include <arpa/inet.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #else
@@ -38,6 +45,11 @@
 #include <ws2tcpip.h>
 #include <windows.h>
 typedef int socklen_t;
+struct iovec
+{
+	void *iov_base;
+	size_t iov_len;
+};
 #endif
 /* clang-format on */
 
@@ -46,8 +58,13 @@ typedef int socklen_t;
 #define MSG_NOSIGNAL 0
 #endif
 
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
 #include <unistd.h>
 
+#include <unmask.h>
 #include <utf8.h>
 #include <ws.h>
 
@@ -59,6 +76,26 @@ typedef int socklen_t;
  * @brief wsServer main routines.
  */
 
+/**
+ * @brief Framed message (header + payload), shared by every client
+ * queue it was pushed to and freed when the last one is done.
+ */
+struct ws_msg
+{
+	int refs;             /**< Reference count, atomic.  */
+	size_t len;           /**< Frame length.             */
+	unsigned char data[]; /**< Frame bytes.              */
+};
+
+/**
+ * @brief Outbound queue entry.
+ */
+struct ws_out
+{
+	struct ws_msg *msg; /**< Queued frame.                     */
+	size_t offset;      /**< Bytes already sent, head only.    */
+};
+
 /**
  * @brief Client socks.
  */
@@ -76,9 +113,17 @@ struct ws_connection
 	pthread_t thrd_tout;
 	bool close_thrd;
 
-	/* Send lock. */
+	/* Send lock, also guards the outbound queue. */
 	pthread_mutex_t mtx_snd;
 
+	/* Outbound queue, a ring of WS_OUT_QUEUE_LEN entries. */
+	struct ws_out *out;
+	uint32_t out_head;
+	uint32_t out_count;
+	size_t out_bytes;
+	size_t out_max_bytes;
+	uint64_t out_dropped;
+
 	/* IP address and port. */
 	char ip[1025]; /* NI_MAXHOST. */
 	char port[32]; /* NI_MAXSERV. */
@@ -91,28 +136,85 @@ struct ws_connection
 	/* Connection context */
 	void *connection_context;
 
+	/* Request path and broadcast channel. */
+	char path[WS_PATH_LEN];
+	int channel;
+
 	ws_cli_conn_t client_id;
+	uint32_t generation;
+
+	/* Event loop mode only, NULL for a thread per client. */
+	struct ws_evl *evl;
+	bool out_armed;              /* EPOLLOUT requested.            */
+	unsigned char *rx;           /* Received, not parsed yet.      */
+	size_t rx_len;
+	size_t rx_cap;
+	unsigned char *frag;         /* Fragmented message so far.     */
+	uint64_t frag_len;
+	int frag_type;               /* -1 if no message in progress.  */
+	uint32_t frag_utf8;          /* UTF-8 state of a TXT message.  */
+	struct timespec close_deadline;
+};
+
+/**
+ * @brief Event loop worker: one epoll instance serving the listening
+ * socket (shared with the other workers) and the clients it accepted.
+ */
+struct ws_evl
+{
+	int epfd;                /* Worker epoll instance.    */
+	int sock;                /* Listening socket.         */
+	uint32_t max_clients;    /* Connection table limit.   */
+	struct ws_server ws_srv; /* wsServer structure copy.  */
+	struct timespec last_tick; /* Last timeout scan.      */
 };
 
 static struct ws_connection *get_client_by_cid(ws_cli_conn_t cid);
 
 /**
- * @brief Clients list.
+ * @brief Clients table, grown on demand and indexed by the slot
+ * encoded in the connection id. Entries are allocated once and
+ * reused, so a stale pointer always points to a valid structure.
+ */
+static struct ws_connection **client_socks;
+
+/**
+ * @brief Current size of the clients table.
  */
-static struct ws_connection client_socks[MAX_CLIENTS];
+static uint32_t client_cap;
 
 /**
  * @brief Timeout to a single send().
  */
 static uint32_t timeout;
 
+/**
+ * @brief Sender thread wake-up pipe, -1 until started.
+ */
+static int sender_pipe[2] = {-1, -1};
+
+/**
+ * @brief Listening servers, looked up by port when a connection
+ * accepted elsewhere is handed over with ws_adopt().
+ */
+static struct ws_listener
+{
+	struct ws_server ws_srv; /* wsServer structure copy.        */
+	struct ws_evl **evls;    /* Event loop workers, NULL if not. */
+	int workers;             /* Event loop worker count.         */
+	unsigned next;           /* Round robin over the workers.    */
+} listeners[WS_MAX_LISTENERS];
+
+/**
+ * @brief Number of valid entries in @ref listeners.
+ */
+static int num_listeners;
+
 /**
  * @brief Client validity macro
  */
-#define CLIENT_VALID(cli)                          \
-	((cli) != NULL && (cli) >= &client_socks[0] && \
-		(cli) <= &client_socks[MAX_CLIENTS - 1] && \
-		(cli)->client_sock > -1)
+#define CLIENT_VALID(cli) \
+	((cli) != NULL && (cli)->client_sock > -1)
 
 
 /**
@@ -209,19 +311,37 @@ static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 		exit(-1);  \
 	} while (0);
 
+/**
+ * @brief Connection id layout: slot + 1 in the low 32 bits, the slot
+ * reuse generation in the high ones, so lookups are O(1) and a closed
+ * id never matches the next connection using the same slot.
+ */
+#define CID_SLOT(cid) ((uint32_t)((cid) & 0xFFFFFFFF) - 1)
+
+/**
+ * @brief Looks up the connection of a given id.
+ *
+ * @param cid Client connection id.
+ *
+ * @return Returns the connection, NULL if the id is not (or no
+ * longer) in use.
+ */
 static struct ws_connection *get_client_by_cid(ws_cli_conn_t cid)
 {
+	struct ws_connection *cli;
+	uint32_t slot;
+
+	cli  = NULL;
+	slot = CID_SLOT(cid);
+
 	pthread_mutex_lock(&mutex);
-	for (int i = 0; i < MAX_CLIENTS; i++)
+	if (slot < client_cap && client_socks[slot] &&
+		client_socks[slot]->client_id == cid)
 	{
-		if (client_socks[i].client_id == cid)
-		{
-			pthread_mutex_unlock(&mutex);
-			return &client_socks[i];
-		}
+		cli = client_socks[slot];
 	}
 	pthread_mutex_unlock(&mutex);
-	return NULL;
+	return (cli);
 }
 /**
  * @brief Shutdown and close a given socket.
@@ -242,19 +362,114 @@ static void close_socket(int fd)
 }
 
 
-static uint64_t cid_generator = 1;
+/**
+ * @brief Finds a free slot, growing the clients table up to
+ * @p max_clients entries, and assigns it a new connection id.
+ *
+ * @param max_clients Table size limit.
+ *
+ * @return Returns the connection or NULL if the table is full.
+ *
+ * @attention Must be called with the global mutex held.
+ */
+static struct ws_connection *alloc_client(uint32_t max_clients)
+{
+	struct ws_connection **tbl;
+	struct ws_connection *cli;
+	uint32_t cap;
+	uint32_t i;
+
+	for (i = 0; i < client_cap; i++)
+	{
+		if (!client_socks[i] || client_socks[i]->client_sock == -1)
+			break;
+	}
+
+	if (i == client_cap)
+	{
+		if (client_cap >= max_clients)
+			return (NULL);
+
+		cap = client_cap ? client_cap * 2 : MAX_CLIENTS;
+		if (cap > max_clients)
+			cap = max_clients;
+
+		tbl = realloc(client_socks, cap * sizeof(*tbl));
+		if (!tbl)
+			return (NULL);
+		memset(tbl + client_cap, 0, (cap - client_cap) * sizeof(*tbl));
+		client_socks = tbl;
+		client_cap   = cap;
+	}
+
+	if (!client_socks[i])
+	{
+		cli = calloc(1, sizeof(*cli));
+		if (!cli)
+			return (NULL);
+
+		cli->client_sock = -1;
+		if (pthread_mutex_init(&cli->mtx_state, NULL))
+			panic("Error on allocating close mutex");
+		if (pthread_cond_init(&cli->cnd_state_close, NULL))
+			panic("Error on allocating condition var\n");
+		if (pthread_mutex_init(&cli->mtx_snd, NULL))
+			panic("Error on allocating send mutex");
+		if (pthread_mutex_init(&cli->mtx_ping, NULL))
+			panic("Error on allocating ping/pong mutex");
+		client_socks[i] = cli;
+	}
 
-static pthread_mutex_t cid_mutex = PTHREAD_MUTEX_INITIALIZER;
+	cli = client_socks[i];
+	cli->generation++;
+	cli->client_id = ((uint64_t)cli->generation << 32) | (i + 1);
+	return (cli);
+}
 
-static uint64_t get_next_cid()
+/**
+ * @brief Sets up a freshly allocated connection for socket
+ * @p sock accepted by server @p ws_srv.
+ *
+ * @param cli    Connection from @ref alloc_client.
+ * @param sock   Client socket.
+ * @param ws_srv Server parameters.
+ *
+ * @return Returns 0 if success, -1 if out of memory.
+ *
+ * @attention Must be called with the global mutex held.
+ */
+static int init_client(struct ws_connection *cli, int sock,
+	const struct ws_server *ws_srv)
 {
-	uint64_t next_cid;
+	memcpy(&cli->ws_srv, ws_srv, sizeof(struct ws_server));
 
-	pthread_mutex_lock(&cid_mutex);
-	next_cid = cid_generator++;
-	pthread_mutex_unlock(&cid_mutex);
+	cli->out = calloc(WS_OUT_QUEUE_LEN, sizeof(struct ws_out));
+	if (!cli->out)
+		return (-1);
 
-	return next_cid;
+	cli->state           = WS_STATE_CONNECTING;
+	cli->close_thrd      = false;
+	cli->last_pong_id    = -1;
+	cli->current_ping_id = -1;
+	cli->connection_context = NULL;
+	cli->path[0]         = '\0';
+	cli->channel         = 0;
+	cli->out_head        = 0;
+	cli->out_count       = 0;
+	cli->out_bytes       = 0;
+	cli->out_dropped     = 0;
+	cli->out_max_bytes   = ws_srv->max_backlog ?
+		ws_srv->max_backlog : WS_OUT_MAX_BACKLOG;
+	cli->evl             = NULL;
+	cli->out_armed       = false;
+	cli->rx_len          = 0;
+	cli->frag_len        = 0;
+	cli->frag_type       = -1;
+	cli->frag_utf8       = 0;
+	cli->close_deadline.tv_sec  = 0;
+	cli->close_deadline.tv_nsec = 0;
+	cli->client_sock     = sock;
+	return (0);
 }
 
 /**
@@ -308,1611 +523,3139 @@ static int set_client_state(struct ws_connection *client, int state)
 }
 
 /**
- * @brief Send a given message @p buf on a socket @p sockfd.
- *
- * @param client Target client.
- * @param buf Message to be sent.
- * @param len Message length.
- * @param flags Send flags.
+ * @brief Allocates a message with room for @p len frame bytes and a
+ * single reference.
  *
- * @return If success (i.e: all message was sent), returns
- * the amount of bytes sent. Otherwise, -1.
+ * @param len Frame length.
  *
- * @note Technically this shouldn't be necessary, since send() should
- * block until all content is sent, since _we_ don't use 'O_NONBLOCK'.
- * However, it was reported (issue #22 on GitHub) that this was
- * happening, so just to be cautious, I will keep using this routine.
+ * @return Returns the new message, NULL if out of memory.
  */
-static ssize_t send_all(
-	struct ws_connection *client, const void *buf, size_t len, int flags)
+static struct ws_msg *ws_msg_alloc(size_t len)
 {
-	const char *p;
-	ssize_t ret;
-	ssize_t r;
+	struct ws_msg *msg;
 
-	ret = 0;
+	msg = malloc(sizeof(struct ws_msg) + len);
+	if (!msg)
+		return (NULL);
 
-	/* Sanity check. */
-	if (!CLIENT_VALID(client))
-		return (-1);
+	msg->refs = 1;
+	msg->len  = len;
+	return (msg);
+}
 
-	p = buf;
-	/* clang-format off */
-	pthread_mutex_lock(&client->mtx_snd);
-		while (len)
+/**
+ * @brief Drops a reference of @p msg, freeing it on the last one.
+ *
+ * @param msg Message.
+ */
+static void ws_msg_put(struct ws_msg *msg)
+{
+	if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(msg);
+}
+
+/**
+ * @brief Wakes the sender thread so it starts watching a queue that
+ * became non-empty.
+ */
+static void wake_sender(void)
+{
+	char c = 0;
+	if (sender_pipe[1] >= 0)
+	{
+		if (write(sender_pipe[1], &c, 1) < 0)
 		{
-			r = send(client->client_sock, p, len, flags);
-			if (r == -1)
-			{
-				pthread_mutex_unlock(&client->mtx_snd);
-				return (-1);
-			}
-			p   += r;
-			len -= r;
-			ret += r;
+			DEBUG("Unable to wake the sender thread\n");
 		}
-	pthread_mutex_unlock(&client->mtx_snd);
-	/* clang-format on */
-	return (ret);
+	}
 }
 
 /**
- * @brief Close client connection (no close handshake, this should
- * be done earlier), set appropriate state and destroy mutexes.
+ * @brief Frees every queued message of @p client.
  *
- * @param client Client connection.
- * @param lock Should lock the global mutex?.
+ * @param client Client connection, mtx_snd held.
+ */
+static void queue_clear(struct ws_connection *client)
+{
+	while (client->out_count)
+	{
+		ws_msg_put(client->out[client->out_head].msg);
+		client->out_head = (client->out_head + 1) % WS_OUT_QUEUE_LEN;
+		client->out_count--;
+	}
+	client->out_bytes = 0;
+}
+
+/**
+ * @brief Writes as much of the queue of @p client as the socket
+ * takes without blocking.
  *
- * @attention This is part of the internal API and is documented just
- * for completeness.
+ * @param client Client connection, mtx_snd held.
+ *
+ * @return Returns 0 if the socket is fine (queue may still be
+ * non-empty), -1 on a socket error, in which case the queue is
+ * dropped and the reader side notices the dead connection.
  */
-static void close_client(struct ws_connection *client, int lock)
+static int queue_flush(struct ws_connection *client)
 {
-	if (!CLIENT_VALID(client))
-		return;
+	struct ws_out *o;
+	ssize_t r;
 
-	set_client_state(client, WS_STATE_CLOSED);
+	while (client->out_count)
+	{
+		o = &client->out[client->out_head];
+		r = send(client->client_sock, o->msg->data + o->offset,
+			o->msg->len - o->offset, MSG_NOSIGNAL | MSG_DONTWAIT);
 
-	close_socket(client->client_sock);
+		if (r < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return (0);
+			queue_clear(client);
+			return (-1);
+		}
 
-	/* Destroy client mutexes and clear fd 'slot'. */
-	/* clang-format off */
-	if (lock)
-		pthread_mutex_lock(&mutex);
-			client->client_sock = -1;
-			pthread_cond_destroy(&client->cnd_state_close);
-			pthread_mutex_destroy(&client->mtx_state);
-			pthread_mutex_destroy(&client->mtx_snd);
-			pthread_mutex_destroy(&client->mtx_ping);
-	if (lock)
-		pthread_mutex_unlock(&mutex);
-	/* clang-format on */
+		o->offset += r;
+		client->out_bytes -= r;
+		if (o->offset < o->msg->len)
+			return (0);
+
+		ws_msg_put(o->msg);
+		client->out_head = (client->out_head + 1) % WS_OUT_QUEUE_LEN;
+		client->out_count--;
+	}
+	return (0);
 }
 
 /**
- * @brief Close time-out thread.
- *
- * For a given client, this routine sleeps until
- * TIMEOUT_MS and closes the connection or returns
- * sooner if already closed connection.
+ * @brief Pushes @p msg to the outbound queue of @p client, writing
+ * straight to the socket first if nothing is pending.
  *
- * @param p ws_connection/ws_cli_conn_t Structure Pointer.
+ * A message that does not fit the backlog is dropped as a whole,
+ * never truncated, unless @p force is set (control frames and
+ * direct sends that must keep their order).
  *
- * @return Always NULL.
+ * @param client Client connection, mtx_snd held.
+ * @param msg    Message, a reference is taken if it gets queued.
+ * @param force  Queue even past the backlog limit.
  *
- * @attention This is part of the internal API and is documented just
- * for completeness.
+ * @return Returns 1 if queued or sent, 0 if dropped, -1 on a
+ * socket error.
  */
-static void *close_timeout(void *p)
+static int queue_push(struct ws_connection *client, struct ws_msg *msg,
+	bool force)
 {
-	struct ws_connection *conn = p;
-	struct timespec ts;
-	int state;
-
-	pthread_mutex_lock(&conn->mtx_state);
+	struct ws_out *o;
+	size_t offset;
+	ssize_t r;
 
-	clock_gettime(CLOCK_REALTIME, &ts);
-	ts.tv_nsec += MS_TO_NS(TIMEOUT_MS);
+	offset = 0;
 
-	/* Normalize the time. */
-	while (ts.tv_nsec >= 1000000000)
+	/* Fast path: empty queue, try to hand it all to the kernel. */
+	if (!client->out_count)
 	{
-		ts.tv_sec++;
-		ts.tv_nsec -= 1000000000;
+		r = send(client->client_sock, msg->data, msg->len,
+			MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return (-1);
+			r = 0;
+		}
+		if ((size_t)r == msg->len)
+			return (1);
+		offset = r;
 	}
 
-	while (conn->state != WS_STATE_CLOSED &&
-		   pthread_cond_timedwait(&conn->cnd_state_close, &conn->mtx_state, &ts) !=
-			   ETIMEDOUT)
-		;
-
-	state = conn->state;
-	pthread_mutex_unlock(&conn->mtx_state);
+	/* A partially sent frame must be queued no matter what. */
+	if (!offset && !force &&
+		(client->out_count == WS_OUT_QUEUE_LEN ||
+		 client->out_bytes + msg->len > client->out_max_bytes))
+	{
+		client->out_dropped++;
+		return (0);
+	}
 
-	/* If already closed. */
-	if (state == WS_STATE_CLOSED)
-		goto quit;
+	/* The ring is full with forced entries, nothing to do but drop. */
+	if (client->out_count == WS_OUT_QUEUE_LEN)
+	{
+		client->out_dropped++;
+		return (0);
+	}
 
-	DEBUG("Timer expired, closing client %d\n", conn->client_sock);
+	o = &client->out[(client->out_head + client->out_count) % WS_OUT_QUEUE_LEN];
+	o->msg    = msg;
+	o->offset = offset;
+	__atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
 
-	close_client(conn, 1);
-quit:
-	return (NULL);
+	client->out_count++;
+	client->out_bytes += msg->len - offset;
+	return (1);
 }
 
 /**
- * @brief For a valid client index @p client, starts
- * the timeout thread and set the current state
- * to 'CLOSING'.
+ * @brief Sender thread: drains the outbound queues with non-blocking
+ * writes as their sockets become writable.
  *
- * @param client Client connection.
+ * @param data Unused.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * @return Never returns.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int start_close_timeout(struct ws_connection *client)
+static void *ws_sender(void *data)
 {
-	if (!CLIENT_VALID(client))
-		return (-1);
+	struct ws_connection **clis; /* Clients being polled.   */
+	struct ws_connection *cli;   /* Client.                 */
+	struct pollfd *pfd;          /* Poll set, pipe first.   */
+	uint32_t size;               /* Poll set capacity.      */
+	char drain[64];
+	void *tmp;
+	uint32_t i;
+	int n;
+
+	((void)data);
+
+	clis = NULL;
+	pfd  = NULL;
+	size = 0;
+
+#ifdef __linux__
+	prctl(PR_SET_NAME, "ws-send");
+#endif
 
-	pthread_mutex_lock(&client->mtx_state);
+	while (1)
+	{
+		/* clang-format off */
+		pthread_mutex_lock(&mutex);
+			if (size < client_cap + 1)
+			{
+				size = client_cap + 1;
+				if ((tmp = realloc(pfd, size * sizeof(*pfd))) != NULL)
+					pfd = tmp;
+				if ((tmp = realloc(clis, size * sizeof(*clis))) != NULL)
+					clis = tmp;
+				if (!pfd || !clis)
+					panic("Unable to allocate the sender poll set");
+			}
 
-	if (client->state != WS_STATE_OPEN)
-		goto out;
+			pfd[0].fd      = sender_pipe[0];
+			pfd[0].events  = POLLIN;
+			pfd[0].revents = 0;
+			n = 1;
 
-	client->state = WS_STATE_CLOSING;
+			/* Event loop clients are drained by their worker. */
+			for (i = 0; i < client_cap; i++)
+			{
+				cli = client_socks[i];
+				if (!cli || cli->client_sock < 0 || cli->evl)
+					continue;
 
-	if (pthread_create(&client->thrd_tout, NULL, close_timeout, client))
-	{
-		pthread_mutex_unlock(&client->mtx_state);
-		panic("Unable to create timeout thread\n");
+				pthread_mutex_lock(&cli->mtx_snd);
+				if (cli->out_count)
+				{
+					pfd[n].fd      = cli->client_sock;
+					pfd[n].events  = POLLOUT;
+					pfd[n].revents = 0;
+					clis[n] = cli;
+					n++;
+				}
+				pthread_mutex_unlock(&cli->mtx_snd);
+			}
+		pthread_mutex_unlock(&mutex);
+		/* clang-format on */
+
+		if (poll(pfd, n, -1) < 0)
+			continue;
+
+		if (pfd[0].revents & POLLIN)
+		{
+			if (read(sender_pipe[0], drain, sizeof(drain)) < 0)
+			{
+				DEBUG("Unable to read the sender pipe\n");
+			}
+		}
+
+		/* clang-format off */
+		pthread_mutex_lock(&mutex);
+			for (i = 1; i < (uint32_t)n; i++)
+			{
+				cli = clis[i];
+				if (!pfd[i].revents || cli->client_sock != pfd[i].fd)
+					continue;
+
+				pthread_mutex_lock(&cli->mtx_snd);
+					queue_flush(cli);
+				pthread_mutex_unlock(&cli->mtx_snd);
+			}
+		pthread_mutex_unlock(&mutex);
+		/* clang-format on */
 	}
-	client->close_thrd = true;
-out:
-	pthread_mutex_unlock(&client->mtx_state);
-	return (0);
+
+	return (NULL);
 }
 
 /**
- * @brief Sets the IP address relative to a client connection opened
- * by the server and save inside the client structure.
+ * @brief Advances a gather list past @p sent bytes.
  *
- * @param client Client connection.
+ * @param iov    Buffers, updated to the first unsent one.
+ * @param iovcnt Number of buffers, updated.
+ * @param sent   Bytes consumed.
  */
-static void set_client_address(struct ws_connection *client)
+static void iov_advance(struct iovec **iov, int *iovcnt, size_t sent)
 {
-	struct sockaddr_storage addr;
-	socklen_t hlen = sizeof(addr);
-
-	if (!CLIENT_VALID(client))
-		return;
-
-	memset(client->ip,   0, sizeof(client->ip));
-	memset(client->port, 0, sizeof(client->port));
-
-	if (getpeername(client->client_sock, (struct sockaddr *)&addr, &hlen) < 0)
-		return;
-
-	getnameinfo((struct sockaddr *)&addr, hlen,
-		client->ip,   sizeof(client->ip),
-		client->port, sizeof(client->port),
-		NI_NUMERICHOST|NI_NUMERICSERV);
-}
-
-/**
- * @brief Gets the IP address relative to a client connection opened
- * by the server.
- *
- * @param client Client connection.
- *
- * @return Pointer the ip address, or NULL if fails.
- *
- * @note The returned string is static, no need to free up memory.
- */
-char *ws_getaddress(ws_cli_conn_t client)
-{
-	struct ws_connection *cli = get_client_by_cid(client);
-	if (!CLIENT_VALID(cli))
-		return (NULL);
-
-	return (cli->ip);
-}
+	while (*iovcnt && sent >= (*iov)->iov_len)
+	{
+		sent -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+	if (*iovcnt)
+	{
+		(*iov)->iov_base = (char *)(*iov)->iov_base + sent;
+		(*iov)->iov_len -= sent;
+	}
+}
 
 /**
- * @brief Gets the IP port relative to a client connection opened
- * by the server.
- *
- * @param client Client connection.
+ * @brief Makes sure someone drains the non-empty queue of @p client:
+ * event loop clients get EPOLLOUT armed on their worker, the others
+ * rely on the sender thread.
  *
- * @return Pointer the port, or NULL if fails.
+ * @param client Client connection, mtx_snd held.
  *
- * @note The returned string is static, no need to free up memory.
+ * @return Returns true if the sender thread must be woken up.
  */
-char *ws_getport(ws_cli_conn_t client)
+static bool queue_kick(struct ws_connection *client)
 {
-	struct ws_connection *cli = get_client_by_cid(client);
-	if (!CLIENT_VALID(cli))
-		return (NULL);
+#ifdef WS_HAVE_EPOLL
+	struct epoll_event ev;
 
-	return (cli->port);
+	if (client->evl)
+	{
+		if (!client->out_armed)
+		{
+			ev.events   = EPOLLIN | EPOLLOUT;
+			ev.data.u64 = client->client_id;
+			epoll_ctl(client->evl->epfd, EPOLL_CTL_MOD, client->client_sock, &ev);
+			client->out_armed = true;
+		}
+		return (false);
+	}
+#endif
+	return (true);
 }
 
 /**
- * @brief Creates and send an WebSocket frame with some payload data.
- *
- * This routine is intended to be used to create a websocket frame for
- * a given type e sending to the client. For higher level routines,
- * please check @ref ws_sendframe_txt and @ref ws_sendframe_bin.
- *
- * @param client Target to be send. If NULL, broadcast the message.
- * @param msg    Message to be send.
- * @param size   Binary message size.
- * @param type   Frame type.
- * @param port   Server listen port to broadcast message (if any).
- *
- * @return Returns the number of bytes written, -1 if error.
+ * @brief Non-blocking counterpart of @ref send_all_iov: writes what
+ * the socket takes right away if nothing is pending and queues a copy
+ * of the rest behind the pending messages, so direct sends keep their
+ * order with respect to a broadcast still in flight.
  *
- * @note If @p size is -1, it is assumed that a text frame is being sent,
- * otherwise, a binary frame. In the later case, the @p size is used.
+ * @param client Client connection, mtx_snd held.
+ * @param iov    Buffers, modified.
+ * @param iovcnt Number of buffers.
  *
- * @attention This is part of the internal API and is documented just
- * for completeness.
+ * @return Returns the amount of bytes sent or queued, -1 if error.
  */
-static int ws_sendframe_internal(struct ws_connection *client, const char *msg,
-	uint64_t size, int type, uint16_t port)
+static ssize_t queue_copy(
+	struct ws_connection *client, struct iovec *iov, int iovcnt)
 {
-	unsigned char *response;   /* Response data.     */
-	unsigned char frame[10];   /* Frame.             */
-	uint8_t idx_first_rData;   /* Index data.        */
-	struct ws_connection *cli; /* Client.            */
-	int idx_response;          /* Index response.    */
-	ssize_t send_ret;          /* Ret send function  */
-	uint64_t length;           /* Message length.    */
-	ssize_t output;            /* Bytes sent.        */
-	uint64_t i;                /* Loop index.        */
+	struct ws_msg *msg;
+	size_t total;
+	size_t len;
+	size_t off;
+	ssize_t r;
+	int i;
 
-	/*
-	 * Check if there is a valid condition before proceeding.
-	 *
-	 * Valid ones:
-	 * client == true  && port == 0
-	 *     -> send to single client
-	 *
-	 * client == false && port != 0
-	 *      -> send to all clients within single port
-	 *
-	 * Other options are invalid!
-	 */
+	total = 0;
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
 
-	if (client)
-	{
-		if (port != 0)
-			return (-1);
-	}
-	else
+#ifndef _WIN32
+	if (!client->out_count)
 	{
-		if (port == 0)
-			return (-1);
+		struct msghdr mh = {0};
+		mh.msg_iov    = iov;
+		mh.msg_iovlen = iovcnt;
+		r = sendmsg(client->client_sock, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return (-1);
+			r = 0;
+		}
+		iov_advance(&iov, &iovcnt, r);
+		if (!iovcnt)
+			return (total);
 	}
+#endif
 
-	frame[0] = (WS_FIN | type);
-	length = (uint64_t)size;
-
-	/* Split the size between octets. */
-	if (length <= 125)
-	{
-		frame[1] = length & 0x7F;
-		idx_first_rData = 2;
-	}
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
 
-	/* Size between 126 and 65535 bytes. */
-	else if (length >= 126 && length <= 65535)
-	{
-		frame[1] = 126;
-		frame[2] = (length >> 8) & 255;
-		frame[3] = length & 255;
-		idx_first_rData = 4;
-	}
+	msg = ws_msg_alloc(len);
+	if (!msg)
+		return (-1);
 
-	/* More than 65535 bytes. */
-	else
+	for (off = 0, i = 0; i < iovcnt; i++)
 	{
-		frame[1] = 127;
-		frame[2] = (unsigned char)((length >> 56) & 255);
-		frame[3] = (unsigned char)((length >> 48) & 255);
-		frame[4] = (unsigned char)((length >> 40) & 255);
-		frame[5] = (unsigned char)((length >> 32) & 255);
-		frame[6] = (unsigned char)((length >> 24) & 255);
-		frame[7] = (unsigned char)((length >> 16) & 255);
-		frame[8] = (unsigned char)((length >> 8) & 255);
-		frame[9] = (unsigned char)(length & 255);
-		idx_first_rData = 10;
+		memcpy(msg->data + off, iov[i].iov_base, iov[i].iov_len);
+		off += iov[i].iov_len;
 	}
 
-	/* Add frame bytes. */
-	idx_response = 0;
-	response = malloc(sizeof(unsigned char) * (idx_first_rData + length + 1));
-	if (!response)
-		return (-1);
+	r = queue_push(client, msg, true);
+	ws_msg_put(msg);
+	return (r == 1 ? (ssize_t)total : -1);
+}
 
-	for (i = 0; i < idx_first_rData; i++)
-	{
-		response[i] = frame[i];
-		idx_response++;
-	}
+/**
+ * @brief Send a gather list of buffers in one go, guaranteeing that
+ * everything was sent, just like @ref send_all. Used to send a frame
+ * header and the caller payload without copying them together.
+ *
+ * @param client Target client.
+ * @param iov    Buffers to be sent, modified on partial sends.
+ * @param iovcnt Number of buffers.
+ * @param flags  send()/sendmsg() flags.
+ *
+ * @return If success (i.e: all buffers were sent), returns
+ * the amount of bytes sent. Otherwise, -1.
+ */
+static ssize_t send_all_iov(
+	struct ws_connection *client, struct iovec *iov, int iovcnt, int flags)
+{
+	ssize_t ret;
+	ssize_t r;
+	bool wake;
 
-	/* Add data bytes. */
-	for (i = 0; i < length; i++)
-	{
-		response[idx_response] = msg[i];
-		idx_response++;
-	}
+	ret = 0;
 
-	response[idx_response] = '\0';
+	/* Sanity check. */
+	if (!CLIENT_VALID(client))
+		return (-1);
 
-	/* Send to the client if there is one. */
-	output = 0;
-	if (client && port == 0)
+	/* Skip empty leading buffers. */
+	while (iovcnt && iov->iov_len == 0)
 	{
-		output = SEND(client, response, idx_response);
-		goto skip_broadcast;
+		iov++;
+		iovcnt--;
 	}
 
 	/* clang-format off */
-	pthread_mutex_lock(&mutex);
-		/* Do broadcast. */
-		for (i = 0; i < MAX_CLIENTS; i++)
+	pthread_mutex_lock(&client->mtx_snd);
+		/* Never block an event loop worker or jump the queue. */
+		if (client->out_count || client->evl)
 		{
-			cli = &client_socks[i];
+			ret  = queue_copy(client, iov, iovcnt);
+			wake = client->out_count && queue_kick(client);
+			pthread_mutex_unlock(&client->mtx_snd);
+			if (wake)
+				wake_sender();
+			return (ret);
+		}
 
-			if ((cli->client_sock > -1) &&
-				get_client_state(cli) == WS_STATE_OPEN &&
-				(cli->ws_srv.port == port))
+		while (iovcnt)
+		{
+#ifndef _WIN32
+			struct msghdr msg = {0};
+			msg.msg_iov    = iov;
+			msg.msg_iovlen = iovcnt;
+			r = sendmsg(client->client_sock, &msg, flags);
+#else
+			r = send(client->client_sock, iov->iov_base, iov->iov_len, flags);
+#endif
+			if (r == -1)
 			{
-				if ((send_ret = SEND(cli, response, idx_response)) != -1)
-					output += send_ret;
-				else
-				{
-					output = -1;
-					break;
-				}
+				pthread_mutex_unlock(&client->mtx_snd);
+				return (-1);
 			}
+			ret += r;
+
+			/* Advance past whatever was sent. */
+			iov_advance(&iov, &iovcnt, r);
 		}
-	pthread_mutex_unlock(&mutex);
+	pthread_mutex_unlock(&client->mtx_snd);
 	/* clang-format on */
-
-skip_broadcast:
-	free(response);
-	return ((int)output);
+	return (ret);
 }
 
 /**
- * @brief Send an WebSocket frame with some payload data.
+ * @brief Send a given message @p buf on a socket @p sockfd.
  *
- * @param client Target to be send. If NULL, broadcast the message.
- * @param msg    Message to be send.
- * @param size   Binary message size.
- * @param type   Frame type.
+ * @param client Target client.
+ * @param buf Message to be sent.
+ * @param len Message length.
+ * @param flags Send flags.
  *
- * @return Returns the number of bytes written, -1 if error.
+ * @return If success (i.e: all message was sent), returns
+ * the amount of bytes sent. Otherwise, -1.
  *
- * @note If @p size is -1, it is assumed that a text frame is being sent,
- * otherwise, a binary frame. In the later case, the @p size is used.
+ * @note Technically this shouldn't be necessary, since send() should
+ * block until all content is sent, since _we_ don't use 'O_NONBLOCK'.
+ * However, it was reported (issue #22 on GitHub) that this was
+ * happening, so just to be cautious, I will keep using this routine.
  */
-int ws_sendframe(ws_cli_conn_t client, const char *msg, uint64_t size, int type)
+static ssize_t send_all(
+	struct ws_connection *client, const void *buf, size_t len, int flags)
 {
-	struct ws_connection *cli = get_client_by_cid(client);
-	if (!CLIENT_VALID(cli))
-		return (-1);
-	return ws_sendframe_internal(cli, msg, size, type, 0);
+	struct iovec iov;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len  = len;
+	return (send_all_iov(client, &iov, 1, flags));
 }
 
 /**
- * @brief Send an WebSocket frame with some payload data to all clients
- * connected into the same port.
- *
- * @param port   Server listen port to broadcast message.
- * @param msg    Message to be send.
- * @param size   Binary message size.
- * @param type   Frame type.
+ * @brief Releases a client connection: closes the socket, drops its
+ * queues and frees the slot. The structure itself is kept for reuse.
  *
- * @return Returns the number of bytes written, -1 if error.
+ * @param client Client connection.
+ * @param lock Should lock the global mutex?.
  *
- * @note If @p size is -1, it is assumed that a text frame is being sent,
- * otherwise, a binary frame. In the later case, the @p size is used.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-int ws_sendframe_bcast(uint16_t port, const char *msg, uint64_t size, int type)
+static void release_client(struct ws_connection *client, int lock)
 {
-	return ws_sendframe_internal(NULL, msg, size, type, port);
+	if (!CLIENT_VALID(client))
+		return;
+
+	set_client_state(client, WS_STATE_CLOSED);
+
+	/* clang-format off */
+	if (lock)
+		pthread_mutex_lock(&mutex);
+			close_socket(client->client_sock);
+			client->client_sock = -1;
+			pthread_mutex_lock(&client->mtx_snd);
+				queue_clear(client);
+				free(client->out);
+				client->out = NULL;
+			pthread_mutex_unlock(&client->mtx_snd);
+			free(client->rx);
+			free(client->frag);
+			client->rx     = NULL;
+			client->rx_len = 0;
+			client->rx_cap = 0;
+			client->frag   = NULL;
+	if (lock)
+		pthread_mutex_unlock(&mutex);
+	/* clang-format on */
 }
 
 /**
- * @brief Given a PONG message, decodes the content
- * as a int32_t number that corresponds to our
- * PONG id.
+ * @brief Close client connection (no close handshake, this should
+ * be done earlier).
  *
- * @param msg Content to be decoded.
+ * Event loop connections belong to their worker, which may be parsing
+ * them right now, so they are only shut down here; the worker sees the
+ * hang up and releases them itself.
  *
- * @return Returns the PONG id.
+ * @param client Client connection.
+ * @param lock Should lock the global mutex?.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-static inline int32_t pong_msg_to_int32(uint8_t *msg)
+static void close_client(struct ws_connection *client, int lock)
 {
-	int32_t pong_id;
-	/* Decodes as big-endian. */
-	pong_id = (msg[3] << 0) | (msg[2] << 8) | (msg[1] << 16) | (msg[0] << 24);
-	return (pong_id);
+	if (!CLIENT_VALID(client))
+		return;
+
+	if (client->evl)
+	{
+		shutdown(client->client_sock, SHUT_RDWR);
+		return;
+	}
+
+	release_client(client, lock);
 }
 
 /**
- * @brief Given a PING id, encodes the content to be sent
- * as payload of a PING frame.
+ * @brief Close time-out thread.
  *
- * @param ping_id PING id to be encoded.
- * @param msg Target buffer.
- */
-static inline void int32_to_ping_msg(int32_t ping_id, uint8_t *msg)
-{
-	/* Encodes as big-endian. */
-	msg[0] = (ping_id >> 24);
-	msg[1] = (ping_id >> 16);
-	msg[2] = (ping_id >>  8);
-	msg[3] = (ping_id >>  0);
-}
-
-/**
- * @brief Send a ping message and close if the client surpasses
- * the threshold imposed.
+ * For a given client, this routine sleeps until
+ * TIMEOUT_MS and closes the connection or returns
+ * sooner if already closed connection.
  *
- * @param cli Client to be sent.
- * @param threshold How many pings can miss?.
- * @param lock Should lock global mutex or not?.
+ * @param p ws_connection/ws_cli_conn_t Structure Pointer.
+ *
+ * @return Always NULL.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static void send_ping_close(struct ws_connection *cli, int threshold, int lock)
+static void *close_timeout(void *p)
 {
-	uint8_t ping_msg[4];
+	struct ws_connection *conn = p;
+	struct timespec ts;
+	int state;
 
-	if (!CLIENT_VALID(cli) || get_client_state(cli) != WS_STATE_OPEN)
-		return;
+	pthread_mutex_lock(&conn->mtx_state);
 
-	/* clang-format off */
-	pthread_mutex_lock(&cli->mtx_ping);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += MS_TO_NS(TIMEOUT_MS);
 
-		cli->current_ping_id++;
-		int32_to_ping_msg(cli->current_ping_id, ping_msg);
+	/* Normalize the time. */
+	while (ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
 
-		/* Send PING. */
-		ws_sendframe_internal(cli, (const char*)ping_msg, sizeof(ping_msg),
-			WS_FR_OP_PING, 0);
+	while (conn->state != WS_STATE_CLOSED &&
+		   pthread_cond_timedwait(&conn->cnd_state_close, &conn->mtx_state, &ts) !=
+			   ETIMEDOUT)
+		;
 
-		/* Check previous PONG: if greater than threshold, abort. */
-		if ((cli->current_ping_id - cli->last_pong_id) > threshold) {
-			DEBUG("Closing, reason: many unanswered PINGs\n");
-			close_client(cli, lock);
-		}
+	state = conn->state;
+	pthread_mutex_unlock(&conn->mtx_state);
 
-	pthread_mutex_unlock(&cli->mtx_ping);
-	/* clang-format on */
+	/* If already closed. */
+	if (state == WS_STATE_CLOSED)
+		goto quit;
+
+	DEBUG("Timer expired, closing client %d\n", conn->client_sock);
+
+	close_client(conn, 1);
+quit:
+	return (NULL);
 }
 
 /**
- * @brief Sends a PING frame to the client @p cli with threshold
- * @p threshold.
- *
- * This routine sends a PING to a single client pointed to by
- * @p cli or a broadcast PING if @p cli is NULL. If the specified
- * client does not respond up to @p threshold PINGs, the connection
- * is aborted.
- *
- * ws_ping() is not automatic: the user who wants to send keep-alive
- * PINGs *must* call this routine in a timely manner, whether on
- * a different thread or inside an event.
- *
- * See examples/ping/ping.c for a minimal example usage.
+ * @brief For a valid client index @p client, starts
+ * the timeout thread and set the current state
+ * to 'CLOSING'.
  *
- * @param cli       Client to be sent, if NULL, broadcast.
- * @param threshold How many ignored PINGs should tolerate? (should be
- *                  positive and greater than 0).
+ * @param client Client connection.
  *
- * @note It should be noted that the time between each call to
- * ws_ping() is the timeout itself for receiving the PONG.
+ * @return Returns 0 if success, -1 otherwise.
  *
- * It is also important to note that for devices with unstable
- * connections (such as a weak WiFi signal or 3/4/5G from a cell phone),
- * a threshold greater than 1 is advisable.
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-void ws_ping(ws_cli_conn_t client, int threshold)
+static int start_close_timeout(struct ws_connection *client)
 {
-	struct ws_connection *cli = get_client_by_cid(client);
-	int i;
+	if (!CLIENT_VALID(client))
+		return (-1);
 
-	/* Sanity check. */
-	if (threshold <= 0)
-		return;
+	pthread_mutex_lock(&client->mtx_state);
 
-	/* PING a single client. */
-	if (cli)
-		send_ping_close(cli, threshold, 1);
+	if (client->state != WS_STATE_OPEN)
+		goto out;
 
-	/* PING broadcast. */
-	else
+	client->state = WS_STATE_CLOSING;
+
+	/* Event loop workers check the deadline themselves. */
+	if (client->evl)
 	{
-		/* clang-format off */
-		pthread_mutex_lock(&mutex);
-			for (i = 0; i < MAX_CLIENTS; i++)
-				send_ping_close(&client_socks[i], threshold, 0);
-		pthread_mutex_unlock(&mutex);
-		/* clang-format on */
+		clock_gettime(CLOCK_MONOTONIC, &client->close_deadline);
+		client->close_deadline.tv_nsec += MS_TO_NS(TIMEOUT_MS);
+		while (client->close_deadline.tv_nsec >= 1000000000)
+		{
+			client->close_deadline.tv_sec++;
+			client->close_deadline.tv_nsec -= 1000000000;
+		}
+		goto out;
+	}
+
+	if (pthread_create(&client->thrd_tout, NULL, close_timeout, client))
+	{
+		pthread_mutex_unlock(&client->mtx_state);
+		panic("Unable to create timeout thread\n");
 	}
+	client->close_thrd = true;
+out:
+	pthread_mutex_unlock(&client->mtx_state);
+	return (0);
 }
 
 /**
- * @brief Sends a WebSocket text frame.
- *
- * @param client Target to be send.
- * @param msg    Message to be send, null terminated.
+ * @brief Sets the IP address relative to a client connection opened
+ * by the server and save inside the client structure.
  *
- * @return Returns the number of bytes written, -1 if error.
+ * @param client Client connection.
  */
-int ws_sendframe_txt(ws_cli_conn_t client, const char *msg)
+static void set_client_address(struct ws_connection *client)
 {
-	return ws_sendframe(client, msg, (uint64_t)strlen(msg), WS_FR_OP_TXT);
+	struct sockaddr_storage addr;
+	socklen_t hlen = sizeof(addr);
+
+	if (!CLIENT_VALID(client))
+		return;
+
+	memset(client->ip,   0, sizeof(client->ip));
+	memset(client->port, 0, sizeof(client->port));
+
+	if (getpeername(client->client_sock, (struct sockaddr *)&addr, &hlen) < 0)
+		return;
+
+	getnameinfo((struct sockaddr *)&addr, hlen,
+		client->ip,   sizeof(client->ip),
+		client->port, sizeof(client->port),
+		NI_NUMERICHOST|NI_NUMERICSERV);
 }
 
 /**
- * @brief Sends a broadcast WebSocket text frame.
+ * @brief Gets the IP address relative to a client connection opened
+ * by the server.
  *
- * @param port Server listen port to broadcast message.
- * @param msg  Message to be send, null terminated.
+ * @param client Client connection.
  *
- * @return Returns the number of bytes written, -1 if error.
+ * @return Pointer the ip address, or NULL if fails.
+ *
+ * @note The returned string is static, no need to free up memory.
  */
-int ws_sendframe_txt_bcast(uint16_t port, const char *msg)
+char *ws_getaddress(ws_cli_conn_t client)
 {
-	return ws_sendframe_bcast(port, msg, (uint64_t)strlen(msg), WS_FR_OP_TXT);
+	struct ws_connection *cli = get_client_by_cid(client);
+	if (!CLIENT_VALID(cli))
+		return (NULL);
+
+	return (cli->ip);
 }
 
 /**
- * @brief Sends a WebSocket binary frame.
+ * @brief Gets the IP port relative to a client connection opened
+ * by the server.
  *
- * @param client Target to be send.
- * @param msg    Message to be send.
- * @param size   Binary message size.
+ * @param client Client connection.
  *
- * @return Returns the number of bytes written, -1 if error.
+ * @return Pointer the port, or NULL if fails.
+ *
+ * @note The returned string is static, no need to free up memory.
  */
-int ws_sendframe_bin(ws_cli_conn_t client, const char *msg, uint64_t size)
+char *ws_getport(ws_cli_conn_t client)
 {
-	return ws_sendframe(client, msg, size, WS_FR_OP_BIN);
+	struct ws_connection *cli = get_client_by_cid(client);
+	if (!CLIENT_VALID(cli))
+		return (NULL);
+
+	return (cli->port);
 }
 
 /**
- * @brief Sends a broadcast WebSocket binary frame.
+ * @brief Gets the socket of a client connection, e.g. for TCP_INFO.
  *
- * @param port Server listen port to broadcast message.
- * @param msg  Message to be send.
- * @param size Binary message size.
+ * @param client Client connection.
  *
- * @return Returns the number of bytes written, -1 if error.
+ * @return Socket fd, or -1 if the client is not valid.
+ *
+ * @note The socket stays owned by the server, never close it.
  */
-int ws_sendframe_bin_bcast(uint16_t port, const char *msg, uint64_t size)
+int ws_getfd(ws_cli_conn_t client)
 {
-	return ws_sendframe_bcast(port, msg, size, WS_FR_OP_BIN);
+	struct ws_connection *cli = get_client_by_cid(client);
+	if (!CLIENT_VALID(cli))
+		return (-1);
+
+	return (cli->client_sock);
 }
 
 /**
- * @brief For a given @p client, gets the current state for
- * the connection, or -1 if invalid.
+ * @brief Gets the path of the HTTP upgrade request of the client.
  *
  * @param client Client connection.
  *
- * @return Returns the connection state or -1 if
- * invalid @p client.
- *
- * @see WS_STATE_CONNECTING
- * @see WS_STATE_OPEN
- * @see WS_STATE_CLOSING
- * @see WS_STATE_CLOSED
+ * @return Pointer the request path, e.g. "/" or NULL if the
+ * client is not valid.
  */
-int ws_get_state(ws_cli_conn_t client)
+char *ws_getpath(ws_cli_conn_t client)
 {
 	struct ws_connection *cli = get_client_by_cid(client);
 	if (!CLIENT_VALID(cli))
-		return -1;
-	return (get_client_state(cli));
+		return (NULL);
+
+	return (cli->path);
 }
 
 /**
- * @brief Close the client connection for the given @p
- * client with normal close code (1000) and no reason
- * string.
- *
- * @param client Client connection.
+ * @brief Moves the client to a broadcast channel, see
+ * @ref ws_sendframe_bcast_channel. Clients start in channel 0.
  *
- * @return Returns 0 on success, -1 otherwise.
+ * @param client  Client connection.
+ * @param channel Channel, a non-negative number.
  *
- * @note If the client did not send a close frame in
- * TIMEOUT_MS milliseconds, the server will close the
- * connection with error code (1002).
+ * @return Returns 0 if success, -1 otherwise.
  */
-int ws_close_client(ws_cli_conn_t client)
+int ws_set_channel(ws_cli_conn_t client, int channel)
 {
 	struct ws_connection *cli = get_client_by_cid(client);
-
-	unsigned char clse_code[2];
-	int cc;
-
-	/* Check if client is a valid and connected client. */
-	if (!CLIENT_VALID(cli) || cli->client_sock == -1)
-		return (-1);
-
-	/*
-	 * Instead of using do_close(), we use this to avoid using
-	 * msg_ctrl buffer from wfd and avoid a race condition
-	 * if this is invoked asynchronously.
-	 */
-	cc = WS_CLSE_NORMAL;
-	clse_code[0] = (cc >> 8);
-	clse_code[1] = (cc & 0xFF);
-	if (ws_sendframe(
-			client, (const char *)clse_code, sizeof(char) * 2, WS_FR_OP_CLSE) < 0)
-	{
-		DEBUG("An error has occurred while sending closing frame!\n");
+	if (!CLIENT_VALID(cli) || channel < 0)
 		return (-1);
-	}
 
-	/*
-	 * Starts the timeout thread: if the client did not send
-	 * a close frame in TIMEOUT_MS milliseconds, the server
-	 * will close the connection with error code (1002).
-	 */
-	start_close_timeout(cli);
+	/* Broadcasts read it under the global mutex. */
+	pthread_mutex_lock(&mutex);
+	cli->channel = channel;
+	pthread_mutex_unlock(&mutex);
 	return (0);
 }
 
 /**
- * @brief Checks is a given opcode @p frame
- * belongs to a control frame or not.
- *
- * @param frame Frame opcode to be checked.
- *
- * @return Returns 1 if is a control frame, 0 otherwise.
- *
- * @attention This is part of the internal API and is documented just
- * for completeness.
- */
-static inline int is_control_frame(int frame)
-{
-	return (
-		frame == WS_FR_OP_CLSE || frame == WS_FR_OP_PING || frame == WS_FR_OP_PONG);
-}
-
-/**
- * @brief Checks is a given opcode @p opcode is valid or not.
- *
- * @param opcode Frame opcode to be checked.
+ * @brief Creates and send an WebSocket frame with some payload data.
  *
- * @return Returns 1 if valid, 0 otherwise.
+ * This routine is intended to be used to create a websocket frame for
+ * a given type e sending to the client. For higher level routines,
+ * please check @ref ws_sendframe_txt and @ref ws_sendframe_bin.
  *
- * @attention This is part of the internal API and is documented just
- * for completeness.
- */
-static inline int is_valid_frame(int opcode)
-{
-	return (
-		opcode == WS_FR_OP_TXT  || opcode == WS_FR_OP_BIN  ||
-		opcode == WS_FR_OP_CONT || opcode == WS_FR_OP_PING ||
-		opcode == WS_FR_OP_PONG || opcode == WS_FR_OP_CLSE
-	);
-}
-
-/**
- * @brief Do the handshake process.
+ * @param client Target to be send. If NULL, broadcast the message.
+ * @param msg    Message to be send.
+ * @param size   Binary message size.
+ * @param type   Frame type.
+ * @param port   Server listen port to broadcast message (if any).
+ * @param channel Broadcast only to clients of this channel,
+ *                WS_CHANNEL_ALL for every client.
  *
- * @param wfd Websocket Frame Data.
+ * @return Returns the number of bytes written, -1 if error.
  *
- * @return Returns 0 if success, a negative number otherwise.
+ * @note If @p size is -1, it is assumed that a text frame is being sent,
+ * otherwise, a binary frame. In the later case, the @p size is used.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int do_handshake(struct ws_frame_data *wfd)
+static int ws_sendframe_internal(struct ws_connection *client, const char *msg,
+	uint64_t size, int type, uint16_t port, int channel)
 {
-	char *response; /* Handshake response message. */
-	char *p;        /* Last request line pointer.  */
-	ssize_t n;      /* Read/Write bytes.           */
+	unsigned char frame[10];   /* Frame.             */
+	uint8_t idx_first_rData;   /* Index data.        */
+	struct ws_connection *cli; /* Client.            */
+	struct iovec iov[2];       /* Header + payload.  */
+	struct ws_msg *bmsg;       /* Broadcast message. */
+	bool queued;               /* Any queue pending. */
+	uint64_t length;           /* Message length.    */
+	ssize_t output;            /* Bytes sent.        */
+	uint64_t i;                /* Loop index.        */
 
-	/* Read the very first client message. */
-	if ((n = RECV(wfd->client, wfd->frm, sizeof(wfd->frm) - 1)) < 0)
-		return (-1);
+	/*
+	 * Check if there is a valid condition before proceeding.
+	 *
+	 * Valid ones:
+	 * client == true  && port == 0
+	 *     -> send to single client
+	 *
+	 * client == false && port != 0
+	 *      -> send to all clients within single port
+	 *
+	 * Other options are invalid!
+	 */
 
-	/* Advance our pointers before the first next_byte(). */
-	p = strstr((const char *)wfd->frm, "\r\n\r\n");
-	if (p == NULL)
+	if (client)
 	{
-		DEBUG("An empty line with \\r\\n was expected!\n");
-		return (-1);
+		if (port != 0)
+			return (-1);
 	}
-	wfd->amt_read = n;
-	wfd->cur_pos = (size_t)((ptrdiff_t)(p - (char *)wfd->frm)) + 4;
-
-	/* Get response. */
-	if (get_handshake_response((char *)wfd->frm, &response) < 0)
+	else
 	{
-		DEBUG("Cannot get handshake response, request was: %s\n", wfd->frm);
-		return (-1);
+		if (port == 0)
+			return (-1);
 	}
 
-	/* Valid request. */
-	DEBUG("Handshaked, response: \n"
-		  "------------------------------------\n"
-		  "%s"
-		  "------------------------------------\n",
-		response);
+	frame[0] = (WS_FIN | type);
+	length = (uint64_t)size;
 
-	/* Send handshake. */
-	if (SEND(wfd->client, response, strlen(response)) < 0)
+	/* Split the size between octets. */
+	if (length <= 125)
 	{
-		free(response);
-		DEBUG("As error has occurred while handshaking!\n");
-		return (-1);
+		frame[1] = length & 0x7F;
+		idx_first_rData = 2;
 	}
 
-	/* Change state. */
-	set_client_state(wfd->client, WS_STATE_OPEN);
-
-	/* Trigger events and clean up buffers. */
-	wfd->client->ws_srv.evs.onopen(wfd->client->client_id);
-	free(response);
-	return (0);
-}
-
-/**
- * @brief Sends a close frame, accordingly with the @p close_code
- * or the message inside @p wfd.
- *
- * @param wfd Websocket Frame Data.
- * @param close_code Websocket close code.
- *
- * @return Returns 0 if success, a negative number otherwise.
- *
- * @attention This is part of the internal API and is documented just
- * for completeness.
- */
-static int do_close(struct ws_frame_data *wfd, int close_code)
-{
-	int cc; /* Close code.           */
-
-	/* If custom close-code. */
-	if (close_code != -1)
+	/* Size between 126 and 65535 bytes. */
+	else if (length >= 126 && length <= 65535)
 	{
-		cc = close_code;
-		goto custom_close;
+		frame[1] = 126;
+		frame[2] = (length >> 8) & 255;
+		frame[3] = length & 255;
+		idx_first_rData = 4;
 	}
 
-	/* If empty or have a close reason, just re-send. */
-	if (wfd->frame_size == 0 || wfd->frame_size > 2)
-		goto send;
-
-	/* Parse close code and check if valid, if not, we issue an protocol error.
-	 */
-	if (wfd->frame_size == 1)
-		cc = wfd->msg_ctrl[0];
+	/* More than 65535 bytes. */
 	else
-		cc = ((int)wfd->msg_ctrl[0]) << 8 | wfd->msg_ctrl[1];
+	{
+		frame[1] = 127;
+		frame[2] = (unsigned char)((length >> 56) & 255);
+		frame[3] = (unsigned char)((length >> 48) & 255);
+		frame[4] = (unsigned char)((length >> 40) & 255);
+		frame[5] = (unsigned char)((length >> 32) & 255);
+		frame[6] = (unsigned char)((length >> 24) & 255);
+		frame[7] = (unsigned char)((length >> 16) & 255);
+		frame[8] = (unsigned char)((length >> 8) & 255);
+		frame[9] = (unsigned char)(length & 255);
+		idx_first_rData = 10;
+	}
 
-	/* Check if it's not valid, if so, we send a protocol error (1002). */
-	if ((cc < 1000 || cc > 1003) && (cc < 1007 || cc > 1011) &&
-		(cc < 3000 || cc > 4999))
+	/*
+	 * The header is sent straight from the stack together with the
+	 * caller payload, no copy of the message is made. The iovec is
+	 * rebuilt per client since partial sends consume it.
+	 */
+	output = 0;
+	if (client && port == 0)
 	{
-		cc = WS_CLSE_PROTERR;
+		iov[0].iov_base = frame;
+		iov[0].iov_len  = idx_first_rData;
+		iov[1].iov_base = (void *)msg;
+		iov[1].iov_len  = length;
+		output = SENDV(client, iov, 2);
+		goto skip_broadcast;
+	}
 
-	custom_close:
-		wfd->msg_ctrl[0] = (cc >> 8);
-		wfd->msg_ctrl[1] = (cc & 0xFF);
+	/*
+	 * Broadcast: frame the message once and push a reference to
+	 * every client queue. Nothing here blocks, a client that cannot
+	 * keep up has the frame dropped once its backlog is full.
+	 */
+	bmsg = ws_msg_alloc(idx_first_rData + length);
+	if (!bmsg)
+		return (-1);
+	memcpy(bmsg->data, frame, idx_first_rData);
+	memcpy(bmsg->data + idx_first_rData, msg, length);
 
-		if (ws_sendframe(wfd->client->client_id, (const char *)wfd->msg_ctrl, sizeof(char) * 2,
-				WS_FR_OP_CLSE) < 0)
+	queued = false;
+
+	/* clang-format off */
+	pthread_mutex_lock(&mutex);
+		for (i = 0; i < client_cap; i++)
 		{
-			DEBUG("An error has occurred while sending closing frame!\n");
-			return (-1);
+			cli = client_socks[i];
+
+			if (cli && (cli->client_sock > -1) &&
+				get_client_state(cli) == WS_STATE_OPEN &&
+				(cli->ws_srv.port == port) &&
+				(channel == WS_CHANNEL_ALL || cli->channel == channel))
+			{
+				pthread_mutex_lock(&cli->mtx_snd);
+					if (queue_push(cli, bmsg, false) == 1)
+						output += bmsg->len;
+					if (cli->out_count)
+						queued |= queue_kick(cli);
+				pthread_mutex_unlock(&cli->mtx_snd);
+			}
 		}
-		return (0);
-	}
+	pthread_mutex_unlock(&mutex);
+	/* clang-format on */
 
-	/* Send the data inside wfd->msg_ctrl. */
-send:
-	if (ws_sendframe(wfd->client->client_id, (const char *)wfd->msg_ctrl, wfd->frame_size,
-			WS_FR_OP_CLSE) < 0)
-	{
-		DEBUG("An error has occurred while sending closing frame!\n");
+	ws_msg_put(bmsg);
+	if (queued)
+		wake_sender();
+
+skip_broadcast:
+	return ((int)output);
+}
+
+/**
+ * @brief Send an WebSocket frame with some payload data.
+ *
+ * @param client Target to be send. If NULL, broadcast the message.
+ * @param msg    Message to be send.
+ * @param size   Binary message size.
+ * @param type   Frame type.
+ *
+ * @return Returns the number of bytes written, -1 if error.
+ *
+ * @note If @p size is -1, it is assumed that a text frame is being sent,
+ * otherwise, a binary frame. In the later case, the @p size is used.
+ */
+int ws_sendframe(ws_cli_conn_t client, const char *msg, uint64_t size, int type)
+{
+	struct ws_connection *cli = get_client_by_cid(client);
+	if (!CLIENT_VALID(cli))
 		return (-1);
-	}
-	return (0);
+	return ws_sendframe_internal(cli, msg, size, type, 0, WS_CHANNEL_ALL);
 }
 
 /**
- * @brief Send a pong frame in response to a ping frame.
+ * @brief Send an WebSocket frame with some payload data to all clients
+ * connected into the same port.
  *
- * Accordingly to the RFC, a pong frame must have the same
- * data payload as the ping frame, so we just send a
- * ordinary frame with PONG opcode.
+ * @param port   Server listen port to broadcast message.
+ * @param msg    Message to be send.
+ * @param size   Binary message size.
+ * @param type   Frame type.
  *
- * @param wfd Websocket frame data.
+ * @return Returns the number of bytes written, -1 if error.
  *
- * @param frame_size Pong frame size.
+ * @note If @p size is -1, it is assumed that a text frame is being sent,
+ * otherwise, a binary frame. In the later case, the @p size is used.
+ */
+int ws_sendframe_bcast(uint16_t port, const char *msg, uint64_t size, int type)
+{
+	return ws_sendframe_internal(NULL, msg, size, type, port, WS_CHANNEL_ALL);
+}
+
+/**
+ * @brief Send an WebSocket frame with some payload data to the clients
+ * of a given channel connected into the same port.
  *
- * @return Returns 0 if success and a negative number
- * otherwise.
+ * @param port    Server listen port to broadcast message.
+ * @param channel Channel set with @ref ws_set_channel.
+ * @param msg     Message to be send.
+ * @param size    Binary message size.
+ * @param type    Frame type.
  *
- * @attention This is part of the internal API and is documented just
- * for completeness.
+ * @return Returns the number of bytes written, -1 if error.
  */
-static int do_pong(struct ws_frame_data *wfd, uint64_t frame_size)
+int ws_sendframe_bcast_channel(uint16_t port, int channel, const char *msg,
+	uint64_t size, int type)
 {
-	if (ws_sendframe(
-			wfd->client->client_id, (const char *)wfd->msg_ctrl, frame_size, WS_FR_OP_PONG) < 0)
-	{
-		wfd->error = 1;
-		DEBUG("An error has occurred while ponging!\n");
-		return (-1);
+	return ws_sendframe_internal(NULL, msg, size, type, port, channel);
+}
+
+/**
+ * @brief Given a PONG message, decodes the content
+ * as a int32_t number that corresponds to our
+ * PONG id.
+ *
+ * @param msg Content to be decoded.
+ *
+ * @return Returns the PONG id.
+ */
+static inline int32_t pong_msg_to_int32(uint8_t *msg)
+{
+	int32_t pong_id;
+	/* Decodes as big-endian. */
+	pong_id = (msg[3] << 0) | (msg[2] << 8) | (msg[1] << 16) | (msg[0] << 24);
+	return (pong_id);
+}
+
+/**
+ * @brief Given a PING id, encodes the content to be sent
+ * as payload of a PING frame.
+ *
+ * @param ping_id PING id to be encoded.
+ * @param msg Target buffer.
+ */
+static inline void int32_to_ping_msg(int32_t ping_id, uint8_t *msg)
+{
+	/* Encodes as big-endian. */
+	msg[0] = (ping_id >> 24);
+	msg[1] = (ping_id >> 16);
+	msg[2] = (ping_id >>  8);
+	msg[3] = (ping_id >>  0);
+}
+
+/**
+ * @brief Send a ping message and close if the client surpasses
+ * the threshold imposed.
+ *
+ * @param cli Client to be sent.
+ * @param threshold How many pings can miss?.
+ * @param lock Should lock global mutex or not?.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void send_ping_close(struct ws_connection *cli, int threshold, int lock)
+{
+	uint8_t ping_msg[4];
+
+	if (!CLIENT_VALID(cli) || get_client_state(cli) != WS_STATE_OPEN)
+		return;
+
+	/* clang-format off */
+	pthread_mutex_lock(&cli->mtx_ping);
+
+		cli->current_ping_id++;
+		int32_to_ping_msg(cli->current_ping_id, ping_msg);
+
+		/* Send PING. */
+		ws_sendframe_internal(cli, (const char*)ping_msg, sizeof(ping_msg),
+			WS_FR_OP_PING, 0, WS_CHANNEL_ALL);
+
+		/* Check previous PONG: if greater than threshold, abort. */
+		if ((cli->current_ping_id - cli->last_pong_id) > threshold) {
+			DEBUG("Closing, reason: many unanswered PINGs\n");
+			close_client(cli, lock);
+		}
+
+	pthread_mutex_unlock(&cli->mtx_ping);
+	/* clang-format on */
+}
+
+/**
+ * @brief Sends a PING frame to the client @p cli with threshold
+ * @p threshold.
+ *
+ * This routine sends a PING to a single client pointed to by
+ * @p cli or a broadcast PING if @p cli is NULL. If the specified
+ * client does not respond up to @p threshold PINGs, the connection
+ * is aborted.
+ *
+ * ws_ping() is not automatic: the user who wants to send keep-alive
+ * PINGs *must* call this routine in a timely manner, whether on
+ * a different thread or inside an event.
+ *
+ * See examples/ping/ping.c for a minimal example usage.
+ *
+ * @param cli       Client to be sent, if NULL, broadcast.
+ * @param threshold How many ignored PINGs should tolerate? (should be
+ *                  positive and greater than 0).
+ *
+ * @note It should be noted that the time between each call to
+ * ws_ping() is the timeout itself for receiving the PONG.
+ *
+ * It is also important to note that for devices with unstable
+ * connections (such as a weak WiFi signal or 3/4/5G from a cell phone),
+ * a threshold greater than 1 is advisable.
+ */
+void ws_ping(ws_cli_conn_t client, int threshold)
+{
+	struct ws_connection *cli = get_client_by_cid(client);
+	int i;
+
+	/* Sanity check. */
+	if (threshold <= 0)
+		return;
+
+	/* PING a single client. */
+	if (cli)
+		send_ping_close(cli, threshold, 1);
+
+	/* PING broadcast. */
+	else
+	{
+		/* clang-format off */
+		pthread_mutex_lock(&mutex);
+			for (i = 0; i < (int)client_cap; i++)
+				send_ping_close(client_socks[i], threshold, 0);
+		pthread_mutex_unlock(&mutex);
+		/* clang-format on */
+	}
+}
+
+/**
+ * @brief Sends a WebSocket text frame.
+ *
+ * @param client Target to be send.
+ * @param msg    Message to be send, null terminated.
+ *
+ * @return Returns the number of bytes written, -1 if error.
+ */
+int ws_sendframe_txt(ws_cli_conn_t client, const char *msg)
+{
+	return ws_sendframe(client, msg, (uint64_t)strlen(msg), WS_FR_OP_TXT);
+}
+
+/**
+ * @brief Sends a broadcast WebSocket text frame.
+ *
+ * @param port Server listen port to broadcast message.
+ * @param msg  Message to be send, null terminated.
+ *
+ * @return Returns the number of bytes written, -1 if error.
+ */
+int ws_sendframe_txt_bcast(uint16_t port, const char *msg)
+{
+	return ws_sendframe_bcast(port, msg, (uint64_t)strlen(msg), WS_FR_OP_TXT);
+}
+
+/**
+ * @brief Sends a WebSocket binary frame.
+ *
+ * @param client Target to be send.
+ * @param msg    Message to be send.
+ * @param size   Binary message size.
+ *
+ * @return Returns the number of bytes written, -1 if error.
+ */
+int ws_sendframe_bin(ws_cli_conn_t client, const char *msg, uint64_t size)
+{
+	return ws_sendframe(client, msg, size, WS_FR_OP_BIN);
+}
+
+/**
+ * @brief Sends a broadcast WebSocket binary frame.
+ *
+ * @param port Server listen port to broadcast message.
+ * @param msg  Message to be send.
+ * @param size Binary message size.
+ *
+ * @return Returns the number of bytes written, -1 if error.
+ */
+int ws_sendframe_bin_bcast(uint16_t port, const char *msg, uint64_t size)
+{
+	return ws_sendframe_bcast(port, msg, size, WS_FR_OP_BIN);
+}
+
+/**
+ * @brief For a given @p client, gets the current state for
+ * the connection, or -1 if invalid.
+ *
+ * @param client Client connection.
+ *
+ * @return Returns the connection state or -1 if
+ * invalid @p client.
+ *
+ * @see WS_STATE_CONNECTING
+ * @see WS_STATE_OPEN
+ * @see WS_STATE_CLOSING
+ * @see WS_STATE_CLOSED
+ */
+int ws_get_state(ws_cli_conn_t client)
+{
+	struct ws_connection *cli = get_client_by_cid(client);
+	if (!CLIENT_VALID(cli))
+		return -1;
+	return (get_client_state(cli));
+}
+
+/**
+ * @brief Outbound backlog of a given client.
+ *
+ * @param client  Client connection.
+ * @param bytes   Bytes queued and not yet written to the socket.
+ * @param dropped Broadcast frames dropped so far because the backlog
+ *                was full.
+ *
+ * @return Returns 0 if success, -1 if the client is not valid.
+ */
+int ws_get_backlog(ws_cli_conn_t client, size_t *bytes, uint64_t *dropped)
+{
+	struct ws_connection *cli = get_client_by_cid(client);
+	if (!CLIENT_VALID(cli))
+		return (-1);
+
+	pthread_mutex_lock(&cli->mtx_snd);
+	if (bytes)
+		*bytes = cli->out_bytes;
+	if (dropped)
+		*dropped = cli->out_dropped;
+	pthread_mutex_unlock(&cli->mtx_snd);
+	return (0);
+}
+
+/**
+ * @brief Close the client connection for the given @p
+ * client with normal close code (1000) and no reason
+ * string.
+ *
+ * @param client Client connection.
+ *
+ * @return Returns 0 on success, -1 otherwise.
+ *
+ * @note If the client did not send a close frame in
+ * TIMEOUT_MS milliseconds, the server will close the
+ * connection with error code (1002).
+ */
+int ws_close_client(ws_cli_conn_t client)
+{
+	struct ws_connection *cli = get_client_by_cid(client);
+
+	unsigned char clse_code[2];
+	int cc;
+
+	/* Check if client is a valid and connected client. */
+	if (!CLIENT_VALID(cli) || cli->client_sock == -1)
+		return (-1);
+
+	/*
+	 * Instead of using do_close(), we use this to avoid using
+	 * msg_ctrl buffer from wfd and avoid a race condition
+	 * if this is invoked asynchronously.
+	 */
+	cc = WS_CLSE_NORMAL;
+	clse_code[0] = (cc >> 8);
+	clse_code[1] = (cc & 0xFF);
+	if (ws_sendframe(
+			client, (const char *)clse_code, sizeof(char) * 2, WS_FR_OP_CLSE) < 0)
+	{
+		DEBUG("An error has occurred while sending closing frame!\n");
+		return (-1);
+	}
+
+	/*
+	 * Starts the timeout thread: if the client did not send
+	 * a close frame in TIMEOUT_MS milliseconds, the server
+	 * will close the connection with error code (1002).
+	 */
+	start_close_timeout(cli);
+	return (0);
+}
+
+/**
+ * @brief Checks is a given opcode @p frame
+ * belongs to a control frame or not.
+ *
+ * @param frame Frame opcode to be checked.
+ *
+ * @return Returns 1 if is a control frame, 0 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static inline int is_control_frame(int frame)
+{
+	return (
+		frame == WS_FR_OP_CLSE || frame == WS_FR_OP_PING || frame == WS_FR_OP_PONG);
+}
+
+/**
+ * @brief Checks is a given opcode @p opcode is valid or not.
+ *
+ * @param opcode Frame opcode to be checked.
+ *
+ * @return Returns 1 if valid, 0 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static inline int is_valid_frame(int opcode)
+{
+	return (
+		opcode == WS_FR_OP_TXT  || opcode == WS_FR_OP_BIN  ||
+		opcode == WS_FR_OP_CONT || opcode == WS_FR_OP_PING ||
+		opcode == WS_FR_OP_PONG || opcode == WS_FR_OP_CLSE
+	);
+}
+
+/**
+ * @brief Saves the path of the HTTP upgrade request @p request,
+ * truncated to WS_PATH_LEN - 1 bytes.
+ *
+ * @param client  Client connection.
+ * @param request Handshake request, NUL terminated.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void set_client_path(struct ws_connection *client,
+	const char *request)
+{
+	size_t i;
+
+	client->path[0] = '\0';
+	if (strncmp(request, "GET ", 4) != 0)
+		return;
+
+	request += 4;
+	for (i = 0; i < WS_PATH_LEN - 1 && request[i] && request[i] != ' ' &&
+		request[i] != '\r' && request[i] != '\n'; i++)
+	{
+		client->path[i] = request[i];
+	}
+	client->path[i] = '\0';
+}
+
+/**
+ * @brief Do the handshake process.
+ *
+ * @param wfd Websocket Frame Data.
+ *
+ * @return Returns 0 if success, a negative number otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int do_handshake(struct ws_frame_data *wfd)
+{
+	char *response; /* Handshake response message. */
+	char *p;        /* Last request line pointer.  */
+	ssize_t n;      /* Read/Write bytes.           */
+
+	/* Read the very first client message. */
+	if ((n = RECV(wfd->client, wfd->frm, sizeof(wfd->frm) - 1)) < 0)
+		return (-1);
+
+	/* Advance our pointers before the first next_byte(). */
+	p = strstr((const char *)wfd->frm, "\r\n\r\n");
+	if (p == NULL)
+	{
+		DEBUG("An empty line with \\r\\n was expected!\n");
+		return (-1);
+	}
+	wfd->amt_read = n;
+	wfd->cur_pos = (size_t)((ptrdiff_t)(p - (char *)wfd->frm)) + 4;
+
+	/* Get response. */
+	wfd->frm[n] = '\0';
+	set_client_path(wfd->client, (const char *)wfd->frm);
+	if (get_handshake_response((char *)wfd->frm, &response) < 0)
+	{
+		DEBUG("Cannot get handshake response, request was: %s\n", wfd->frm);
+		return (-1);
+	}
+
+	/* Valid request. */
+	DEBUG("Handshaked, response: \n"
+		  "------------------------------------\n"
+		  "%s"
+		  "------------------------------------\n",
+		response);
+
+	/* Send handshake. */
+	if (SEND(wfd->client, response, strlen(response)) < 0)
+	{
+		free(response);
+		DEBUG("As error has occurred while handshaking!\n");
+		return (-1);
+	}
+
+	/* Change state. */
+	set_client_state(wfd->client, WS_STATE_OPEN);
+
+	/* Trigger events and clean up buffers. */
+	wfd->client->ws_srv.evs.onopen(wfd->client->client_id);
+	free(response);
+	return (0);
+}
+
+/**
+ * @brief Sends a close frame to @p client, accordingly with the
+ * @p close_code or echoing the close frame payload @p msg.
+ *
+ * @param client Client connection.
+ * @param msg Received close frame payload.
+ * @param size Payload size.
+ * @param close_code Websocket close code, -1 to echo @p msg.
+ *
+ * @return Returns 0 if success, a negative number otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int send_close(struct ws_connection *client, const unsigned char *msg,
+	uint64_t size, int close_code)
+{
+	unsigned char code[2]; /* Close code payload. */
+	int cc;                /* Close code.         */
+
+	/* If custom close-code. */
+	if (close_code != -1)
+	{
+		cc = close_code;
+		goto custom_close;
+	}
+
+	/* If empty or have a close reason, just re-send. */
+	if (size == 0 || size > 2)
+		goto send;
+
+	/* Parse close code and check if valid, if not, we issue an protocol error.
+	 */
+	if (size == 1)
+		cc = msg[0];
+	else
+		cc = ((int)msg[0]) << 8 | msg[1];
+
+	/* Check if it's not valid, if so, we send a protocol error (1002). */
+	if ((cc < 1000 || cc > 1003) && (cc < 1007 || cc > 1011) &&
+		(cc < 3000 || cc > 4999))
+	{
+		cc = WS_CLSE_PROTERR;
+
+	custom_close:
+		code[0] = (cc >> 8);
+		code[1] = (cc & 0xFF);
+		msg  = code;
+		size = sizeof(code);
+	}
+
+	/* Send the close frame. */
+send:
+	if (ws_sendframe_internal(client, (const char *)msg, size,
+			WS_FR_OP_CLSE, 0, WS_CHANNEL_ALL) < 0)
+	{
+		DEBUG("An error has occurred while sending closing frame!\n");
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Sends a close frame, accordingly with the @p close_code
+ * or the message inside @p wfd.
+ *
+ * @param wfd Websocket Frame Data.
+ * @param close_code Websocket close code.
+ *
+ * @return Returns 0 if success, a negative number otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int do_close(struct ws_frame_data *wfd, int close_code)
+{
+	return (send_close(wfd->client, wfd->msg_ctrl, wfd->frame_size,
+		close_code));
+}
+
+/**
+ * @brief Send a pong frame in response to a ping frame.
+ *
+ * Accordingly to the RFC, a pong frame must have the same
+ * data payload as the ping frame, so we just send a
+ * ordinary frame with PONG opcode.
+ *
+ * @param wfd Websocket frame data.
+ *
+ * @param frame_size Pong frame size.
+ *
+ * @return Returns 0 if success and a negative number
+ * otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int do_pong(struct ws_frame_data *wfd, uint64_t frame_size)
+{
+	if (ws_sendframe(
+			wfd->client->client_id, (const char *)wfd->msg_ctrl, frame_size, WS_FR_OP_PONG) < 0)
+	{
+		wfd->error = 1;
+		DEBUG("An error has occurred while ponging!\n");
+		return (-1);
+	}
+	return (0);
+}
+
+/**
+ * @brief Read a chunk of bytes and return the next byte
+ * belonging to the frame.
+ *
+ * @param wfd Websocket Frame Data.
+ *
+ * @return Returns the byte read, or -1 if error.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static inline int next_byte(struct ws_frame_data *wfd)
+{
+	ssize_t n;
+
+	/* If empty or full. */
+	if (wfd->cur_pos == 0 || wfd->cur_pos == wfd->amt_read)
+	{
+		if ((n = RECV(wfd->client, wfd->frm, sizeof(wfd->frm))) <= 0)
+		{
+			wfd->error = 1;
+			DEBUG("An error has occurred while trying to read next byte\n");
+			return (-1);
+		}
+		wfd->amt_read = (size_t)n;
+		wfd->cur_pos = 0;
+	}
+	return (wfd->frm[wfd->cur_pos++]);
+}
+
+/**
+ * @brief Reads the next @p n header bytes, straight from the
+ * buffered block when it holds them all.
+ *
+ * @param wfd Websocket Frame Data.
+ * @param dst Destination.
+ * @param n   Amount of bytes.
+ *
+ * @return Returns 0 if success, -1 if error.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static inline int next_bytes(struct ws_frame_data *wfd, uint8_t *dst,
+	size_t n)
+{
+	int cur_byte;
+	size_t i;
+
+	if (wfd->cur_pos != 0 && wfd->amt_read - wfd->cur_pos >= n)
+	{
+		memcpy(dst, wfd->frm + wfd->cur_pos, n);
+		wfd->cur_pos += n;
+		return (0);
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if ((cur_byte = next_byte(wfd)) == -1)
+			return (-1);
+		dst[i] = cur_byte;
+	}
+	return (0);
+}
+
+/**
+ * @brief Reads and unmasks @p len payload bytes into @p dst.
+ *
+ * Whatever is buffered is unmasked in bulk; a remainder larger than
+ * the buffer is received straight into @p dst instead of going
+ * through it.
+ *
+ * @param wfd   Websocket Frame Data.
+ * @param dst   Destination.
+ * @param len   Payload length.
+ * @param masks Frame masks.
+ *
+ * @return Returns 0 if success, -1 if error.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int read_payload(struct ws_frame_data *wfd, uint8_t *dst,
+	uint64_t len, const uint8_t *masks)
+{
+	uint64_t done; /* Bytes unmasked.  */
+	size_t n;      /* Span length.     */
+	ssize_t r;     /* Bytes received.  */
+
+	done = 0;
+	while (done < len)
+	{
+		/* If empty or full. */
+		if (wfd->cur_pos == 0 || wfd->cur_pos == wfd->amt_read)
+		{
+			if (len - done >= sizeof(wfd->frm))
+			{
+				r = RECV(wfd->client, dst + done, len - done);
+				if (r <= 0)
+					goto err;
+				ws_unmask(dst + done, dst + done, r, masks, done);
+				done += r;
+				continue;
+			}
+
+			if ((r = RECV(wfd->client, wfd->frm, sizeof(wfd->frm))) <= 0)
+				goto err;
+			wfd->amt_read = (size_t)r;
+			wfd->cur_pos  = 0;
+		}
+
+		n = wfd->amt_read - wfd->cur_pos;
+		if (n > len - done)
+			n = len - done;
+
+		ws_unmask(dst + done, wfd->frm + wfd->cur_pos, n, masks, done);
+		wfd->cur_pos += n;
+		done += n;
+	}
+	return (0);
+
+err:
+	wfd->error = 1;
+	DEBUG("An error has occurred while trying to read the payload\n");
+	return (-1);
+}
+
+/**
+ * @brief Skips @p frame_size bytes of the current frame.
+ *
+ * @param wfd Websocket Frame Data.
+ * @param frame_size Amount of bytes to be skipped.
+ *
+ * @return Returns 0 if success, a negative number
+ * otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int skip_frame(struct ws_frame_data *wfd, uint64_t frame_size)
+{
+	uint64_t i;
+	for (i = 0; i < frame_size; i++)
+	{
+		if (next_byte(wfd) == -1)
+		{
+			wfd->error = 1;
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+/**
+ * Frame state data
+ *
+ * This structure holds the current data for handling the
+ * received frames.
+ */
+struct frame_state_data
+{
+	unsigned char *msg_data; /* Data frame.                */
+	unsigned char *msg_ctrl; /* Control frame.             */
+	uint8_t masks_data[4];   /* Masks data frame array.    */
+	uint8_t masks_ctrl[4];   /* Masks control frame array. */
+	uint64_t msg_idx_data;   /* Current msg index.         */
+	uint64_t msg_idx_ctrl;   /* Current msg index.         */
+	uint64_t frame_length;   /* Frame length.              */
+	uint64_t frame_size;     /* Current frame size.        */
+#ifdef VALIDATE_UTF8
+	uint32_t utf8_state;     /* Current UTF-8 state.       */
+#endif
+	int32_t pong_id;         /* Current PONG id.           */
+	uint8_t opcode;          /* Frame opcode.              */
+	uint8_t is_fin;          /* Is FIN frame flag.         */
+	uint8_t mask;            /* Mask.                      */
+	int cur_byte;            /* Current frame byte.        */
+};
+
+/**
+ * @brief Validates TXT frames if UTF8 validation is enabled.
+ * If the content is not valid, the connection is aborted.
+ *
+ * @param wfd WebSocket frame data.
+ * @param fsd Frame state data.
+ *
+ * @return Always 0.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int validate_utf8_txt(struct ws_frame_data *wfd,
+	struct frame_state_data *fsd)
+{
+#ifdef VALIDATE_UTF8
+	/* UTF-8 Validate partial (or not) frame. */
+	if (wfd->frame_type != WS_FR_OP_TXT)
+		return (0);
+
+	if (fsd->is_fin)
+	{
+		if (is_utf8_len_state(
+			fsd->msg_data + (fsd->msg_idx_data - fsd->frame_length),
+			fsd->frame_length, fsd->utf8_state) != UTF8_ACCEPT)
+		{
+			DEBUG("Dropping invalid complete message!\n");
+			wfd->error = 1;
+			do_close(wfd, WS_CLSE_INVUTF8);
+		}
+
+		return (0);
+	}
+
+	/* Check current state for a CONT or initial TXT frame. */
+	fsd->utf8_state =
+		is_utf8_len_state(fsd->msg_data +
+			(fsd->msg_idx_data - fsd->frame_length),
+			fsd->frame_length, fsd->utf8_state);
+
+	/* We can be in any state, except reject. */
+	if (fsd->utf8_state == UTF8_REJECT)
+	{
+		DEBUG("Dropping invalid cont/initial frame!\n");
+		wfd->error = 1;
+		do_close(wfd, WS_CLSE_INVUTF8);
+	}
+#endif
+	return (0);
+}
+
+/**
+ * @brief Handle PONG frames in response to our PING
+ * (or not, unsolicited is possible too).
+ *
+ * @param wfd WebSocket frame data.
+ * @param fsd Frame state data.
+ *
+ * @return Always 0.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int handle_pong_frame(struct ws_frame_data *wfd,
+	struct frame_state_data *fsd)
+{
+	fsd->is_fin = 0;
+
+	/* If there is no content and/or differs the size, ignore it. */
+	if (fsd->frame_size != sizeof(wfd->client->last_pong_id))
+		return (0);
+
+	/*
+	 * Our PONG id should be positive and smaller than our
+	 * current PING id. If not, ignore.
+	 */
+	/* clang-format off */
+	pthread_mutex_lock(&wfd->client->mtx_ping);
+		fsd->pong_id = pong_msg_to_int32(fsd->msg_ctrl);
+		if (fsd->pong_id < 0 || fsd->pong_id > wfd->client->current_ping_id)
+		{
+			pthread_mutex_unlock(&wfd->client->mtx_ping);
+			return (0);
+		}
+		wfd->client->last_pong_id = fsd->pong_id;
+	pthread_mutex_unlock(&wfd->client->mtx_ping);
+	/* clang-format on */
+
+	return (0);
+}
+
+/**
+ * @brief Handle PING frames sending a PONG response.
+ *
+ * @param wfd WebSocket frame data.
+ * @param fsd Frame state data.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int handle_ping_frame(struct ws_frame_data *wfd,
+	struct frame_state_data *fsd)
+{
+	if (do_pong(wfd, fsd->frame_size) < 0)
+		return (-1);
+
+	/* Quick hack to keep our loop. */
+	fsd->is_fin = 0;
+	return (0);
+}
+
+/**
+ * @brief Handle close frames while checking for UTF8
+ * in the close reason.
+ *
+ * @param wfd WebSocket frame data.
+ * @param fsd Frame state data.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int handle_close_frame(struct ws_frame_data *wfd,
+	struct frame_state_data *fsd)
+{
+#ifdef VALIDATE_UTF8
+	/* If there is a close reason, check if it is UTF-8 valid. */
+	if (fsd->frame_size > 2 &&
+		!is_utf8_len(fsd->msg_ctrl + 2, fsd->frame_size - 2))
+	{
+		DEBUG("Invalid close frame payload reason! (not UTF-8)\n");
+		wfd->error = 1;
+		return (-1);
+	}
+#endif
+
+	/*
+	 * Since we're aborting, we can scratch the 'data'-related
+	 * vars here.
+	 */
+	wfd->frame_size = fsd->frame_size;
+	wfd->frame_type = WS_FR_OP_CLSE;
+	free(fsd->msg_data);
+	return (0);
+}
+
+/**
+ * @brief Reads the current frame isolating data from control frames.
+ * The parameters are changed in order to reflect the current state.
+ *
+ * @param wfd Websocket Frame Data.
+ * @param fsd Frame state data.
+ *
+ * @return Returns 0 if success, a negative number otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int read_single_frame(struct ws_frame_data *wfd,
+	struct frame_state_data *fsd)
+{
+	uint64_t *frame_size; /* Curr frame size. */
+	unsigned char *tmp; /* Tmp message.     */
+	unsigned char *msg; /* Current message. */
+	uint64_t *msg_idx;  /* Message index.   */
+	uint8_t *masks;     /* Current mask.    */
+	uint8_t ext[8];     /* Extended length. */
+	uint64_t i;         /* Loop index.      */
+
+	/* Decide which mask and msg to use. */
+	if (is_control_frame(fsd->opcode)) {
+		frame_size = &fsd->frame_size;
+		msg_idx = &fsd->msg_idx_ctrl;
+		masks   = fsd->masks_ctrl;
+		msg     = fsd->msg_ctrl;
+	}
+	else {
+		frame_size = &wfd->frame_size;
+		msg_idx = &fsd->msg_idx_data;
+		masks   = fsd->masks_data;
+		msg     = fsd->msg_data;
+	}
+
+	/* Decode masks and length for 16-bit messages. */
+	if (fsd->frame_length == 126)
+	{
+		if (next_bytes(wfd, ext, 2) < 0)
+			return (-1);
+		fsd->frame_length = ((uint64_t)ext[0] << 8) | ext[1];
+	}
+
+	/* 64-bit messages. */
+	else if (fsd->frame_length == 127)
+	{
+		if (next_bytes(wfd, ext, 8) < 0)
+			return (-1);
+		for (fsd->frame_length = 0, i = 0; i < 8; i++)
+			fsd->frame_length = (fsd->frame_length << 8) | ext[i];
+	}
+
+	*frame_size += fsd->frame_length;
+
+	/*
+	 * Check frame size
+	 *
+	 * We need to limit the amount supported here, since if
+	 * we follow strictly to the RFC, we have to allow 2^64
+	 * bytes. Also keep in mind that this is still true
+	 * for continuation frames.
+	 */
+	if (*frame_size > MAX_FRAME_LENGTH)
+	{
+		DEBUG("Current frame from client %d, exceeds the maximum\n"
+			  "amount of bytes allowed (%" PRId64 "/%d)!",
+			wfd->client->client_sock, *frame_size + fsd->frame_length,
+			MAX_FRAME_LENGTH);
+
+		wfd->error = 1;
+		return (-1);
+	}
+
+	/* Read masks. */
+	if (next_bytes(wfd, masks, 4) < 0)
+		return (-1);
+
+	/*
+	 * Abort if error.
+	 *
+	 * This is tricky: we may have multiples error codes from the
+	 * previous next_bytes() calls, but, since we're only setting
+	 * variables and flags, there is no major issue in setting
+	 * them wrong _if_ we do not use their values, thing that
+	 * we do here.
+	 */
+	if (wfd->error)
+		return (-1);
+
+	/*
+	 * Allocate memory.
+	 *
+	 * The statement below will allocate a new chunk of memory
+	 * if msg is NULL with size total_length. Otherwise, it will
+	 * resize the total memory accordingly with the message index
+	 * and if the current frame is a FIN frame or not, if so,
+	 * increment the size by 1 to accommodate the line ending \0.
+	 */
+	if (fsd->frame_length > 0)
+	{
+		if (!is_control_frame(fsd->opcode))
+		{
+			tmp = realloc(msg, *msg_idx + fsd->frame_length + fsd->is_fin);
+			if (!tmp)
+			{
+				DEBUG("Cannot allocate memory, requested: % " PRId64 "\n",
+					(*msg_idx + fsd->frame_length + fsd->is_fin));
+
+				wfd->error = 1;
+				return (-1);
+			}
+			msg = tmp;
+			fsd->msg_data = msg;
+		}
+
+		/* Copy to the proper location. */
+		if (read_payload(wfd, msg + *msg_idx, fsd->frame_length, masks) < 0)
+			return (-1);
+		*msg_idx += fsd->frame_length;
+	}
+
+	/* If we're inside a FIN frame, lets... */
+	if (fsd->is_fin && *frame_size > 0)
+	{
+		/* Increase memory if our FIN frame is of length 0. */
+		if (!fsd->frame_length && !is_control_frame(fsd->opcode))
+		{
+			tmp = realloc(msg, *msg_idx + 1);
+			if (!tmp)
+			{
+				DEBUG("Cannot allocate memory, requested: %" PRId64 "\n",
+					(*msg_idx + 1));
+
+				wfd->error = 1;
+				return (-1);
+			}
+			msg = tmp;
+			fsd->msg_data = msg;
+		}
+		msg[*msg_idx] = '\0';
+	}
+
+	return (0);
+}
+
+/**
+ * @brief Reads the next frame, whether if a TXT/BIN/CLOSE
+ * of arbitrary size.
+ *
+ * @param wfd Websocket Frame Data.
+ *
+ * @return Returns 0 if success, a negative number otherwise.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int next_complete_frame(struct ws_frame_data *wfd)
+{
+	struct frame_state_data fsd = {0};
+	fsd.msg_data = NULL;
+	fsd.msg_ctrl = wfd->msg_ctrl;
+
+#ifdef VALIDATE_UTF8
+	fsd.utf8_state = UTF8_ACCEPT;
+#endif
+
+	wfd->frame_size =  0;
+	wfd->frame_type = -1;
+	wfd->msg = NULL;
+
+	/* Read until find a FIN or a unsupported frame. */
+	do
+	{
+		fsd.cur_byte = next_byte(wfd);
+		if (fsd.cur_byte == -1)
+			return (-1);
+
+		fsd.is_fin = (fsd.cur_byte & 0xFF) >> WS_FIN_SHIFT;
+		fsd.opcode = (fsd.cur_byte & 0xF);
+
+		/* Check for RSV field. */
+		if (fsd.cur_byte & 0x70)
+		{
+			DEBUG("RSV is set while wsServer do not negotiate extensions!\n");
+			wfd->error = 1;
+			break;
+		}
+
+		/*
+		 * Check if the current opcode makes sense:
+		 * a) If we're inside a cont frame but no previous data frame
+		 *
+		 * b) If we're handling a data-frame and receive another data
+		 *    frame. (it's expected to receive only CONT or control
+		 *    frames).
+		 *
+		 * It is worth to note that in a), we do not need to check
+		 * if the previous frame was FIN or not: if was FIN, an
+		 * on_message event was triggered and this function returned;
+		 * so the only possibility here is a previous non-FIN data
+		 * frame, ;-).
+		 */
+		if ((wfd->frame_type == -1 && fsd.opcode == WS_FR_OP_CONT) ||
+			(wfd->frame_type != -1 && !is_control_frame(fsd.opcode) &&
+				fsd.opcode != WS_FR_OP_CONT))
+		{
+			DEBUG("Unexpected frame was received!, opcode: %d, previous: %d\n",
+				fsd.opcode, wfd->frame_type);
+			wfd->error = 1;
+			break;
+		}
+
+		/* Check if one of the valid opcodes. */
+		if (!is_valid_frame(fsd.opcode))
+		{
+			DEBUG("Unsupported frame opcode: %d\n", fsd.opcode);
+			/* We should consider as error receive an unknown frame. */
+			wfd->frame_type = fsd.opcode;
+			wfd->error = 1;
+			break;
+		}
+
+		/* Check our current state: if CLOSING, we only accept close frames. */
+		if (get_client_state(wfd->client) == WS_STATE_CLOSING &&
+			fsd.opcode != WS_FR_OP_CLSE)
+		{
+			DEBUG("Unexpected frame received, expected CLOSE (%d), "
+				  "received: (%d)",
+				WS_FR_OP_CLSE, fsd.opcode);
+			wfd->error = 1;
+			break;
+		}
+
+		/* Only change frame type if not a CONT frame. */
+		if (fsd.opcode != WS_FR_OP_CONT && !is_control_frame(fsd.opcode))
+			wfd->frame_type = fsd.opcode;
+
+		fsd.mask         = next_byte(wfd);
+		fsd.frame_length = fsd.mask & 0x7F;
+		fsd.frame_size   = 0;
+		fsd.msg_idx_ctrl = 0;
+
+		/*
+		 * We should deny non-FIN control frames or that have
+		 * more than 125 octets.
+		 */
+		if (is_control_frame(fsd.opcode) &&
+			(!fsd.is_fin || fsd.frame_length > 125))
+		{
+			DEBUG("Control frame bigger than 125 octets or not a FIN "
+				  "frame!\n");
+			wfd->error = 1;
+			break;
+		}
+
+		/* Read a single frame, and then handle accordingly. */
+		if (read_single_frame(wfd, &fsd) < 0)
+			break;
+
+		/* Handle each frame
+		 * Obs: If BIN, nothing should be done unless we got
+		 * a FIN-frame.
+		 */
+		switch (fsd.opcode) {
+			/* UTF-8 Validate partial (or not) frame. */
+			case WS_FR_OP_CONT:
+			case WS_FR_OP_TXT: {
+				validate_utf8_txt(wfd, &fsd);
+				break;
+			}
+			/*
+			 * We _may_ send a PING frame if the ws_ping() routine was invoked.
+			 *
+			 * If the content is invalid and/or differs the size, ignore it.
+			 * (maybe unsolicited PONG).
+			 */
+			case WS_FR_OP_PONG: {
+				handle_pong_frame(wfd, &fsd);
+				goto next_it;
+				break;
+			}
+			/* We should answer to a PING frame as soon as possible. */
+			case WS_FR_OP_PING: {
+				if (handle_ping_frame(wfd, &fsd) < 0)
+					goto done;
+				break;
+			}
+			/* We interrupt the loop as soon as we find a CLOSE frame. */
+			case WS_FR_OP_CLSE: {
+				if (handle_close_frame(wfd, &fsd) < 0)
+					goto done;
+				return (0);
+				break;
+			}
+		}
+
+next_it:;
+
+	} while (!fsd.is_fin && !wfd->error);
+
+done:
+	/* Check for error. */
+	if (wfd->error)
+	{
+		free(fsd.msg_data);
+		wfd->msg = NULL;
+		return (-1);
+	}
+
+	wfd->msg = fsd.msg_data;
+	return (0);
+}
+
+/**
+ * @brief Establishes to connection with the client and trigger
+ * events when occurs one.
+ *
+ * @param vclient Client connection.
+ *
+ * @return Returns @p vclient.
+ *
+ * @note This will be run on a different thread.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void *ws_establishconnection(void *vclient)
+{
+	struct ws_frame_data wfd;      /* WebSocket frame data.   */
+	struct ws_connection *client;  /* Client structure.       */
+	int clse_thrd;                 /* Time-out close thread.  */
+
+	client = vclient;
+
+#ifdef __linux__
+	prctl(PR_SET_NAME, "ws-client");
+#endif
+
+	/* Prepare frame data. */
+	memset(&wfd, 0, sizeof(wfd));
+	wfd.client = client;
+
+	/* Do handshake. */
+	if (do_handshake(&wfd) < 0)
+		goto closed;
+
+	/* Read next frame until client disconnects or an error occur. */
+	while (next_complete_frame(&wfd) >= 0)
+	{
+		/* Text/binary event. */
+		if ((wfd.frame_type == WS_FR_OP_TXT ||
+			wfd.frame_type == WS_FR_OP_BIN) && !wfd.error)
+		{
+			client->ws_srv.evs.onmessage(client->client_id, wfd.msg, wfd.frame_size,
+				wfd.frame_type);
+		}
+
+		/* Close event. */
+		else if (wfd.frame_type == WS_FR_OP_CLSE && !wfd.error)
+		{
+			/*
+			 * We only send a CLOSE frame once, if we're already
+			 * in CLOSING state, there is no need to send.
+			 */
+			if (get_client_state(client) != WS_STATE_CLOSING)
+			{
+				set_client_state(client, WS_STATE_CLOSING);
+
+				/* We only send a close frameSend close frame */
+				do_close(&wfd, -1);
+			}
+
+			free(wfd.msg);
+			break;
+		}
+
+		free(wfd.msg);
+	}
+
+	/*
+	 * on_close events always occur, whether for client closure
+	 * or server closure, as the server is expected to
+	 * always know when the client disconnects.
+	 */
+	client->ws_srv.evs.onclose(client->client_id);
+
+closed:
+	clse_thrd = client->close_thrd;
+
+	/* Wait for timeout thread if necessary. */
+	if (clse_thrd)
+	{
+		pthread_cond_signal(&client->cnd_state_close);
+		pthread_join(client->thrd_tout, NULL);
+	}
+
+	/* Close connectin properly. */
+	if (get_client_state(client) != WS_STATE_CLOSED) {
+		DEBUG("Closing: normal close\n");
+		close_client(client, 1);
 	}
-	return (0);
+
+	return (vclient);
 }
 
 /**
- * @brief Read a chunk of bytes and return the next byte
- * belonging to the frame.
- *
- * @param wfd Websocket Frame Data.
+ * @brief Records the server @p ws_srv so that ws_adopt() can hand
+ * connections over to it.
  *
- * @return Returns the byte read, or -1 if error.
+ * @param ws_srv  Server parameters.
+ * @param evls    Event loop workers, NULL in thread per client mode.
+ * @param workers Number of workers in @p evls.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static inline int next_byte(struct ws_frame_data *wfd)
+static void add_listener(const struct ws_server *ws_srv,
+	struct ws_evl **evls, int workers)
 {
-	ssize_t n;
+	struct ws_listener *l; /* New entry. */
 
-	/* If empty or full. */
-	if (wfd->cur_pos == 0 || wfd->cur_pos == wfd->amt_read)
+	pthread_mutex_lock(&mutex);
+	if (num_listeners < WS_MAX_LISTENERS)
 	{
-		if ((n = RECV(wfd->client, wfd->frm, sizeof(wfd->frm))) <= 0)
-		{
-			wfd->error = 1;
-			DEBUG("An error has occurred while trying to read next byte\n");
-			return (-1);
-		}
-		wfd->amt_read = (size_t)n;
-		wfd->cur_pos = 0;
+		l = &listeners[num_listeners];
+		memcpy(&l->ws_srv, ws_srv, sizeof(*ws_srv));
+		l->evls    = evls;
+		l->workers = workers;
+		num_listeners++;
 	}
-	return (wfd->frm[wfd->cur_pos++]);
+	pthread_mutex_unlock(&mutex);
 }
 
 /**
- * @brief Skips @p frame_size bytes of the current frame.
+ * Accept parameters.
+ */
+struct ws_accept_params
+{
+	int sock;
+	struct ws_server ws_srv;
+};
+
+/**
+ * @brief Starts the thread of the connected socket @p new_sock,
+ * closing it if the client table is full.
  *
- * @param wfd Websocket Frame Data.
- * @param frame_size Amount of bytes to be skipped.
+ * @param ws_srv   Server parameters.
+ * @param new_sock Client socket.
  *
- * @return Returns 0 if success, a negative number
- * otherwise.
+ * @return Returns 0 if success, -1 otherwise.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int skip_frame(struct ws_frame_data *wfd, uint64_t frame_size)
+static int thread_add_client(const struct ws_server *ws_srv, int new_sock)
 {
-	uint64_t i;
-	for (i = 0; i < frame_size; i++)
+	pthread_t client_thread;    /* Client thread.         */
+	struct timeval time;        /* Client socket timeout. */
+	struct ws_connection *cli;  /* New client.            */
+
+#ifndef _WIN32
+	/* Adopted sockets may come from a non-blocking server. */
+	fcntl(new_sock, F_SETFL, fcntl(new_sock, F_GETFL) & ~O_NONBLOCK);
+#endif
+
+	if (timeout)
 	{
-		if (next_byte(wfd) == -1)
-		{
-			wfd->error = 1;
-			return (-1);
-		}
+		time.tv_sec = timeout / 1000;
+		time.tv_usec = (timeout % 1000) * 1000;
+
+		/*
+		 * Socket timeout
+		 * This feature seems to be supported on Linux, Windows,
+		 * macOS and FreeBSD.
+		 *
+		 * See:
+		 *   https://linux.die.net/man/3/setsockopt
+		 */
+		setsockopt(new_sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&time,
+			sizeof(struct timeval));
+	}
+
+	/* Adds client socket to socks list. */
+	pthread_mutex_lock(&mutex);
+	cli = alloc_client(MAX_CLIENTS);
+	if (cli && init_client(cli, new_sock, ws_srv) < 0)
+		cli = NULL;
+	if (cli)
+		set_client_address(cli);
+	pthread_mutex_unlock(&mutex);
+
+	/* Client socket added to socks list ? */
+	if (!cli)
+	{
+		close_socket(new_sock);
+		return (-1);
 	}
+
+	if (pthread_create(&client_thread, NULL, ws_establishconnection, cli))
+		panic("Could not create the client thread!");
+
+	pthread_detach(client_thread);
 	return (0);
 }
 
 /**
- * Frame state data
+ * @brief Main loop that keeps accepting new connections.
  *
- * This structure holds the current data for handling the
- * received frames.
- */
-struct frame_state_data
-{
-	unsigned char *msg_data; /* Data frame.                */
-	unsigned char *msg_ctrl; /* Control frame.             */
-	uint8_t masks_data[4];   /* Masks data frame array.    */
-	uint8_t masks_ctrl[4];   /* Masks control frame array. */
-	uint64_t msg_idx_data;   /* Current msg index.         */
-	uint64_t msg_idx_ctrl;   /* Current msg index.         */
-	uint64_t frame_length;   /* Frame length.              */
-	uint64_t frame_size;     /* Current frame size.        */
-#ifdef VALIDATE_UTF8
-	uint32_t utf8_state;     /* Current UTF-8 state.       */
-#endif
-	int32_t pong_id;         /* Current PONG id.           */
-	uint8_t opcode;          /* Frame opcode.              */
-	uint8_t is_fin;          /* Is FIN frame flag.         */
-	uint8_t mask;            /* Mask.                      */
-	int cur_byte;            /* Current frame byte.        */
-};
-
-/**
- * @brief Validates TXT frames if UTF8 validation is enabled.
- * If the content is not valid, the connection is aborted.
+ * @param data Server socket.
  *
- * @param wfd WebSocket frame data.
- * @param fsd Frame state data.
+ * @return Returns @p data.
  *
- * @return Always 0.
+ * @note This may be run on a different thread.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int validate_utf8_txt(struct ws_frame_data *wfd,
-	struct frame_state_data *fsd)
+static void *ws_accept(void *data)
 {
-#ifdef VALIDATE_UTF8
-	/* UTF-8 Validate partial (or not) frame. */
-	if (wfd->frame_type != WS_FR_OP_TXT)
-		return (0);
+	struct ws_accept_params *ws_prm; /* wsServer parameters. */
+	struct sockaddr_storage sa; /* Client.                */
+	socklen_t salen;            /* Length of sockaddr.    */
+	int new_sock;               /* New opened connection. */
+	int sock;                   /* Server sock.           */
 
-	if (fsd->is_fin)
+	ws_prm = data;
+	sock   = ws_prm->sock;
+	salen  = sizeof(sa);
+
+#ifdef __linux__
+	prctl(PR_SET_NAME, "ws-accept");
+#endif
+
+	while (1)
 	{
-		if (is_utf8_len_state(
-			fsd->msg_data + (fsd->msg_idx_data - fsd->frame_length),
-			fsd->frame_length, fsd->utf8_state) != UTF8_ACCEPT)
-		{
-			DEBUG("Dropping invalid complete message!\n");
-			wfd->error = 1;
-			do_close(wfd, WS_CLSE_INVUTF8);
-		}
+		/* Accept. */
+		new_sock = accept(sock, (struct sockaddr *)&sa, &salen);
+		if (new_sock < 0)
+			panic("Error on accepting connections..");
 
-		return (0);
+		thread_add_client(&ws_prm->ws_srv, new_sock);
 	}
 
-	/* Check current state for a CONT or initial TXT frame. */
-	fsd->utf8_state =
-		is_utf8_len_state(fsd->msg_data +
-			(fsd->msg_idx_data - fsd->frame_length),
-			fsd->frame_length, fsd->utf8_state);
+	free(data);
+	return (data);
+}
 
-	/* We can be in any state, except reject. */
-	if (fsd->utf8_state == UTF8_REJECT)
-	{
-		DEBUG("Dropping invalid cont/initial frame!\n");
-		wfd->error = 1;
-		do_close(wfd, WS_CLSE_INVUTF8);
-	}
+#ifdef WS_HAVE_EPOLL
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE 0
 #endif
-	return (0);
-}
 
 /**
- * @brief Handle PONG frames in response to our PING
- * (or not, unsolicited is possible too).
- *
- * @param wfd WebSocket frame data.
- * @param fsd Frame state data.
+ * @brief Events handled per epoll_wait() call.
+ */
+#define WS_EVL_EVENTS 64
+
+/**
+ * @brief Close timeout scan period, in milliseconds.
+ */
+#define WS_EVL_TICK_MS 100
+
+/**
+ * @brief Bytes read per recv() call in event loop mode.
+ */
+#define WS_EVL_RECV (16*1024)
+
+/**
+ * @brief Receive buffer size kept for an idle client, larger ones
+ * are released once drained.
+ */
+#define WS_EVL_RX_KEEP (64*1024)
+
+/**
+ * @brief Releases an event loop client, triggering the close event
+ * if the connection was open.
  *
- * @return Always 0.
+ * @param client Client connection.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int handle_pong_frame(struct ws_frame_data *wfd,
-	struct frame_state_data *fsd)
+static void evl_drop(struct ws_connection *client)
 {
-	fsd->is_fin = 0;
+	int state;
 
-	/* If there is no content and/or differs the size, ignore it. */
-	if (fsd->frame_size != sizeof(wfd->client->last_pong_id))
-		return (0);
+	state = get_client_state(client);
+	epoll_ctl(client->evl->epfd, EPOLL_CTL_DEL, client->client_sock, NULL);
 
 	/*
-	 * Our PONG id should be positive and smaller than our
-	 * current PING id. If not, ignore.
+	 * on_close events always occur, whether for client closure
+	 * or server closure, as the server is expected to
+	 * always know when the client disconnects.
 	 */
-	/* clang-format off */
-	pthread_mutex_lock(&wfd->client->mtx_ping);
-		fsd->pong_id = pong_msg_to_int32(fsd->msg_ctrl);
-		if (fsd->pong_id < 0 || fsd->pong_id > wfd->client->current_ping_id)
-		{
-			pthread_mutex_unlock(&wfd->client->mtx_ping);
-			return (0);
-		}
-		wfd->client->last_pong_id = fsd->pong_id;
-	pthread_mutex_unlock(&wfd->client->mtx_ping);
-	/* clang-format on */
+	if (state == WS_STATE_OPEN || state == WS_STATE_CLOSING)
+		client->ws_srv.evs.onclose(client->client_id);
 
-	return (0);
+	/* Last chance for a pending close frame. */
+	pthread_mutex_lock(&client->mtx_snd);
+	queue_flush(client);
+	pthread_mutex_unlock(&client->mtx_snd);
+
+	DEBUG("Closing: event loop client %d\n", client->client_sock);
+	release_client(client, 1);
 }
 
 /**
- * @brief Handle PING frames sending a PONG response.
+ * @brief Writes the pending queue of an event loop client,
+ * disarming EPOLLOUT once it is empty.
  *
- * @param wfd WebSocket frame data.
- * @param fsd Frame state data.
+ * @param client Client connection.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * @return Returns 0 if success, -1 on a socket error.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int handle_ping_frame(struct ws_frame_data *wfd,
-	struct frame_state_data *fsd)
+static int evl_flush(struct ws_connection *client)
 {
-	if (do_pong(wfd, fsd->frame_size) < 0)
-		return (-1);
+	struct epoll_event ev;
+	int ret;
 
-	/* Quick hack to keep our loop. */
-	fsd->is_fin = 0;
-	return (0);
+	/* clang-format off */
+	pthread_mutex_lock(&client->mtx_snd);
+		ret = queue_flush(client);
+		if (!ret && !client->out_count && client->out_armed)
+		{
+			ev.events   = EPOLLIN;
+			ev.data.u64 = client->client_id;
+			epoll_ctl(client->evl->epfd, EPOLL_CTL_MOD, client->client_sock, &ev);
+			client->out_armed = false;
+		}
+	pthread_mutex_unlock(&client->mtx_snd);
+	/* clang-format on */
+	return (ret);
 }
 
 /**
- * @brief Handle close frames while checking for UTF8
- * in the close reason.
+ * @brief Answers the HTTP upgrade request once it is complete in the
+ * receive buffer of @p client.
  *
- * @param wfd WebSocket frame data.
- * @param fsd Frame state data.
+ * @param client Client connection.
  *
- * @return Returns 0 if success, -1 otherwise.
+ * @return Returns 1 if handshaked, 0 if more bytes are needed and -1
+ * if the request is invalid.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int handle_close_frame(struct ws_frame_data *wfd,
-	struct frame_state_data *fsd)
+static int evl_handshake(struct ws_connection *client)
 {
-#ifdef VALIDATE_UTF8
-	/* If there is a close reason, check if it is UTF-8 valid. */
-	if (fsd->frame_size > 2 &&
-		!is_utf8_len(fsd->msg_ctrl + 2, fsd->frame_size - 2))
+	char *response; /* Handshake response message. */
+	unsigned char c; /* Byte after the request.    */
+	size_t hlen;    /* Request length.             */
+	char *p;        /* Last request line pointer.  */
+	int ret;
+
+	client->rx[client->rx_len] = '\0';
+	p = strstr((const char *)client->rx, "\r\n\r\n");
+	if (p == NULL)
 	{
-		DEBUG("Invalid close frame payload reason! (not UTF-8)\n");
-		wfd->error = 1;
+		if (client->rx_len >= MESSAGE_LENGTH - 1)
+		{
+			DEBUG("An empty line with \\r\\n was expected!\n");
+			return (-1);
+		}
+		return (0);
+	}
+
+	/* Frames may follow the request, keep them out of the parser. */
+	hlen = (size_t)((ptrdiff_t)(p - (char *)client->rx)) + 4;
+	c = client->rx[hlen];
+	client->rx[hlen] = '\0';
+	set_client_path(client, (const char *)client->rx);
+	ret = get_handshake_response((char *)client->rx, &response);
+	client->rx[hlen] = c;
+
+	if (ret < 0)
+	{
+		DEBUG("Cannot get handshake response\n");
 		return (-1);
 	}
-#endif
 
-	/*
-	 * Since we're aborting, we can scratch the 'data'-related
-	 * vars here.
-	 */
-	wfd->frame_size = fsd->frame_size;
-	wfd->frame_type = WS_FR_OP_CLSE;
-	free(fsd->msg_data);
-	return (0);
+	if (SEND(client, response, strlen(response)) < 0)
+	{
+		free(response);
+		DEBUG("As error has occurred while handshaking!\n");
+		return (-1);
+	}
+	free(response);
+
+	client->rx_len -= hlen;
+	memmove(client->rx, client->rx + hlen, client->rx_len);
+
+	set_client_state(client, WS_STATE_OPEN);
+	client->ws_srv.evs.onopen(client->client_id);
+	return (1);
 }
 
 /**
- * @brief Reads the current frame isolating data from control frames.
- * The parameters are changed in order to reflect the current state.
+ * @brief Handles a data frame (TXT, BIN or CONT) whose payload is
+ * already unmasked, triggering the message event once complete.
  *
- * @param wfd Websocket Frame Data.
- * @param fsd Frame state data.
+ * Unfragmented messages are delivered straight from the receive
+ * buffer, only fragmented ones are assembled in a separate buffer.
  *
- * @return Returns 0 if success, a negative number otherwise.
+ * @param client  Client connection.
+ * @param opcode  Frame opcode.
+ * @param fin     FIN bit.
+ * @param payload Frame payload, followed by at least one writable byte.
+ * @param len     Payload length.
+ *
+ * @return Returns 0 if success, -1 otherwise.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int read_single_frame(struct ws_frame_data *wfd,
-	struct frame_state_data *fsd)
+static int evl_data_frame(struct ws_connection *client, int opcode, int fin,
+	unsigned char *payload, uint64_t len)
 {
-	uint64_t *frame_size; /* Curr frame size. */
-	unsigned char *tmp; /* Tmp message.     */
-	unsigned char *msg; /* Current message. */
-	uint64_t *msg_idx;  /* Message index.   */
-	uint8_t *masks;     /* Current mask.    */
-	int cur_byte;       /* Curr byte read.  */
-	uint64_t i;         /* Loop index.      */
+	unsigned char *tmp;
+	unsigned char c;
 
-	/* Decide which mask and msg to use. */
-	if (is_control_frame(fsd->opcode)) {
-		frame_size = &fsd->frame_size;
-		msg_idx = &fsd->msg_idx_ctrl;
-		masks   = fsd->masks_ctrl;
-		msg     = fsd->msg_ctrl;
-	}
-	else {
-		frame_size = &wfd->frame_size;
-		msg_idx = &fsd->msg_idx_data;
-		masks   = fsd->masks_data;
-		msg     = fsd->msg_data;
+	if (opcode != WS_FR_OP_CONT)
+	{
+		client->frag_type = opcode;
+		client->frag_utf8 = UTF8_ACCEPT;
 	}
 
-	/* Decode masks and length for 16-bit messages. */
-	if (fsd->frame_length == 126)
-		fsd->frame_length = (((uint64_t)next_byte(wfd)) << 8) | next_byte(wfd);
-
-	/* 64-bit messages. */
-	else if (fsd->frame_length == 127)
+#ifdef VALIDATE_UTF8
+	/* UTF-8 Validate partial (or not) frame. */
+	if (client->frag_type == WS_FR_OP_TXT)
 	{
-		fsd->frame_length =
-			(((uint64_t)next_byte(wfd)) << 56) | /* frame[2]. */
-			(((uint64_t)next_byte(wfd)) << 48) | /* frame[3]. */
-			(((uint64_t)next_byte(wfd)) << 40) |
-			(((uint64_t)next_byte(wfd)) << 32) |
-			(((uint64_t)next_byte(wfd)) << 24) |
-			(((uint64_t)next_byte(wfd)) << 16) |
-			(((uint64_t)next_byte(wfd)) << 8)  |
-			(((uint64_t)next_byte(wfd))); /* frame[9]. */
+		client->frag_utf8 =
+			is_utf8_len_state(payload, len, client->frag_utf8);
+
+		if (client->frag_utf8 == UTF8_REJECT ||
+			(fin && client->frag_utf8 != UTF8_ACCEPT))
+		{
+			DEBUG("Dropping invalid cont/initial frame!\n");
+			send_close(client, NULL, 0, WS_CLSE_INVUTF8);
+			return (-1);
+		}
 	}
+#endif
 
-	*frame_size += fsd->frame_length;
+	/* Whole message in a single frame, no copy. */
+	if (fin && opcode != WS_FR_OP_CONT)
+	{
+		c = payload[len];
+		payload[len] = '\0';
+		client->ws_srv.evs.onmessage(client->client_id, payload, len,
+			opcode);
+		payload[len] = c;
+		client->frag_type = -1;
+		return (0);
+	}
 
-	/*
-	 * Check frame size
-	 *
-	 * We need to limit the amount supported here, since if
-	 * we follow strictly to the RFC, we have to allow 2^64
-	 * bytes. Also keep in mind that this is still true
-	 * for continuation frames.
-	 */
-	if (*frame_size > MAX_FRAME_LENGTH)
+	if (client->frag_len + len > MAX_FRAME_LENGTH)
 	{
 		DEBUG("Current frame from client %d, exceeds the maximum\n"
 			  "amount of bytes allowed (%" PRId64 "/%d)!",
-			wfd->client->client_sock, *frame_size + fsd->frame_length,
-			MAX_FRAME_LENGTH);
-
-		wfd->error = 1;
+			client->client_sock, client->frag_len + len, MAX_FRAME_LENGTH);
 		return (-1);
 	}
 
-	/* Read masks. */
-	masks[0] = next_byte(wfd);
-	masks[1] = next_byte(wfd);
-	masks[2] = next_byte(wfd);
-	masks[3] = next_byte(wfd);
-
-	/*
-	 * Abort if error.
-	 *
-	 * This is tricky: we may have multiples error codes from the
-	 * previous next_bytes() calls, but, since we're only setting
-	 * variables and flags, there is no major issue in setting
-	 * them wrong _if_ we do not use their values, thing that
-	 * we do here.
-	 */
-	if (wfd->error)
-		return (-1);
-
-	/*
-	 * Allocate memory.
-	 *
-	 * The statement below will allocate a new chunk of memory
-	 * if msg is NULL with size total_length. Otherwise, it will
-	 * resize the total memory accordingly with the message index
-	 * and if the current frame is a FIN frame or not, if so,
-	 * increment the size by 1 to accommodate the line ending \0.
-	 */
-	if (fsd->frame_length > 0)
+	tmp = realloc(client->frag, client->frag_len + len + 1);
+	if (!tmp)
 	{
-		if (!is_control_frame(fsd->opcode))
-		{
-			tmp = realloc(msg, *msg_idx + fsd->frame_length + fsd->is_fin);
-			if (!tmp)
-			{
-				DEBUG("Cannot allocate memory, requested: % " PRId64 "\n",
-					(*msg_idx + fsd->frame_length + fsd->is_fin));
-
-				wfd->error = 1;
-				return (-1);
-			}
-			msg = tmp;
-			fsd->msg_data = msg;
-		}
-
-		/* Copy to the proper location. */
-		for (i = 0; i < fsd->frame_length; i++, (*msg_idx)++)
-		{
-			/* We were able to read? .*/
-			cur_byte = next_byte(wfd);
-			if (cur_byte == -1)
-				return (-1);
-
-			msg[*msg_idx] = cur_byte ^ masks[i % 4];
-		}
+		DEBUG("Cannot allocate memory, requested: %" PRId64 "\n",
+			(client->frag_len + len + 1));
+		return (-1);
 	}
+	client->frag = tmp;
+	memcpy(client->frag + client->frag_len, payload, len);
+	client->frag_len += len;
 
-	/* If we're inside a FIN frame, lets... */
-	if (fsd->is_fin && *frame_size > 0)
-	{
-		/* Increase memory if our FIN frame is of length 0. */
-		if (!fsd->frame_length && !is_control_frame(fsd->opcode))
-		{
-			tmp = realloc(msg, *msg_idx + 1);
-			if (!tmp)
-			{
-				DEBUG("Cannot allocate memory, requested: %" PRId64 "\n",
-					(*msg_idx + 1));
+	if (!fin)
+		return (0);
 
-				wfd->error = 1;
-				return (-1);
-			}
-			msg = tmp;
-			fsd->msg_data = msg;
-		}
-		msg[*msg_idx] = '\0';
-	}
+	client->frag[client->frag_len] = '\0';
+	client->ws_srv.evs.onmessage(client->client_id, client->frag,
+		client->frag_len, client->frag_type);
 
+	free(client->frag);
+	client->frag      = NULL;
+	client->frag_len  = 0;
+	client->frag_type = -1;
 	return (0);
 }
 
 /**
- * @brief Reads the next frame, whether if a TXT/BIN/CLOSE
- * of arbitrary size.
+ * @brief Parses every complete frame in the receive buffer of
+ * @p client, leaving a trailing partial frame for the next read.
  *
- * @param wfd Websocket Frame Data.
+ * Applies the same checks as @ref next_complete_frame.
  *
- * @return Returns 0 if success, a negative number otherwise.
+ * @param client Client connection.
+ *
+ * @return Returns 0 if success, -1 if the connection must be closed.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static int next_complete_frame(struct ws_frame_data *wfd)
+static int evl_parse(struct ws_connection *client)
 {
-	struct frame_state_data fsd = {0};
-	fsd.msg_data = NULL;
-	fsd.msg_ctrl = wfd->msg_ctrl;
-
-#ifdef VALIDATE_UTF8
-	fsd.utf8_state = UTF8_ACCEPT;
-#endif
-
-	wfd->frame_size =  0;
-	wfd->frame_type = -1;
-	wfd->msg = NULL;
+	unsigned char *frame;   /* Current frame.        */
+	unsigned char *payload; /* Current payload.      */
+	uint8_t *masks;         /* Frame masks.          */
+	uint64_t len;           /* Payload length.       */
+	size_t avail;           /* Unparsed bytes.       */
+	size_t hlen;            /* Header length.        */
+	size_t pos;             /* Parse position.       */
+	int32_t pong_id;        /* Received PONG id.     */
+	int opcode;             /* Frame opcode.         */
+	int is_fin;             /* FIN bit.              */
+	int ret;                /* Return value.         */
+	uint64_t i;             /* Loop index.           */
+
+	pos = 0;
+	ret = 0;
 
-	/* Read until find a FIN or a unsupported frame. */
-	do
+	while (client->rx_len - pos >= 2)
 	{
-		fsd.cur_byte = next_byte(wfd);
-		if (fsd.cur_byte == -1)
-			return (-1);
-
-		fsd.is_fin = (fsd.cur_byte & 0xFF) >> WS_FIN_SHIFT;
-		fsd.opcode = (fsd.cur_byte & 0xF);
+		frame  = client->rx + pos;
+		avail  = client->rx_len - pos;
+		is_fin = (frame[0] & 0xFF) >> WS_FIN_SHIFT;
+		opcode = (frame[0] & 0xF);
 
 		/* Check for RSV field. */
-		if (fsd.cur_byte & 0x70)
+		if (frame[0] & 0x70)
 		{
 			DEBUG("RSV is set while wsServer do not negotiate extensions!\n");
-			wfd->error = 1;
+			ret = -1;
 			break;
 		}
 
-		/*
-		 * Check if the current opcode makes sense:
-		 * a) If we're inside a cont frame but no previous data frame
-		 *
-		 * b) If we're handling a data-frame and receive another data
-		 *    frame. (it's expected to receive only CONT or control
-		 *    frames).
-		 *
-		 * It is worth to note that in a), we do not need to check
-		 * if the previous frame was FIN or not: if was FIN, an
-		 * on_message event was triggered and this function returned;
-		 * so the only possibility here is a previous non-FIN data
-		 * frame, ;-).
-		 */
-		if ((wfd->frame_type == -1 && fsd.opcode == WS_FR_OP_CONT) ||
-			(wfd->frame_type != -1 && !is_control_frame(fsd.opcode) &&
-				fsd.opcode != WS_FR_OP_CONT))
+		/* Check if the current opcode makes sense. */
+		if ((client->frag_type == -1 && opcode == WS_FR_OP_CONT) ||
+			(client->frag_type != -1 && !is_control_frame(opcode) &&
+				opcode != WS_FR_OP_CONT))
 		{
 			DEBUG("Unexpected frame was received!, opcode: %d, previous: %d\n",
-				fsd.opcode, wfd->frame_type);
-			wfd->error = 1;
+				opcode, client->frag_type);
+			ret = -1;
 			break;
 		}
 
 		/* Check if one of the valid opcodes. */
-		if (!is_valid_frame(fsd.opcode))
+		if (!is_valid_frame(opcode))
 		{
-			DEBUG("Unsupported frame opcode: %d\n", fsd.opcode);
-			/* We should consider as error receive an unknown frame. */
-			wfd->frame_type = fsd.opcode;
-			wfd->error = 1;
+			DEBUG("Unsupported frame opcode: %d\n", opcode);
+			ret = -1;
 			break;
 		}
 
 		/* Check our current state: if CLOSING, we only accept close frames. */
-		if (get_client_state(wfd->client) == WS_STATE_CLOSING &&
-			fsd.opcode != WS_FR_OP_CLSE)
+		if (get_client_state(client) == WS_STATE_CLOSING &&
+			opcode != WS_FR_OP_CLSE)
 		{
 			DEBUG("Unexpected frame received, expected CLOSE (%d), "
 				  "received: (%d)",
-				WS_FR_OP_CLSE, fsd.opcode);
-			wfd->error = 1;
+				WS_FR_OP_CLSE, opcode);
+			ret = -1;
 			break;
 		}
 
-		/* Only change frame type if not a CONT frame. */
-		if (fsd.opcode != WS_FR_OP_CONT && !is_control_frame(fsd.opcode))
-			wfd->frame_type = fsd.opcode;
-
-		fsd.mask         = next_byte(wfd);
-		fsd.frame_length = fsd.mask & 0x7F;
-		fsd.frame_size   = 0;
-		fsd.msg_idx_ctrl = 0;
+		len  = frame[1] & 0x7F;
+		hlen = 2 + 4;
 
 		/*
 		 * We should deny non-FIN control frames or that have
 		 * more than 125 octets.
 		 */
-		if (is_control_frame(fsd.opcode) &&
-			(!fsd.is_fin || fsd.frame_length > 125))
+		if (is_control_frame(opcode) && (!is_fin || len > 125))
 		{
 			DEBUG("Control frame bigger than 125 octets or not a FIN "
 				  "frame!\n");
-			wfd->error = 1;
+			ret = -1;
 			break;
 		}
 
-		/* Read a single frame, and then handle accordingly. */
-		if (read_single_frame(wfd, &fsd) < 0)
+		if (len == 126)
+			hlen += 2;
+		else if (len == 127)
+			hlen += 8;
+
+		if (avail < hlen)
 			break;
 
-		/* Handle each frame
-		 * Obs: If BIN, nothing should be done unless we got
-		 * a FIN-frame.
-		 */
-		switch (fsd.opcode) {
-			/* UTF-8 Validate partial (or not) frame. */
-			case WS_FR_OP_CONT:
-			case WS_FR_OP_TXT: {
-				validate_utf8_txt(wfd, &fsd);
-				break;
-			}
+		/* Decode 16-bit and 64-bit lengths. */
+		if (len == 126)
+			len = ((uint64_t)frame[2] << 8) | frame[3];
+		else if (len == 127)
+		{
+			for (len = 0, i = 2; i < 10; i++)
+				len = (len << 8) | frame[i];
+		}
+
+		if (len > MAX_FRAME_LENGTH)
+		{
+			DEBUG("Current frame from client %d, exceeds the maximum\n"
+				  "amount of bytes allowed (%" PRId64 "/%d)!",
+				client->client_sock, len, MAX_FRAME_LENGTH);
+			ret = -1;
+			break;
+		}
+
+		/* Wait for the whole frame. */
+		if (avail - hlen < len)
+			break;
+
+		masks   = frame + hlen - 4;
+		payload = frame + hlen;
+		pos    += hlen + len;
+
+		ws_unmask(payload, payload, len, masks, 0);
+
+		switch (opcode)
+		{
 			/*
 			 * We _may_ send a PING frame if the ws_ping() routine was invoked.
 			 *
 			 * If the content is invalid and/or differs the size, ignore it.
 			 * (maybe unsolicited PONG).
 			 */
-			case WS_FR_OP_PONG: {
-				handle_pong_frame(wfd, &fsd);
-				goto next_it;
+			case WS_FR_OP_PONG:
+				if (len != sizeof(client->last_pong_id))
+					break;
+
+				/* clang-format off */
+				pthread_mutex_lock(&client->mtx_ping);
+					pong_id = pong_msg_to_int32(payload);
+					if (pong_id >= 0 && pong_id <= client->current_ping_id)
+						client->last_pong_id = pong_id;
+				pthread_mutex_unlock(&client->mtx_ping);
+				/* clang-format on */
 				break;
-			}
+
 			/* We should answer to a PING frame as soon as possible. */
-			case WS_FR_OP_PING: {
-				if (handle_ping_frame(wfd, &fsd) < 0)
-					goto done;
+			case WS_FR_OP_PING:
+				if (ws_sendframe_internal(client, (const char *)payload, len,
+						WS_FR_OP_PONG, 0, WS_CHANNEL_ALL) < 0)
+				{
+					DEBUG("An error has occurred while ponging!\n");
+					ret = -1;
+				}
 				break;
-			}
-			/* We interrupt the loop as soon as we find a CLOSE frame. */
-			case WS_FR_OP_CLSE: {
-				if (handle_close_frame(wfd, &fsd) < 0)
-					goto done;
-				return (0);
+
+			/* A CLOSE frame ends the connection. */
+			case WS_FR_OP_CLSE:
+#ifdef VALIDATE_UTF8
+				/* If there is a close reason, check if it is UTF-8 valid. */
+				if (len > 2 && !is_utf8_len(payload + 2, len - 2))
+				{
+					DEBUG("Invalid close frame payload reason! (not UTF-8)\n");
+					ret = -1;
+					break;
+				}
+#endif
+				/*
+				 * We only send a CLOSE frame once, if we're already
+				 * in CLOSING state, there is no need to send.
+				 */
+				if (get_client_state(client) != WS_STATE_CLOSING)
+				{
+					set_client_state(client, WS_STATE_CLOSING);
+					send_close(client, payload, len, -1);
+				}
+				ret = -1;
 				break;
-			}
+
+			default:
+				ret = evl_data_frame(client, opcode, is_fin, payload, len);
+				break;
+		}
+
+		if (ret < 0)
+			break;
+	}
+
+	/* Keep the partial frame for the next read. */
+	client->rx_len -= pos;
+	if (pos && client->rx_len)
+		memmove(client->rx, client->rx + pos, client->rx_len);
+
+	return (ret);
+}
+
+/**
+ * @brief Reads whatever is available from an event loop client and
+ * processes it.
+ *
+ * @param client Client connection.
+ *
+ * @return Returns 0 if success, -1 if the connection must be closed.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int evl_read(struct ws_connection *client)
+{
+	unsigned char *tmp;
+	ssize_t n;
+	size_t room;
+	int ret;
+	int i;
+
+	/* Bounded, so a fast sender does not starve the others. */
+	for (i = 0; i < 4; i++)
+	{
+		/* One spare byte for the in place NUL terminator. */
+		if (client->rx_cap - client->rx_len < WS_EVL_RECV + 1)
+		{
+			tmp = realloc(client->rx, client->rx_len + WS_EVL_RECV + 1);
+			if (!tmp)
+				return (-1);
+			client->rx     = tmp;
+			client->rx_cap = client->rx_len + WS_EVL_RECV + 1;
 		}
 
-next_it:;
+		room = client->rx_cap - client->rx_len - 1;
+		n = recv(client->client_sock, client->rx + client->rx_len, room, 0);
+		if (n == 0)
+			return (-1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return (-1);
+		}
 
-	} while (!fsd.is_fin && !wfd->error);
+		client->rx_len += n;
+		if ((size_t)n < room)
+			break;
+	}
 
-done:
-	/* Check for error. */
-	if (wfd->error)
+	if (get_client_state(client) == WS_STATE_CONNECTING)
 	{
-		free(fsd.msg_data);
-		wfd->msg = NULL;
-		return (-1);
+		ret = evl_handshake(client);
+		if (ret <= 0)
+			return (ret);
 	}
 
-	wfd->msg = fsd.msg_data;
-	return (0);
+	ret = evl_parse(client);
+
+	if (!client->rx_len && client->rx_cap > WS_EVL_RX_KEEP)
+	{
+		free(client->rx);
+		client->rx     = NULL;
+		client->rx_cap = 0;
+	}
+	return (ret);
 }
 
 /**
- * @brief Establishes to connection with the client and trigger
- * events when occurs one.
+ * @brief Registers the connected socket @p new_sock with the worker
+ * @p evl, closing it if the client table is full.
  *
- * @param vclient Client connection.
- *
- * @return Returns @p vclient.
+ * @param evl      Event loop worker.
+ * @param new_sock Client socket.
  *
- * @note This will be run on a different thread.
+ * @return Returns 0 if success, -1 otherwise.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static void *ws_establishconnection(void *vclient)
+static int evl_add_client(struct ws_evl *evl, int new_sock)
 {
-	struct ws_frame_data wfd;      /* WebSocket frame data.   */
-	struct ws_connection *client;  /* Client structure.       */
-	int clse_thrd;                 /* Time-out close thread.  */
-
-	client = vclient;
-
-	/* Prepare frame data. */
-	memset(&wfd, 0, sizeof(wfd));
-	wfd.client = client;
+	struct ws_connection *cli; /* New client.            */
+	struct epoll_event ev;     /* Client registration.   */
 
-	/* Do handshake. */
-	if (do_handshake(&wfd) < 0)
-		goto closed;
+	fcntl(new_sock, F_SETFL, fcntl(new_sock, F_GETFL) | O_NONBLOCK);
 
-	/* Read next frame until client disconnects or an error occur. */
-	while (next_complete_frame(&wfd) >= 0)
-	{
-		/* Text/binary event. */
-		if ((wfd.frame_type == WS_FR_OP_TXT ||
-			wfd.frame_type == WS_FR_OP_BIN) && !wfd.error)
+	/* clang-format off */
+	pthread_mutex_lock(&mutex);
+		cli = alloc_client(evl->max_clients);
+		if (cli && init_client(cli, new_sock, &evl->ws_srv) < 0)
+			cli = NULL;
+		if (cli)
 		{
-			client->ws_srv.evs.onmessage(client->client_id, wfd.msg, wfd.frame_size,
-				wfd.frame_type);
-		}
+			cli->evl = evl;
+			set_client_address(cli);
 
-		/* Close event. */
-		else if (wfd.frame_type == WS_FR_OP_CLSE && !wfd.error)
-		{
-			/*
-			 * We only send a CLOSE frame once, if we're already
-			 * in CLOSING state, there is no need to send.
-			 */
-			if (get_client_state(client) != WS_STATE_CLOSING)
+			ev.events   = EPOLLIN;
+			ev.data.u64 = cli->client_id;
+			if (epoll_ctl(evl->epfd, EPOLL_CTL_ADD, new_sock, &ev) < 0)
 			{
-				set_client_state(client, WS_STATE_CLOSING);
-
-				/* We only send a close frameSend close frame */
-				do_close(&wfd, -1);
+				release_client(cli, 0);
+				pthread_mutex_unlock(&mutex);
+				return (-1);
 			}
-
-			free(wfd.msg);
-			break;
 		}
+	pthread_mutex_unlock(&mutex);
+	/* clang-format on */
 
-		free(wfd.msg);
+	if (!cli)
+	{
+		DEBUG("Client table full, refusing connection\n");
+		close_socket(new_sock);
+		return (-1);
 	}
+	return (0);
+}
 
-	/*
-	 * on_close events always occur, whether for client closure
-	 * or server closure, as the server is expected to
-	 * always know when the client disconnects.
-	 */
-	client->ws_srv.evs.onclose(client->client_id);
-
-closed:
-	clse_thrd = client->close_thrd;
+/**
+ * @brief Accepts every pending connection on the listening socket
+ * and registers them with the worker @p evl.
+ *
+ * @param evl Event loop worker.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static void evl_accept(struct ws_evl *evl)
+{
+	int new_sock; /* New opened connection. */
 
-	/* Wait for timeout thread if necessary. */
-	if (clse_thrd)
+	while (1)
 	{
-		pthread_cond_signal(&client->cnd_state_close);
-		pthread_join(client->thrd_tout, NULL);
-	}
+		new_sock = accept(evl->sock, NULL, NULL);
+		if (new_sock < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			/* Drained, taken by another worker or out of fds. */
+			break;
+		}
 
-	/* Close connectin properly. */
-	if (get_client_state(client) != WS_STATE_CLOSED) {
-		DEBUG("Closing: normal close\n");
-		close_client(client, 1);
+		evl_add_client(evl, new_sock);
 	}
-
-	return (vclient);
 }
 
 /**
- * Accept parameters.
+ * @brief Shuts down the clients of @p evl that did not answer our
+ * close frame in TIMEOUT_MS, the event loop counterpart of
+ * @ref close_timeout.
+ *
+ * @param evl Event loop worker.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
  */
-struct ws_accept_params
+static void evl_tick(struct ws_evl *evl)
 {
-	int sock;
-	struct ws_server ws_srv;
-};
+	struct ws_connection *cli;
+	struct timespec now;
+	uint32_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if ((now.tv_sec - evl->last_tick.tv_sec) * 1000 +
+		(now.tv_nsec - evl->last_tick.tv_nsec) / 1000000 < WS_EVL_TICK_MS)
+	{
+		return;
+	}
+	evl->last_tick = now;
+
+	/* clang-format off */
+	pthread_mutex_lock(&mutex);
+		for (i = 0; i < client_cap; i++)
+		{
+			cli = client_socks[i];
+			if (!CLIENT_VALID(cli) || cli->evl != evl ||
+				get_client_state(cli) != WS_STATE_CLOSING)
+			{
+				continue;
+			}
+
+			if (now.tv_sec > cli->close_deadline.tv_sec ||
+				(now.tv_sec == cli->close_deadline.tv_sec &&
+				 now.tv_nsec >= cli->close_deadline.tv_nsec))
+			{
+				DEBUG("Timer expired, closing client %d\n", cli->client_sock);
+				shutdown(cli->client_sock, SHUT_RDWR);
+			}
+		}
+	pthread_mutex_unlock(&mutex);
+	/* clang-format on */
+}
 
 /**
- * @brief Main loop that keeps accepting new connections.
- *
- * @param data Server socket.
+ * @brief Event loop worker: accepts, reads, parses and writes for
+ * every client it owns, none of it blocking.
  *
- * @return Returns @p data.
+ * @param data Event loop worker structure.
  *
- * @note This may be run on a different thread.
+ * @return Never returns.
  *
  * @attention This is part of the internal API and is documented just
  * for completeness.
  */
-static void *ws_accept(void *data)
+static void *ws_evl_worker(void *data)
 {
-	struct ws_accept_params *ws_prm; /* wsServer parameters. */
-	struct sockaddr_storage sa; /* Client.                */
-	pthread_t client_thread;    /* Client thread.         */
-	struct timeval time;        /* Client socket timeout. */
-	socklen_t salen;            /* Length of sockaddr.    */
-	int new_sock;               /* New opened connection. */
-	int sock;                   /* Server sock.           */
-	int i;                      /* Loop index.            */
+	struct epoll_event evs[WS_EVL_EVENTS]; /* Ready events. */
+	struct ws_connection *cli;             /* Client.       */
+	struct ws_evl *evl;                    /* Worker.       */
+	int n;
+	int i;
 
-	ws_prm = data;
-	sock   = ws_prm->sock;
-	salen  = sizeof(sa);
+	evl = data;
+	prctl(PR_SET_NAME, "ws-loop");
 
 	while (1)
 	{
-		/* Accept. */
-		new_sock = accept(sock, (struct sockaddr *)&sa, &salen);
-		if (new_sock < 0)
-			panic("Error on accepting connections..");
-
-		if (timeout)
+		n = epoll_wait(evl->epfd, evs, WS_EVL_EVENTS, WS_EVL_TICK_MS);
+		if (n < 0)
 		{
-			time.tv_sec = timeout / 1000;
-			time.tv_usec = (timeout % 1000) * 1000;
-
-			/*
-			 * Socket timeout
-			 * This feature seems to be supported on Linux, Windows,
-			 * macOS and FreeBSD.
-			 *
-			 * See:
-			 *   https://linux.die.net/man/3/setsockopt
-			 */
-			setsockopt(new_sock, SOL_SOCKET, SO_SNDTIMEO, (const char*)&time,
-				sizeof(struct timeval));
+			if (errno != EINTR)
+				panic("Error on waiting for events..");
+			n = 0;
 		}
 
-		/* Adds client socket to socks list. */
-		pthread_mutex_lock(&mutex);
-		for (i = 0; i < MAX_CLIENTS; i++)
+		for (i = 0; i < n; i++)
 		{
-			if (client_socks[i].client_sock == -1)
+			/* Listening socket. */
+			if (evs[i].data.u64 == 0)
 			{
-				memcpy(&client_socks[i].ws_srv, &ws_prm->ws_srv,
-					sizeof(struct ws_server));
-
-				client_socks[i].client_sock  = new_sock;
-				client_socks[i].state        = WS_STATE_CONNECTING;
-				client_socks[i].close_thrd   = false;
-				client_socks[i].last_pong_id = -1;
-				client_socks[i].current_ping_id = -1;
-				client_socks[i].client_id = get_next_cid();
-				set_client_address(&client_socks[i]);
-
-				if (pthread_mutex_init(&client_socks[i].mtx_state, NULL))
-					panic("Error on allocating close mutex");
-				if (pthread_cond_init(&client_socks[i].cnd_state_close, NULL))
-					panic("Error on allocating condition var\n");
-				if (pthread_mutex_init(&client_socks[i].mtx_snd, NULL))
-					panic("Error on allocating send mutex");
-				if (pthread_mutex_init(&client_socks[i].mtx_ping, NULL))
-					panic("Error on allocating ping/pong mutex");
-				break;
+				evl_accept(evl);
+				continue;
 			}
-		}
-		pthread_mutex_unlock(&mutex);
 
-		/* Client socket added to socks list ? */
-		if (i != MAX_CLIENTS)
-		{
-			if (pthread_create(
-					&client_thread, NULL, ws_establishconnection, &client_socks[i]))
-				panic("Could not create the client thread!");
+			cli = get_client_by_cid(evs[i].data.u64);
+			if (!CLIENT_VALID(cli) || cli->evl != evl)
+				continue;
+
+			if ((evs[i].events & EPOLLOUT) && evl_flush(cli) < 0)
+			{
+				evl_drop(cli);
+				continue;
+			}
 
-			pthread_detach(client_thread);
+			if ((evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+				evl_read(cli) < 0)
+			{
+				evl_drop(cli);
+			}
 		}
-		else
-			close_socket(new_sock);
+
+		evl_tick(evl);
 	}
 
-	free(data);
-	return (data);
+	return (NULL);
+}
+
+/**
+ * @brief Starts the event loop workers for the listening socket
+ * @p sock.
+ *
+ * @param ws_srv Web Socket server parameters.
+ * @param sock   Listening socket.
+ *
+ * @return If @p thread_loop != 0, returns 0. Otherwise, never
+ * returns.
+ *
+ * @attention This is part of the internal API and is documented just
+ * for completeness.
+ */
+static int evl_start(struct ws_server *ws_srv, int sock)
+{
+	struct epoll_event ev;  /* Listener registration. */
+	struct ws_evl *evl;     /* Worker.                */
+	pthread_t evl_thread;   /* Worker thread.         */
+	int workers;            /* Worker count.          */
+	int i;
+
+	struct ws_evl **evls;   /* Workers, for ws_adopt(). */
+
+	workers = ws_srv->workers > 0 ? ws_srv->workers : WS_EVL_WORKERS;
+	evls    = calloc(workers, sizeof(*evls));
+	if (!evls)
+		panic("Unable to allocate the event loop, out of memory!\n");
+
+	/* Workers race for new connections, none may block on accept(). */
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+
+	for (i = 0; i < workers; i++)
+	{
+		evl = calloc(1, sizeof(*evl));
+		if (!evl)
+			panic("Unable to allocate the event loop, out of memory!\n");
+
+		memcpy(&evl->ws_srv, ws_srv, sizeof(*ws_srv));
+		evl->sock        = sock;
+		evl->max_clients = ws_srv->max_clients ?
+			ws_srv->max_clients : WS_EVL_MAX_CLIENTS;
+
+		evl->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (evl->epfd < 0)
+			panic("Unable to create the event loop");
+
+		/* Connection ids start at 1, 0 stands for the listener. */
+		ev.events   = EPOLLIN | EPOLLEXCLUSIVE;
+		ev.data.u64 = 0;
+		if (epoll_ctl(evl->epfd, EPOLL_CTL_ADD, sock, &ev) < 0)
+			panic("Unable to watch the listening socket");
+
+		evls[i] = evl;
+		if (i == workers - 1)
+			add_listener(ws_srv, evls, workers);
+
+		/* The last worker takes over the caller if not threaded. */
+		if (i == workers - 1 && !ws_srv->thread_loop)
+			ws_evl_worker(evl);
+
+		if (pthread_create(&evl_thread, NULL, ws_evl_worker, evl))
+			panic("Could not create the event loop thread!");
+		pthread_detach(evl_thread);
+	}
+
+	return (0);
 }
+#endif
 
 /**
  * @brief By using the server parameters provided in @p ws_srv,
@@ -2026,15 +3769,37 @@ int ws_socket(struct ws_server *ws_srv)
 	sock = do_bind_socket(ws_srv);
 
 	/* Listen. */
-	if (listen(sock, MAX_CLIENTS) < 0)
+	if (listen(sock, ws_srv->event_loop ? SOMAXCONN : MAX_CLIENTS) < 0)
 		panic("Unable to listen!\n");
 
 	/* Wait for incoming connections. */
 	printf("Waiting for incoming connections...\n");
-	memset(client_socks, -1, sizeof(client_socks));
+
+	/* Sender thread, shared by every server. */
+	pthread_mutex_lock(&mutex);
+	if (sender_pipe[0] < 0)
+	{
+		pthread_t sender_thread;
+		if (pipe(sender_pipe) < 0)
+			panic("Unable to create the sender pipe");
+		fcntl(sender_pipe[1], F_SETFL, fcntl(sender_pipe[1], F_GETFL) | O_NONBLOCK);
+		if (pthread_create(&sender_thread, NULL, ws_sender, NULL))
+			panic("Could not create the sender thread!");
+		pthread_detach(sender_thread);
+	}
+	pthread_mutex_unlock(&mutex);
+
+#ifdef WS_HAVE_EPOLL
+	if (ws_srv->event_loop)
+	{
+		free(ws_prm);
+		return (evl_start(ws_srv, sock));
+	}
+#endif
 
 	/* Accept connections. */
 	ws_prm->sock = sock;
+	add_listener(ws_srv, NULL, 0);
 
 	if (!ws_srv->thread_loop)
 		ws_accept(ws_prm);
@@ -2048,6 +3813,59 @@ int ws_socket(struct ws_server *ws_srv)
 	return (0);
 }
 
+/**
+ * @brief Hands the connected socket @p fd over to the server
+ * listening on @p port, as if it had accepted it itself.
+ *
+ * The opening handshake must still be unread in @p fd: this lets
+ * another server on a different port (e.g: an HTTP server) peek at
+ * a request and pass WebSocket upgrades along.
+ *
+ * @param port Port of a server started with ws_socket().
+ * @param fd   Connected client socket, owned by wsServer from now on
+ *             and closed on failure.
+ *
+ * @return Returns 0 if success, -1 otherwise.
+ */
+int ws_adopt(uint16_t port, int fd)
+{
+	struct ws_listener *l; /* Target server.  */
+	struct ws_server srv;  /* Server copy.    */
+	int i;
+
+	l = NULL;
+
+	pthread_mutex_lock(&mutex);
+	for (i = 0; i < num_listeners; i++)
+	{
+		if (listeners[i].ws_srv.port == port)
+		{
+			l = &listeners[i];
+			break;
+		}
+	}
+
+	if (!l)
+	{
+		pthread_mutex_unlock(&mutex);
+		close_socket(fd);
+		return (-1);
+	}
+
+#ifdef WS_HAVE_EPOLL
+	if (l->evls)
+	{
+		struct ws_evl *evl = l->evls[l->next++ % l->workers];
+		pthread_mutex_unlock(&mutex);
+		return (evl_add_client(evl, fd));
+	}
+#endif
+	memcpy(&srv, &l->ws_srv, sizeof(srv));
+	pthread_mutex_unlock(&mutex);
+
+	return (thread_add_client(&srv, fd));
+}
+
 #ifdef AFL_FUZZ
 /**
  * @brief WebSocket fuzzy test routine
@@ -2074,28 +3892,18 @@ int ws_file(struct ws_events *evs, const char *file)
 	if (sock < 0)
 		panic("Invalid file\n");
 
-	/* Copy events. */
-	memcpy(&cli_events, evs, sizeof(struct ws_events));
+	/* Set client settings. */
+	struct ws_server srv = {0};
+	struct ws_connection *cli;
+	memcpy(&srv.evs, evs, sizeof(struct ws_events));
 
-	/* Clear client socks list. */
-	memset(client_socks, -1, sizeof(client_socks));
+	pthread_mutex_lock(&mutex);
+	cli = alloc_client(MAX_CLIENTS);
+	if (!cli || init_client(cli, sock, &srv) < 0)
+		panic("Unable to allocate the client");
+	pthread_mutex_unlock(&mutex);
 
-	/* Set client settings. */
-	client_socks[0].client_sock = sock;
-	client_socks[0].state = WS_STATE_CONNECTING;
-	client_socks[0].close_thrd = false;
-
-	/* Initialize mutexes. */
-	if (pthread_mutex_init(&client_socks[0].mtx_state, NULL))
-		panic("Error on allocating close mutex");
-	if (pthread_cond_init(&client_socks[0].cnd_state_close, NULL))
-		panic("Error on allocating condition var\n");
-	if (pthread_mutex_init(&client_socks[0].mtx_snd, NULL))
-		panic("Error on allocating send mutex");
-	if (pthread_mutex_init(&client_socks[0].mtx_ping, NULL))
-		panic("Error on allocating ping/pong mutex");
-
-	ws_establishconnection(&client_socks[0]);
+	ws_establishconnection(cli);
 	return (0);
 }
 #endif
\ No newline at end of file
@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+#include "common.h"
+#include "capture.h"
+#include "viewer.h"
+#include <dirent.h>
+#include <signal.h>
+
+/*
+ * End to end pipeline benchmark. Runs synthetic source -> encoder -> TS mux ->
+ * fan-out in process, attaches N loopback TCP/WebSocket viewers and measures a
+ * fixed window for every viewer count of the sweep. Results go out as JSON.
+ *
+ * CPU is attributed per pipeline stage from the thread names :
+ *   capture     source dequeue and encoder input (capAppRun)
+ *   encoder     encoder output, TS mux and fan-out copy
+ *   net-send    raw TCP per connection senders
+ *   ws-*        WebSocket server threads
+ *   viewers     the simulated clients, not part of the pipeline
+ */
+
+#define BENCH_MAX_STEPS         16
+#define BENCH_MAX_GROUPS        16
+#define BENCH_WARMUP_US         1000000
+#define BENCH_TCP_PORT          16700
+#define BENCH_WS_PORT           16701
+
+typedef enum
+{
+    BENCH_KIND_TCP = 0,
+    BENCH_KIND_WS,
+    BENCH_KIND_MIXED,
+}BenchKind_t;
+
+typedef struct
+{
+    char        name[16];
+    uint64_t    ticks;
+}BenchCpu_t;
+
+typedef struct
+{
+    int64_t     timeUs;
+    uint64_t    frames;
+    uint64_t    aus;
+    uint64_t    tsBytes;
+    BenchCpu_t  cpu[BENCH_MAX_GROUPS];
+    int         numCpu;
+}BenchSnapshot_t;
+
+typedef struct
+{
+    CaptureConfig_t capture;
+    int             seconds;
+    int             steps[BENCH_MAX_STEPS];
+    int             numSteps;
+    BenchKind_t     kind;
+    const char      *output;
+}BenchConfig_t;
+
+static App_t app;
+static volatile bool benchStop;
+
+
+static void benchSignal(int sig)
+{
+    UNUSED_PARAMETER(sig);
+    benchStop = true;
+}
+
+static void *benchPipelineThread(void *args)
+{
+    App_t *a = args;
+    pthread_setname_np(pthread_self(), "capture");
+    capAppRun(a);
+    return NULL;
+}
+
+//Fold every thread's utime + stime into its name group
+static void benchReadCpu(BenchSnapshot_t *snap)
+{
+    DIR *dir = opendir("/proc/self/task");
+    if(dir == NULL)
+    { return; }
+
+    struct dirent *d;
+    while ((d = readdir(dir)) != NULL)
+    {
+        if(d->d_name[0] == '.')
+        { continue; }
+
+        char path[sizeof("/proc/self/task//stat") + sizeof(d->d_name)], line[512];
+        snprintf(path, sizeof(path), "/proc/self/task/%s/stat", d->d_name);
+        FILE *f = fopen(path, "r");
+        if(f == NULL)
+        { continue; }
+        char *ok = fgets(line, sizeof(line), f);
+        fclose(f);
+        if(ok == NULL)
+        { continue; }
+
+        //pid (comm) state ppid ... utime(14) stime(15), comm may hold spaces
+        char *open = strchr(line, '(');
+        char *close = strrchr(line, ')');
+        if(open == NULL || close == NULL)
+        { continue; }
+
+        char name[16] = {0};
+        int len = close - open - 1;
+        memcpy(name, open + 1, len < 15 ? len : 15);
+        if(strncmp(name, "ws-", 3) == 0)
+        { strcpy(name, "websocket"); }
+
+        unsigned long utime = 0, stime = 0;
+        if(sscanf(close + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        { continue; }
+
+        int i;
+        for(i = 0; i < snap->numCpu; i++)
+        {
+            if(strcmp(snap->cpu[i].name, name) == 0)
+            { break; }
+        }
+        if(i == snap->numCpu)
+        {
+            if(snap->numCpu == BENCH_MAX_GROUPS)
+            { continue; }
+            strcpy(snap->cpu[i].name, name);
+            snap->numCpu++;
+        }
+        snap->cpu[i].ticks += utime + stime;
+    }
+    closedir(dir);
+}
+
+static void benchSnapshot(BenchSnapshot_t *snap)
+{
+    memset(snap, 0, sizeof(BenchSnapshot_t));
+    snap->timeUs = viewerTimeUs();
+    snap->frames = __atomic_load_n(&app.framesTotal, __ATOMIC_RELAXED);
+    snap->aus = __atomic_load_n(&app.ausTotal, __ATOMIC_RELAXED);
+    snap->tsBytes = __atomic_load_n(&app.tsBytesTotal, __ATOMIC_RELAXED);
+    benchReadCpu(snap);
+}
+
+static long benchStatusKb(const char *key)
+{
+    char line[256];
+    long value = -1;
+    size_t keyLen = strlen(key);
+
+    FILE *f = fopen("/proc/self/status", "r");
+    if(f == NULL)
+    { return -1; }
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if(strncmp(line, key, keyLen) == 0 && line[keyLen] == ':')
+        {
+            value = strtol(line + keyLen + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+static void benchRunStep(FILE *out, BenchConfig_t *bc, int count, bool first)
+{
+    Viewer_t **viewers = calloc(count, sizeof(Viewer_t *));
+    ViewerPool_t *pool = viewerPoolCreate();
+    OKAY_RETURN(viewers == NULL || pool == NULL, , "failed to allocate %d viewers\n", count);
+
+    int connected = 0;
+    for(int i = 0; i < count && !benchStop; i++)
+    {
+        bool ws = (bc->kind == BENCH_KIND_WS) || (bc->kind == BENCH_KIND_MIXED && (i & 1));
+        ViewerConfig_t vc = {
+            .kind = ws ? VIEWER_WS : VIEWER_TCP,
+            .host = "127.0.0.1",
+            .port = ws ? bc->capture.wsPort : bc->capture.tcpPort,
+        };
+
+        viewers[i] = viewerCreate(&vc);
+        if(viewers[i] != NULL && viewerPoolAdd(pool, viewers[i]) == CSTATUS_SUCCESS)
+        { connected++; }
+    }
+
+    //Let the fan-out pick everybody up before measuring
+    viewerPoolRun(pool, BENCH_WARMUP_US, &benchStop);
+    for(int i = 0; i < count; i++)
+    {
+        if(viewers[i] != NULL)
+        { viewerResetStats(viewers[i]); }
+    }
+
+    BenchSnapshot_t before, after;
+    benchSnapshot(&before);
+    viewerPoolRun(pool, (int64_t)bc->seconds * 1000000, &benchStop);
+    benchSnapshot(&after);
+
+    double elapsed = (after.timeUs - before.timeUs) / 1000000.0;
+    double tick = sysconf(_SC_CLK_TCK);
+
+    //Compact the live viewers for the latency percentiles
+    Viewer_t **live = calloc(count, sizeof(Viewer_t *));
+    int numLive = 0;
+    for(int i = 0; i < count; i++)
+    {
+        if(viewers[i] != NULL)
+        { live[numLive++] = viewers[i]; }
+    }
+
+    uint64_t ccErrors = 0, syncErrors = 0, stalls = 0, closed = 0;
+    for(int i = 0; i < numLive; i++)
+    {
+        ccErrors += live[i]->stats.ccErrors;
+        syncErrors += live[i]->stats.syncErrors;
+        stalls += live[i]->stats.stalls;
+        closed += live[i]->closed;
+    }
+
+    fprintf(out, "%s    {\n", first ? "" : ",\n");
+    fprintf(out, "      \"viewers\": %d,\n      \"connected\": %d,\n      \"closed\": %llu,\n",
+            count, connected, (unsigned long long)closed);
+    fprintf(out, "      \"duration_s\": %.3f,\n", elapsed);
+    fprintf(out, "      \"fps\": %.2f,\n", (after.frames - before.frames) / elapsed);
+    fprintf(out, "      \"encoded_fps\": %.2f,\n", (after.aus - before.aus) / elapsed);
+    fprintf(out, "      \"mux_kbps\": %.1f,\n", (after.tsBytes - before.tsBytes) * 8 / elapsed / 1000);
+
+    fprintf(out, "      \"cpu_percent\": {");
+    for(int i = 0; i < after.numCpu; i++)
+    {
+        uint64_t prev = 0;
+        for(int j = 0; j < before.numCpu; j++)
+        {
+            if(strcmp(before.cpu[j].name, after.cpu[i].name) == 0)
+            { prev = before.cpu[j].ticks; }
+        }
+        uint64_t delta = after.cpu[i].ticks > prev ? after.cpu[i].ticks - prev : 0;
+        fprintf(out, "%s\"%s\": %.1f", i ? ", " : "", after.cpu[i].name, delta / tick / elapsed * 100.0);
+    }
+    fprintf(out, "},\n");
+
+    fprintf(out, "      \"rss_kb\": %ld,\n      \"hwm_kb\": %ld,\n", benchStatusKb("VmRSS"), benchStatusKb("VmHWM"));
+    fprintf(out, "      \"latency_us\": {\"p50\": %lld, \"p99\": %lld, \"max\": %lld},\n",
+            (long long)viewerLatencyPercentile(live, numLive, 50),
+            (long long)viewerLatencyPercentile(live, numLive, 99),
+            (long long)viewerLatencyPercentile(live, numLive, 100));
+    fprintf(out, "      \"cc_errors\": %llu,\n      \"sync_errors\": %llu,\n      \"stalls\": %llu,\n",
+            (unsigned long long)ccErrors, (unsigned long long)syncErrors, (unsigned long long)stalls);
+
+    fprintf(out, "      \"clients\": [");
+    double minKbps = -1, sumKbps = 0;
+    for(int i = 0; i < numLive; i++)
+    {
+        double kbps = live[i]->stats.bytes * 8 / elapsed / 1000;
+        sumKbps += kbps;
+        if(minKbps < 0 || kbps < minKbps)
+        { minKbps = kbps; }
+        fprintf(out, "%s\n        {\"kind\": \"%s\", \"goodput_kbps\": %.1f, \"frames\": %llu, \"cc_errors\": %llu, \"stalls\": %llu}",
+                i ? "," : "", live[i]->config.kind == VIEWER_WS ? "ws" : "tcp", kbps,
+                (unsigned long long)live[i]->stats.frames, (unsigned long long)live[i]->stats.ccErrors,
+                (unsigned long long)live[i]->stats.stalls);
+    }
+    fprintf(out, "\n      ]\n    }");
+    fflush(out);
+
+    fprintf(stderr, "capture_bench : %3d viewers (%d connected), %.1f fps, goodput min %.0f avg %.0f kbps, p99 %lld us\n",
+            count, connected, (after.frames - before.frames) / elapsed, minKbps,
+            numLive ? sumKbps / numLive : 0, (long long)viewerLatencyPercentile(live, numLive, 99));
+
+    viewerPoolDestroy(pool);
+    for(int i = 0; i < count; i++)
+    { viewerDestroy(viewers[i]); }
+    free(live);
+    free(viewers);
+
+    //Give the server a moment to reap the closed connections
+    usleep(500000);
+}
+
+static void benchUsage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+        "  -d <seconds>           measurement window per step (default 10)\n"
+        "  -n <list>              viewer counts to sweep (default 1,8,32,128)\n"
+        "  -k <tcp|ws|mixed>      viewer transport (default mixed)\n"
+        "  -e <mpp|mock>          encoder backend (default mock)\n"
+        "  -m <file>              Annex-B stream for the mock encoder\n"
+        "  -b <bps>               encoder bitrate (default 4000000)\n"
+        "  -W <width> -H <height> -r <fps> -f <nv24|nv12>\n"
+        "  -o <file>              JSON output, - for stdout (default capture_bench.json)\n",
+        prog);
+}
+
+static CStatus_t benchParseArgs(BenchConfig_t *bc, int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:k:e:m:b:W:H:r:f:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            bc->seconds = atoi(optarg);
+            break;
+        case 'n':
+        {
+            bc->numSteps = 0;
+            for(char *tok = strtok(optarg, ","); tok != NULL && bc->numSteps < BENCH_MAX_STEPS; tok = strtok(NULL, ","))
+            { bc->steps[bc->numSteps++] = atoi(tok); }
+            break;
+        }
+        case 'k':
+            if(strcmp(optarg, "tcp") == 0)
+            { bc->kind = BENCH_KIND_TCP; }
+            else if(strcmp(optarg, "ws") == 0)
+            { bc->kind = BENCH_KIND_WS; }
+            else if(strcmp(optarg, "mixed") == 0)
+            { bc->kind = BENCH_KIND_MIXED; }
+            else
+            { OKAY_RETURN(true, CSTATUS_BAD_PARAM, "unknown viewer kind %s\n", optarg); }
+            break;
+        case 'e':
+            bc->capture.encoder.backend = encoderBackendFromString(optarg);
+            OKAY_RETURN((int)bc->capture.encoder.backend < 0, CSTATUS_BAD_PARAM, "unknown encoder %s\n", optarg);
+            break;
+        case 'm':
+            bc->capture.encoder.mockPath = optarg;
+            break;
+        case 'b':
+            bc->capture.encoder.birate = atoi(optarg);
+            break;
+        case 'W':
+            bc->capture.source.width = atoi(optarg);
+            break;
+        case 'H':
+            bc->capture.source.height = atoi(optarg);
+            break;
+        case 'r':
+            bc->capture.source.fps = atoi(optarg);
+            bc->capture.encoder.fps = bc->capture.source.fps;
+            break;
+        case 'f':
+            if(strcmp(optarg, "nv12") == 0)
+            { bc->capture.source.pixfmt = V4L2_PIX_FMT_NV12; }
+            else if(strcmp(optarg, "nv24") == 0)
+            { bc->capture.source.pixfmt = V4L2_PIX_FMT_NV24; }
+            else
+            { OKAY_RETURN(true, CSTATUS_BAD_PARAM, "unknown pixel format %s\n", optarg); }
+            break;
+        case 'o':
+            bc->output = optarg;
+            break;
+        default:
+            return CSTATUS_BAD_PARAM;
+        }
+    }
+    OKAY_RETURN(bc->seconds <= 0 || bc->numSteps <= 0, CSTATUS_BAD_PARAM, "nothing to measure\n");
+    return CSTATUS_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig_t bc = {
+        .capture = {
+            .source = {
+                .type = SOURCE_SYNTHETIC,
+                .pixfmt = V4L2_PIX_FMT_NV12,
+                .width = IMG_WIDTH,
+                .height = IMG_HEIGHT,
+                .fps = 60,
+                .numBufs = DMA_BUFF_COUNT,
+            },
+            .encoder = {
+                .birate = 4000000,
+                .fps = 60,
+                .gop = 60,
+                .backend = ENCODER_BACKEND_MOCK,
+                .codec = ENCODER_CODEC_H264,
+            },
+            .tcpPort = BENCH_TCP_PORT,
+            .wsPort = BENCH_WS_PORT,
+            .display = false,
+            .verbose = false,
+        },
+        .seconds = 10,
+        .steps = {1, 8, 32, 128},
+        .numSteps = 4,
+        .kind = BENCH_KIND_MIXED,
+        .output = "capture_bench.json",
+    };
+
+    if(CSTATUS_SUCCESS != benchParseArgs(&bc, argc, argv))
+    {
+        benchUsage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, benchSignal);
+    signal(SIGTERM, benchSignal);
+    pthread_setname_np(pthread_self(), "viewers");
+
+    FILE *out = (strcmp(bc.output, "-") == 0) ? stdout : fopen(bc.output, "w");
+    OKAY_RETURN(out == NULL, 1, "failed to open %s : %s\n", bc.output, ERRSTR);
+
+    if(CSTATUS_SUCCESS != capAppInit(&app, &bc.capture))
+    {
+        capAppDeinit(&app);
+        return 1;
+    }
+
+    pthread_t pipeline;
+    if(pthread_create(&pipeline, NULL, benchPipelineThread, &app))
+    {
+        capAppDeinit(&app);
+        OKAY_RETURN(true, 1, "failed to start the pipeline thread\n");
+    }
+
+    fprintf(out, "{\n  \"config\": {\"width\": %u, \"height\": %u, \"fps\": %d, \"bitrate\": %d, \"encoder\": \"%s\", "
+                 "\"kind\": \"%s\", \"seconds\": %d},\n  \"runs\": [\n",
+            app.source->fmt.width, app.source->fmt.height, bc.capture.source.fps, bc.capture.encoder.birate,
+            app.enc->ops->name, bc.kind == BENCH_KIND_TCP ? "tcp" : (bc.kind == BENCH_KIND_WS ? "ws" : "mixed"),
+            bc.seconds);
+
+    for(int i = 0; i < bc.numSteps && !benchStop; i++)
+    {
+        benchRunStep(out, &bc, bc.steps[i], i == 0);
+    }
+    fprintf(out, "\n  ]\n}\n");
+
+    if(out != stdout)
+    { fclose(out); }
+
+    capAppStop(&app);
+    pthread_join(pipeline, NULL);
+    capAppDeinit(&app);
+    return 0;
+}
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include "common.h"
+#include "viewer.h"
+#include <signal.h>
+#include <sys/resource.h>
+
+/*
+ * Stand alone stream consumer simulator for capacity planning. Opens N raw TCP
+ * connections to the Net_t port and M WebSocket connections to the ws.c server
+ * of a running capture, optionally reads a subset of them at a capped rate and
+ * validates every stream through ts_demuxer. Clients can be ramped in steps so
+ * the interval reports show the viewer count where the fan-out starts to hurt.
+ */
+
+#define LOADGEN_MAX_CLIENTS     4096
+
+typedef struct
+{
+    const char      *host;
+    uint16_t        tcpPort;
+    uint16_t        wsPort;
+    const char      *wsPath;
+    int             numTcp;
+    int             numWs;
+    int             numSlow;        //Clients of each kind reading at slowRate
+    int             slowRate;       //Bytes per second
+    int             rampStep;       //Clients added per interval, 0 connects all at once
+    int             intervalMs;
+    int             seconds;
+    int             stallMs;
+    bool            demux;
+    bool            perClient;
+}LoadgenConfig_t;
+
+typedef struct
+{
+    uint64_t        bytes;
+    uint64_t        ccErrors;
+    uint64_t        demuxLost;
+    uint64_t        stalls;
+}LoadgenMark_t;
+
+static volatile bool loadgenStop;
+
+
+static void loadgenSignal(int sig)
+{
+    UNUSED_PARAMETER(sig);
+    loadgenStop = true;
+}
+
+//Alternate the kinds while both last so a ramp grows them together
+static Viewer_t *loadgenConnect(LoadgenConfig_t *lc, int *tcpUsed, int *wsUsed)
+{
+    bool ws = *wsUsed < lc->numWs && (*tcpUsed >= lc->numTcp || *wsUsed < *tcpUsed);
+    int kindIndex = ws ? (*wsUsed)++ : (*tcpUsed)++;
+
+    ViewerConfig_t vc = {
+        .kind = ws ? VIEWER_WS : VIEWER_TCP,
+        .host = lc->host,
+        .port = ws ? lc->wsPort : lc->tcpPort,
+        .path = lc->wsPath,
+        .readRate = kindIndex < lc->numSlow ? lc->slowRate : 0,
+        .stallMs = lc->stallMs,
+        .demux = lc->demux,
+    };
+    return viewerCreate(&vc);
+}
+
+static const char *loadgenKind(Viewer_t *v)
+{
+    return v->config.kind == VIEWER_WS ? "ws" : "tcp";
+}
+
+static void loadgenReport(LoadgenConfig_t *lc, Viewer_t **viewers, LoadgenMark_t *marks, int count,
+                          double elapsed, double interval)
+{
+    uint64_t ccErrors = 0, lost = 0, stalls = 0;
+    int open = 0, starved = 0, numLive = 0;
+    double minKbps = -1, sumKbps = 0;
+    Viewer_t **live = calloc(count, sizeof(Viewer_t *));
+    OKAY_RETURN(live == NULL, , "failed to allocate report\n");
+
+    for(int i = 0; i < count; i++)
+    {
+        Viewer_t *v = viewers[i];
+        if(v == NULL)
+        { continue; }
+
+        ViewerStats_t *s = &v->stats;
+        double kbps = (s->bytes - marks[i].bytes) * 8 / interval / 1000;
+
+        //Throttled clients are expected to fall behind
+        if(v->config.readRate == 0 && !v->closed)
+        {
+            live[numLive++] = v;
+            sumKbps += kbps;
+            open++;
+            if(minKbps < 0 || kbps < minKbps)
+            { minKbps = kbps; }
+            if(kbps == 0)
+            { starved++; }
+        }
+        ccErrors += s->ccErrors - marks[i].ccErrors;
+        lost += s->demuxLost - marks[i].demuxLost;
+        stalls += s->stalls - marks[i].stalls;
+
+        if(lc->perClient)
+        {
+            printf("  %4d %-3s %s rate %8.1f kbps, cc %llu, lost %llu, stalls %llu%s\n", i, loadgenKind(v),
+                    v->config.readRate ? "slow" : "full", kbps,
+                    (unsigned long long)(s->ccErrors - marks[i].ccErrors),
+                    (unsigned long long)(s->demuxLost - marks[i].demuxLost),
+                    (unsigned long long)(s->stalls - marks[i].stalls), v->closed ? " closed" : "");
+        }
+
+        marks[i].bytes = s->bytes;
+        marks[i].ccErrors = s->ccErrors;
+        marks[i].demuxLost = s->demuxLost;
+        marks[i].stalls = s->stalls;
+    }
+
+    int64_t p99 = viewerLatencyPercentile(live, numLive, 99);
+    printf("%7.1fs %4d clients, full rate min %8.1f avg %8.1f kbps, starved %d, cc %llu, lost %llu, stalls %llu, full rate p99 %lld us\n",
+            elapsed, count, minKbps < 0 ? 0 : minKbps, open ? sumKbps / open : 0, starved,
+            (unsigned long long)ccErrors, (unsigned long long)lost, (unsigned long long)stalls, (long long)p99);
+    fflush(stdout);
+
+    //Percentiles cover one interval
+    for(int i = 0; i < count; i++)
+    {
+        if(viewers[i] != NULL)
+        { viewers[i]->stats.numLatency = 0; }
+    }
+    free(live);
+}
+
+static void loadgenSummary(Viewer_t **viewers, int count, double elapsed)
+{
+    printf("\nclient kind mode     avg kbps   frames  cc_err   lost  stalls  sync\n");
+    for(int i = 0; i < count; i++)
+    {
+        Viewer_t *v = viewers[i];
+        if(v == NULL)
+        {
+            printf("%6d  -   failed to connect\n", i);
+            continue;
+        }
+
+        ViewerStats_t *s = &v->stats;
+        double active = elapsed;
+        if(s->connectedUs != 0)
+        { active = (viewerTimeUs() - s->connectedUs) / 1000000.0; }
+        printf("%6d %-4s %-6s %10.1f %8llu %7llu %6llu %7llu %5llu%s\n", i, loadgenKind(v),
+                v->config.readRate ? "slow" : "full", active > 0 ? s->bytes * 8 / active / 1000 : 0,
+                (unsigned long long)s->frames, (unsigned long long)s->ccErrors,
+                (unsigned long long)s->demuxLost, (unsigned long long)s->stalls,
+                (unsigned long long)s->syncErrors, v->closed ? " closed" : "");
+    }
+}
+
+static void loadgenUsage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+        "  -a <host>              capture host (default 127.0.0.1)\n"
+        "  -p <port>              raw TS port (default 6700)\n"
+        "  -w <port>              WebSocket port (default 8080)\n"
+        "  -u <path>              WebSocket request path (default /)\n"
+        "  -n <count>             TCP clients (default 16)\n"
+        "  -m <count>             WebSocket clients (default 16)\n"
+        "  -s <count>:<bytes/s>   throttle the first <count> clients of each kind\n"
+        "  -R <count>             clients added per interval (default all at once)\n"
+        "  -i <ms>                report interval (default 1000)\n"
+        "  -d <seconds>           run time after the last client connected, 0 until ^C (default 30)\n"
+        "  -S <ms>                silence counted as a stall (default 500)\n"
+        "  -x                     skip the ts_demuxer check, continuity counters only\n"
+        "  -v                     per client lines in every report\n",
+        prog);
+}
+
+static CStatus_t loadgenParseArgs(LoadgenConfig_t *lc, int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:w:u:n:m:s:R:i:d:S:xv")) != -1)
+    {
+        switch (opt)
+        {
+        case 'a':
+            lc->host = optarg;
+            break;
+        case 'p':
+            lc->tcpPort = atoi(optarg);
+            break;
+        case 'w':
+            lc->wsPort = atoi(optarg);
+            break;
+        case 'u':
+            lc->wsPath = optarg;
+            break;
+        case 'n':
+            lc->numTcp = atoi(optarg);
+            break;
+        case 'm':
+            lc->numWs = atoi(optarg);
+            break;
+        case 's':
+            OKAY_RETURN(sscanf(optarg, "%d:%d", &lc->numSlow, &lc->slowRate) != 2 || lc->slowRate <= 0,
+                        CSTATUS_BAD_PARAM, "bad slow client spec %s\n", optarg);
+            break;
+        case 'R':
+            lc->rampStep = atoi(optarg);
+            break;
+        case 'i':
+            lc->intervalMs = atoi(optarg);
+            break;
+        case 'd':
+            lc->seconds = atoi(optarg);
+            break;
+        case 'S':
+            lc->stallMs = atoi(optarg);
+            break;
+        case 'x':
+            lc->demux = false;
+            break;
+        case 'v':
+            lc->perClient = true;
+            break;
+        default:
+            return CSTATUS_BAD_PARAM;
+        }
+    }
+
+    int total = lc->numTcp + lc->numWs;
+    OKAY_RETURN(total <= 0 || total > LOADGEN_MAX_CLIENTS, CSTATUS_BAD_PARAM,
+                "client count must be 1..%d\n", LOADGEN_MAX_CLIENTS);
+    OKAY_RETURN(lc->intervalMs <= 0, CSTATUS_BAD_PARAM, "bad report interval\n");
+    return CSTATUS_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    LoadgenConfig_t lc = {
+        .host = "127.0.0.1",
+        .tcpPort = 6700,
+        .wsPort = 8080,
+        .numTcp = 16,
+        .numWs = 16,
+        .intervalMs = 1000,
+        .seconds = 30,
+        .demux = true,
+    };
+
+    if(CSTATUS_SUCCESS != loadgenParseArgs(&lc, argc, argv))
+    {
+        loadgenUsage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, loadgenSignal);
+    signal(SIGTERM, loadgenSignal);
+
+    //Each client holds a socket, make sure a few hundred fit
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    int total = lc.numTcp + lc.numWs;
+    Viewer_t **viewers = calloc(total, sizeof(Viewer_t *));
+    LoadgenMark_t *marks = calloc(total, sizeof(LoadgenMark_t));
+    ViewerPool_t *pool = viewerPoolCreate();
+    OKAY_RETURN(viewers == NULL || marks == NULL || pool == NULL, 1, "failed to allocate %d clients\n", total);
+
+    printf("loadgen : %d tcp (%s:%u), %d ws (%s:%u), %d slow per kind at %d B/s\n", lc.numTcp, lc.host, lc.tcpPort,
+            lc.numWs, lc.host, lc.wsPort, lc.numSlow, lc.slowRate);
+
+    int64_t start = viewerTimeUs();
+    int64_t last = start;
+    int64_t end = 0;
+    int count = 0, tcpUsed = 0, wsUsed = 0;
+
+    while (!loadgenStop)
+    {
+        int step = lc.rampStep > 0 ? lc.rampStep : total;
+        for(int i = 0; i < step && count < total; i++, count++)
+        {
+            viewers[count] = loadgenConnect(&lc, &tcpUsed, &wsUsed);
+            if(viewers[count] != NULL && viewerPoolAdd(pool, viewers[count]) != CSTATUS_SUCCESS)
+            {
+                viewerDestroy(viewers[count]);
+                viewers[count] = NULL;
+            }
+        }
+        if(count == total && end == 0 && lc.seconds > 0)
+        { end = viewerTimeUs() + (int64_t)lc.seconds * 1000000; }
+
+        viewerPoolRun(pool, (int64_t)lc.intervalMs * 1000, &loadgenStop);
+
+        int64_t now = viewerTimeUs();
+        loadgenReport(&lc, viewers, marks, count, (now - start) / 1000000.0, (now - last) / 1000000.0);
+        last = now;
+
+        if(end != 0 && now >= end)
+        { break; }
+    }
+
+    loadgenSummary(viewers, count, (viewerTimeUs() - start) / 1000000.0);
+
+    viewerPoolDestroy(pool);
+    for(int i = 0; i < count; i++)
+    { viewerDestroy(viewers[i]); }
+    free(marks);
+    free(viewers);
+    return 0;
+}
@@ -0,0 +1,646 @@
+#define _GNU_SOURCE
+#include "common.h"
+#include "fec.h"
+#include "list_common.h"
+#include "mpeg-ts.h"
+#include "ws.h"
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/*
+ * Microbenchmarks for the hot kernels of the streaming path. Every case prints
+ * one line
+ *
+ *   BENCH <name> <bytes/op> <ns/op> <MB/s>
+ *
+ * sorted as declared below, so two runs diff cleanly between commits. Each
+ * case doubles its iteration count until one run lasts the minimum time.
+ */
+
+#define MICRO_DEFAULT_MS        500
+#define MICRO_WS_PORT           17700
+#define MICRO_IDR_SIZE          (150 * 1024)
+#define MICRO_P_SIZE            (20 * 1024)
+#define MICRO_NALU_BUFFER       (1024 * 1024)
+#define MICRO_NALU_SPACING      (16 * 1024)
+#define MICRO_LIST_NODES        TS_TOTAL_PACKET
+
+typedef struct
+{
+    const char  *name;
+    size_t      bytes;                      //Payload per op, 0 for pure op counts
+    void        (*Run)(void *arg, uint64_t iters);
+    void        *arg;
+}MicroCase_t;
+
+typedef struct
+{
+    uint8_t     *data;
+    size_t      size;
+    int         flags;
+}MicroBuffer_t;
+
+typedef struct
+{
+    List_t      link;
+    int         value;
+}MicroNode_t;
+
+static volatile uint64_t microSink;
+
+
+static int64_t microTimeNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void microFill(uint8_t *p, size_t len, uint32_t seed)
+{
+    //Never 0x00, no accidental start codes
+    for(size_t i = 0; i < len; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        p[i] = (seed >> 24) | 0x01;
+    }
+}
+
+static MicroBuffer_t *microAnnexB(size_t size, int flags)
+{
+    MicroBuffer_t *b = calloc(1, sizeof(MicroBuffer_t));
+    b->data = malloc(size);
+    b->size = size;
+    b->flags = flags;
+    microFill(b->data, size, 0x1234);
+
+    static const uint8_t idr[] = {0x00, 0x00, 0x00, 0x01, 0x65, 0x88};
+    static const uint8_t slice[] = {0x00, 0x00, 0x00, 0x01, 0x41, 0x9a};
+    memcpy(b->data, (flags & MPEG_FLAG_IDR_FRAME) ? idr : slice, sizeof(idr));
+    return b;
+}
+
+/****************************************************************************** */
+/****************************** TS muxer / demuxer **************************** */
+/****************************************************************************** */
+
+static uint8_t microTsPacket[TS_PACKET_SIZE];
+
+static void *microTsAlloc(void *param, size_t bytes)
+{
+    UNUSED_PARAMETER(param);
+    UNUSED_PARAMETER(bytes);
+    return microTsPacket;
+}
+
+static void microTsFree(void *param, void *packet)
+{
+    UNUSED_PARAMETER(param);
+    UNUSED_PARAMETER(packet);
+}
+
+static int microTsWrite(void *param, const void *packet, size_t bytes)
+{
+    UNUSED_PARAMETER(packet);
+    *(uint64_t *)param += bytes;
+    return 0;
+}
+
+static struct mpeg_ts_func_t microTsHandler = {
+    .alloc = microTsAlloc,
+    .free = microTsFree,
+    .write = microTsWrite,
+};
+
+static void microTsMux(void *arg, uint64_t iters)
+{
+    MicroBuffer_t *b = arg;
+    uint64_t written = 0;
+    void *ts = mpeg_ts_create(&microTsHandler, &written);
+    int stream = mpeg_ts_add_stream(ts, PSI_STREAM_H264, NULL, 0);
+
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        int64_t pts = i * 1500;
+        mpeg_ts_write(ts, stream, b->flags, pts, pts, b->data, b->size);
+    }
+
+    mpeg_ts_destroy(ts);
+    microSink += written;
+}
+
+static int microTsCollect(void *param, const void *packet, size_t bytes)
+{
+    MicroBuffer_t *b = param;
+    memcpy(b->data + b->size, packet, bytes);
+    b->size += bytes;
+    return 0;
+}
+
+static struct mpeg_ts_func_t microTsCollectHandler = {
+    .alloc = microTsAlloc,
+    .free = microTsFree,
+    .write = microTsCollect,
+};
+
+//One gop worth of TS, 1 IDR and 59 P frames
+static MicroBuffer_t *microTsStream(void)
+{
+    MicroBuffer_t *idr = microAnnexB(MICRO_IDR_SIZE, MPEG_FLAG_IDR_FRAME);
+    MicroBuffer_t *p = microAnnexB(MICRO_P_SIZE, 0);
+    MicroBuffer_t *out = calloc(1, sizeof(MicroBuffer_t));
+    out->data = malloc((MICRO_IDR_SIZE + 59 * MICRO_P_SIZE) * 2);
+
+    void *ts = mpeg_ts_create(&microTsCollectHandler, out);
+    int stream = mpeg_ts_add_stream(ts, PSI_STREAM_H264, NULL, 0);
+    for(int i = 0; i < 60; i++)
+    {
+        MicroBuffer_t *b = (i == 0) ? idr : p;
+        mpeg_ts_write(ts, stream, b->flags, i * 1500, i * 1500, b->data, b->size);
+    }
+    mpeg_ts_destroy(ts);
+    return out;
+}
+
+static int microTsOnPacket(void *param, int program, int stream, int codecid, int flags,
+                            int64_t pts, int64_t dts, const void *data, size_t bytes)
+{
+    UNUSED_PARAMETER(program);
+    UNUSED_PARAMETER(stream);
+    UNUSED_PARAMETER(codecid);
+    UNUSED_PARAMETER(flags);
+    UNUSED_PARAMETER(pts);
+    UNUSED_PARAMETER(dts);
+    UNUSED_PARAMETER(data);
+    *(uint64_t *)param += bytes;
+    return 0;
+}
+
+static void microTsDemux(void *arg, uint64_t iters)
+{
+    MicroBuffer_t *b = arg;
+    uint64_t frames = 0;
+
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        void *demux = ts_demuxer_create(microTsOnPacket, &frames);
+        for(size_t off = 0; off + TS_PACKET_SIZE <= b->size; off += TS_PACKET_SIZE)
+        {
+            ts_demuxer_input(demux, b->data + off, TS_PACKET_SIZE);
+        }
+        ts_demuxer_flush(demux);
+        ts_demuxer_destroy(demux);
+    }
+    microSink += frames;
+}
+
+/****************************************************************************** */
+/***************************** Annex-B and CRC scans ************************** */
+/****************************************************************************** */
+
+static MicroBuffer_t *microNaluStream(void)
+{
+    MicroBuffer_t *b = microAnnexB(MICRO_NALU_BUFFER, 0);
+    for(size_t off = MICRO_NALU_SPACING; off + 4 < b->size; off += MICRO_NALU_SPACING)
+    {
+        b->data[off] = 0x00;
+        b->data[off + 1] = 0x00;
+        b->data[off + 2] = 0x01;
+        b->data[off + 3] = 0x41;
+    }
+    return b;
+}
+
+static void microFindNalu(void *arg, uint64_t iters)
+{
+    MicroBuffer_t *b = arg;
+    uint64_t found = 0;
+
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        const uint8_t *p = b->data;
+        size_t left = b->size;
+        int n;
+        while ((n = mpeg_h264_find_nalu(p, left, NULL)) > 0)
+        {
+            p += n;
+            left -= n;
+            found++;
+        }
+    }
+    microSink += found;
+}
+
+static void microCrc32(void *arg, uint64_t iters)
+{
+    MicroBuffer_t *b = arg;
+    uint32_t crc = 0;
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        crc ^= mpeg_crc32(0xffffffff, b->data, b->size);
+    }
+    microSink += crc;
+}
+
+//One 7 TS packet RTP datagram per op into a 10x5 matrix with row FEC
+static void microFecEncode(void *arg, uint64_t iters)
+{
+    MicroBuffer_t *b = arg;
+    FecConfig_t config = { .cols = 10, .rows = 5, .rowFec = true };
+    FecEnc_t *fec = fecEncCreate(&config);
+    FecPacket_t out[2];
+    uint8_t rtp[FEC_RTP_HEADER + FEC_MAX_PAYLOAD];
+    uint64_t emitted = 0;
+
+    memcpy(rtp + FEC_RTP_HEADER, b->data, FEC_MAX_PAYLOAD);
+    rtp[0] = 0x80;
+    rtp[1] = 33;
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        rtp[2] = (uint8_t)(i >> 8);
+        rtp[3] = (uint8_t)i;
+        emitted += fecEncode(fec, rtp, sizeof(rtp), out);
+    }
+    fecEncDestroy(fec);
+    microSink += emitted;
+}
+
+static void microFecXor(void *arg, uint64_t iters)
+{
+    MicroBuffer_t *b = arg;
+    static uint8_t acc[FEC_MAX_PAYLOAD];
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        fecXor(acc, b->data + (i & 63), b->size);
+    }
+    microSink += acc[0];
+}
+
+/****************************************************************************** */
+/************************************* Lists ********************************** */
+/****************************************************************************** */
+
+static MicroNode_t microNodes[MICRO_LIST_NODES];
+
+//The muxer fill pattern : take every free buffer to the send queue and back
+static void microListCycle(void *arg, uint64_t iters)
+{
+    UNUSED_PARAMETER(arg);
+    List_t qFree, qSend;
+    listInit(&qFree);
+    listInit(&qSend);
+    for(int i = 0; i < MICRO_LIST_NODES; i++)
+    {
+        listInsert(&qFree, &microNodes[i].link);
+    }
+
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        for(int j = 0; j < MICRO_LIST_NODES; j++)
+        {
+            MicroNode_t *n = NULL;
+            LIST_POP_FRONT(n, &qFree, link);
+            listInsertBack(&qSend, &n->link);
+        }
+        for(int j = 0; j < MICRO_LIST_NODES; j++)
+        {
+            MicroNode_t *n = NULL;
+            LIST_POP_FRONT(n, &qSend, link);
+            listInsertBack(&qFree, &n->link);
+        }
+    }
+}
+
+static void microListLength(void *arg, uint64_t iters)
+{
+    List_t *list = arg;
+    uint64_t total = 0;
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        total += listLength(list);
+    }
+    microSink += total;
+}
+
+static void microListIterate(void *arg, uint64_t iters)
+{
+    List_t *list = arg;
+    uint64_t total = 0;
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        MicroNode_t *n = NULL;
+        LIST_FOR_EACH(n, list, link)
+        {
+            total += n->value;
+        }
+    }
+    microSink += total;
+}
+
+/****************************************************************************** */
+/****************************** WebSocket loopback **************************** */
+/****************************************************************************** */
+
+typedef struct
+{
+    int                         fd;
+    pthread_t                   drain;
+    volatile bool               running;
+    volatile ws_cli_conn_t      cid;
+    _Atomic uint64_t            received;
+}MicroWs_t;
+
+static MicroWs_t microWs;
+
+static void microWsOnOpen(ws_cli_conn_t client)
+{
+    microWs.cid = client;
+}
+
+static void microWsOnClose(ws_cli_conn_t client)
+{
+    UNUSED_PARAMETER(client);
+}
+
+static void microWsOnMessage(ws_cli_conn_t client, const unsigned char *msg, uint64_t size, int type)
+{
+    UNUSED_PARAMETER(client);
+    UNUSED_PARAMETER(msg);
+    UNUSED_PARAMETER(type);
+    atomic_fetch_add(&microWs.received, size);
+}
+
+static void *microWsDrain(void *args)
+{
+    static uint8_t buf[256 * 1024];
+    UNUSED_PARAMETER(args);
+    while (microWs.running)
+    {
+        if(read(microWs.fd, buf, sizeof(buf)) <= 0)
+        { break; }
+    }
+    return NULL;
+}
+
+static CStatus_t microWsStart(void)
+{
+    if(microWs.cid != 0)
+    { return CSTATUS_SUCCESS; }
+
+    ws_socket(&(struct ws_server){
+        .host = "127.0.0.1",
+        .port = MICRO_WS_PORT,
+        .thread_loop = 1,
+        .timeout_ms = 1000,
+        .evs.onopen = microWsOnOpen,
+        .evs.onclose = microWsOnClose,
+        .evs.onmessage = microWsOnMessage,
+    });
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(MICRO_WS_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    microWs.fd = socket(AF_INET, SOCK_STREAM, 0);
+    OKAY_RETURN(microWs.fd < 0, CSTATUS_SYSCALL, "failed to create socket : %s\n", ERRSTR);
+    setsockopt(microWs.fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+    int ret = -1;
+    for(int i = 0; i < 50 && ret < 0; i++)
+    {
+        ret = connect(microWs.fd, (struct sockaddr *)&addr, sizeof(addr));
+        if(ret < 0)
+        { usleep(20000); }
+    }
+    OKAY_RETURN(ret < 0, CSTATUS_SYSCALL, "failed to connect websocket server : %s\n", ERRSTR);
+
+    const char *req = "GET / HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+    OKAY_RETURN(write(microWs.fd, req, strlen(req)) != (ssize_t)strlen(req), CSTATUS_SYSCALL, "handshake failed\n");
+
+    char resp[1024];
+    int fill = 0;
+    while (fill < (int)sizeof(resp) - 1)
+    {
+        int n = read(microWs.fd, resp + fill, sizeof(resp) - 1 - fill);
+        OKAY_RETURN(n <= 0, CSTATUS_FAIL, "handshake failed\n");
+        fill += n;
+        resp[fill] = '\0';
+        if(strstr(resp, "\r\n\r\n") != NULL)
+        { break; }
+    }
+
+    for(int i = 0; i < 100 && microWs.cid == 0; i++)
+    { usleep(10000); }
+    OKAY_RETURN(microWs.cid == 0, CSTATUS_FAIL, "websocket client never opened\n");
+
+    microWs.running = true;
+    pthread_create(&microWs.drain, NULL, microWsDrain, NULL);
+    return CSTATUS_SUCCESS;
+}
+
+static void microWsSend(void *arg, uint64_t iters)
+{
+    MicroBuffer_t *b = arg;
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        ws_sendframe_bin(microWs.cid, (const char *)b->data, b->size);
+    }
+}
+
+//Client to server binary frames, masked as browsers send them
+static MicroBuffer_t *microWsMasked(size_t payload)
+{
+    MicroBuffer_t *b = calloc(1, sizeof(MicroBuffer_t));
+    b->data = malloc(payload + 14);
+    uint8_t *p = b->data;
+    static const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+    *p++ = 0x82;
+    if(payload < 126)
+    { *p++ = 0x80 | payload; }
+    else if(payload < 65536)
+    {
+        *p++ = 0x80 | 126;
+        *p++ = payload >> 8;
+        *p++ = payload & 0xff;
+    }
+    else
+    {
+        *p++ = 0x80 | 127;
+        for(int i = 7; i >= 0; i--)
+        { *p++ = (uint64_t)payload >> (8 * i); }
+    }
+    memcpy(p, mask, 4);
+    p += 4;
+
+    microFill(p, payload, 0x4321);
+    for(size_t i = 0; i < payload; i++)
+    { p[i] ^= mask[i & 3]; }
+
+    b->size = (p - b->data) + payload;
+    b->flags = payload;
+    return b;
+}
+
+static void microWsRecv(void *arg, uint64_t iters)
+{
+    MicroBuffer_t *b = arg;
+    uint64_t target = atomic_load(&microWs.received) + iters * (uint64_t)b->flags;
+
+    for(uint64_t i = 0; i < iters; i++)
+    {
+        size_t off = 0;
+        while (off < b->size)
+        {
+            ssize_t n = write(microWs.fd, b->data + off, b->size - off);
+            if(n <= 0)
+            { return; }
+            off += n;
+        }
+    }
+
+    while (atomic_load(&microWs.received) < target)
+    { sched_yield(); }
+}
+
+/****************************************************************************** */
+/************************************* Driver ********************************* */
+/****************************************************************************** */
+
+static void microRun(MicroCase_t *c, int minMs)
+{
+    uint64_t iters = 1;
+    int64_t elapsed = 0;
+
+    //Warm caches and lazy allocations
+    c->Run(c->arg, 1);
+
+    for(;;)
+    {
+        int64_t start = microTimeNs();
+        c->Run(c->arg, iters);
+        elapsed = microTimeNs() - start;
+        if(elapsed >= (int64_t)minMs * 1000000 || iters >= (1ULL << 40))
+        { break; }
+        iters *= 2;
+    }
+
+    double nsPerOp = (double)elapsed / iters;
+    double mbps = c->bytes ? c->bytes / nsPerOp * 1000.0 : 0.0;
+    printf("BENCH %-28s %10zu %14.1f %10.1f\n", c->name, c->bytes, nsPerOp, mbps);
+    fflush(stdout);
+}
+
+static void microUsage(const char *prog)
+{
+    printf("usage: %s [-t <ms per case>] [-f <name filter>] [-l]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    int minMs = MICRO_DEFAULT_MS;
+    const char *filter = NULL;
+    bool list = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:f:l")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            minMs = atoi(optarg);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'l':
+            list = true;
+            break;
+        default:
+            microUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    MicroBuffer_t *idr = microAnnexB(MICRO_IDR_SIZE, MPEG_FLAG_IDR_FRAME);
+    MicroBuffer_t *pFrame = microAnnexB(MICRO_P_SIZE, 0);
+    MicroBuffer_t *gop = microTsStream();
+    MicroBuffer_t *nalus = microNaluStream();
+    MicroBuffer_t crcPacket = { idr->data, TS_PACKET_SIZE, 0 };
+    MicroBuffer_t crcSection = { idr->data, 1024, 0 };
+    MicroBuffer_t fecPayload = { idr->data, FEC_MAX_PAYLOAD, 0 };
+    MicroBuffer_t ws188 = { idr->data, TS_PACKET_SIZE, 0 };
+    MicroBuffer_t ws4k = { idr->data, 4096, 0 };
+    MicroBuffer_t ws64k = { idr->data, 65536, 0 };
+    MicroBuffer_t ws150k = { idr->data, MICRO_IDR_SIZE, 0 };
+    MicroBuffer_t *wsMasked125 = microWsMasked(125);
+    MicroBuffer_t *wsMasked4k = microWsMasked(4096);
+    MicroBuffer_t *wsMasked64k = microWsMasked(65536);
+
+    static List_t fullList;
+    listInit(&fullList);
+    for(int i = 0; i < MICRO_LIST_NODES; i++)
+    {
+        microNodes[i].value = i;
+        listInsertBack(&fullList, &microNodes[i].link);
+    }
+
+    MicroCase_t cases[] = {
+        { "ts_mux/idr_150k",            MICRO_IDR_SIZE,         microTsMux,         idr },
+        { "ts_mux/p_20k",               MICRO_P_SIZE,           microTsMux,         pFrame },
+        { "ts_demux/gop_60",            gop->size,              microTsDemux,       gop },
+        { "h264_find_nalu/1m",          MICRO_NALU_BUFFER,      microFindNalu,      nalus },
+        { "crc32/188",                  TS_PACKET_SIZE,         microCrc32,         &crcPacket },
+        { "crc32/1024",                 1024,                   microCrc32,         &crcSection },
+        { "fec_xor/1316",               FEC_MAX_PAYLOAD,        microFecXor,        &fecPayload },
+        { "fec_encode/10x5_row",        FEC_MAX_PAYLOAD,        microFecEncode,     &fecPayload },
+        { "list/length_2048",           0,                      microListLength,    &fullList },
+        { "list/iterate_2048",          0,                      microListIterate,   &fullList },
+        { "list/pop_push_cycle_2048",   0,                      microListCycle,     NULL },
+        { "ws_sendframe/188",           TS_PACKET_SIZE,         microWsSend,        &ws188 },
+        { "ws_sendframe/4k",            4096,                   microWsSend,        &ws4k },
+        { "ws_sendframe/64k",           65536,                  microWsSend,        &ws64k },
+        { "ws_sendframe/150k",          MICRO_IDR_SIZE,         microWsSend,        &ws150k },
+        { "ws_recv_masked/125",         125,                    microWsRecv,        wsMasked125 },
+        { "ws_recv_masked/4k",          4096,                   microWsRecv,        wsMasked4k },
+        { "ws_recv_masked/64k",         65536,                  microWsRecv,        wsMasked64k },
+    };
+
+    printf("# BENCH <name> <bytes/op> <ns/op> <MB/s>\n");
+    for(size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        MicroCase_t *c = &cases[i];
+        if(filter != NULL && strstr(c->name, filter) == NULL)
+        { continue; }
+
+        if(list)
+        {
+            printf("%s\n", c->name);
+            continue;
+        }
+
+        if(strncmp(c->name, "ws_", 3) == 0 && microWsStart() != CSTATUS_SUCCESS)
+        {
+            printf("BENCH %-28s %10zu %14s %10s\n", c->name, c->bytes, "n/a", "n/a");
+            continue;
+        }
+
+        microRun(c, minMs);
+    }
+
+    if(microWs.running)
+    {
+        microWs.running = false;
+        shutdown(microWs.fd, SHUT_RDWR);
+        pthread_join(microWs.drain, NULL);
+        close(microWs.fd);
+    }
+    return 0;
+}
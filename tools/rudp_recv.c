@@ -0,0 +1,530 @@
+#define _GNU_SOURCE
+#include "common.h"
+#include "rudp.h"
+#include "mpeg-ts.h"
+#include "mpeg-ts-proto.h"
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/*
+ * Receiver for the capture reliable UDP sink. Registers with the sink, NACKs the
+ * gaps in the sequence numbers once per retransmission timeout, delivers in order
+ * and gives a gap up once it is older than the latency budget. Loss can be injected on the data datagrams,
+ * retransmissions included, or the path shaped with netem on the loopback:
+ *
+ *   capture ... -n 9000 -L 120
+ *   rudp_recv -s 127.0.0.1:9000 -x 2 -b 3
+ *
+ *   tc qdisc add dev lo root netem delay 20ms 5ms loss 1%
+ *
+ * Every interval prints the data received and dropped on purpose, retransmissions,
+ * gaps recovered and lost, duplicates, NACKs sent, the sink's RTT estimate, TS
+ * continuity errors and demuxed frames.
+ */
+
+#define RUDP_RECV_WINDOW        8192        //Sequences between delivery and the newest, power of two
+#define RUDP_RECV_BATCH         32
+#define RUDP_RECV_HELLO_MS      500
+#define RUDP_RECV_MIN_NACK_US   10000
+
+typedef struct
+{
+    const char      *sink;          //"host:port"
+    int             latencyMs;      //Give a gap up after this long
+    double          lossPct;        //Data datagrams dropped on purpose
+    int             burst;          //Consecutive datagrams per drop
+    int             seconds;
+    int             intervalMs;
+    const char      *output;        //TS in order, "-" for stdout
+}RudpRecvConfig_t;
+
+typedef struct
+{
+    bool            have;
+    bool            missing;
+    int64_t         missSinceUs;
+    int64_t         lastNackUs;
+    size_t          len;
+    uint8_t         data[RUDP_MAX_PAYLOAD];
+}RudpRecvSlot_t;
+
+typedef struct
+{
+    RudpRecvConfig_t config;
+    int             fd;
+    struct sockaddr_in sink;
+    void            *demuxer;
+    FILE            *out;
+    int             burstLeft;
+    int             cc[8192];
+    bool            synced;
+
+    RudpRecvSlot_t  *slots;
+    bool            started;
+    uint32_t        nextDeliver;    //Oldest sequence not delivered or given up
+    uint32_t        highest;        //One past the newest sequence seen
+    int64_t         nackIntervalUs; //From the sink's RTT estimate
+    int64_t         rttUs;
+
+    uint8_t         nack[RUDP_HEADER + 8 * RUDP_MAX_NACK_RANGES];
+    int             nackRanges;
+
+    uint64_t        received;
+    uint64_t        dropped;
+    uint64_t        rexmits;
+    uint64_t        recovered;
+    uint64_t        lost;
+    uint64_t        duplicates;
+    uint64_t        nacks;
+    uint64_t        ccErrors;
+    uint64_t        frames;
+    uint64_t        keyFrames;
+    uint64_t        corrupt;
+}RudpRecv_t;
+
+static volatile bool rudpRecvStop;
+
+
+static void rudpRecvSignal(int sig)
+{
+    UNUSED_PARAMETER(sig);
+    rudpRecvStop = true;
+}
+
+static int64_t rudpRecvNowUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t rudpRecvGet32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void rudpRecvPut32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void rudpRecvSend(RudpRecv_t *r, int type)
+{
+    uint8_t buf[RUDP_HEADER] = { (uint8_t)type };
+    sendto(r->fd, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&r->sink, sizeof(r->sink));
+}
+
+//Echoes the sink's clock, the sink tells its RTT estimate in return
+static void rudpRecvPing(RudpRecv_t *r, uint8_t *d, size_t len)
+{
+    if(len >= RUDP_HEADER + 8)
+    {
+        r->rttUs = rudpRecvGet32(d + RUDP_HEADER);
+        int64_t rto = r->rttUs + 4 * (int64_t)rudpRecvGet32(d + RUDP_HEADER + 4);
+        r->nackIntervalUs = (rto > RUDP_RECV_MIN_NACK_US) ? rto : RUDP_RECV_MIN_NACK_US;
+    }
+    d[0] = RUDP_PONG;
+    sendto(r->fd, d, RUDP_HEADER, MSG_DONTWAIT, (struct sockaddr *)&r->sink, sizeof(r->sink));
+}
+
+static int rudpRecvDemuxPacket(void *param, int program, int stream, int codecid, int flags,
+                               int64_t pts, int64_t dts, const void *data, size_t bytes)
+{
+    UNUSED_PARAMETER(program);
+    UNUSED_PARAMETER(stream);
+    UNUSED_PARAMETER(codecid);
+    UNUSED_PARAMETER(pts);
+    UNUSED_PARAMETER(dts);
+    UNUSED_PARAMETER(data);
+    UNUSED_PARAMETER(bytes);
+
+    //The first frame starts mid PES after joining the stream
+    RudpRecv_t *r = param;
+    r->frames++;
+    r->keyFrames += (flags & MPEG_FLAG_IDR_FRAME) ? 1 : 0;
+    if(r->synced && (flags & (MPEG_FLAG_PACKET_LOST | MPEG_FLAG_PACKET_CORRUPT)))
+    { r->corrupt++; }
+    r->synced = true;
+    return 0;
+}
+
+static void rudpRecvDeliver(RudpRecv_t *r, const uint8_t *ts, size_t len)
+{
+    if(r->out != NULL)
+    { fwrite(ts, 1, len, r->out); }
+
+    for(size_t off = 0; off + TS_PACKET_SIZE <= len; off += TS_PACKET_SIZE)
+    {
+        const uint8_t *p = ts + off;
+        int pid = ((p[1] & 0x1f) << 8) | p[2];
+        int cc = p[3] & 0x0f;
+        if(p[0] == 0x47 && pid != 0x1fff && (p[3] & 0x10))
+        {
+            if(r->cc[pid] >= 0 && cc != r->cc[pid] && cc != ((r->cc[pid] + 1) & 0x0f))
+            { r->ccErrors++; }
+            r->cc[pid] = cc;
+        }
+        ts_demuxer_input(r->demuxer, p, TS_PACKET_SIZE);
+    }
+}
+
+static bool rudpRecvDrop(RudpRecv_t *r)
+{
+    if(r->burstLeft > 0)
+    {
+        r->burstLeft--;
+        return true;
+    }
+
+    //One drop event per burst keeps the average loss at lossPct
+    double p = r->config.lossPct / 100.0 / r->config.burst;
+    if(p > 0 && (double)rand() / RAND_MAX < p)
+    {
+        r->burstLeft = r->config.burst - 1;
+        return true;
+    }
+    return false;
+}
+
+//Hands over everything in order up to the first gap still worth waiting for
+static void rudpRecvAdvance(RudpRecv_t *r, int64_t now)
+{
+    int64_t budget = r->config.latencyMs * 1000LL;
+    while(r->nextDeliver != r->highest)
+    {
+        RudpRecvSlot_t *slot = &r->slots[r->nextDeliver & (RUDP_RECV_WINDOW - 1)];
+        if(slot->have)
+        {
+            rudpRecvDeliver(r, slot->data, slot->len);
+        }
+        else if(now - slot->missSinceUs >= budget)
+        {
+            r->lost++;
+        }
+        else
+        {
+            break;
+        }
+        slot->have = false;
+        slot->missing = false;
+        r->nextDeliver++;
+    }
+}
+
+static void rudpRecvNackAdd(RudpRecv_t *r, uint32_t seq)
+{
+    uint8_t *range = r->nack + RUDP_HEADER + 8 * r->nackRanges;
+    if(r->nackRanges > 0 && rudpRecvGet32(range - 4) + 1 == seq)
+    {
+        rudpRecvPut32(range - 4, seq);
+        return;
+    }
+
+    //The rest goes with the next round
+    if(r->nackRanges == RUDP_MAX_NACK_RANGES)
+    { return; }
+
+    range = r->nack + RUDP_HEADER + 8 * r->nackRanges++;
+    rudpRecvPut32(range, seq);
+    rudpRecvPut32(range + 4, seq);
+}
+
+static void rudpRecvNackFlush(RudpRecv_t *r)
+{
+    if(r->nackRanges == 0)
+    { return; }
+
+    memset(r->nack, 0, RUDP_HEADER);
+    r->nack[0] = RUDP_NACK;
+    rudpRecvPut32(r->nack + 4, (uint32_t)r->nackRanges);
+    sendto(r->fd, r->nack, RUDP_HEADER + 8 * r->nackRanges, MSG_DONTWAIT, (struct sockaddr *)&r->sink, sizeof(r->sink));
+    r->nacks++;
+    r->nackRanges = 0;
+}
+
+static void rudpRecvData(RudpRecv_t *r, const uint8_t *d, size_t len, int64_t now)
+{
+    uint32_t seq = rudpRecvGet32(d + 4);
+    bool rexmit = (d[1] & RUDP_FLAG_REXMIT) != 0;
+    r->rexmits += rexmit ? 1 : 0;
+
+    if(!r->started)
+    {
+        r->started = true;
+        r->nextDeliver = seq;
+        r->highest = seq;
+    }
+
+    if((int32_t)(seq - r->nextDeliver) < 0)
+    {
+        r->duplicates++;
+        return;
+    }
+
+    //Far ahead of delivery, give the oldest gaps up to make room
+    while(seq - r->nextDeliver >= RUDP_RECV_WINDOW)
+    {
+        RudpRecvSlot_t *slot = &r->slots[r->nextDeliver & (RUDP_RECV_WINDOW - 1)];
+        if(slot->have)
+        { rudpRecvDeliver(r, slot->data, slot->len); }
+        else if(r->nextDeliver != r->highest)
+        { r->lost++; }
+        slot->have = false;
+        slot->missing = false;
+        r->nextDeliver++;
+        r->highest = ((int32_t)(r->highest - r->nextDeliver) < 0) ? r->nextDeliver : r->highest;
+    }
+
+    //A new gap is NACKed at once
+    if((int32_t)(seq - r->highest) >= 0)
+    {
+        for(uint32_t s = r->highest; s != seq; s++)
+        {
+            RudpRecvSlot_t *slot = &r->slots[s & (RUDP_RECV_WINDOW - 1)];
+            slot->have = false;
+            slot->missing = true;
+            slot->missSinceUs = now;
+            slot->lastNackUs = now;
+            rudpRecvNackAdd(r, s);
+        }
+        r->highest = seq + 1;
+    }
+
+    RudpRecvSlot_t *slot = &r->slots[seq & (RUDP_RECV_WINDOW - 1)];
+    if(slot->have)
+    {
+        r->duplicates++;
+        return;
+    }
+    if(slot->missing)
+    { r->recovered++; }
+
+    slot->have = true;
+    slot->missing = false;
+    slot->len = len - RUDP_HEADER;
+    memcpy(slot->data, d + RUDP_HEADER, slot->len);
+}
+
+//NACKs the gaps again once per round trip, drops the ones past the budget
+static void rudpRecvTimer(RudpRecv_t *r, int64_t now)
+{
+    rudpRecvAdvance(r, now);
+    for(uint32_t s = r->nextDeliver; s != r->highest; s++)
+    {
+        RudpRecvSlot_t *slot = &r->slots[s & (RUDP_RECV_WINDOW - 1)];
+        if(slot->missing && now - slot->lastNackUs >= r->nackIntervalUs)
+        {
+            slot->lastNackUs = now;
+            rudpRecvNackAdd(r, s);
+        }
+    }
+    rudpRecvNackFlush(r);
+}
+
+static void rudpRecvReport(RudpRecv_t *r, double elapsed)
+{
+    //Keep stdout clean when the TS goes there
+    fprintf(r->out == stdout ? stderr : stdout, "%6.1fs rx %8" PRIu64 " dropped %6" PRIu64 " rexmit %6" PRIu64 " recovered %6" PRIu64
+            " lost %5" PRIu64 " dup %4" PRIu64 " nack %5" PRIu64 " rtt %5.1fms cc %4" PRIu64 " frames %6" PRIu64
+            " key %4" PRIu64 " corrupt %4" PRIu64 "\n",
+            elapsed, r->received, r->dropped, r->rexmits, r->recovered, r->lost, r->duplicates, r->nacks,
+            r->rttUs / 1000.0, r->ccErrors, r->frames, r->keyFrames, r->corrupt);
+}
+
+static void rudpRecvUsage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+        "  -s <host:port> capture rudp sink (default 127.0.0.1:9000)\n"
+        "  -L <ms>        latency budget, gaps are given up after it (default %d)\n"
+        "  -x <percent>   data datagrams to drop on arrival\n"
+        "  -b <count>     datagrams per drop, bursts (default 1)\n"
+        "  -d <seconds>   run time, 0 until interrupted (default 0)\n"
+        "  -i <ms>        report interval (default 1000)\n"
+        "  -o <file>      write the TS, - for stdout\n",
+        prog, RUDP_DEFAULT_LATENCY_MS);
+}
+
+static CStatus_t rudpRecvParseArgs(RudpRecvConfig_t *config, int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "s:L:x:b:d:i:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            config->sink = optarg;
+            break;
+        case 'L':
+            config->latencyMs = atoi(optarg);
+            break;
+        case 'x':
+            config->lossPct = atof(optarg);
+            break;
+        case 'b':
+            config->burst = atoi(optarg);
+            break;
+        case 'd':
+            config->seconds = atoi(optarg);
+            break;
+        case 'i':
+            config->intervalMs = atoi(optarg);
+            break;
+        case 'o':
+            config->output = optarg;
+            break;
+        default:
+            return CSTATUS_BAD_PARAM;
+        }
+    }
+    OKAY_RETURN(config->latencyMs < 1, CSTATUS_BAD_PARAM, "bad latency\n");
+    OKAY_RETURN(config->burst < 1 || config->intervalMs < 1, CSTATUS_BAD_PARAM, "bad burst or interval\n");
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t rudpRecvResolve(RudpRecv_t *r)
+{
+    char host[256];
+    OKAY_RETURN(strlen(r->config.sink) >= sizeof(host), CSTATUS_BAD_PARAM, "bad sink %s\n", r->config.sink);
+    strcpy(host, r->config.sink);
+
+    char *port = strrchr(host, ':');
+    OKAY_RETURN(port == NULL, CSTATUS_BAD_PARAM, "sink %s has no port\n", r->config.sink);
+    *port++ = '\0';
+
+    struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_DGRAM };
+    struct addrinfo *res = NULL;
+    int ret = getaddrinfo(host, port, &hints, &res);
+    OKAY_RETURN(ret != 0, CSTATUS_BAD_PARAM, "failed to resolve %s : %s\n", r->config.sink, gai_strerror(ret));
+    memcpy(&r->sink, res->ai_addr, sizeof(struct sockaddr_in));
+    freeaddrinfo(res);
+    return CSTATUS_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    static RudpRecv_t r;
+    RudpRecvConfig_t *config = &r.config;
+    config->sink = "127.0.0.1:9000";
+    config->latencyMs = RUDP_DEFAULT_LATENCY_MS;
+    config->burst = 1;
+    config->intervalMs = 1000;
+
+    if(rudpRecvParseArgs(config, argc, argv) != CSTATUS_SUCCESS)
+    {
+        rudpRecvUsage(argv[0]);
+        return 1;
+    }
+    OKAY_RETURN(rudpRecvResolve(&r) != CSTATUS_SUCCESS, 1, "failed to resolve the sink\n");
+
+    signal(SIGINT, rudpRecvSignal);
+    signal(SIGTERM, rudpRecvSignal);
+    memset(r.cc, 0xff, sizeof(r.cc));
+    srand((unsigned)rudpRecvNowUs());
+    r.nackIntervalUs = RUDP_RECV_MIN_NACK_US;
+
+    r.fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    OKAY_RETURN(r.fd < 0, 1, "failed to create socket : %s\n", ERRSTR);
+    setsockopt(r.fd, SOL_SOCKET, SO_RCVBUF, &(int){8 * 1024 * 1024}, sizeof(int));
+
+    if(config->output != NULL)
+    {
+        r.out = strcmp(config->output, "-") == 0 ? stdout : fopen(config->output, "wb");
+        OKAY_RETURN(r.out == NULL, 1, "failed to open %s : %s\n", config->output, ERRSTR);
+    }
+
+    r.slots = calloc(RUDP_RECV_WINDOW, sizeof(RudpRecvSlot_t));
+    r.demuxer = ts_demuxer_create(rudpRecvDemuxPacket, &r);
+    OKAY_RETURN(r.slots == NULL || r.demuxer == NULL, 1, "failed to create the demuxer\n");
+
+    static uint8_t bufs[RUDP_RECV_BATCH][RUDP_MAX_DGRAM];
+    struct mmsghdr msgs[RUDP_RECV_BATCH];
+    struct iovec iovs[RUDP_RECV_BATCH];
+
+    int64_t start = rudpRecvNowUs(), lastReport = start, lastHello = 0;
+    while(!rudpRecvStop)
+    {
+        int64_t now = rudpRecvNowUs();
+        if(config->seconds > 0 && now - start >= config->seconds * 1000000LL)
+        { break; }
+
+        if(now - lastReport >= config->intervalMs * 1000LL)
+        {
+            lastReport = now;
+            rudpRecvReport(&r, (now - start) / 1e6);
+        }
+
+        //Answered with a cookie PING while the sink does not know this receiver
+        if(now - lastHello >= RUDP_RECV_HELLO_MS * 1000LL)
+        {
+            lastHello = now;
+            rudpRecvSend(&r, RUDP_HELLO);
+        }
+
+        struct pollfd pfd = { .fd = r.fd, .events = POLLIN };
+        int ret = poll(&pfd, 1, 5);
+        now = rudpRecvNowUs();
+        while(ret > 0)
+        {
+            for(int i = 0; i < RUDP_RECV_BATCH; i++)
+            {
+                iovs[i].iov_base = bufs[i];
+                iovs[i].iov_len = RUDP_MAX_DGRAM;
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int n = recvmmsg(r.fd, msgs, RUDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+            for(int i = 0; i < n; i++)
+            {
+                const uint8_t *d = bufs[i];
+                size_t len = msgs[i].msg_len;
+                if(len < RUDP_HEADER)
+                { continue; }
+
+                switch(d[0])
+                {
+                case RUDP_DATA:
+                    if(rudpRecvDrop(&r))
+                    {
+                        r.dropped++;
+                        break;
+                    }
+                    r.received++;
+                    rudpRecvData(&r, d, len, now);
+                    break;
+                case RUDP_PING:
+                    rudpRecvPing(&r, bufs[i], len);
+                    break;
+                case RUDP_BYE:
+                    printf("sink closed\n");
+                    rudpRecvStop = true;
+                    break;
+                default:
+                    break;
+                }
+            }
+            if(n < RUDP_RECV_BATCH)
+            { break; }
+        }
+        rudpRecvTimer(&r, now);
+    }
+
+    rudpRecvSend(&r, RUDP_BYE);
+    rudpRecvReport(&r, (rudpRecvNowUs() - start) / 1e6);
+
+    ts_demuxer_destroy(r.demuxer);
+    free(r.slots);
+    if(r.out != NULL && r.out != stdout)
+    { fclose(r.out); }
+    close(r.fd);
+    return 0;
+}
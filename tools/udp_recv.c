@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include "common.h"
+#include "fec.h"
+#include "mpeg-ts.h"
+#include "mpeg-ts-proto.h"
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/*
+ * Receiver for the capture UDP sink. Joins the media port and, for RTP, the
+ * SMPTE 2022-1 column (port + 2) and row (port + 4) FEC ports, repairs losses
+ * with fec.c and validates the result through ts_demuxer. Loss can be injected
+ * before the FEC decoder so recovery is measurable on one host without netem:
+ *
+ *   capture ... -u 127.0.0.1:5000 -F 10x5,row
+ *   udp_recv -p 5000 -x 2 -b 3
+ *
+ * Every interval prints the media and FEC datagrams, the ones dropped on purpose,
+ * recovered and unrecoverable, TS continuity errors and demuxed frames.
+ */
+
+#define UDP_RECV_MAX_DGRAM      2048
+#define UDP_RECV_BATCH          32
+#define UDP_RECV_SOCKETS        3           //Media, column FEC, row FEC
+
+typedef struct
+{
+    int             port;
+    const char      *group;         //Multicast group to join, NULL for unicast
+    const char      *iface;
+    double          lossPct;        //Media datagrams dropped on purpose
+    int             burst;          //Consecutive datagrams per drop
+    int             seconds;
+    int             intervalMs;
+    const char      *output;        //Repaired TS, "-" for stdout
+}UdpRecvConfig_t;
+
+typedef struct
+{
+    UdpRecvConfig_t config;
+    FecDec_t        *fec;
+    void            *demuxer;
+    FILE            *out;
+    int             burstLeft;
+    int             cc[8192];
+    bool            synced;
+
+    uint64_t        media;
+    uint64_t        fecPkts;
+    uint64_t        mediaBytes;
+    uint64_t        fecBytes;
+    uint64_t        dropped;
+    uint64_t        ccErrors;
+    uint64_t        frames;
+    uint64_t        keyFrames;
+    uint64_t        corrupt;
+}UdpRecv_t;
+
+static volatile bool udpRecvStop;
+
+
+static void udpRecvSignal(int sig)
+{
+    UNUSED_PARAMETER(sig);
+    udpRecvStop = true;
+}
+
+static int64_t udpRecvNowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int udpRecvDemuxPacket(void *param, int program, int stream, int codecid, int flags,
+                              int64_t pts, int64_t dts, const void *data, size_t bytes)
+{
+    UNUSED_PARAMETER(program);
+    UNUSED_PARAMETER(stream);
+    UNUSED_PARAMETER(codecid);
+    UNUSED_PARAMETER(pts);
+    UNUSED_PARAMETER(dts);
+    UNUSED_PARAMETER(data);
+    UNUSED_PARAMETER(bytes);
+
+    //The first frame starts mid PES after joining the stream
+    UdpRecv_t *r = param;
+    r->frames++;
+    r->keyFrames += (flags & MPEG_FLAG_IDR_FRAME) ? 1 : 0;
+    if(r->synced && (flags & (MPEG_FLAG_PACKET_LOST | MPEG_FLAG_PACKET_CORRUPT)))
+    { r->corrupt++; }
+    r->synced = true;
+    return 0;
+}
+
+//Repaired TS in sequence order, from the FEC decoder or straight from the socket
+static void udpRecvDeliver(const uint8_t *ts, size_t len, void *udata)
+{
+    UdpRecv_t *r = udata;
+    if(r->out != NULL)
+    { fwrite(ts, 1, len, r->out); }
+
+    for(size_t off = 0; off + TS_PACKET_SIZE <= len; off += TS_PACKET_SIZE)
+    {
+        const uint8_t *p = ts + off;
+        int pid = ((p[1] & 0x1f) << 8) | p[2];
+        int cc = p[3] & 0x0f;
+        if(p[0] == 0x47 && pid != 0x1fff && (p[3] & 0x10))
+        {
+            if(r->cc[pid] >= 0 && cc != r->cc[pid] && cc != ((r->cc[pid] + 1) & 0x0f))
+            { r->ccErrors++; }
+            r->cc[pid] = cc;
+        }
+        ts_demuxer_input(r->demuxer, p, TS_PACKET_SIZE);
+    }
+}
+
+static bool udpRecvDrop(UdpRecv_t *r)
+{
+    if(r->burstLeft > 0)
+    {
+        r->burstLeft--;
+        return true;
+    }
+
+    //One drop event per burst keeps the average loss at lossPct
+    double p = r->config.lossPct / 100.0 / r->config.burst;
+    if(p > 0 && (double)rand() / RAND_MAX < p)
+    {
+        r->burstLeft = r->config.burst - 1;
+        return true;
+    }
+    return false;
+}
+
+static int udpRecvSocket(UdpRecvConfig_t *config, uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    OKAY_RETURN(fd < 0, -1, "failed to create socket : %s\n", ERRSTR);
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &(int){1}, sizeof(int));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &(int){8 * 1024 * 1024}, sizeof(int));
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = config->group ? inet_addr(config->group) : htonl(INADDR_ANY),
+    };
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+    {
+        printf("failed to bind udp port %d : %s\n", port, ERRSTR);
+        close(fd);
+        return -1;
+    }
+
+    if(config->group != NULL)
+    {
+        struct ip_mreqn mreq = {
+            .imr_multiaddr.s_addr = inet_addr(config->group),
+            .imr_ifindex = config->iface ? (int)if_nametoindex(config->iface) : 0,
+        };
+        if(setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+        {
+            printf("failed to join %s : %s\n", config->group, ERRSTR);
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+static void udpRecvReport(UdpRecv_t *r, double elapsed)
+{
+    FecDecStats_t fs = { 0 };
+    if(r->fec != NULL)
+    { fecDecGetStats(r->fec, &fs); }
+
+    //Keep stdout clean when the TS goes there
+    double overhead = r->mediaBytes ? 100.0 * r->fecBytes / r->mediaBytes : 0;
+    fprintf(r->out == stdout ? stderr : stdout, "%6.1fs media %8" PRIu64 " fec %7" PRIu64 " (%4.1f%%) dropped %6" PRIu64 " recovered %6" PRIu64
+           " lost %5" PRIu64 " late %4" PRIu64 " cc %4" PRIu64 " frames %6" PRIu64 " key %4" PRIu64 " corrupt %4" PRIu64 "\n",
+           elapsed, r->media, r->fecPkts, overhead, r->dropped, fs.recovered, fs.lost, fs.late, r->ccErrors,
+           r->frames, r->keyFrames, r->corrupt);
+}
+
+static void udpRecvUsage(const char *prog)
+{
+    printf("usage: %s [options]\n"
+        "  -p <port>      media port, FEC on port+2 and port+4 (default 5000)\n"
+        "  -g <group>     multicast group to join\n"
+        "  -I <ifname>    interface for the multicast join\n"
+        "  -x <percent>   media datagrams to drop before the FEC decoder\n"
+        "  -b <count>     datagrams per drop, bursts (default 1)\n"
+        "  -d <seconds>   run time, 0 until interrupted (default 0)\n"
+        "  -i <ms>        report interval (default 1000)\n"
+        "  -o <file>      write the repaired TS, - for stdout\n",
+        prog);
+}
+
+static CStatus_t udpRecvParseArgs(UdpRecvConfig_t *config, int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "p:g:I:x:b:d:i:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'p':
+            config->port = atoi(optarg);
+            break;
+        case 'g':
+            config->group = optarg;
+            break;
+        case 'I':
+            config->iface = optarg;
+            break;
+        case 'x':
+            config->lossPct = atof(optarg);
+            break;
+        case 'b':
+            config->burst = atoi(optarg);
+            break;
+        case 'd':
+            config->seconds = atoi(optarg);
+            break;
+        case 'i':
+            config->intervalMs = atoi(optarg);
+            break;
+        case 'o':
+            config->output = optarg;
+            break;
+        default:
+            return CSTATUS_BAD_PARAM;
+        }
+    }
+    OKAY_RETURN(config->port == 0 || config->port > 65535 - FEC_ROW_PORT_OFFSET, CSTATUS_BAD_PARAM, "bad port\n");
+    OKAY_RETURN(config->burst < 1 || config->intervalMs < 1, CSTATUS_BAD_PARAM, "bad burst or interval\n");
+    return CSTATUS_SUCCESS;
+}
+
+int main(int argc, char *argv[])
+{
+    static UdpRecv_t r;
+    UdpRecvConfig_t *config = &r.config;
+    config->port = 5000;
+    config->burst = 1;
+    config->intervalMs = 1000;
+
+    if(udpRecvParseArgs(config, argc, argv) != CSTATUS_SUCCESS)
+    {
+        udpRecvUsage(argv[0]);
+        return 1;
+    }
+
+    signal(SIGINT, udpRecvSignal);
+    signal(SIGTERM, udpRecvSignal);
+    memset(r.cc, 0xff, sizeof(r.cc));
+    srand((unsigned)udpRecvNowMs());
+
+    int fds[UDP_RECV_SOCKETS] = { -1, -1, -1 };
+    static const int offsets[UDP_RECV_SOCKETS] = { 0, FEC_COLUMN_PORT_OFFSET, FEC_ROW_PORT_OFFSET };
+    for(int i = 0; i < UDP_RECV_SOCKETS; i++)
+    {
+        fds[i] = udpRecvSocket(config, config->port + offsets[i]);
+        OKAY_RETURN(fds[i] < 0, 1, "failed to open udp port %d\n", config->port + offsets[i]);
+    }
+
+    if(config->output != NULL)
+    {
+        r.out = strcmp(config->output, "-") == 0 ? stdout : fopen(config->output, "wb");
+        OKAY_RETURN(r.out == NULL, 1, "failed to open %s : %s\n", config->output, ERRSTR);
+    }
+
+    r.demuxer = ts_demuxer_create(udpRecvDemuxPacket, &r);
+    r.fec = fecDecCreate(udpRecvDeliver, &r);
+    OKAY_RETURN(r.demuxer == NULL || r.fec == NULL, 1, "failed to create the demuxer\n");
+
+    static uint8_t bufs[UDP_RECV_BATCH][UDP_RECV_MAX_DGRAM];
+    struct mmsghdr msgs[UDP_RECV_BATCH];
+    struct iovec iovs[UDP_RECV_BATCH];
+
+    int64_t start = udpRecvNowMs(), lastReport = start;
+    while(!udpRecvStop)
+    {
+        int64_t now = udpRecvNowMs();
+        if(config->seconds > 0 && now - start >= config->seconds * 1000LL)
+        { break; }
+
+        if(now - lastReport >= config->intervalMs)
+        {
+            lastReport = now;
+            udpRecvReport(&r, (now - start) / 1000.0);
+        }
+
+        struct pollfd pfds[UDP_RECV_SOCKETS];
+        for(int i = 0; i < UDP_RECV_SOCKETS; i++)
+        {
+            pfds[i].fd = fds[i];
+            pfds[i].events = POLLIN;
+        }
+        if(poll(pfds, UDP_RECV_SOCKETS, 100) <= 0)
+        { continue; }
+
+        for(int s = 0; s < UDP_RECV_SOCKETS; s++)
+        {
+            if(!(pfds[s].revents & POLLIN))
+            { continue; }
+
+            for(int i = 0; i < UDP_RECV_BATCH; i++)
+            {
+                iovs[i].iov_base = bufs[i];
+                iovs[i].iov_len = UDP_RECV_MAX_DGRAM;
+                memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+                msgs[i].msg_hdr.msg_iov = &iovs[i];
+                msgs[i].msg_hdr.msg_iovlen = 1;
+            }
+
+            int n = recvmmsg(fds[s], msgs, UDP_RECV_BATCH, MSG_DONTWAIT, NULL);
+            for(int i = 0; i < n; i++)
+            {
+                const uint8_t *d = bufs[i];
+                size_t len = msgs[i].msg_len;
+                if(s != 0)
+                {
+                    r.fecPkts++;
+                    r.fecBytes += len;
+                    fecDecFec(r.fec, d, len);
+                    continue;
+                }
+
+                r.media++;
+                r.mediaBytes += len;
+                if(udpRecvDrop(&r))
+                {
+                    r.dropped++;
+                    continue;
+                }
+
+                //Plain TS datagrams have no sequence numbers to repair by
+                if(len > 0 && d[0] == 0x47)
+                { udpRecvDeliver(d, len, &r); }
+                else
+                { fecDecMedia(r.fec, d, len); }
+            }
+        }
+    }
+
+    fecDecFlush(r.fec);
+    udpRecvReport(&r, (udpRecvNowMs() - start) / 1000.0);
+
+    fecDecDestroy(r.fec);
+    ts_demuxer_destroy(r.demuxer);
+    if(r.out != NULL && r.out != stdout)
+    { fclose(r.out); }
+    for(int i = 0; i < UDP_RECV_SOCKETS; i++)
+    { close(fds[i]); }
+    return 0;
+}
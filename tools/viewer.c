@@ -0,0 +1,509 @@
+#include "viewer.h"
+#include "mpeg-ts.h"
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <time.h>
+
+#define VIEWER_READ_SIZE        (64 * 1024)
+#define VIEWER_DEFAULT_STALL    500
+#define VIEWER_MAX_LATENCY      (10 * 1000000LL)
+#define VIEWER_POLL_MS          5
+#define PTS_MASK                ((1LL << 33) - 1)
+
+struct ViewerPool
+{
+    int             epfd;
+    List_t          lViewers;
+};
+
+
+int64_t viewerTimeUs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void viewerAddLatency(Viewer_t *v, uint32_t us)
+{
+    ViewerStats_t *s = &v->stats;
+    if(s->numLatency == s->capLatency)
+    {
+        int cap = s->capLatency ? s->capLatency * 2 : 1024;
+        uint32_t *l = realloc(s->latencyUs, cap * sizeof(uint32_t));
+        if(l == NULL)
+        { return; }
+        s->latencyUs = l;
+        s->capLatency = cap;
+    }
+    s->latencyUs[s->numLatency++] = us;
+}
+
+static void viewerParsePes(Viewer_t *v, const uint8_t *p, int len, int64_t nowUs)
+{
+    //00 00 01 <stream id> <len:2> <flags:2> <hdr len> <pts:5>
+    if(len < 14 || p[0] != 0 || p[1] != 0 || p[2] != 1)
+    { return; }
+    if((p[3] & 0xf0) != 0xe0)
+    { return; }
+
+    v->stats.frames++;
+    if(!(p[7] & 0x80))
+    { return; }
+
+    int64_t pts = ((int64_t)(p[9] & 0x0e) << 29) | ((int64_t)p[10] << 22) | ((int64_t)(p[11] & 0xfe) << 14)
+                | ((int64_t)p[12] << 7) | (p[13] >> 1);
+    int64_t now90 = (nowUs * 90 / 1000) & PTS_MASK;
+    int64_t latency = ((now90 - pts) & PTS_MASK) * 1000 / 90;
+    if(latency < VIEWER_MAX_LATENCY)
+    { viewerAddLatency(v, (uint32_t)latency); }
+}
+
+static int viewerDemuxPacket(void *param, int program, int stream, int codecid, int flags,
+                            int64_t pts, int64_t dts, const void *data, size_t bytes)
+{
+    UNUSED_PARAMETER(program);
+    UNUSED_PARAMETER(stream);
+    UNUSED_PARAMETER(codecid);
+    UNUSED_PARAMETER(pts);
+    UNUSED_PARAMETER(dts);
+    UNUSED_PARAMETER(data);
+    UNUSED_PARAMETER(bytes);
+
+    //The first frame starts mid PES after joining the stream
+    Viewer_t *v = param;
+    v->stats.demuxFrames++;
+    if(v->demuxSynced && (flags & (MPEG_FLAG_PACKET_LOST | MPEG_FLAG_PACKET_CORRUPT)))
+    { v->stats.demuxLost++; }
+    v->demuxSynced = true;
+    return 0;
+}
+
+static void viewerPacket(Viewer_t *v, const uint8_t *p, int64_t nowUs)
+{
+    if(v->demuxer != NULL)
+    { ts_demuxer_input(v->demuxer, p, TS_PACKET_SIZE); }
+
+    int pid = ((p[1] & 0x1f) << 8) | p[2];
+    int afc = (p[3] >> 4) & 0x03;
+    int cc = p[3] & 0x0f;
+
+    v->stats.packets++;
+    if(pid == 0x1fff)
+    { return; }
+
+    int offset = 4;
+    bool discontinuity = false;
+    if(afc & 0x02)
+    {
+        discontinuity = p[4] > 0 && (p[5] & 0x80);
+        offset += 1 + p[4];
+    }
+
+    if(!(afc & 0x01) || offset >= TS_PACKET_SIZE)
+    { return; }
+
+    //Equal counter is a legal duplicate packet
+    if(v->cc[pid] >= 0 && !discontinuity && cc != v->cc[pid] && cc != ((v->cc[pid] + 1) & 0x0f))
+    { v->stats.ccErrors++; }
+    v->cc[pid] = cc;
+
+    if(p[1] & 0x40)
+    { viewerParsePes(v, p + offset, TS_PACKET_SIZE - offset, nowUs); }
+}
+
+static void viewerFeedTs(Viewer_t *v, const uint8_t *data, size_t len, int64_t nowUs)
+{
+    v->stats.bytes += len;
+
+    while (len > 0)
+    {
+        if(v->tsFill == 0)
+        {
+            //Resync on the next sync byte, one error per lost run
+            if(data[0] != 0x47)
+            {
+                const uint8_t *sync = memchr(data, 0x47, len);
+                v->stats.syncErrors++;
+                if(sync == NULL)
+                { return; }
+                len -= sync - data;
+                data = sync;
+            }
+
+            //Whole packets straight from the read buffer
+            while (len >= TS_PACKET_SIZE && data[0] == 0x47)
+            {
+                viewerPacket(v, data, nowUs);
+                data += TS_PACKET_SIZE;
+                len -= TS_PACKET_SIZE;
+            }
+            if(len == 0 || data[0] != 0x47)
+            { continue; }
+        }
+
+        size_t n = TS_PACKET_SIZE - v->tsFill;
+        if(n > len)
+        { n = len; }
+        memcpy(v->ts + v->tsFill, data, n);
+        v->tsFill += n;
+        data += n;
+        len -= n;
+
+        if(v->tsFill == TS_PACKET_SIZE)
+        {
+            viewerPacket(v, v->ts, nowUs);
+            v->tsFill = 0;
+        }
+    }
+}
+
+static CStatus_t viewerFeedWs(Viewer_t *v, const uint8_t *data, size_t len, int64_t nowUs)
+{
+    while (len > 0)
+    {
+        if(v->wsRemain > 0)
+        {
+            size_t n = (v->wsRemain < len) ? v->wsRemain : len;
+            if(v->wsData)
+            { viewerFeedTs(v, data, n, nowUs); }
+            v->wsRemain -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        v->wsHdr[v->wsHdrFill++] = *data++;
+        len--;
+        if(v->wsHdrFill < 2)
+        { continue; }
+
+        int lenCode = v->wsHdr[1] & 0x7f;
+        int need = 2 + (lenCode == 126 ? 2 : (lenCode == 127 ? 8 : 0)) + ((v->wsHdr[1] & 0x80) ? 4 : 0);
+        if(v->wsHdrFill < need)
+        { continue; }
+
+        uint64_t size = lenCode;
+        if(lenCode == 126)
+        { size = ((uint64_t)v->wsHdr[2] << 8) | v->wsHdr[3]; }
+        else if(lenCode == 127)
+        {
+            size = 0;
+            for(int i = 0; i < 8; i++)
+            { size = (size << 8) | v->wsHdr[2 + i]; }
+        }
+
+        int opcode = v->wsHdr[0] & 0x0f;
+        if(opcode == 0x08)
+        { return CSTATUS_FAIL; }
+
+        v->wsData = (opcode == 0x00 || opcode == 0x01 || opcode == 0x02);
+        v->wsRemain = size;
+        v->wsHdrFill = 0;
+    }
+    return CSTATUS_SUCCESS;
+}
+
+static CStatus_t viewerWsHandshake(Viewer_t *v, int64_t nowUs)
+{
+    char req[512];
+    int len = snprintf(req, sizeof(req),
+                        "GET %s HTTP/1.1\r\n"
+                        "Host: %s:%u\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                        "Sec-WebSocket-Version: 13\r\n\r\n",
+                        v->config.path ? v->config.path : "/", v->config.host, v->config.port);
+    OKAY_RETURN(write(v->fd, req, len) != len, CSTATUS_SYSCALL, "failed to send websocket upgrade : %s\n", ERRSTR);
+
+    char resp[2048];
+    int fill = 0;
+    while (fill < (int)sizeof(resp) - 1)
+    {
+        int n = read(v->fd, resp + fill, sizeof(resp) - 1 - fill);
+        OKAY_RETURN(n <= 0, CSTATUS_FAIL, "websocket upgrade failed : %s\n", n < 0 ? ERRSTR : "closed");
+        fill += n;
+        resp[fill] = '\0';
+
+        char *end = strstr(resp, "\r\n\r\n");
+        if(end == NULL)
+        { continue; }
+
+        OKAY_RETURN(strncmp(resp, "HTTP/1.1 101", 12) != 0, CSTATUS_FAIL, "websocket upgrade refused\n");
+
+        //Frames may follow the response in the same read
+        end += 4;
+        return viewerFeedWs(v, (uint8_t *)end, resp + fill - end, nowUs);
+    }
+    OKAY_RETURN(true, CSTATUS_FAIL, "websocket upgrade response too long\n");
+}
+
+Viewer_t *viewerCreate(ViewerConfig_t *config)
+{
+    Viewer_t *v = calloc(1, sizeof(Viewer_t));
+    OKAY_RETURN(v == NULL, NULL, "failed to allocate viewer\n");
+    memcpy(&v->config, config, sizeof(ViewerConfig_t));
+    memset(v->cc, -1, sizeof(v->cc));
+    if(v->config.stallMs <= 0)
+    { v->config.stallMs = VIEWER_DEFAULT_STALL; }
+    v->fd = -1;
+
+    if(config->demux)
+    {
+        v->demuxer = ts_demuxer_create(viewerDemuxPacket, v);
+        if(v->demuxer == NULL)
+        {
+            free(v);
+            OKAY_RETURN(true, NULL, "failed to create ts demuxer\n");
+        }
+    }
+
+    char port[8];
+    struct addrinfo hints = {0}, *res = NULL;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%u", config->port);
+
+    do
+    {
+        int ret = getaddrinfo(config->host, port, &hints, &res);
+        OKAY_STOP(ret != 0, "failed to resolve %s : %s\n", config->host, gai_strerror(ret));
+
+        v->fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        OKAY_STOP(v->fd < 0, "failed to create socket : %s\n", ERRSTR);
+
+        struct timeval tv = { 2, 0 };
+        setsockopt(v->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(v->fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int));
+
+        ret = connect(v->fd, res->ai_addr, res->ai_addrlen);
+        OKAY_STOP(ret < 0, "failed to connect %s:%u : %s\n", config->host, config->port, ERRSTR);
+
+        int64_t now = viewerTimeUs();
+        v->lastRefillUs = now;
+        if(config->kind == VIEWER_WS)
+        {
+            OKAY_STOP(viewerWsHandshake(v, now) != CSTATUS_SUCCESS, "websocket handshake with %s:%u failed\n",
+                        config->host, config->port);
+        }
+
+        fcntl(v->fd, F_SETFL, fcntl(v->fd, F_GETFL) | O_NONBLOCK);
+        freeaddrinfo(res);
+        return v;
+    } while (0);
+
+    if(res != NULL)
+    { freeaddrinfo(res); }
+    viewerDestroy(v);
+    return NULL;
+}
+
+void viewerDestroy(Viewer_t *v)
+{
+    if(v == NULL)
+    { return; }
+
+    if(v->link.next != NULL)
+    { listRemove(&v->link); }
+    if(v->fd >= 0)
+    { close(v->fd); }
+    if(v->demuxer != NULL)
+    { ts_demuxer_destroy(v->demuxer); }
+    free(v->stats.latencyUs);
+    free(v);
+}
+
+CStatus_t viewerRead(Viewer_t *v, int64_t nowUs)
+{
+    static __thread uint8_t buf[VIEWER_READ_SIZE];
+
+    if(v->closed)
+    { return CSTATUS_FAIL; }
+
+    size_t budget = sizeof(buf);
+    if(v->config.readRate > 0)
+    {
+        double burst = v->config.readRate / 10.0;
+        if(burst < TS_PACKET_SIZE)
+        { burst = TS_PACKET_SIZE; }
+
+        v->tokens += (double)v->config.readRate * (nowUs - v->lastRefillUs) / 1000000.0;
+        v->lastRefillUs = nowUs;
+        if(v->tokens > burst)
+        { v->tokens = burst; }
+        if(v->tokens < 1)
+        {
+            v->paused = true;
+            return CSTATUS_AGAIN;
+        }
+        if(budget > (size_t)v->tokens)
+        { budget = (size_t)v->tokens; }
+    }
+    v->paused = false;
+
+    int n = recv(v->fd, buf, budget, 0);
+    if(n < 0)
+    { return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? CSTATUS_AGAIN : CSTATUS_FAIL; }
+    if(n == 0)
+    {
+        v->closed = true;
+        return CSTATUS_FAIL;
+    }
+
+    if(v->stats.lastRxUs != 0 && nowUs - v->stats.lastRxUs > v->config.stallMs * 1000LL)
+    { v->stats.stalls++; }
+    if(v->stats.connectedUs == 0)
+    { v->stats.connectedUs = nowUs; }
+    v->stats.lastRxUs = nowUs;
+
+    if(v->config.readRate > 0)
+    { v->tokens -= n; }
+
+    if(v->config.kind == VIEWER_WS)
+    {
+        if(viewerFeedWs(v, buf, n, nowUs) != CSTATUS_SUCCESS)
+        {
+            v->closed = true;
+            return CSTATUS_FAIL;
+        }
+    }
+    else
+    {
+        viewerFeedTs(v, buf, n, nowUs);
+    }
+    return CSTATUS_SUCCESS;
+}
+
+void viewerResetStats(Viewer_t *v)
+{
+    uint32_t *latency = v->stats.latencyUs;
+    int cap = v->stats.capLatency;
+    int64_t lastRx = v->stats.lastRxUs;
+
+    memset(&v->stats, 0, sizeof(v->stats));
+    v->stats.latencyUs = latency;
+    v->stats.capLatency = cap;
+    v->stats.lastRxUs = lastRx;
+}
+
+static int viewerCmpU32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+int64_t viewerLatencyPercentile(Viewer_t **viewers, int count, double percentile)
+{
+    int total = 0;
+    for(int i = 0; i < count; i++)
+    { total += viewers[i]->stats.numLatency; }
+    if(total == 0)
+    { return -1; }
+
+    uint32_t *all = malloc(total * sizeof(uint32_t));
+    OKAY_RETURN(all == NULL, -1, "failed to allocate latency samples\n");
+
+    int n = 0;
+    for(int i = 0; i < count; i++)
+    {
+        memcpy(all + n, viewers[i]->stats.latencyUs, viewers[i]->stats.numLatency * sizeof(uint32_t));
+        n += viewers[i]->stats.numLatency;
+    }
+
+    qsort(all, total, sizeof(uint32_t), viewerCmpU32);
+    int index = (int)(percentile / 100.0 * (total - 1) + 0.5);
+    int64_t value = all[index];
+    free(all);
+    return value;
+}
+
+ViewerPool_t *viewerPoolCreate(void)
+{
+    ViewerPool_t *pool = calloc(1, sizeof(ViewerPool_t));
+    OKAY_RETURN(pool == NULL, NULL, "failed to allocate viewer pool\n");
+    listInit(&pool->lViewers);
+
+    pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(pool->epfd < 0)
+    {
+        free(pool);
+        OKAY_RETURN(true, NULL, "epoll_create1 failed : %s\n", ERRSTR);
+    }
+    return pool;
+}
+
+void viewerPoolDestroy(ViewerPool_t *pool)
+{
+    //Viewers stay owned by the caller
+    Viewer_t *v = NULL, *_v = NULL;
+    LIST_FOR_EACH_SAFE(v, _v, &pool->lViewers, link)
+    {
+        listRemove(&v->link);
+    }
+    close(pool->epfd);
+    free(pool);
+}
+
+CStatus_t viewerPoolAdd(ViewerPool_t *pool, Viewer_t *v)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = v };
+    int ret = epoll_ctl(pool->epfd, EPOLL_CTL_ADD, v->fd, &ev);
+    OKAY_RETURN(ret < 0, CSTATUS_SYSCALL, "failed to watch viewer : %s\n", ERRSTR);
+    listInsertBack(&pool->lViewers, &v->link);
+    return CSTATUS_SUCCESS;
+}
+
+static void viewerPoolWatch(ViewerPool_t *pool, Viewer_t *v, uint32_t events)
+{
+    struct epoll_event ev = { .events = events, .data.ptr = v };
+    epoll_ctl(pool->epfd, EPOLL_CTL_MOD, v->fd, &ev);
+}
+
+void viewerPoolRun(ViewerPool_t *pool, int64_t durationUs, volatile bool *stop)
+{
+    struct epoll_event events[64];
+    int64_t end = viewerTimeUs() + durationUs;
+
+    while (stop == NULL || !*stop)
+    {
+        int64_t now = viewerTimeUs();
+        if(now >= end)
+        { break; }
+
+        int timeout = (end - now) / 1000;
+        if(timeout > VIEWER_POLL_MS)
+        { timeout = VIEWER_POLL_MS; }
+
+        int n = epoll_wait(pool->epfd, events, 64, timeout);
+        now = viewerTimeUs();
+        for(int i = 0; i < n; i++)
+        {
+            Viewer_t *v = events[i].data.ptr;
+            CStatus_t status = viewerRead(v, now);
+            if(status == CSTATUS_FAIL)
+            {
+                v->closed = true;
+                epoll_ctl(pool->epfd, EPOLL_CTL_DEL, v->fd, NULL);
+            }
+            else if(v->paused)
+            {
+                //Leave the data in the socket until the bucket refills
+                viewerPoolWatch(pool, v, 0);
+            }
+        }
+
+        Viewer_t *v = NULL;
+        LIST_FOR_EACH(v, &pool->lViewers, link)
+        {
+            if(v->paused && !v->closed)
+            {
+                v->paused = false;
+                viewerPoolWatch(pool, v, EPOLLIN);
+            }
+        }
+    }
+}
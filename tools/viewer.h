@@ -0,0 +1,124 @@
+#ifndef __VIEWER_H__
+#define __VIEWER_H__
+
+#include "common.h"
+#include "list_common.h"
+
+/*
+ * Simulated stream consumers for capture_bench and loadgen. A viewer connects
+ * over raw TCP or WebSocket, reads the TS stream at an optional capped rate
+ * and checks it : sync bytes, continuity counters and video PES timestamps.
+ * Viewers are driven from one thread by a ViewerPool_t event loop.
+ */
+
+struct Viewer;
+struct ViewerPool;
+
+typedef struct Viewer               Viewer_t;
+typedef struct ViewerPool           ViewerPool_t;
+
+typedef enum
+{
+    VIEWER_TCP = 0,         //Raw TS stream from the Net_t port
+    VIEWER_WS,              //Binary WebSocket messages holding TS packets
+}ViewerKind_t;
+
+typedef struct
+{
+    ViewerKind_t    kind;
+    const char      *host;
+    uint16_t        port;
+    const char      *path;          //WebSocket request path, "/" if NULL
+    int             readRate;       //Bytes per second, 0 reads as fast as possible
+    int             stallMs;        //Silence longer than this counts as a stall, 0 for 500ms
+    bool            demux;          //Also run the stream through ts_demuxer, counts frames it flags as lost
+}ViewerConfig_t;
+
+typedef struct
+{
+    uint64_t        bytes;          //TS bytes received, WebSocket framing excluded
+    uint64_t        packets;
+    uint64_t        ccErrors;
+    uint64_t        syncErrors;
+    uint64_t        stalls;
+    uint64_t        frames;         //Video PES starts
+    uint64_t        demuxFrames;    //Frames out of ts_demuxer, config.demux only
+    uint64_t        demuxLost;      //Of those, flagged MPEG_FLAG_PACKET_LOST or _CORRUPT
+
+    //First packet arrival minus the PES pts, the pipeline stamps pts with CLOCK_MONOTONIC
+    uint32_t        *latencyUs;
+    int             numLatency;
+    int             capLatency;
+
+    int64_t         connectedUs;    //Time of the first TS byte, 0 until then
+    int64_t         lastRxUs;
+}ViewerStats_t;
+
+struct Viewer
+{
+    ViewerConfig_t  config;
+    int             fd;
+    bool            closed;
+    ViewerStats_t   stats;
+
+    //Receive state
+    uint8_t         ts[TS_PACKET_SIZE];
+    int             tsFill;
+    int8_t          cc[8192];
+    void            *demuxer;
+    bool            demuxSynced;
+
+    //WebSocket frame parser
+    uint8_t         wsHdr[14];
+    int             wsHdrFill;
+    uint64_t        wsRemain;
+    bool            wsData;
+
+    //Read throttling
+    double          tokens;
+    int64_t         lastRefillUs;
+    bool            paused;
+
+    List_t          link;
+};
+
+/**
+ * CLOCK_MONOTONIC in microseconds, same base as EncoderPacket_t.pts
+ */
+int64_t viewerTimeUs(void);
+
+/**
+ * Connect and, for WebSocket, complete the handshake. The socket is left non blocking.
+ */
+Viewer_t *viewerCreate(ViewerConfig_t *config);
+
+void viewerDestroy(Viewer_t *v);
+
+/**
+ * Drain the socket within the rate budget, CSTATUS_FAIL once the peer closed
+ */
+CStatus_t viewerRead(Viewer_t *v, int64_t nowUs);
+
+/**
+ * Reset the counters, keeps the connection and parser state
+ */
+void viewerResetStats(Viewer_t *v);
+
+/**
+ * Percentile (0-100) of the latency samples in microseconds, -1 if there are none
+ */
+int64_t viewerLatencyPercentile(Viewer_t **viewers, int count, double percentile);
+
+
+ViewerPool_t *viewerPoolCreate(void);
+
+void viewerPoolDestroy(ViewerPool_t *pool);
+
+CStatus_t viewerPoolAdd(ViewerPool_t *pool, Viewer_t *v);
+
+/**
+ * Service every viewer for durationUs, returns early if *stop becomes true
+ */
+void viewerPoolRun(ViewerPool_t *pool, int64_t durationUs, volatile bool *stop);
+
+#endif
@@ -0,0 +1,185 @@
+// WebCodecs player for the raw access unit protocol, see CAP_WS_RAW_PATH in inc/capture.h.
+// Every message is a 16 byte big endian header followed by Annex-B data.
+'use strict';
+
+const RAW_HEADER_SIZE = 16;
+const RAW_CONFIG = 0;
+const RAW_FRAME = 1;
+const RAW_KEY_REQUEST = 2;
+const RAW_FLAG_KEY = 0x01;
+const RAW_FLAG_H265 = 0x02;
+
+const canvas = document.getElementById('view');
+const ctx = canvas.getContext('2d');
+const statusLine = document.getElementById('status');
+
+let decoder = null;
+let paramSets = null;
+let configVersion = -1;
+let needKey = true;
+let socket = null;
+let frames = 0;
+
+function hex(b) {
+  return b.toString(16).padStart(2, '0').toUpperCase();
+}
+
+// First NAL unit of the given type in an Annex-B buffer
+function findNalu(data, match) {
+  for (let i = 0; i + 3 < data.length; i++) {
+    if (data[i] === 0 && data[i + 1] === 0 && data[i + 2] === 1 && match(data[i + 3])) {
+      return data.subarray(i + 3);
+    }
+  }
+  return null;
+}
+
+// First bytes of a NAL unit without emulation prevention bytes
+function unescape(nalu, count) {
+  const out = [];
+  for (let i = 0; i < nalu.length && out.length < count; i++) {
+    if (i >= 2 && nalu[i] === 3 && nalu[i - 1] === 0 && nalu[i - 2] === 0) {
+      continue;
+    }
+    out.push(nalu[i]);
+  }
+  return out;
+}
+
+// ISO/IEC 14496-15 E.3 from the SPS profile_tier_level, parameter sets stay in band
+function hevcCodecString(data) {
+  const nalu = findNalu(data, (b) => ((b >> 1) & 0x3f) === 33);
+  const sps = nalu === null ? [] : unescape(nalu, 15);
+  if (sps.length < 15) {
+    return 'hev1.1.6.L123.B0';
+  }
+  const ptl = sps.slice(3);
+  const space = ['', 'A', 'B', 'C'][ptl[0] >> 6];
+  const tier = (ptl[0] & 0x20) ? 'H' : 'L';
+  let compat = ((ptl[1] << 24) | (ptl[2] << 16) | (ptl[3] << 8) | ptl[4]) >>> 0;
+  let reversed = 0;
+  for (let i = 0; i < 32; i++, compat >>>= 1) {
+    reversed = ((reversed << 1) | (compat & 1)) >>> 0;
+  }
+  const constraints = ptl.slice(5, 11);
+  while (constraints.length > 1 && constraints[constraints.length - 1] === 0) {
+    constraints.pop();
+  }
+  return 'hev1.' + space + (ptl[0] & 0x1f) + '.' + reversed.toString(16).toUpperCase() + '.' + tier + ptl[11] +
+    '.' + constraints.map(hex).join('.');
+}
+
+function codecString(data, h265) {
+  if (h265) {
+    return hevcCodecString(data);
+  }
+  const sps = findNalu(data, (b) => (b & 0x1f) === 7);
+  if (sps === null || sps.length < 4) {
+    return 'avc1.640033';
+  }
+  return 'avc1.' + hex(sps[1]) + hex(sps[2]) + hex(sps[3]);
+}
+
+function configure(data, h265) {
+  if (decoder !== null && decoder.state !== 'closed') {
+    decoder.close();
+  }
+  decoder = new VideoDecoder({
+    output: (frame) => {
+      if (canvas.width !== frame.displayWidth || canvas.height !== frame.displayHeight) {
+        canvas.width = frame.displayWidth;
+        canvas.height = frame.displayHeight;
+      }
+      ctx.drawImage(frame, 0, 0);
+      frame.close();
+      frames++;
+    },
+    error: (e) => {
+      statusLine.textContent = 'decoder error: ' + e.message;
+      needKey = true;
+      requestKey();
+    },
+  });
+  // No description: Annex-B input, parameter sets travel in band
+  decoder.configure({ codec: codecString(data, h265), optimizeForLatency: true });
+  paramSets = data.slice();
+  needKey = true;
+}
+
+function requestKey() {
+  if (socket !== null && socket.readyState === WebSocket.OPEN) {
+    socket.send(new Uint8Array([RAW_KEY_REQUEST]));
+  }
+}
+
+function onMessage(buf) {
+  const view = new DataView(buf);
+  if (buf.byteLength < RAW_HEADER_SIZE) {
+    return;
+  }
+  const type = view.getUint8(0);
+  const flags = view.getUint8(1);
+  const version = view.getUint16(2);
+  const pts = Number(view.getBigInt64(8));
+  const data = new Uint8Array(buf, RAW_HEADER_SIZE);
+
+  if (type === RAW_CONFIG) {
+    if (version !== configVersion) {
+      configVersion = version;
+      configure(data, (flags & RAW_FLAG_H265) !== 0);
+    }
+    return;
+  }
+  if (type !== RAW_FRAME || decoder === null || decoder.state !== 'configured') {
+    return;
+  }
+
+  const key = (flags & RAW_FLAG_KEY) !== 0;
+  if (needKey && !key) {
+    return;
+  }
+  needKey = false;
+
+  // Drop instead of queueing when the tab can not keep up. The frames after a dropped
+  // one reference it, so everything up to the next key frame goes too. An intra refresh
+  // stream has no periodic key frames, ask for one
+  if (!key && decoder.decodeQueueSize > 2) {
+    needKey = true;
+    requestKey();
+    return;
+  }
+
+  let payload = data;
+  if (key) {
+    payload = new Uint8Array(paramSets.length + data.length);
+    payload.set(paramSets, 0);
+    payload.set(data, paramSets.length);
+  }
+  decoder.decode(new EncodedVideoChunk({ type: key ? 'key' : 'delta', timestamp: pts, data: payload }));
+}
+
+function connect() {
+  const proto = location.protocol === 'https:' ? 'wss:' : 'ws:';
+  const ws = new WebSocket(proto + '//' + location.host + '/ws/raw');
+  ws.binaryType = 'arraybuffer';
+  socket = ws;
+  ws.onopen = () => { statusLine.textContent = 'connected'; };
+  ws.onmessage = (ev) => onMessage(ev.data);
+  ws.onclose = () => {
+    statusLine.textContent = 'disconnected, retrying';
+    configVersion = -1;
+    setTimeout(connect, 1000);
+  };
+}
+
+if (typeof VideoDecoder === 'undefined') {
+  statusLine.innerHTML = 'WebCodecs is not available, open <a href="/live.ts">/live.ts</a> in a player instead';
+} else {
+  connect();
+  setInterval(() => {
+    if (frames > 0) {
+      statusLine.textContent = 'connected, ' + frames + ' fps';
+    }
+    frames = 0;
+  }, 1000);
+}